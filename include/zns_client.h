@@ -0,0 +1,118 @@
+/*  =========================================================================
+    zns_client - Client API to zns_srv
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of zenstore - ZeroMQ based encrypted store.      
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_CLIENT_H_INCLUDED
+#define ZNS_CLIENT_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zns_client connected to endpoint
+ZNS_EXPORT zns_client_t *
+    zns_client_new (const char *endpoint);
+
+//  Destroy the zns_client
+ZNS_EXPORT void
+    zns_client_destroy (zns_client_t **self_p);
+
+//  Set size of chunk used for transfers, default is 256kB
+ZNS_EXPORT void
+    zns_client_set_chunk_size (zns_client_t *self, size_t chunk_size);
+
+//  Set number of chunks client can have in flight, default is 8
+ZNS_EXPORT void
+    zns_client_set_credit (zns_client_t *self, size_t credit);
+
+//  Set reply timeout in msec, default is 5000
+ZNS_EXPORT void
+    zns_client_set_timeout (zns_client_t *self, int timeout);
+
+//  Enable near cache of up to size values. Cached values are invalidated by
+//  changes published by zns_srv on endpoint (see PUBLISH) and are never
+//  older than max_age msec, which bounds the staleness when notification is
+//  lost. Return 0 for success, -1 for error.
+ZNS_EXPORT int
+    zns_client_set_cache (zns_client_t *self, const char *endpoint, size_t size, int max_age);
+
+//  Talk to store with given name hosted by zns_host, NULL for plain zns_srv
+ZNS_EXPORT void
+    zns_client_set_store (zns_client_t *self, const char *name);
+
+//  Return the socket connected to zns_srv
+ZNS_EXPORT zsock_t *
+    zns_client_sock (zns_client_t *self);
+
+//  Put value to store. Value is streamed in chunks, with at most credit
+//  chunks unacknowledged. Return 0 for success, -1 for error, errno is set
+//  to EBUSY when server refused the request because of client's quota.
+ZNS_EXPORT int
+    zns_client_put (zns_client_t *self, const char *key, zchunk_t *value);
+
+//  Put value to store, which is deleted after ttl msec, 0 means never.
+//  Return 0 for success, -1 for error.
+ZNS_EXPORT int
+    zns_client_put_ttl (zns_client_t *self, const char *key, zchunk_t *value, int64_t ttl);
+
+//  Get value from store, return NULL if key does not exist or on error.
+//  With near cache enabled, fresh cached values are returned without asking
+//  zns_srv and stale ones are transferred again only if changed. Request
+//  refused because of client's quota is retried with backoff, errno is set
+//  to EBUSY if all attempts are refused. Caller is responsible for
+//  destroying the returned chunk.
+ZNS_EXPORT zchunk_t *
+    zns_client_get (zns_client_t *self, const char *key);
+
+//  Put the value only if key has still the expected version, 0 expects
+//  missing key, NULL value deletes the key. Return 0 and set version to the
+//  new one, or -1 on conflict or error. On conflict the version is set to
+//  the current one and current value is returned if current_p is not NULL,
+//  so caller can retry at once. Value is sent in single message.
+ZNS_EXPORT int
+    zns_client_cas (zns_client_t *self, const char *key, uint64_t *version_p, zchunk_t *value, zchunk_t **current_p);
+
+//  Add delta to the decimal number stored in key, missing key counts as 0.
+//  Return 0 and set value to the result, -1 on error.
+ZNS_EXPORT int
+    zns_client_incr (zns_client_t *self, const char *key, int64_t delta, int64_t *value_p);
+
+//  Append value to the key, missing key is created. Return 0 for success,
+//  -1 for error. Value is sent in single message.
+ZNS_EXPORT int
+    zns_client_append (zns_client_t *self, const char *key, zchunk_t *value);
+
+//  Subscribe to changes of keys starting with prefix, published by zns_srv
+//  on endpoint (see PUBLISH). Return 0 for success, -1 for error.
+ZNS_EXPORT int
+    zns_client_watch (zns_client_t *self, const char *endpoint, const char *prefix);
+
+//  Wait up to timeout msec for change of watched key. Return 0 and fill key,
+//  operation (PUT or DELETE) and version, or -1 on timeout. Caller is
+//  responsible for freeing key and operation.
+ZNS_EXPORT int
+    zns_client_watch_recv (zns_client_t *self, char **key_p, char **op_p, uint64_t *version_p, int timeout);
+
+//  Return the socket receiving changes of watched keys or NULL
+ZNS_EXPORT zsock_t *
+    zns_client_watch_sock (zns_client_t *self);
+
+//  Self test of this class
+ZNS_EXPORT void
+    zns_client_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
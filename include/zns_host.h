@@ -0,0 +1,64 @@
+/*  =========================================================================
+    zns_host - Actor hosting many named stores
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of zenstore - ZeroMQ based encrypted store.      
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_HOST_H_INCLUDED
+#define ZNS_HOST_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//  @interface
+//  Create new zns_host actor instance, which hosts many named stores. Each
+//  store is served by its own zns_srv actor with own file, password and
+//  thread.
+//
+//      zactor_t *zns_host = zactor_new (zns_host_actor, NULL);
+//
+//  Destroy zns_host instance, all stores are saved.
+//
+//      zactor_destroy (&zns_host);
+//
+//  Enable verbose logging of commands and activity:
+//
+//      zstr_send (zns_host, "VERBOSE");
+//
+//  Host store with given name, file and password.
+//
+//      zstr_sendx (zns_host, "STORE", name, path, password, NULL);
+//
+//  Bind the front socket to endpoint, can be repeated for more endpoints.
+//
+//      zstr_sendx (zns_host, "BIND", endpoint, NULL);
+//
+//  Clients use the zns_srv protocol with name of store in front of every
+//  request and reply, e.g.
+//
+//      name GET key                -> name GET key [value version]
+//
+//  Request for unknown store is answered by name ERROR key reason command.
+//
+//  This is the zns_host constructor as a zactor_fn;
+ZNS_EXPORT void
+    zns_host_actor (zsock_t *pipe, void *args);
+
+//  Self test of this actor
+ZNS_EXPORT void
+    zns_host_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
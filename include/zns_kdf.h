@@ -0,0 +1,91 @@
+/*  =========================================================================
+    zns_kdf - Password based key derivation
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of zenstore - ZeroMQ based encrypted store.      
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_KDF_H_INCLUDED
+#define ZNS_KDF_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zns_kdf with random salt and interactive limits of Argon2id
+ZNS_EXPORT zns_kdf_t *
+    zns_kdf_new (void);
+
+//  Destroy the zns_kdf, derived key is wiped
+ZNS_EXPORT void
+    zns_kdf_destroy (zns_kdf_t **self_p);
+
+//  Create a copy of zns_kdf with the same salt, limits and derived key
+ZNS_EXPORT zns_kdf_t *
+    zns_kdf_dup (zns_kdf_t *self);
+
+//  Set maximum number of passes and memory in bytes of all key derivations
+//  of the process, 64 passes and 1GB by default. Header with higher limits
+//  is refused by decode. Call it before any zns_kdf is used.
+ZNS_EXPORT void
+    zns_kdf_set_max_limits (uint64_t opslimit, size_t memlimit);
+
+//  Set number of passes and memory in bytes used by key derivation, values
+//  under minimum of Argon2id are raised to it and values over maximum are
+//  lowered to it. Derived key is dropped.
+ZNS_EXPORT void
+    zns_kdf_set_limits (zns_kdf_t *self, uint64_t opslimit, size_t memlimit);
+
+//  Return number of passes of key derivation
+ZNS_EXPORT uint64_t
+    zns_kdf_opslimit (zns_kdf_t *self);
+
+//  Return memory in bytes used by key derivation
+ZNS_EXPORT size_t
+    zns_kdf_memlimit (zns_kdf_t *self);
+
+//  Derive the key from password, return 0 for success, -1 for error, e.g.
+//  if there is not enough memory.
+ZNS_EXPORT int
+    zns_kdf_derive (zns_kdf_t *self, const char *password);
+
+//  Return the derived key of crypto_secretbox_KEYBYTES kept in locked
+//  memory, NULL if no key was derived yet
+ZNS_EXPORT const byte *
+    zns_kdf_key (zns_kdf_t *self);
+
+//  Return true if both derive the same key from the same password
+ZNS_EXPORT bool
+    zns_kdf_eq (zns_kdf_t *self, zns_kdf_t *other);
+
+//  Pick number of passes for current memory, so derivation takes about
+//  msecs on this machine, memory is lowered only if a single pass takes
+//  longer. Derived key is dropped. Return msecs the derivation takes.
+ZNS_EXPORT int64_t
+    zns_kdf_calibrate (zns_kdf_t *self, int64_t msecs);
+
+//  Store salt and limits in header of store file
+ZNS_EXPORT void
+    zns_kdf_encode (zns_kdf_t *self, zconfig_t *header);
+
+//  Create zns_kdf with salt and limits from header, NULL if header has none
+//  or its limits are over the maximum
+ZNS_EXPORT zns_kdf_t *
+    zns_kdf_decode (zconfig_t *header);
+
+//  Self test of this class
+ZNS_EXPORT void
+    zns_kdf_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -54,17 +54,26 @@
 //  These classes are stable or legacy and built in all releases
 //  Draft classes are by default not built in stable releases
 #ifdef ZNS_BUILD_DRAFT_API
+typedef struct _zns_kdf_t zns_kdf_t;
+#define ZNS_KDF_T_DEFINED
 typedef struct _zns_store_t zns_store_t;
 #define ZNS_STORE_T_DEFINED
 typedef struct _zns_srv_t zns_srv_t;
 #define ZNS_SRV_T_DEFINED
+typedef struct _zns_client_t zns_client_t;
+#define ZNS_CLIENT_T_DEFINED
+typedef struct _zns_host_t zns_host_t;
+#define ZNS_HOST_T_DEFINED
 #endif // ZNS_BUILD_DRAFT_API
 
 
 //  Public classes, each with its own header file
 #ifdef ZNS_BUILD_DRAFT_API
+#include "zns_kdf.h"
 #include "zns_store.h"
 #include "zns_srv.h"
+#include "zns_client.h"
+#include "zns_host.h"
 #endif // ZNS_BUILD_DRAFT_API
 
 #endif
@@ -24,6 +24,22 @@ extern "C" {
 //
 //      zactor_t *zns_srv = zactor_new (zns_srv, NULL);
 //
+//  Application can pass its own zns_store_t instead of NULL, keep using it
+//  directly and let zns_srv serve other processes. Such store is neither
+//  saved nor destroyed by the actor.
+//
+//  Bind read write socket to endpoint, can be repeated for more endpoints,
+//  e.g. tcp:// for remote clients and ipc:// or inproc:// for local ones.
+//  Reply is signal, 0 when bound, 1 for error.
+//
+//      zstr_sendx (zns_srv, "BIND", endpoint, NULL);
+//      zsock_wait (zns_srv);
+//
+//  Serve store hosted by zns_host (see zns_host) instead of binding, the
+//  backend connects to endpoint as name.
+//
+//      zstr_sendx (zns_srv, "BACKEND", endpoint, name, NULL);
+//
 //  Destroy zns_srv instance.
 //
 //      zactor_destroy (&zns_srv);
@@ -32,14 +48,191 @@ extern "C" {
 //
 //      zstr_send (zns_srv, "VERBOSE");
 //
-//  Start zns_srv actor.
+//  Start zns_srv actor. Only the index of store file is loaded at once,
+//  values are loaded in batches between requests, and a key asked for
+//  before its batch is loaded on demand. Store is ready when all are loaded,
+//  see zns_ready in STATS. Store file which exists but can't be loaded,
+//  e.g. by wrong password, is never saved over, STOP and exit leave it as
+//  it is.
 //
 //      zstr_sendx (zns_srv, "START", NULL);
 //
+//  Hand the store over to new process on upgrade. All endpoints are unbound,
+//  requests received until then are handled and the store is written
+//  decrypted to sealed memory file (Linux only), reply is HANDOVER and its
+//  descriptor, -1 for error. The store is not saved at exit, unless RESUME
+//  binds the endpoints again because the new process failed.
+//
+//      zstr_sendx (zns_srv, "HANDOVER", NULL);
+//      zstr_recvx (zns_srv, &command, &fd, NULL);
+//      zstr_sendx (zns_srv, "RESUME", NULL);
+//
+//  New process takes the store over from the descriptor passed by the old
+//  one instead of START, the password must be the same. Reply is TAKEOVER
+//  and 0 or -1 for error. Endpoints are bound afterwards.
+//
+//      zstr_sendx (zns_srv, "TAKEOVER", fd, NULL);
+//      zstr_recvx (zns_srv, &command, &result, NULL);
+//
 //  Stop zns_srv actor.
 //
 //      zstr_sendx (zns_srv, "STOP", NULL);
 //
+//  Encrypt the store file by salsa20poly1305 (default),
+//  xchacha20poly1305_ietf, aes256gcm or the fastest cipher supported by
+//  this CPU.
+//
+//      zstr_sendx (zns_srv, "CIPHER", "fastest", NULL);
+//
+//  Key of the store is derived from password by Argon2id once per process at
+//  START, salt and limits are kept in the header of store file. Key of file
+//  saved by older version is the password itself, the file gets salt on next
+//  save. Set opslimit and memlimit in bytes of new salts (interactive limits
+//  by default), or pick ones taking about msecs on this machine by CALIBRATE.
+//  CALIBRATE runs in its own thread while requests go on, msecs is -1 if it
+//  fails or REKEY or CALIBRATE is already running. Limits are capped by
+//  zns_kdf_set_max_limits, header or snapshot over them is refused.
+//
+//      zstr_sendx (zns_srv, "KDF", "2", "67108864", NULL);
+//      zstr_sendx (zns_srv, "CALIBRATE", "500", NULL);
+//      zstr_recvx (zns_srv, &command, &opslimit, &memlimit, &msecs, NULL);
+//
+//  Change the password online. The key with new salt is derived in its own
+//  thread while requests go on. Every value has its own data key, so only
+//  the data keys are wrapped by the new key, in batches between requests.
+//  The store is saved in its own thread when all are done. REKEY while
+//  REKEY or CALIBRATE is being derived is refused. Followers need the same
+//  REKEY. Values are not encrypted again, so REKEY protects from a leaked
+//  password, not from a leaked data key, e.g. from memory dump; write the
+//  values again for that.
+//
+//      zstr_sendx (zns_srv, "REKEY", password, NULL);
+//
+//  Write point in time copy of the store to path while requests go on, they
+//  wait only while the store is packed. Reply is BACKUP, bytes written or -1
+//  for error and msecs taken. The copy is encrypted by the same key and can
+//  be started by STORE and START with the same password.
+//
+//      zstr_sendx (zns_srv, "BACKUP", path, NULL);
+//      zstr_recvx (zns_srv, &command, &bytes, &msecs, NULL);
+//
+//  Verify the store file on disk, every index segment and value is decrypted
+//  and checked without loading it. The file is read in batches between
+//  requests at rate bytes per second (8MB by default), reply is VERIFY and
+//  number of corrupted ranges found, -1 if the file can't be read or other
+//  VERIFY is running. File is read by the key it was saved with, so the
+//  store can be verified while REKEY is in progress. Corrupted ranges are
+//  logged with their offset and counted in metrics. SCRUB does the same
+//  every msecs, without reply, 0 stops it.
+//
+//      zstr_sendx (zns_srv, "VERIFY", "8388608", NULL);
+//      zstr_recvx (zns_srv, &command, &corrupted, NULL);
+//      zstr_sendx (zns_srv, "SCRUB", "86400000", NULL);
+//
+//  Set high water marks of read write socket bound afterwards.
+//
+//      zstr_sendx (zns_srv, "HWM", "1000", "1000", NULL);
+//
+//  Limit every client to rate requests per second with given burst and to
+//  max number of requests queued at once. Requests over the limits are
+//  refused by BUSY key command reply. Clients are served in turns, one
+//  request of every client in a turn, and a turn reads no more requests
+//  than it serves, so the queue of client holds only requests waiting
+//  while others are served.
+//
+//      zstr_sendx (zns_srv, "RATELIMIT", "1000", "100", NULL);
+//      zstr_sendx (zns_srv, "QUEUE", "16", NULL);
+//
+//  Refuse values streamed by STREAM over max bytes and drop streamed values
+//  whose client sent no chunk for msecs, default 64MB and 30000.
+//
+//      zstr_sendx (zns_srv, "UPLOAD", "67108864", "30000", NULL);
+//
+//  Publish changes of keys on PUB socket, can be repeated for more endpoints.
+//
+//      zstr_sendx (zns_srv, "PUBLISH", endpoint, NULL);
+//
+//  Every put or delete is published as key, op (PUT or DELETE) and version,
+//  so WATCH of prefix is a SUB socket subscribed to the prefix. The same feed
+//  invalidates near cache of zns_client.
+//
+//  Replicate changes to followers connected to endpoint. Every follower gets
+//  encrypted snapshot of the store and then the log of changes sealed by the
+//  password together with their sequence number. Follower refuses change
+//  sealed under other number or not newer than its store, so changes can't
+//  be replayed or rolled back. Only changes made through the actor are
+//  replicated.
+//
+//      zstr_sendx (zns_srv, "REPLICATE", endpoint, NULL);
+//
+//  Follow primary zns_srv replicating on endpoint. Follower must use the same
+//  password, it serves reads only and refuses changes with ERROR key
+//  read-only command. Missed change or silent primary makes it load new
+//  snapshot.
+//
+//      zstr_sendx (zns_srv, "FOLLOW", endpoint, NULL);
+//
+//  Ask follower for replication lag, reply is number of changes it is behind
+//  and msecs since it was last up to date. Primary replies 0 0.
+//
+//      zstr_sendx (zns_srv, "LAG", NULL);
+//      zstr_recvx (zns_srv, &command, &changes, &msecs, NULL);
+//
+//  Ask for metrics, reply is STATS followed by name and value pairs. Counters
+//  of requests by command, refused requests, failed saves and backups,
+//  snapshots sent, verifications and corrupted ranges found, gauges of keys,
+//  readiness (1 when store is loaded), keys waiting to be loaded, values
+//  which failed to open on load (store is not saved while there are any),
+//  followers and replication sequence and histograms of request, save, load
+//  and backup times in usecs as count, sum, p50, p99 and p999.
+//  Clients can ask the same by STATS on the read write socket.
+//
+//      zstr_sendx (zns_srv, "STATS", NULL);
+//
+//  Serve the same metrics in Prometheus text format over HTTP on tcp://
+//  endpoint, histograms in seconds. Every request is answered and closed.
+//
+//      zstr_sendx (zns_srv, "METRICS", "tcp://*:9150", NULL);
+//
+//  Trace every n-th request, save and load by spans, e.g. decode, lookup,
+//  copy and send of GET or phases of save, 0 none. Last 1024 traces are kept
+//  for TRACE DUMP, reply is TRACE followed by a frame per trace, oldest
+//  first. Operations slower than usecs are logged with their spans.
+//
+//      zstr_sendx (zns_srv, "TRACE", "SAMPLE", "100", NULL);
+//      zstr_sendx (zns_srv, "TRACE", "SLOW", "10000", NULL);
+//      zstr_sendx (zns_srv, "TRACE", "DUMP", NULL);
+//
+//  Clients talk to the read write socket using following commands:
+//
+//      GET key [version]           -> GET key [value version]
+//      PUT key value [ttl=msec]
+//      DELETE key
+//      FETCH key offset size [version]
+//                                  -> FETCH key offset [total version data]
+//      STREAM key offset total data [ttl=msec] -> STREAM key offset
+//      CAS key version [value]     -> CAS key OK version
+//                                  -> CAS key CONFLICT version [value]
+//      INCR key [delta]            -> INCR key value version
+//      APPEND key data             -> APPEND key version
+//      STATS                       -> STATS [name value]...
+//
+//  FETCH and STREAM transfer big values in chunks, every chunk is answered,
+//  so clients can limit number of chunks in flight (see zns_client). CAS,
+//  INCR and APPEND keep expiry time of the key. Errors are reported as
+//  ERROR key reason command, so clients can tell which request failed.
+//
+//  Value put with ttl is deleted after ttl msecs, STREAM takes it with the
+//  last chunk. Expiry is published and replicated as DELETE, expiry time is
+//  kept in the store file. INCR and APPEND keep the expiry time of key.
+//
+//  GET and FETCH with version of value client already has are answered by
+//  NOTMODIFIED key version if the key has not changed since. CAS puts the
+//  value (or deletes the key if missing) only if the key has the version,
+//  0 for missing key; conflict returns the current value, so the client can
+//  retry at once. INCR adds delta (default 1) to decimal number stored in
+//  the key, APPEND adds data to the end of value. All three are atomic.
+//
 //  This is the zns_srv constructor as a zactor_fn;
 ZNS_EXPORT void
     zns_srv_actor (zsock_t *pipe, void *args);
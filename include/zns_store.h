@@ -17,6 +17,29 @@ extern "C" {
 #endif
 
 //  @interface
+//  Callback for key deleted by expiry
+typedef void (zns_store_expired_fn) (
+    const char *key, uint64_t version, void *arg);
+
+//  Callback for phase of save or load which took usecs, phases of save are
+//  pack, encrypt, write and fsync, export has encode instead of the last
+//  two, phases of load are read, decode, decrypt and unpack. Phase can be
+//  reported more times, times add up.
+typedef void (zns_store_phase_fn) (
+    const char *phase, int64_t usecs, void *arg);
+
+//  Callback for key read by scan with its value, version and expiry time.
+//  The value is wiped once the callback returns. Return 0 to go on, -1 to
+//  stop the scan.
+typedef int (zns_store_scan_fn) (
+    const char *key, zchunk_t *value, uint64_t version, int64_t expires, void *arg);
+
+//  Callback for corrupted range of store file found by verify, offset and
+//  size in bytes and what is there: header, index, key of the value, values
+//  without key or unverified values after corrupted index
+typedef void (zns_store_corrupt_fn) (
+    uint64_t offset, uint64_t size, const char *what, void *arg);
+
 //  Create a new zns_store
 ZNS_EXPORT zns_store_t *
     zns_store_new (void);
@@ -25,15 +48,86 @@ ZNS_EXPORT zns_store_t *
 ZNS_EXPORT void
     zns_store_destroy (zns_store_t **self_p);
 
-//  Put the binary chunk with given key to store
-ZNS_EXPORT void
+//  Put the binary chunk with given key to store, NULL value deletes the key.
+//  Return the version assigned to the change.
+ZNS_EXPORT uint64_t
     zns_store_put (zns_store_t *self, const char* key, zchunk_t *value);
 
+//  Put the binary chunk, which expires after ttl msec, 0 means never.
+//  Return the version assigned to the change.
+ZNS_EXPORT uint64_t
+    zns_store_put_ttl (zns_store_t *self, const char* key, zchunk_t *value, int64_t ttl);
+
+//  Put the value only if version of key is still expected one, 0 expects
+//  missing key. NULL value deletes the key. The key keeps its expiry time,
+//  as with incr and append. Return 0 and store the new version to version_p
+//  or -1 with the current version if key has changed.
+ZNS_EXPORT int
+    zns_store_cas (zns_store_t *self, const char* key, uint64_t expected, zchunk_t *value, uint64_t *version_p);
+
+//  Add delta to the decimal number stored in key, missing key counts as 0.
+//  Return 0 and store the result and new version, or -1 if the value is not
+//  a number or the result would overflow.
+ZNS_EXPORT int
+    zns_store_incr (zns_store_t *self, const char* key, int64_t delta, int64_t *value_p, uint64_t *version_p);
+
+//  Append the value to the key, missing key is created. Return the version
+//  assigned to the change.
+ZNS_EXPORT uint64_t
+    zns_store_append (zns_store_t *self, const char* key, zchunk_t *value);
+
 //  Get the reference to the store or NULL if not there - ownership is NOT
-//  passed
+//  passed. Reference is valid until key is changed, so it is not safe to
+//  use it when other threads write to the store.
 ZNS_EXPORT const zchunk_t *
     zns_store_get (zns_store_t *self, const char* key);
 
+//  Get the copy of value or NULL if not there, optionally with its version.
+//  Caller is responsible for destroying the returned chunk.
+ZNS_EXPORT zchunk_t *
+    zns_store_lookup (zns_store_t *self, const char* key, uint64_t *version_p);
+
+//  Return version of the key or 0 if not there. Versions only grow, even
+//  across save and load.
+ZNS_EXPORT uint64_t
+    zns_store_version (zns_store_t *self, const char* key);
+
+//  Return wall clock time in msec when the key expires, 0 if never or if
+//  the key is not there
+ZNS_EXPORT int64_t
+    zns_store_expires (zns_store_t *self, const char* key);
+
+//  Delete keys expired before now (wall clock msec) and call expired_fn,
+//  if not NULL, with key and version of every deletion. Only keys which
+//  expired are touched. Return number of deleted keys.
+ZNS_EXPORT size_t
+    zns_store_expire (zns_store_t *self, int64_t now, zns_store_expired_fn *expired_fn, void *arg);
+
+//  Return msecs from now (wall clock) until zns_store_expire has work to do,
+//  -1 if no key expires
+ZNS_EXPORT int64_t
+    zns_store_expire_timeout (zns_store_t *self, int64_t now);
+
+//  Apply the change made by other store with given version and expiry time,
+//  NULL value deletes the key. Used by replicas, so versions stay the same
+//  as on the primary. Return 0 if applied, -1 if key has the same or newer
+//  version already, so old change can't roll it back.
+ZNS_EXPORT int
+    zns_store_apply (zns_store_t *self, const char* key, zchunk_t *value, uint64_t version, int64_t expires);
+
+//  Return the last version assigned to a change
+ZNS_EXPORT uint64_t
+    zns_store_sequence (zns_store_t *self);
+
+//  Return number of keys in the store
+ZNS_EXPORT size_t
+    zns_store_size (zns_store_t *self);
+
+//  Return number of values which failed to open since the store was loaded.
+//  Store with any is not saved or exported, so the file keeps them.
+ZNS_EXPORT size_t
+    zns_store_unreadable (zns_store_t *self);
+
 //  Set directory to store
 ZNS_EXPORT void
     zns_store_set_dir (zns_store_t *self, const char *dir);
@@ -42,14 +136,148 @@ ZNS_EXPORT void
 ZNS_EXPORT void
     zns_store_set_file (zns_store_t *self, const char *file);
 
+//  Set cipher of saved and exported store, salsa20poly1305 (default),
+//  xchacha20poly1305_ietf, aes256gcm or fastest one supported by this CPU.
+//  Load accepts any of them and keeps the cipher of the file unless one was
+//  set. Return 0 for success, -1 if the cipher is not known or supported.
+ZNS_EXPORT int
+    zns_store_set_cipher (zns_store_t *self, const char *name);
+
+//  Return name of cipher of saved and exported store
+ZNS_EXPORT const char *
+    zns_store_cipher (zns_store_t *self);
+
+//  Key passed to save and export is derived by kdf, which stores its salt
+//  and limits in the header. The kdf is not owned by the store, NULL for
+//  key used as it is.
+ZNS_EXPORT void
+    zns_store_set_kdf (zns_store_t *self, zns_kdf_t *kdf);
+
+//  Call phase_fn at the end of every phase of save, export, load and
+//  import, NULL to stop. It is called from the thread doing the work.
+ZNS_EXPORT void
+    zns_store_set_phase_fn (zns_store_t *self, zns_store_phase_fn *phase_fn, void *arg);
+
+//  Return key derivation of store file, NULL if there is no file or it is
+//  keyed by password itself. Only the header is read.
+ZNS_EXPORT zns_kdf_t *
+    zns_store_read_kdf (zns_store_t *self);
+
+//  Return key derivation of content returned by export, NULL if the content
+//  is keyed by password itself. Caller is responsible for destroying it.
+ZNS_EXPORT zns_kdf_t *
+    zns_store_image_kdf (zchunk_t *buffer);
+
 //  Load the keystore from path/file, return 0 for success, -1 for error
 ZNS_EXPORT int
     zns_store_load (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES]);
 
-//  Save the keystore to path/file, return 0 for success, -1 for error
+//  Load the keystore from path/file like zns_store_load, but values sealed
+//  by their data keys stay sealed until load_step or until their key is
+//  used, so the store can serve at once. Store saved before format 4 is
+//  loaded whole. Return 0 for success, -1 for error.
+ZNS_EXPORT int
+    zns_store_load_begin (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES]);
+
+//  Open at most batch values waiting since load_begin, return number of
+//  values still waiting. Save, export and rekey open the rest at once.
+ZNS_EXPORT size_t
+    zns_store_load_step (zns_store_t *self, size_t batch);
+
+//  Save the keystore to path/file, return 0 for success, -1 for error. The
+//  store is locked only while it is packed, encryption and writing run
+//  after, so other threads using the store wait only for the pack.
 ZNS_EXPORT int
     zns_store_save (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES]);
 
+//  Write point in time copy of the store to path in the same format as the
+//  file, return number of bytes written or -1 for error. Data keys are
+//  wrapped by key, which kdf derives, NULL for raw key. Master key and KDF
+//  of the store are not touched and the store is locked only while it is
+//  packed, so it can be called from another thread while the store is in
+//  use, rekeyed included. Phases are not reported.
+ZNS_EXPORT int64_t
+    zns_store_backup (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], zns_kdf_t *kdf, const char *path);
+
+//  Return the encrypted content of the store in the same format as the file,
+//  or NULL for error. Caller is responsible for destroying the chunk.
+ZNS_EXPORT zchunk_t *
+    zns_store_export (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES]);
+
+//  Replace the content of the store by content returned from export, return
+//  0 for success, -1 for error
+ZNS_EXPORT int
+    zns_store_import (zns_store_t *self, zchunk_t *buffer, byte key [crypto_secretbox_KEYBYTES]);
+
+//  Return copy of value of key from content returned by export or NULL if
+//  the key is missing or for error. Only the index and the value of key are
+//  decrypted, except for files saved before format 4.
+ZNS_EXPORT zchunk_t *
+    zns_store_extract (zchunk_t *buffer, const char *name, byte key [crypto_secretbox_KEYBYTES]);
+
+//  Call scan_fn with every key of path/file which has not expired, the store
+//  itself is not changed. Values of format 4 are read from the file and
+//  opened one at a time, so only the index is held in memory, files of
+//  older formats are read whole. Return 0 for success, -1 for error or if
+//  scan_fn stopped the scan.
+ZNS_EXPORT int
+    zns_store_scan (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], zns_store_scan_fn *scan_fn, void *arg);
+
+//  Start verifying path/file by key, the store itself is not touched. Every
+//  corrupted range is reported to corrupt_fn, which may be NULL. Return 0
+//  for success, -1 if the file can't be read.
+ZNS_EXPORT int
+    zns_store_verify_begin (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], zns_store_corrupt_fn *corrupt_fn, void *arg);
+
+//  Authenticate next segments of the index and values until at least bytes
+//  of file are read. Index and values are read by two handles in step, so
+//  only one segment and one value are in memory. Return number of bytes
+//  read, 0 when the whole file is verified. Calls of verify must come from
+//  one thread.
+ZNS_EXPORT size_t
+    zns_store_verify_step (zns_store_t *self, size_t bytes);
+
+//  Finish verify, return number of corrupted ranges found, -1 if none was
+//  started
+ZNS_EXPORT int
+    zns_store_verify_end (zns_store_t *self);
+
+//  Verify path/file at once, reading at most rate bytes per second, 0 for
+//  no limit. Return number of corrupted ranges, -1 if the file can't be
+//  read.
+ZNS_EXPORT int
+    zns_store_verify (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], size_t rate, zns_store_corrupt_fn *corrupt_fn, void *arg);
+
+//  Start rewrapping data keys of all values by new master key used by next
+//  export and save. Values themselves are not encrypted again, so it keeps
+//  the store safe from leaked old password or master key, not from leaked
+//  data keys, which stay valid for values written before.
+ZNS_EXPORT void
+    zns_store_rekey (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES]);
+
+//  Rewrap at most batch data keys waiting for new master key, return number
+//  of keys still waiting. Export wraps the rest at once.
+ZNS_EXPORT size_t
+    zns_store_rewrap (zns_store_t *self, size_t batch);
+
+//  Write content of the store unencrypted to new memory file, sealed against
+//  any change, for zenstore process taking over this one. It carries key
+//  derivation and a check of the key. Return the file descriptor or -1 for
+//  error, memory files need Linux.
+ZNS_EXPORT int
+    zns_store_handover (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES]);
+
+//  Return key derivation of memory file from handover, NULL if it is keyed
+//  by password itself. Caller is responsible for destroying it.
+ZNS_EXPORT zns_kdf_t *
+    zns_store_handover_kdf (int fd);
+
+//  Replace the content of the store by memory file from handover, key must
+//  be the same as key of handover. The file stays open. Return 0 for
+//  success, -1 for error.
+ZNS_EXPORT int
+    zns_store_takeover (zns_store_t *self, int fd, byte key [crypto_secretbox_KEYBYTES]);
+
 //  Self test of this class
 ZNS_EXPORT void
     zns_store_test (bool verbose);
@@ -18,13 +18,15 @@
 
 #include "zns_classes.h"
 
+#include <inttypes.h>
+
 #if defined __UNIX__
 #include <termios.h>
 
 // read up to crypto_secretbox_KEYBYTES from tty. Return allocated array or NULL
 // if the input is longer, warning is issues and key is stripped down
 static byte *
-s_getkey ()
+s_getkey (const char *name)
 {
     // source of "wisdom"
     // http://www.gnu.org/software/libc/manual/html_node/getpass.html
@@ -54,7 +56,10 @@ s_getkey ()
         goto end;
     }
 
-    printf ("Enter the password: ");
+    if (name)
+        printf ("Enter the password of %s: ", name);
+    else
+        printf ("Enter the password: ");
     fflush (stdout);
 
     r = (int) read (STDIN_FILENO, ret, crypto_secretbox_KEYBYTES);
@@ -80,18 +85,82 @@ end:
 #error Please send a pull request with password reading for Windows
 #endif
 
+//  Hand the store over to new process connecting to listener, it gets the
+//  store in memory file. Return 0 if it took the store over, -1 if this
+//  process goes on serving.
+
+static int
+s_handover (zactor_t *zns_srv, int listener)
+{
+    int peer = zns_handover_accept (listener);
+    if (peer == -1)
+        return -1;
+    zsys_info ("handing store over to new process");
+    zstr_sendx (zns_srv, "HANDOVER", NULL);
+    //  Reply to LAG may come first
+    int fd = -1;
+    zmsg_t *msg;
+    while ((msg = zmsg_recv (zns_srv))) {
+        char *command = zmsg_popstr (msg);
+        bool done = command && streq (command, "HANDOVER");
+        if (done) {
+            char *fd_str = zmsg_popstr (msg);
+            fd = fd_str ? atoi (fd_str) : -1;
+            zstr_free (&fd_str);
+        }
+        zstr_free (&command);
+        zmsg_destroy (&msg);
+        if (done)
+            break;
+    }
+    int r = zns_handover_send (peer, fd);
+    if (fd != -1) {
+        close (fd);
+        if (r == 0)
+            r = zns_handover_wait (peer);
+        if (r == -1) {
+            zsys_error ("new process failed to take store over, serving again");
+            zstr_sendx (zns_srv, "RESUME", NULL);
+        }
+    }
+    else
+        r = -1;
+    close (peer);
+    return r;
+}
+
 int main (int argc, char *argv [])
 {
     bool verbose = false;
-    char *endpoint = ZNS_DEFAULT_ENDPOINT;
+    zlistx_t *endpoints = zlistx_new ();
     char *store_path = NULL;
+    char *replicate = NULL;
+    char *follow = NULL;
+    char *cipher = NULL;
+    char *kdf = NULL;
+    char *metrics = NULL;
+    char *slow = NULL;
+    char *handover = NULL;
+    char *takeover = NULL;
+    int64_t calibrate = 0;
+    zlistx_t *hosted = zlistx_new ();
     int argn;
     for (argn = 1; argn < argc; argn++) {
         if (streq (argv [argn], "--help")
         ||  streq (argv [argn], "-h")) {
             puts ("zenstore [options] ...");
-            puts ("  --endpoint / -e        zeromq endpoint to bind");
+            puts ("  --endpoint / -e        zeromq endpoint to bind, can be repeated");
             puts ("  --store / -s           path to store file");
+            puts ("  --replicate / -r       replicate changes to followers on endpoint");
+            puts ("  --follow / -f          read only replica of primary on endpoint");
+            puts ("  --host / -H            host store name:path, can be repeated");
+            puts ("  --cipher / -c          salsa20poly1305, xchacha20poly1305_ietf, aes256gcm or fastest");
+            puts ("  --metrics / -m         serve Prometheus metrics on tcp endpoint");
+            puts ("  --slow / -S            log requests, saves and loads slower than usecs");
+            puts ("  --kdf / -k             key derivation limits opslimit:memlimit of new keys");
+            puts ("  --calibrate / -C       print key derivation limits taking msecs and exit");
+            puts ("  --handover / -o        hand store over to new process connecting to unix socket");
+            puts ("  --takeover / -t        take store over from process listening on unix socket");
             puts ("  --verbose / -v         verbose test output");
             puts ("  --help / -h            this information");
             return 0;
@@ -107,7 +176,7 @@ int main (int argc, char *argv [])
                 printf ("Missing argument for --endpoint/-e\n");
                 return -1;
             }
-            endpoint = argv [argn+1];
+            zlistx_add_end (endpoints, argv [argn+1]);
             argn++;
         }
         else
@@ -120,17 +189,211 @@ int main (int argc, char *argv [])
             store_path = argv [argn+1];
             argn++;
         }
+        else
+        if (streq (argv [argn], "--replicate")
+        ||  streq (argv [argn], "-r")) {
+            if (argc == argn+1) {
+                printf ("Missing argument for --replicate/-r\n");
+                return -1;
+            }
+            replicate = argv [argn+1];
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--follow")
+        ||  streq (argv [argn], "-f")) {
+            if (argc == argn+1) {
+                printf ("Missing argument for --follow/-f\n");
+                return -1;
+            }
+            follow = argv [argn+1];
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--cipher")
+        ||  streq (argv [argn], "-c")) {
+            if (argc == argn+1) {
+                printf ("Missing argument for --cipher/-c\n");
+                return -1;
+            }
+            cipher = argv [argn+1];
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--metrics")
+        ||  streq (argv [argn], "-m")) {
+            if (argc == argn+1) {
+                printf ("Missing argument for --metrics/-m\n");
+                return -1;
+            }
+            metrics = argv [argn+1];
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--slow")
+        ||  streq (argv [argn], "-S")) {
+            if (argc == argn+1) {
+                printf ("Missing argument for --slow/-S\n");
+                return -1;
+            }
+            slow = argv [argn+1];
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--kdf")
+        ||  streq (argv [argn], "-k")) {
+            if (argc == argn+1 || !strchr (argv [argn+1], ':')) {
+                printf ("Missing opslimit:memlimit argument for --kdf/-k\n");
+                return -1;
+            }
+            kdf = argv [argn+1];
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--calibrate")
+        ||  streq (argv [argn], "-C")) {
+            if (argc == argn+1 || atoll (argv [argn+1]) <= 0) {
+                printf ("Missing msecs argument for --calibrate/-C\n");
+                return -1;
+            }
+            calibrate = atoll (argv [argn+1]);
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--handover")
+        ||  streq (argv [argn], "-o")) {
+            if (argc == argn+1) {
+                printf ("Missing argument for --handover/-o\n");
+                return -1;
+            }
+            handover = argv [argn+1];
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--takeover")
+        ||  streq (argv [argn], "-t")) {
+            if (argc == argn+1) {
+                printf ("Missing argument for --takeover/-t\n");
+                return -1;
+            }
+            takeover = argv [argn+1];
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--host")
+        ||  streq (argv [argn], "-H")) {
+            if (argc == argn+1 || !strchr (argv [argn+1], ':')) {
+                printf ("Missing name:path argument for --host/-H\n");
+                return -1;
+            }
+            zlistx_add_end (hosted, argv [argn+1]);
+            argn++;
+        }
         else {
             printf ("Unknown option: %s\n", argv [argn]);
             return 1;
         }
     }
 
+    if (calibrate) {
+        //  Derivation of key from password takes about msecs on this machine
+        zns_kdf_t *calibrated = zns_kdf_new ();
+        int64_t msecs = zns_kdf_calibrate (calibrated, calibrate);
+        printf ("--kdf %" PRIu64 ":%zu takes %" PRId64 " msecs\n",
+                zns_kdf_opslimit (calibrated), zns_kdf_memlimit (calibrated), msecs);
+        zns_kdf_destroy (&calibrated);
+        zlistx_destroy (&endpoints);
+        zlistx_destroy (&hosted);
+        return 0;
+    }
+    if (!store_path && zlistx_size (hosted) == 0) {
+        printf ("Missing --store/-s\n");
+        zlistx_destroy (&endpoints);
+        zlistx_destroy (&hosted);
+        return -1;
+    }
+    if (store_path && zlistx_size (hosted) > 0) {
+        printf ("Can't use --store/-s and --host/-H together\n");
+        zlistx_destroy (&endpoints);
+        zlistx_destroy (&hosted);
+        return -1;
+    }
+    if (replicate && follow) {
+        printf ("Can't use --replicate/-r and --follow/-f together\n");
+        zlistx_destroy (&endpoints);
+        zlistx_destroy (&hosted);
+        return -1;
+    }
+    if (zlistx_size (hosted) > 0 && (replicate || follow)) {
+        printf ("Can't replicate stores hosted by --host/-H\n");
+        zlistx_destroy (&endpoints);
+        zlistx_destroy (&hosted);
+        return -1;
+    }
+    if (zlistx_size (hosted) > 0 && metrics) {
+        printf ("Can't serve metrics of stores hosted by --host/-H\n");
+        zlistx_destroy (&endpoints);
+        zlistx_destroy (&hosted);
+        return -1;
+    }
+    if (zlistx_size (hosted) > 0 && (handover || takeover)) {
+        printf ("Can't hand over stores hosted by --host/-H\n");
+        zlistx_destroy (&endpoints);
+        zlistx_destroy (&hosted);
+        return -1;
+    }
+    if (cipher && !zns_cipher_available (cipher)) {
+        printf ("Cipher %s is not supported\n", cipher);
+        zlistx_destroy (&endpoints);
+        zlistx_destroy (&hosted);
+        return -1;
+    }
+    if (zlistx_size (endpoints) == 0)
+        zlistx_add_end (endpoints, ZNS_DEFAULT_ENDPOINT);
+
+    if (zlistx_size (hosted) > 0) {
+        //  Many named stores in one process, every one with own password
+        zactor_t *zns_host = zactor_new (zns_host_actor, NULL);
+        if (verbose)
+            zstr_send (zns_host, "VERBOSE");
+        for (char *spec = (char *) zlistx_first (hosted);
+                   spec != NULL;
+                   spec = (char *) zlistx_next (hosted)) {
+            char *name = strdup (spec);
+            char *path = strchr (name, ':');
+            *path++ = '\0';
+            byte *password = s_getkey (name);
+            if (!password) {
+                printf ("Reading password failed");
+                zstr_free (&name);
+                zactor_destroy (&zns_host);
+                return -1;
+            }
+            zstr_sendx (zns_host, "STORE", name, path, password, NULL);
+            free (password);
+            zstr_free (&name);
+        }
+        zlistx_destroy (&hosted);
+        for (char *endpoint = (char *) zlistx_first (endpoints);
+                   endpoint != NULL;
+                   endpoint = (char *) zlistx_next (endpoints))
+            zstr_sendx (zns_host, "BIND", endpoint, NULL);
+        zlistx_destroy (&endpoints);
+
+        char *message = zstr_recv (zns_host);
+        if (!message)
+            puts ("interrupted");
+        zstr_free (&message);
+        zactor_destroy (&zns_host);
+        return 0;
+    }
+    zlistx_destroy (&hosted);
+
     //  Insert main code here
     if (verbose)
-        zsys_info ("zenstore - Daemon\n\tendpoint=%s, store_path=%s", endpoint, store_path);
+        zsys_info ("zenstore - Daemon\n\tendpoint=%s, store_path=%s", (char *) zlistx_first (endpoints), store_path);
 
-    byte * password = s_getkey ();
+    byte * password = s_getkey (NULL);
     if (!password) {
         printf ("Reading password failed");
         return -1;
@@ -140,25 +403,134 @@ int main (int argc, char *argv [])
     zactor_t *zns_srv = zactor_new (zns_srv_actor, NULL);
 
     // start an actor
-    zstr_sendx (zns_srv, "STORE", "src/test.zenstore", NULL);
+    if (verbose)
+        zstr_send (zns_srv, "VERBOSE");
+    zstr_sendx (zns_srv, "STORE", store_path, NULL);
+    if (slow)
+        zstr_sendx (zns_srv, "TRACE", "SLOW", slow, NULL);
+    if (cipher)
+        zstr_sendx (zns_srv, "CIPHER", cipher, NULL);
+    if (kdf) {
+        char *memlimit = strchr (kdf, ':');
+        *memlimit++ = '\0';
+        zstr_sendx (zns_srv, "KDF", kdf, memlimit, NULL);
+    }
     zstr_sendx (zns_srv, "PASSWORD", password, NULL);
     free (password);
     password = NULL;
-    zstr_sendx (zns_srv, "START", NULL);
-    zstr_sendx (zns_srv, "BIND", endpoint, NULL);
+    int peer = -1;
+    if (takeover) {
+        //  Old process stops serving now, its store comes decrypted in
+        //  memory file, so nothing is read or decrypted
+        peer = zns_handover_connect (takeover);
+        int fd = peer == -1 ? -1 : zns_handover_recv (peer);
+        char *result = NULL;
+        if (fd != -1) {
+            char fd_str [16];
+            snprintf (fd_str, sizeof fd_str, "%d", fd);
+            zstr_sendx (zns_srv, "TAKEOVER", fd_str, NULL);
+            char *command = NULL;
+            zstr_recvx (zns_srv, &command, &result, NULL);
+            zstr_free (&command);
+            close (fd);
+        }
+        if (!result || !streq (result, "0")) {
+            printf ("Taking store over from %s failed\n", takeover);
+            if (peer != -1) {
+                zns_handover_done (peer, -1);
+                close (peer);
+            }
+            zstr_free (&result);
+            zactor_destroy (&zns_srv);
+            zlistx_destroy (&endpoints);
+            return -1;
+        }
+        zstr_free (&result);
+    }
+    else
+        zstr_sendx (zns_srv, "START", NULL);
+    int bound = 0;
+    for (char *endpoint = (char *) zlistx_first (endpoints);
+               bound == 0 && endpoint != NULL;
+               endpoint = (char *) zlistx_next (endpoints)) {
+        zstr_sendx (zns_srv, "BIND", endpoint, NULL);
+        bound = zsock_wait (zns_srv);
+        if (bound != 0)
+            printf ("Can't bind to %s\n", endpoint);
+    }
+    zlistx_destroy (&endpoints);
+    if (bound != 0) {
+        //  Old process binds its endpoints again and goes on
+        if (peer != -1) {
+            zns_handover_done (peer, -1);
+            close (peer);
+        }
+        zactor_destroy (&zns_srv);
+        return -1;
+    }
+    if (metrics)
+        zstr_sendx (zns_srv, "METRICS", metrics, NULL);
+    if (replicate)
+        zstr_sendx (zns_srv, "REPLICATE", replicate, NULL);
+    if (follow)
+        zstr_sendx (zns_srv, "FOLLOW", follow, NULL);
+    if (peer != -1) {
+        //  Endpoints are ours, old process can exit
+        zns_handover_done (peer, 0);
+        close (peer);
+    }
+    int listener = handover ? zns_handover_listen (handover) : -1;
+    bool handed_over = false;
 
     // src/malamute.c under MPL license
-    //  Accept and print any message back from server
+    //  Accept and print any message back from server, follower reports its
+    //  replication lag every minute, new process may come to take over
+    zmq_pollitem_t items [] = {
+        {zsock_resolve (zns_srv), 0, ZMQ_POLLIN, 0},
+        {NULL, listener, ZMQ_POLLIN, 0}
+    };
     while (true) {
-        char *message = zstr_recv (zns_srv);
-        if (message) {
-            puts (message);
-            free (message);
+        int r = zmq_poll (items, listener == -1 ? 1 : 2, follow ? 60000 : -1);
+        if (r == -1 || zsys_interrupted) {
+            puts ("interrupted");
+            break;
         }
-        else {
+        if (r == 0) {
+            zstr_sendx (zns_srv, "LAG", NULL);
+            continue;
+        }
+        if (items [1].revents & ZMQ_POLLIN) {
+            handed_over = s_handover (zns_srv, listener) == 0;
+            if (handed_over) {
+                zsys_info ("store handed over, exiting");
+                break;
+            }
+            continue;
+        }
+        zmsg_t *msg = zmsg_recv (zns_srv);
+        if (!msg) {
             puts ("interrupted");
             break;
         }
+        char *message = zmsg_popstr (msg);
+        if (message && streq (message, "LAG")) {
+            char *changes = zmsg_popstr (msg);
+            char *msecs = zmsg_popstr (msg);
+            zsys_info ("replication lag: %s changes, %s msecs", changes, msecs);
+            zstr_free (&changes);
+            zstr_free (&msecs);
+        }
+        else
+        if (message)
+            puts (message);
+        zstr_free (&message);
+        zmsg_destroy (&msg);
+    }
+    //  Socket path belongs to the new process now
+    if (listener != -1) {
+        close (listener);
+        if (!handed_over)
+            unlink (handover);
     }
     zactor_destroy (&zns_srv);
 
@@ -0,0 +1,403 @@
+/*  =========================================================================
+    zenstore_tool - Offline import, export, rebuild and verify of store files
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zenstore_tool - Offline import, export, rebuild and verify of store files
+@discuss
+    Works on store files directly by libzns, no zenstore runs and nothing
+    goes through sockets.
+
+    import reads records from a dump file and puts them to the store file,
+    which is created unless it exists. Records are applied in file order,
+    the later of two records of one key wins, and the file is written once
+    at the end by all cores. Versions of records are kept, so an export
+    imported again gives the same store. Record which would go back to the
+    same or older version of its key, or has none, gets the next version
+    of the store (zns_dump).
+
+    export writes every key of the store file to a dump file. Values are
+    read from the file and opened one at a time (zns_store_scan), so the
+    memory needed is about the size of the index, not of the store.
+
+    rebuild loads the store file of any format and writes it again in the
+    current one, by the cipher and key derivation limits given. Files keyed
+    by the password itself get the salt.
+
+    verify decrypts every index segment and value of the store file without
+    loading it and prints every corrupted range by its offset. Memory needed
+    does not grow with the store, reads can be limited by --rate. Exit code
+    is 1 if any corruption is found.
+
+    Dump file is NDJSON by default, one object per line, or binary by
+    --binary, see zns_dump for both formats. Use - for stdin or stdout, the
+    password is read from the terminal.
+@end
+*/
+
+#include "zns_classes.h"
+
+#include <inttypes.h>
+#include <termios.h>
+
+//  Store file and its key
+
+typedef struct {
+    zns_store_t *store;
+    zns_kdf_t *kdf;             //  NULL if the key is the password itself
+    byte key [crypto_secretbox_KEYBYTES];
+    bool exists;                //  File was there when opened
+} s_file_t;
+
+//  Read the password from terminal, so stdin and stdout stay free for
+//  dumps. Return allocated string or NULL.
+
+static char *
+s_getpass (void)
+{
+    FILE *tty = fopen ("/dev/tty", "r+");
+    if (!tty) {
+        zsys_error ("Can't open terminal: %m");
+        return NULL;
+    }
+    struct termios old, new_;
+    if (tcgetattr (fileno (tty), &old) != 0) {
+        zsys_error ("tcgetattr failed: %m");
+        fclose (tty);
+        return NULL;
+    }
+    new_ = old;
+    new_.c_lflag &= ~ECHO;
+    if (tcsetattr (fileno (tty), TCSAFLUSH, &new_) != 0) {
+        zsys_error ("tcsetattr failed: %m");
+        fclose (tty);
+        return NULL;
+    }
+    fputs ("Enter the password: ", tty);
+    fflush (tty);
+
+    char buffer [1024];
+    char *password = NULL;
+    if (fgets (buffer, sizeof buffer, tty)) {
+        buffer [strcspn (buffer, "\n")] = '\0';
+        password = strdup (buffer);
+    }
+    sodium_memzero (buffer, sizeof buffer);
+    fputs ("\n", tty);
+    (void) tcsetattr (fileno (tty), TCSAFLUSH, &old);
+    fclose (tty);
+    return password;
+}
+
+//  Set directory and file of store to path
+
+static void
+s_set_path (zns_store_t *store, const char *path)
+{
+    const char *file = strrchr (path, '/');
+    if (file) {
+        char *dir = strndup (path, (size_t) (file - path));
+        zns_store_set_dir (store, file == path ? "/" : dir);
+        zns_store_set_file (store, file + 1);
+        zstr_free (&dir);
+    }
+    else {
+        zns_store_set_dir (store, ".");
+        zns_store_set_file (store, path);
+    }
+}
+
+//  Open store file at path and derive its key from password
+
+static s_file_t *
+s_file_open (const char *path, const char *password)
+{
+    s_file_t *self = (s_file_t *) zmalloc (sizeof (s_file_t));
+    assert (self);
+    self->store = zns_store_new ();
+    assert (self->store);
+    s_set_path (self->store, path);
+    self->exists = zsys_file_exists (path);
+
+    //  The same as zns_srv, key of older file is the password itself
+    self->kdf = self->exists ? zns_store_read_kdf (self->store) : NULL;
+    if (self->kdf) {
+        if (zns_kdf_derive (self->kdf, password) == -1) {
+            zns_kdf_destroy (&self->kdf);
+            zns_store_destroy (&self->store);
+            free (self);
+            return NULL;
+        }
+        memcpy (self->key, zns_kdf_key (self->kdf), sizeof self->key);
+    }
+    else {
+        size_t size = strlen (password) < sizeof self->key ? strlen (password) : sizeof self->key;
+        memcpy (self->key, password, size);
+    }
+    return self;
+}
+
+static void
+s_file_destroy (s_file_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_file_t *self = *self_p;
+        zns_store_set_kdf (self->store, NULL);
+        zns_store_destroy (&self->store);
+        zns_kdf_destroy (&self->kdf);
+        sodium_memzero (self->key, sizeof self->key);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Save the store by cipher, new key derivation is made if limits are
+//  given or if the file has none yet. Return 0 for success, -1 for error.
+
+static int
+s_file_save (s_file_t *self, const char *password, const char *cipher, const char *limits)
+{
+    if (cipher && zns_store_set_cipher (self->store, cipher) == -1)
+        return -1;
+    if (!self->kdf || limits) {
+        zns_kdf_t *kdf = zns_kdf_new ();
+        assert (kdf);
+        if (limits)
+            zns_kdf_set_limits (kdf, strtoull (limits, NULL, 10), (size_t) strtoull (strchr (limits, ':') + 1, NULL, 10));
+        if (zns_kdf_derive (kdf, password) == -1) {
+            zns_kdf_destroy (&kdf);
+            return -1;
+        }
+        zns_kdf_destroy (&self->kdf);
+        self->kdf = kdf;
+        memcpy (self->key, zns_kdf_key (kdf), sizeof self->key);
+    }
+    zns_store_set_kdf (self->store, self->kdf);
+    return zns_store_save (self->store, self->key);
+}
+
+//  Export state
+
+typedef struct {
+    zns_dump_t *dump;
+    int64_t count;
+    bool verbose;
+} s_export_t;
+
+static int
+s_export_key (const char *key, zchunk_t *value, uint64_t version, int64_t expires, void *arg)
+{
+    s_export_t *self = (s_export_t *) arg;
+    if (zns_dump_write (self->dump, key, value, version, expires) == -1)
+        return -1;
+    self->count++;
+    if (self->verbose && self->count % 100000 == 0)
+        zsys_info ("exported %" PRId64 " keys", self->count);
+    return 0;
+}
+
+//  Print corrupted range found by verify
+
+static void
+s_verify_corrupt (uint64_t offset, uint64_t size, const char *what, void *arg)
+{
+    printf ("corrupted at %" PRIu64 ", %" PRIu64 " bytes: %s\n", offset, size, what);
+}
+
+int main (int argc, char *argv [])
+{
+    bool verbose = false;
+    bool binary = false;
+    char *cipher = NULL;
+    char *kdf = NULL;
+    size_t rate = 0;
+    char *args [3] = {NULL, NULL, NULL};
+    int args_count = 0;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("zenstore_tool [options] command ...");
+            puts ("  import dump store      put records of dump to store file, created if missing");
+            puts ("  export store dump      write all keys of store file to dump");
+            puts ("  rebuild store [new]    write store file in current format, in place by default");
+            puts ("  verify store           check every index segment and value of store file");
+            puts ("  --binary / -b          binary dump instead of NDJSON");
+            puts ("  --cipher / -c          salsa20poly1305, xchacha20poly1305_ietf, aes256gcm or fastest");
+            puts ("  --kdf / -k             key derivation limits opslimit:memlimit of new key");
+            puts ("  --rate / -r            bytes per second read by verify, unlimited by default");
+            puts ("  --verbose / -v         verbose output");
+            puts ("  --help / -h            this information");
+            puts ("Use - for dump on stdin or stdout.");
+            return 0;
+        }
+        else
+        if (streq (argv [argn], "--verbose")
+        ||  streq (argv [argn], "-v"))
+            verbose = true;
+        else
+        if (streq (argv [argn], "--binary")
+        ||  streq (argv [argn], "-b"))
+            binary = true;
+        else
+        if (streq (argv [argn], "--cipher")
+        ||  streq (argv [argn], "-c")) {
+            if (argc == argn+1) {
+                printf ("Missing argument for --cipher/-c\n");
+                return -1;
+            }
+            cipher = argv [argn+1];
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--kdf")
+        ||  streq (argv [argn], "-k")) {
+            if (argc == argn+1 || !strchr (argv [argn+1], ':')) {
+                printf ("Missing opslimit:memlimit argument for --kdf/-k\n");
+                return -1;
+            }
+            kdf = argv [argn+1];
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--rate")
+        ||  streq (argv [argn], "-r")) {
+            if (argc == argn+1) {
+                printf ("Missing argument for --rate/-r\n");
+                return -1;
+            }
+            rate = (size_t) strtoull (argv [argn+1], NULL, 10);
+            argn++;
+        }
+        else
+        if (*argv [argn] == '-' && !streq (argv [argn], "-")) {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+        else
+        if (args_count == 3) {
+            printf ("Too many arguments: %s\n", argv [argn]);
+            return 1;
+        }
+        else
+            args [args_count++] = argv [argn];
+    }
+
+    const char *command = args [0];
+    if (!command
+    ||  (streq (command, "import") && args_count != 3)
+    ||  (streq (command, "export") && args_count != 3)
+    ||  (streq (command, "rebuild") && args_count != 2 && args_count != 3)
+    ||  (streq (command, "verify") && args_count != 2)) {
+        printf ("Missing arguments, see --help\n");
+        return -1;
+    }
+    if (!streq (command, "import") && !streq (command, "export")
+    &&  !streq (command, "rebuild") && !streq (command, "verify")) {
+        printf ("Unknown command: %s\n", command);
+        return 1;
+    }
+    if (cipher && !zns_cipher_available (cipher)) {
+        printf ("Cipher %s is not supported\n", cipher);
+        return -1;
+    }
+    const char *store_path = streq (command, "import") ? args [2] : args [1];
+    if (!streq (command, "import") && !zsys_file_exists (store_path)) {
+        printf ("Store file %s does not exist\n", store_path);
+        return -1;
+    }
+
+    char *password = s_getpass ();
+    if (!password) {
+        printf ("Reading password failed\n");
+        return -1;
+    }
+    s_file_t *file = s_file_open (store_path, password);
+    if (!file) {
+        printf ("Deriving key of %s failed\n", store_path);
+        sodium_memzero (password, strlen (password));
+        zstr_free (&password);
+        return -1;
+    }
+
+    int64_t start = zclock_mono ();
+    int r = 0;
+    int corrupted = 0;
+    if (streq (command, "import")) {
+        //  Records are added to keys already there
+        if (file->exists)
+            r = zns_store_load (file->store, file->key);
+        FILE *input = r == -1 ? NULL
+                    : streq (args [1], "-") ? stdin : fopen (args [1], "rb");
+        if (r == 0 && !input)
+            zsys_error ("Can't open '%s' for reading: %s", args [1], strerror (errno));
+        int64_t count = -1;
+        if (input) {
+            zns_dump_t *dump = zns_dump_new (input, binary);
+            count = zns_dump_import (dump, file->store, verbose);
+            zns_dump_destroy (&dump);
+        }
+        if (input && input != stdin)
+            fclose (input);
+        r = count == -1 ? -1 : s_file_save (file, password, cipher, kdf);
+        if (r == 0)
+            printf ("imported %" PRId64 " records to %s, %zu keys, %" PRId64 " msecs\n",
+                    count, store_path, zns_store_size (file->store), zclock_mono () - start);
+    }
+    else
+    if (streq (command, "export")) {
+        s_export_t export_ = {NULL, 0, verbose};
+        FILE *output = streq (args [2], "-") ? stdout : fopen (args [2], "wb");
+        if (!output) {
+            zsys_error ("Can't open '%s' for writing: %s", args [2], strerror (errno));
+            r = -1;
+        }
+        else
+            export_.dump = zns_dump_new (output, binary);
+        if (r == 0)
+            r = zns_store_scan (file->store, file->key, s_export_key, &export_);
+        if (export_.dump && zns_dump_finish (export_.dump) == -1)
+            r = -1;
+        zns_dump_destroy (&export_.dump);
+        if (output && output != stdout && fclose (output) != 0)
+            r = -1;
+        if (r == 0)
+            fprintf (stderr, "exported %" PRId64 " keys from %s, %" PRId64 " msecs\n",
+                     export_.count, store_path, zclock_mono () - start);
+    }
+    else
+    if (streq (command, "verify")) {
+        corrupted = zns_store_verify (file->store, file->key, rate, s_verify_corrupt, NULL);
+        r = corrupted == -1 ? -1 : 0;
+        if (r == 0)
+            printf ("verified %s, %d corrupted ranges, %" PRId64 " msecs\n",
+                    store_path, corrupted, zclock_mono () - start);
+    }
+    else {
+        //  Load takes every format, save writes the current one
+        r = zns_store_load (file->store, file->key);
+        //  New file is keyed the same
+        if (r == 0 && args_count == 3)
+            s_set_path (file->store, args [2]);
+        if (r == 0)
+            r = s_file_save (file, password, cipher, kdf);
+        if (r == 0)
+            printf ("rebuilt %s, %zu keys, %" PRId64 " msecs\n",
+                    args_count == 3 ? args [2] : store_path, zns_store_size (file->store), zclock_mono () - start);
+    }
+    if (r == -1)
+        printf ("%s of %s failed\n", command, store_path);
+    s_file_destroy (&file);
+    sodium_memzero (password, strlen (password));
+    zstr_free (&password);
+    return r == -1 ? -1 : corrupted ? 1 : 0;
+}
@@ -0,0 +1,575 @@
+/*  =========================================================================
+    zns_bench - Benchmark
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of zenstore - ZeroMQ based encrypted store.      
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_bench - Benchmark
+@discuss
+    Drives zns_srv over tcp://, ipc:// and inproc:// endpoints by number of
+    concurrent clients, each with given number of requests in flight. Keys
+    are picked at random, values have random size from the range and given
+    percent of requests are reads. Reports throughput and latency histogram
+    of reads and writes, direct lookup in embedded zns_store serves as the
+    baseline. Then measures encrypt and decrypt throughput of every cipher
+    of store file this CPU supports.
+
+    With --persist it saves and loads stores of 1k keys and ten times more
+    up to the given number of keys instead. Reports time, file size and
+    time and peak RSS of every phase of save and load, as text or as one
+    JSON object per store by --json.
+
+    PUT is not answered, so the write is PUT followed by GET of the same key
+    and its latency is the time until the GET is answered.
+@end
+*/
+
+#include "zns_classes.h"
+
+#include <inttypes.h>
+
+#define BENCH_ROUNDS 10
+#define BENCH_BUCKETS 32
+#define BENCH_PHASES 8
+#define BENCH_FILE "zns-bench.zenstore"
+
+static const char *s_phase_names [BENCH_PHASES] = {
+    "pack", "encrypt", "write", "fsync",
+    "read", "decode", "decrypt", "unpack"
+};
+
+//  Time and peak RSS of phases of save and load
+
+typedef struct {
+    int64_t usecs [BENCH_PHASES];
+    int64_t peak_kb [BENCH_PHASES];     //  -1 unknown
+} s_phases_t;
+
+//  Workload of one client
+
+typedef struct {
+    const char *endpoint;       //  Endpoint of zns_srv
+    size_t requests;            //  Number of requests to send
+    size_t keys;                //  Number of keys
+    size_t min_size;            //  Range of value sizes
+    size_t max_size;
+    unsigned reads;             //  Percent of reads
+    size_t depth;               //  Requests in flight
+    uint64_t seed;              //  Of the random generator
+    int64_t *read_samples;      //  Latencies in usec, filled by client
+    size_t read_count;
+    int64_t *write_samples;
+    size_t write_count;
+} s_workload_t;
+
+//  Request in flight
+
+typedef struct {
+    int64_t sent;
+    bool write;
+} s_inflight_t;
+
+//  xorshift64*, cheap and good enough to pick keys and sizes
+
+static uint64_t
+s_random (uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static size_t
+s_value_size (s_workload_t *self, uint64_t *state)
+{
+    return self->min_size + s_random (state) % (self->max_size - self->min_size + 1);
+}
+
+static int
+s_cmp_int64 (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+//  Client sends its requests after GO, keeping depth requests in flight.
+//  Replies of one client come in order, so the oldest request is answered.
+
+static void
+s_client_actor (zsock_t *pipe, void *args)
+{
+    s_workload_t *self = (s_workload_t *) args;
+    zsock_t *sock = zsock_new_dealer (self->endpoint);
+    assert (sock);
+    s_inflight_t *inflight = (s_inflight_t *) zmalloc (self->depth * sizeof (s_inflight_t));
+    byte *data = (byte *) zmalloc (self->max_size ? self->max_size : 1);
+    assert (inflight && data);
+    uint64_t state = self->seed;
+    for (size_t i = 0; i != self->max_size; i++)
+        data [i] = (byte) s_random (&state);
+    zsock_signal (pipe, 0);
+
+    char *command = zstr_recv (pipe);
+    bool go = command && streq (command, "GO");
+    zstr_free (&command);
+    size_t sent = 0;
+    size_t answered = 0;
+    size_t head = 0;
+    while (go && answered < self->requests) {
+        while (sent < self->requests && sent - answered < self->depth) {
+            char key [32];
+            snprintf (key, sizeof key, "bench-%" PRIu64, s_random (&state) % self->keys);
+            s_inflight_t *request = &inflight [sent % self->depth];
+            request->write = s_random (&state) % 100 >= self->reads;
+            request->sent = zclock_usecs ();
+            if (request->write) {
+                zmsg_t *put = zmsg_new ();
+                zmsg_addstr (put, "PUT");
+                zmsg_addstr (put, key);
+                zmsg_addmem (put, data, s_value_size (self, &state));
+                zmsg_send (&put, sock);
+            }
+            zstr_sendx (sock, "GET", key, NULL);
+            sent++;
+        }
+        zmsg_t *reply = zmsg_recv (sock);
+        if (!reply)
+            break;              //  Interrupted
+        int64_t usecs = zclock_usecs () - inflight [head].sent;
+        if (inflight [head].write)
+            self->write_samples [self->write_count++] = usecs;
+        else
+            self->read_samples [self->read_count++] = usecs;
+        head = (head + 1) % self->depth;
+        answered++;
+        zmsg_destroy (&reply);
+    }
+    zstr_send (pipe, "DONE");
+
+    //  Wait for $TERM from zactor_destroy
+    command = zstr_recv (pipe);
+    zstr_free (&command);
+    free (data);
+    free (inflight);
+    zsock_destroy (&sock);
+}
+
+//  Print latency percentiles and histogram of samples in usec, sorts them
+
+static void
+s_report (const char *name, int64_t *samples, size_t count, bool histogram)
+{
+    if (count == 0)
+        return;
+    qsort (samples, count, sizeof (int64_t), s_cmp_int64);
+    int64_t sum = 0;
+    for (size_t i = 0; i != count; i++)
+        sum += samples [i];
+    printf ("  %-8s n=%-9zu avg=%8.2fus p50=%8" PRId64 "us p99=%8" PRId64
+            "us p99.9=%8" PRId64 "us max=%8" PRId64 "us\n",
+            name, count, (double) sum / count,
+            samples [count / 2],
+            samples [count * 99 / 100],
+            samples [count * 999 / 1000],
+            samples [count - 1]);
+    if (!histogram)
+        return;
+
+    //  Power of two buckets, bucket i counts samples under 2^i usec
+    size_t buckets [BENCH_BUCKETS] = {0};
+    for (size_t i = 0; i != count; i++) {
+        int bucket = 0;
+        while (bucket < BENCH_BUCKETS - 1 && samples [i] >= ((int64_t) 1 << bucket))
+            bucket++;
+        buckets [bucket]++;
+    }
+    for (int i = 0; i != BENCH_BUCKETS; i++) {
+        if (buckets [i] == 0)
+            continue;
+        int width = (int) (buckets [i] * 50 / count);
+        printf ("    <%10" PRId64 "us %9zu %6.2f%% %.*s\n",
+                (int64_t) 1 << i, buckets [i], buckets [i] * 100.0 / count,
+                width ? width : 1, "##################################################");
+    }
+}
+
+//  Run the workload by clients against endpoint, print throughput and
+//  latencies
+
+static void
+s_bench_workload (const char *name, s_workload_t *workload, size_t clients, size_t requests, bool histogram)
+{
+    zactor_t **actors = (zactor_t **) zmalloc (clients * sizeof (zactor_t *));
+    s_workload_t *loads = (s_workload_t *) zmalloc (clients * sizeof (s_workload_t));
+    int64_t *read_samples = (int64_t *) zmalloc (requests * sizeof (int64_t));
+    int64_t *write_samples = (int64_t *) zmalloc (requests * sizeof (int64_t));
+    assert (actors && loads && read_samples && write_samples);
+
+    size_t offset = 0;
+    for (size_t i = 0; i != clients; i++) {
+        loads [i] = *workload;
+        loads [i].requests = requests / clients + (i < requests % clients);
+        loads [i].seed = workload->seed + i * 0x9E3779B97F4A7C15ULL;
+        loads [i].read_samples = read_samples + offset;
+        loads [i].write_samples = write_samples + offset;
+        offset += loads [i].requests;
+        actors [i] = zactor_new (s_client_actor, &loads [i]);
+        assert (actors [i]);
+    }
+
+    int64_t start = zclock_usecs ();
+    for (size_t i = 0; i != clients; i++)
+        zstr_send (actors [i], "GO");
+    for (size_t i = 0; i != clients; i++) {
+        char *done = zstr_recv (actors [i]);
+        zstr_free (&done);
+    }
+    int64_t usecs = zclock_usecs () - start;
+    for (size_t i = 0; i != clients; i++)
+        zactor_destroy (&actors [i]);
+
+    //  Samples of clients are moved together
+    size_t read_count = 0;
+    size_t write_count = 0;
+    for (size_t i = 0; i != clients; i++) {
+        memmove (read_samples + read_count, loads [i].read_samples, loads [i].read_count * sizeof (int64_t));
+        memmove (write_samples + write_count, loads [i].write_samples, loads [i].write_count * sizeof (int64_t));
+        read_count += loads [i].read_count;
+        write_count += loads [i].write_count;
+    }
+    printf ("%-10s %10.0f ops/s in %.3fs\n", name,
+            (double) (read_count + write_count) * 1000000 / (usecs ? usecs : 1),
+            (double) usecs / 1000000);
+    s_report ("read", read_samples, read_count, histogram);
+    s_report ("write", write_samples, write_count, histogram);
+
+    free (write_samples);
+    free (read_samples);
+    free (loads);
+    free (actors);
+}
+
+//  Lookup keys of workload in embedded store, the baseline of transports
+
+static void
+s_bench_direct (zns_store_t *store, s_workload_t *workload, size_t requests)
+{
+    int64_t *samples = (int64_t *) zmalloc (requests * sizeof (int64_t));
+    assert (samples);
+    uint64_t state = workload->seed;
+    int64_t start = zclock_usecs ();
+    for (size_t i = 0; i != requests; i++) {
+        char key [32];
+        snprintf (key, sizeof key, "bench-%" PRIu64, s_random (&state) % workload->keys);
+        int64_t sent = zclock_usecs ();
+        zchunk_t *value = zns_store_lookup (store, key, NULL);
+        samples [i] = zclock_usecs () - sent;
+        assert (value);
+        zchunk_destroy (&value);
+    }
+    int64_t usecs = zclock_usecs () - start;
+    printf ("%-10s %10.0f ops/s in %.3fs\n", "direct",
+            (double) requests * 1000000 / (usecs ? usecs : 1), (double) usecs / 1000000);
+    s_report ("read", samples, requests, false);
+    free (samples);
+}
+
+static void
+s_bench_phase (const char *phase, int64_t usecs, void *arg)
+{
+    s_phases_t *self = (s_phases_t *) arg;
+    for (int i = 0; i != BENCH_PHASES; i++)
+        if (streq (phase, s_phase_names [i])) {
+            self->usecs [i] += usecs;
+            int64_t peak = zns_perf_rss_peak ();
+            if (peak > self->peak_kb [i])
+                self->peak_kb [i] = peak;
+        }
+    zns_perf_rss_reset ();
+}
+
+//  Save and load store of keys, print times, file size and phases
+
+static void
+s_bench_persist (s_workload_t *workload, size_t keys, const char *dir, bool json)
+{
+    s_phases_t phases;
+    memset (&phases, 0, sizeof phases);
+    for (int i = 0; i != BENCH_PHASES; i++)
+        phases.peak_kb [i] = -1;
+    byte key [crypto_secretbox_KEYBYTES];
+    randombytes_buf (key, sizeof key);
+
+    zns_store_t *store = zns_store_new ();
+    zns_store_set_dir (store, dir);
+    zns_store_set_file (store, BENCH_FILE);
+    uint64_t state = workload->seed;
+    for (size_t i = 0; i != keys; i++) {
+        char name [32];
+        snprintf (name, sizeof name, "bench-%zu", i);
+        size_t size = s_value_size (workload, &state);
+        zchunk_t *value = zchunk_new (NULL, size);
+        zchunk_fill (value, 'x', size);
+        zns_store_put (store, name, value);
+        zchunk_destroy (&value);
+    }
+
+    zns_store_set_phase_fn (store, s_bench_phase, &phases);
+    zns_perf_rss_reset ();
+    int64_t start = zclock_usecs ();
+    int r = zns_store_save (store, key);
+    int64_t save_usecs = zclock_usecs () - start;
+    zns_store_destroy (&store);
+
+    char path [PATH_MAX];
+    snprintf (path, sizeof path, "%s/%s", dir, BENCH_FILE);
+    ssize_t file_size = zsys_file_size (path);
+
+    store = zns_store_new ();
+    zns_store_set_dir (store, dir);
+    zns_store_set_file (store, BENCH_FILE);
+    zns_store_set_phase_fn (store, s_bench_phase, &phases);
+    zns_perf_rss_reset ();
+    start = zclock_usecs ();
+    if (r == 0)
+        r = zns_store_load (store, key);
+    int64_t load_usecs = zclock_usecs () - start;
+    zns_store_destroy (&store);
+    zsys_file_delete (path);
+    sodium_memzero (key, sizeof key);
+
+    if (json) {
+        printf ("{\"keys\":%zu,\"min_size\":%zu,\"max_size\":%zu,\"ok\":%s,"
+                "\"save_usecs\":%" PRId64 ",\"load_usecs\":%" PRId64 ",\"file_size\":%zd,\"phases\":{",
+                keys, workload->min_size, workload->max_size, r == 0 ? "true" : "false",
+                save_usecs, load_usecs, file_size);
+        for (int i = 0; i != BENCH_PHASES; i++)
+            printf ("%s\"%s\":{\"usecs\":%" PRId64 ",\"peak_rss_kb\":%" PRId64 "}",
+                    i ? "," : "", s_phase_names [i], phases.usecs [i], phases.peak_kb [i]);
+        printf ("}}\n");
+    }
+    else {
+        printf ("%zu keys%s: save=%.3fs load=%.3fs file=%zd bytes\n",
+                keys, r == 0 ? "" : " FAILED",
+                (double) save_usecs / 1000000, (double) load_usecs / 1000000, file_size);
+        for (int i = 0; i != BENCH_PHASES; i++)
+            printf ("  %-8s %10.3fs peak RSS %10" PRId64 " kB\n",
+                    s_phase_names [i], (double) phases.usecs [i] / 1000000, phases.peak_kb [i]);
+    }
+    fflush (stdout);
+}
+
+//  Seal and open buffer of size bytes by the cipher, print MB/s
+
+static void
+s_bench_cipher (const char *name, size_t size)
+{
+    zns_cipher_t *cipher = zns_cipher_new (name);
+    if (!cipher) {
+        printf ("%-24s not supported by this CPU\n", name);
+        return;
+    }
+    byte key [crypto_secretbox_KEYBYTES];
+    byte nonce [crypto_secretbox_NONCEBYTES];
+    randombytes_buf (key, sizeof key);
+    randombytes_buf (nonce, sizeof nonce);
+    byte *data = (byte *) zmalloc (size);
+    byte *buffer = (byte *) zmalloc (size + zns_cipher_mac_size (cipher));
+    assert (data && buffer);
+    randombytes_buf (data, size);
+
+    int64_t start = zclock_usecs ();
+    for (int i = 0; i != BENCH_ROUNDS; i++)
+        zns_cipher_seal (cipher, buffer, data, size, nonce, key);
+    int64_t seal_usecs = zclock_usecs () - start;
+
+    start = zclock_usecs ();
+    for (int i = 0; i != BENCH_ROUNDS; i++) {
+        int r = zns_cipher_open (cipher, data, buffer, size + zns_cipher_mac_size (cipher), nonce, key);
+        assert (r == 0);
+    }
+    int64_t open_usecs = zclock_usecs () - start;
+
+    double megabytes = (double) size * BENCH_ROUNDS / (1024 * 1024);
+    printf ("%-24s encrypt=%8.1fMB/s decrypt=%8.1fMB/s\n", name,
+            megabytes * 1000000 / (seal_usecs ? seal_usecs : 1),
+            megabytes * 1000000 / (open_usecs ? open_usecs : 1));
+    free (data);
+    free (buffer);
+    zns_cipher_destroy (&cipher);
+}
+
+int main (int argc, char *argv [])
+{
+    size_t count = 100000;
+    size_t data_size = 64;
+    size_t clients = 1;
+    bool histogram = false;
+    size_t persist = 0;
+    bool json = false;
+    const char *dir = ".";
+    const char *transport = NULL;
+    const char *tcp_endpoint = "tcp://127.0.0.1:5670";
+    s_workload_t workload = {
+        .keys = 1000, .min_size = 100, .max_size = 100,
+        .reads = 90, .depth = 1, .seed = 88172645463325252ULL
+    };
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("zns_bench [options] ...");
+            puts ("  --requests / -n        number of requests per transport");
+            puts ("  --keys / -k            number of keys");
+            puts ("  --size / -s            size of value or min:max range of sizes");
+            puts ("  --reads / -r           percent of requests which are reads");
+            puts ("  --clients / -c         number of concurrent clients");
+            puts ("  --depth / -p           requests in flight per client");
+            puts ("  --transport / -T       tcp, ipc or inproc, all by default");
+            puts ("  --histogram / -g       print latency histograms");
+            puts ("  --tcp / -t             tcp endpoint to use");
+            puts ("  --data / -d            MB encrypted by each cipher");
+            puts ("  --persist / -P         save and load stores of 1k keys up to this number instead");
+            puts ("  --json / -j            print results of --persist as JSON");
+            puts ("  --dir / -D             directory of store files of --persist");
+            puts ("  --help / -h            this information");
+            return 0;
+        }
+        else
+        if ((streq (argv [argn], "--requests") || streq (argv [argn], "-n"))
+        &&  argn + 1 < argc)
+            count = (size_t) atol (argv [++argn]);
+        else
+        if ((streq (argv [argn], "--keys") || streq (argv [argn], "-k"))
+        &&  argn + 1 < argc)
+            workload.keys = (size_t) atol (argv [++argn]);
+        else
+        if ((streq (argv [argn], "--size") || streq (argv [argn], "-s"))
+        &&  argn + 1 < argc) {
+            const char *range = argv [++argn];
+            workload.min_size = workload.max_size = (size_t) atol (range);
+            if (strchr (range, ':'))
+                workload.max_size = (size_t) atol (strchr (range, ':') + 1);
+        }
+        else
+        if ((streq (argv [argn], "--reads") || streq (argv [argn], "-r"))
+        &&  argn + 1 < argc)
+            workload.reads = (unsigned) atoi (argv [++argn]);
+        else
+        if ((streq (argv [argn], "--clients") || streq (argv [argn], "-c"))
+        &&  argn + 1 < argc)
+            clients = (size_t) atol (argv [++argn]);
+        else
+        if ((streq (argv [argn], "--depth") || streq (argv [argn], "-p"))
+        &&  argn + 1 < argc)
+            workload.depth = (size_t) atol (argv [++argn]);
+        else
+        if ((streq (argv [argn], "--transport") || streq (argv [argn], "-T"))
+        &&  argn + 1 < argc)
+            transport = argv [++argn];
+        else
+        if (streq (argv [argn], "--histogram") || streq (argv [argn], "-g"))
+            histogram = true;
+        else
+        if ((streq (argv [argn], "--tcp") || streq (argv [argn], "-t"))
+        &&  argn + 1 < argc)
+            tcp_endpoint = argv [++argn];
+        else
+        if ((streq (argv [argn], "--data") || streq (argv [argn], "-d"))
+        &&  argn + 1 < argc)
+            data_size = (size_t) atol (argv [++argn]);
+        else
+        if ((streq (argv [argn], "--persist") || streq (argv [argn], "-P"))
+        &&  argn + 1 < argc)
+            persist = (size_t) atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "--json") || streq (argv [argn], "-j"))
+            json = true;
+        else
+        if ((streq (argv [argn], "--dir") || streq (argv [argn], "-D"))
+        &&  argn + 1 < argc)
+            dir = argv [++argn];
+        else {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+    }
+    if (count == 0 || workload.keys == 0 || clients == 0 || workload.depth == 0) {
+        printf ("Number of requests, keys, clients and depth must be positive\n");
+        return 1;
+    }
+    if (workload.min_size > workload.max_size || workload.reads > 100) {
+        printf ("Invalid range of sizes or percent of reads\n");
+        return 1;
+    }
+    if (transport && !streq (transport, "tcp") && !streq (transport, "ipc") && !streq (transport, "inproc")) {
+        printf ("Unknown transport: %s\n", transport);
+        return 1;
+    }
+
+    if (persist) {
+        for (size_t keys = 1000; keys <= persist; keys *= 10)
+            s_bench_persist (&workload, keys, dir, json);
+        return 0;
+    }
+
+    //  Embedded store with all keys, served by actor on all transports at once
+    zns_store_t *store = zns_store_new ();
+    uint64_t state = workload.seed;
+    for (size_t i = 0; i != workload.keys; i++) {
+        char key [32];
+        snprintf (key, sizeof key, "bench-%zu", i);
+        size_t size = s_value_size (&workload, &state);
+        zchunk_t *value = zchunk_new (NULL, size);
+        zchunk_fill (value, 'x', size);
+        zns_store_put (store, key, value);
+        zchunk_destroy (&value);
+    }
+
+    zactor_t *zns_srv = zactor_new (zns_srv_actor, store);
+    const char *endpoints [] = {tcp_endpoint, "ipc://@/zns-bench", "inproc://zns-bench"};
+    const char *names [] = {"tcp", "ipc", "inproc"};
+    bool bound [3];
+    for (int i = 0; i != 3; i++) {
+        zstr_sendx (zns_srv, "BIND", endpoints [i], NULL);
+        bound [i] = zsock_wait (zns_srv) == 0;
+        //  Transport asked for can't be skipped
+        if (!bound [i] && transport && streq (transport, names [i])) {
+            zsys_error ("Can't bind to '%s'", endpoints [i]);
+            zactor_destroy (&zns_srv);
+            zns_store_destroy (&store);
+            return 1;
+        }
+        if (!bound [i] && !transport)
+            zsys_warning ("Can't bind to '%s', %s is skipped", endpoints [i], names [i]);
+    }
+
+    printf ("%zu requests, %zu keys, value size %zu-%zu, %u%% reads, %zu clients, depth %zu\n",
+            count, workload.keys, workload.min_size, workload.max_size,
+            workload.reads, clients, workload.depth);
+    for (int i = 0; i != 3; i++) {
+        if (!bound [i] || (transport && !streq (transport, names [i])))
+            continue;
+        workload.endpoint = endpoints [i];
+        s_bench_workload (names [i], &workload, clients, count, histogram);
+    }
+    zactor_destroy (&zns_srv);
+    s_bench_direct (store, &workload, count);
+    zns_store_destroy (&store);
+
+    printf ("Cipher throughput, %zu MB %d times\n", data_size, BENCH_ROUNDS);
+    const char *ciphers [] = {"salsa20poly1305", "xchacha20poly1305_ietf", "aes256gcm"};
+    for (int i = 0; i != 3; i++)
+        s_bench_cipher (ciphers [i], data_size * 1024 * 1024);
+    return 0;
+}
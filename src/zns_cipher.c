@@ -0,0 +1,308 @@
+/*  =========================================================================
+    zns_cipher - Authenticated ciphers of store file
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_cipher - Authenticated ciphers of store file
+@discuss
+    Wraps libsodium constructions usable for the store file behind the same
+    seal and open calls. crypto_secretbox with salsa20poly1305 is the
+    original format and the default. crypto_aead xchacha20poly1305_ietf is
+    faster on most CPUs and crypto_aead aes256gcm is the fastest, but only
+    on x86_64 CPUs with AES-NI and PCLMUL, which is checked at runtime.
+
+    All ciphers use 256 bit key and 16 bytes MAC. AES-256-GCM uses the first
+    12 bytes of random nonce only, so key must not encrypt more than about
+    2^32 store files, which is far beyond any real use.
+@end
+*/
+
+#include "zns_classes.h"
+
+typedef int (s_seal_fn) (byte *buffer, const byte *data, size_t size,
+                         const byte *nonce, const byte *key);
+typedef int (s_open_fn) (byte *data, const byte *buffer, size_t size,
+                         const byte *nonce, const byte *key);
+
+typedef struct {
+    const char *name;           //  Cipher in header
+    const char *method;         //  Method in header
+    size_t nonce_size;
+    size_t mac_size;
+    s_seal_fn *seal;
+    s_open_fn *open;
+} s_cipher_t;
+
+//  Structure of our class
+
+struct _zns_cipher_t {
+    const s_cipher_t *cipher;   //  Entry of s_ciphers
+};
+
+static int
+s_secretbox_seal (byte *buffer, const byte *data, size_t size,
+                  const byte *nonce, const byte *key)
+{
+    return crypto_secretbox_easy (buffer, data, size, nonce, key);
+}
+
+static int
+s_secretbox_open (byte *data, const byte *buffer, size_t size,
+                  const byte *nonce, const byte *key)
+{
+    return crypto_secretbox_open_easy (data, buffer, size, nonce, key);
+}
+
+static int
+s_xchacha20_seal (byte *buffer, const byte *data, size_t size,
+                  const byte *nonce, const byte *key)
+{
+    return crypto_aead_xchacha20poly1305_ietf_encrypt (
+            buffer, NULL, data, size, NULL, 0, NULL, nonce, key);
+}
+
+static int
+s_xchacha20_open (byte *data, const byte *buffer, size_t size,
+                  const byte *nonce, const byte *key)
+{
+    return crypto_aead_xchacha20poly1305_ietf_decrypt (
+            data, NULL, NULL, buffer, size, NULL, 0, nonce, key);
+}
+
+static int
+s_aes256gcm_seal (byte *buffer, const byte *data, size_t size,
+                  const byte *nonce, const byte *key)
+{
+    return crypto_aead_aes256gcm_encrypt (
+            buffer, NULL, data, size, NULL, 0, NULL, nonce, key);
+}
+
+static int
+s_aes256gcm_open (byte *data, const byte *buffer, size_t size,
+                  const byte *nonce, const byte *key)
+{
+    return crypto_aead_aes256gcm_decrypt (
+            data, NULL, NULL, buffer, size, NULL, 0, nonce, key);
+}
+
+//  Sorted from the slowest to the fastest
+
+static const s_cipher_t s_ciphers [] = {
+    {"salsa20poly1305", "crypto_secretbox",
+     crypto_secretbox_NONCEBYTES, crypto_secretbox_MACBYTES,
+     s_secretbox_seal, s_secretbox_open},
+    {"xchacha20poly1305_ietf", "crypto_aead",
+     crypto_aead_xchacha20poly1305_ietf_NPUBBYTES, crypto_aead_xchacha20poly1305_ietf_ABYTES,
+     s_xchacha20_seal, s_xchacha20_open},
+    {"aes256gcm", "crypto_aead",
+     crypto_aead_aes256gcm_NPUBBYTES, crypto_aead_aes256gcm_ABYTES,
+     s_aes256gcm_seal, s_aes256gcm_open},
+};
+
+#define ZNS_CIPHERS (sizeof (s_ciphers) / sizeof (s_ciphers [0]))
+
+static bool
+s_supported (const s_cipher_t *cipher)
+{
+    //  CPU features are detected by sodium_init, which is safe to repeat
+    if (sodium_init () == -1)
+        return false;
+    if (cipher->seal == s_aes256gcm_seal)
+        return crypto_aead_aes256gcm_is_available () == 1;
+    return true;
+}
+
+static const s_cipher_t *
+s_find (const char *name)
+{
+    if (!name)
+        return NULL;
+    if (streq (name, "fastest")) {
+        for (size_t i = ZNS_CIPHERS; i != 0; i--)
+            if (s_supported (&s_ciphers [i - 1]))
+                return &s_ciphers [i - 1];
+        return NULL;
+    }
+    for (size_t i = 0; i != ZNS_CIPHERS; i++)
+        if (streq (name, s_ciphers [i].name))
+            return s_supported (&s_ciphers [i]) ? &s_ciphers [i] : NULL;
+    return NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new zns_cipher by name, salsa20poly1305, xchacha20poly1305_ietf,
+//  aes256gcm or fastest for the fastest one this CPU supports. Return NULL
+//  if the name is unknown or the CPU lacks support for the cipher.
+
+zns_cipher_t *
+zns_cipher_new (const char *name)
+{
+    const s_cipher_t *cipher = s_find (name);
+    if (!cipher)
+        return NULL;
+    zns_cipher_t *self = (zns_cipher_t *) zmalloc (sizeof (zns_cipher_t));
+    assert (self);
+    self->cipher = cipher;
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the zns_cipher
+
+void
+zns_cipher_destroy (zns_cipher_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zns_cipher_t *self = *self_p;
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return true if the cipher is known and supported by this CPU
+
+bool
+zns_cipher_available (const char *name)
+{
+    return s_find (name) != NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Return name of the cipher, stored as cipher in the header of store file
+
+const char *
+zns_cipher_name (zns_cipher_t *self)
+{
+    assert (self);
+    return self->cipher->name;
+}
+
+//  --------------------------------------------------------------------------
+//  Return libsodium construction of the cipher, stored as method in the
+//  header of store file
+
+const char *
+zns_cipher_method (zns_cipher_t *self)
+{
+    assert (self);
+    return self->cipher->method;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of nonce bytes used by the cipher, at most
+//  crypto_secretbox_NONCEBYTES
+
+size_t
+zns_cipher_nonce_size (zns_cipher_t *self)
+{
+    assert (self);
+    return self->cipher->nonce_size;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of bytes the cipher adds to the plain text
+
+size_t
+zns_cipher_mac_size (zns_cipher_t *self)
+{
+    assert (self);
+    return self->cipher->mac_size;
+}
+
+//  --------------------------------------------------------------------------
+//  Encrypt size bytes of data to buffer of size + mac_size bytes. Return 0
+//  for success, -1 for error.
+
+int
+zns_cipher_seal (zns_cipher_t *self, byte *buffer, const byte *data, size_t size,
+                 const byte *nonce, const byte *key)
+{
+    assert (self);
+    return self->cipher->seal (buffer, data, size, nonce, key) == 0 ? 0 : -1;
+}
+
+//  --------------------------------------------------------------------------
+//  Decrypt and verify size bytes of buffer to data of size - mac_size bytes.
+//  Return 0 for success, -1 for wrong key or corrupted buffer.
+
+int
+zns_cipher_open (zns_cipher_t *self, byte *data, const byte *buffer, size_t size,
+                 const byte *nonce, const byte *key)
+{
+    assert (self);
+    if (size < self->cipher->mac_size)
+        return -1;
+    return self->cipher->open (data, buffer, size, nonce, key) == 0 ? 0 : -1;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zns_cipher_test (bool verbose)
+{
+    printf (" * zns_cipher: ");
+
+    //  @selftest
+    assert (!zns_cipher_new ("rot13"));
+    assert (!zns_cipher_new (NULL));
+    assert (zns_cipher_available ("salsa20poly1305"));
+    assert (zns_cipher_available ("xchacha20poly1305_ietf"));
+    assert (zns_cipher_available ("fastest"));
+
+    byte key [crypto_secretbox_KEYBYTES] = "s3cr3t";
+    byte nonce [crypto_secretbox_NONCEBYTES];
+    randombytes_buf (nonce, sizeof nonce);
+    const byte data [] = "Hello, World!";
+    byte buffer [sizeof data + 16];
+    byte decrypted [sizeof data];
+
+    const char *names [] = {"salsa20poly1305", "xchacha20poly1305_ietf", "aes256gcm", "fastest"};
+    for (size_t i = 0; i != sizeof (names) / sizeof (names [0]); i++) {
+        zns_cipher_t *self = zns_cipher_new (names [i]);
+        if (!self) {
+            //  Only AES-256-GCM depends on the CPU
+            assert (streq (names [i], "aes256gcm"));
+            assert (!zns_cipher_available (names [i]));
+            if (verbose)
+                zsys_info ("aes256gcm is not supported by this CPU");
+            continue;
+        }
+        if (verbose)
+            zsys_info ("%s -> %s %s", names [i], zns_cipher_method (self), zns_cipher_name (self));
+        assert (zns_cipher_nonce_size (self) <= sizeof nonce);
+        assert (zns_cipher_mac_size (self) == 16);
+
+        int r = zns_cipher_seal (self, buffer, data, sizeof data, nonce, key);
+        assert (r == 0);
+        memset (decrypted, 0, sizeof decrypted);
+        r = zns_cipher_open (self, decrypted, buffer, sizeof buffer, nonce, key);
+        assert (r == 0);
+        assert (memcmp (data, decrypted, sizeof data) == 0);
+
+        //  Tampered buffer, wrong key and short buffer are refused
+        buffer [0] ^= 1;
+        r = zns_cipher_open (self, decrypted, buffer, sizeof buffer, nonce, key);
+        assert (r == -1);
+        buffer [0] ^= 1;
+        byte wrong [crypto_secretbox_KEYBYTES] = "wr0ng!!";
+        r = zns_cipher_open (self, decrypted, buffer, sizeof buffer, nonce, wrong);
+        assert (r == -1);
+        r = zns_cipher_open (self, decrypted, buffer, 8, nonce, key);
+        assert (r == -1);
+        zns_cipher_destroy (&self);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
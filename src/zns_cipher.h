@@ -0,0 +1,75 @@
+/*  =========================================================================
+    zns_cipher - Authenticated ciphers of store file
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_CIPHER_H_INCLUDED
+#define ZNS_CIPHER_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _zns_cipher_t zns_cipher_t;
+
+//  @interface
+//  Create a new zns_cipher by name, salsa20poly1305, xchacha20poly1305_ietf,
+//  aes256gcm or fastest for the fastest one this CPU supports. Return NULL
+//  if the name is unknown or the CPU lacks support for the cipher.
+ZNS_EXPORT zns_cipher_t *
+    zns_cipher_new (const char *name);
+
+//  Destroy the zns_cipher
+ZNS_EXPORT void
+    zns_cipher_destroy (zns_cipher_t **self_p);
+
+//  Return true if the cipher is known and supported by this CPU
+ZNS_EXPORT bool
+    zns_cipher_available (const char *name);
+
+//  Return name of the cipher, stored as cipher in the header of store file
+ZNS_EXPORT const char *
+    zns_cipher_name (zns_cipher_t *self);
+
+//  Return libsodium construction of the cipher, stored as method in the
+//  header of store file
+ZNS_EXPORT const char *
+    zns_cipher_method (zns_cipher_t *self);
+
+//  Return number of nonce bytes used by the cipher, at most
+//  crypto_secretbox_NONCEBYTES
+ZNS_EXPORT size_t
+    zns_cipher_nonce_size (zns_cipher_t *self);
+
+//  Return number of bytes the cipher adds to the plain text
+ZNS_EXPORT size_t
+    zns_cipher_mac_size (zns_cipher_t *self);
+
+//  Encrypt size bytes of data to buffer of size + mac_size bytes. Return 0
+//  for success, -1 for error.
+ZNS_EXPORT int
+    zns_cipher_seal (zns_cipher_t *self, byte *buffer, const byte *data, size_t size,
+                     const byte *nonce, const byte *key);
+
+//  Decrypt and verify size bytes of buffer to data of size - mac_size bytes.
+//  Return 0 for success, -1 for wrong key or corrupted buffer.
+ZNS_EXPORT int
+    zns_cipher_open (zns_cipher_t *self, byte *data, const byte *buffer, size_t size,
+                     const byte *nonce, const byte *key);
+
+//  Self test of this class
+ZNS_EXPORT void
+    zns_cipher_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,10 +25,58 @@
 
 //  Internal API
 #include "zns_nonce.h"
+#include "zns_wheel.h"
+#include "zns_cipher.h"
+#include "zns_metrics.h"
+#include "zns_trace.h"
+#include "zns_handover.h"
+#include "zns_io.h"
+#include "zns_perf.h"
+#include "zns_dump.h"
 
 //  *** Draft method, defined for internal use only ***
 //  Self test of this class.
 ZNS_EXPORT void
     zns_nonce_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZNS_EXPORT void
+    zns_wheel_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZNS_EXPORT void
+    zns_cipher_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZNS_EXPORT void
+    zns_metrics_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZNS_EXPORT void
+    zns_trace_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZNS_EXPORT void
+    zns_handover_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZNS_EXPORT void
+    zns_io_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZNS_EXPORT void
+    zns_perf_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZNS_EXPORT void
+    zns_dump_test (bool verbose);
+
 #endif
@@ -0,0 +1,1122 @@
+/*  =========================================================================
+    zns_client - Client API to zns_srv
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of zenstore - ZeroMQ based encrypted store.      
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_client - Client API to zns_srv
+@discuss
+    Values are transferred in chunks using FETCH and STREAM commands with
+    credit based flow control, see zguide, Chapter 7, file transfer. Client
+    keeps at most credit chunks in flight, so neither side needs to hold the
+    whole value in a single frame and big transfers are interleaved with
+    requests of other clients.
+@end
+*/
+
+#include "zns_classes.h"
+
+#include <inttypes.h>
+
+#define ZNS_CLIENT_CHUNK_SIZE   (256 * 1024)
+#define ZNS_CLIENT_CREDIT       8
+#define ZNS_CLIENT_TIMEOUT      5000
+#define ZNS_CLIENT_RETRIES      3
+
+//  Structure of our class
+
+struct _zns_client_t {
+    zsock_t *sock;              //  Dealer socket connected to zns_srv
+    zpoller_t *poller;          //  Poller for reply timeouts
+    size_t chunk_size;          //  Size of transfer chunk
+    size_t credit;              //  Maximum number of chunks in flight
+    int timeout;                //  Reply timeout in msec
+    zsock_t *watch;             //  Subscriber for changes of watched keys
+    char *watch_endpoint;       //  Endpoint watch socket is connected to
+    zhashx_t *cache;            //  Near cache, key : s_cache_item_t or NULL
+    zlistx_t *cache_order;      //  Keys of near cache, the oldest first
+    zsock_t *cache_sub;         //  Subscriber for cache invalidations
+    size_t cache_size;          //  Maximum number of cached keys
+    int64_t cache_max_age;      //  Maximum age of cached value in msec
+    char *store;                //  Name of store hosted by zns_host or NULL
+};
+
+//  Value in near cache
+
+typedef struct {
+    zchunk_t *value;
+    uint64_t version;           //  Version reported by zns_srv
+    int64_t expires;            //  Monotonic time when value gets stale
+    void *handle;               //  Handle in cache_order list
+    zlistx_t *order;            //  The cache_order list
+} s_cache_item_t;
+
+static s_cache_item_t *
+s_cache_item_new (zchunk_t *value, uint64_t version, int64_t expires)
+{
+    s_cache_item_t *self = (s_cache_item_t *) zmalloc (sizeof (s_cache_item_t));
+    assert (self);
+    self->value = value;
+    self->version = version;
+    self->expires = expires;
+    return self;
+}
+
+static void
+s_cache_item_destroy (void **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_cache_item_t *self = (s_cache_item_t *) *self_p;
+        if (self->handle)
+            zlistx_delete (self->order, self->handle);
+        sodium_memzero (zchunk_data (self->value), zchunk_max_size (self->value));
+        zchunk_destroy (&self->value);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zns_client connected to endpoint
+
+zns_client_t *
+zns_client_new (const char *endpoint)
+{
+    assert (endpoint);
+    zns_client_t *self = (zns_client_t *) zmalloc (sizeof (zns_client_t));
+    assert (self);
+    //  Initialize class properties here
+    self->sock = zsock_new_dealer (endpoint);
+    if (!self->sock) {
+        free (self);
+        return NULL;
+    }
+    self->poller = zpoller_new (self->sock, NULL);
+    assert (self->poller);
+    self->chunk_size = ZNS_CLIENT_CHUNK_SIZE;
+    self->credit = ZNS_CLIENT_CREDIT;
+    self->timeout = ZNS_CLIENT_TIMEOUT;
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the zns_client
+
+void
+zns_client_destroy (zns_client_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zns_client_t *self = *self_p;
+        //  Free class properties here
+        zpoller_destroy (&self->poller);
+        zsock_destroy (&self->sock);
+        zsock_destroy (&self->watch);
+        zstr_free (&self->watch_endpoint);
+        zhashx_destroy (&self->cache);
+        zlistx_destroy (&self->cache_order);
+        zsock_destroy (&self->cache_sub);
+        zstr_free (&self->store);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Set size of chunk used for transfers, default is 256kB
+
+void
+zns_client_set_chunk_size (zns_client_t *self, size_t chunk_size)
+{
+    assert (self);
+    assert (chunk_size > 0);
+    self->chunk_size = chunk_size;
+}
+
+//  --------------------------------------------------------------------------
+//  Set number of chunks client can have in flight, default is 8
+
+void
+zns_client_set_credit (zns_client_t *self, size_t credit)
+{
+    assert (self);
+    assert (credit > 0);
+    self->credit = credit;
+}
+
+//  --------------------------------------------------------------------------
+//  Set reply timeout in msec, default is 5000
+
+void
+zns_client_set_timeout (zns_client_t *self, int timeout)
+{
+    assert (self);
+    self->timeout = timeout;
+}
+
+//  --------------------------------------------------------------------------
+//  Enable near cache of up to size values. Cached values are invalidated by
+//  changes published by zns_srv on endpoint (see PUBLISH) and are never
+//  older than max_age msec, which bounds the staleness when notification is
+//  lost. Return 0 for success, -1 for error.
+
+int
+zns_client_set_cache (zns_client_t *self, const char *endpoint, size_t size, int max_age)
+{
+    assert (self);
+    assert (endpoint);
+    assert (size > 0);
+
+    zsock_destroy (&self->cache_sub);
+    zhashx_destroy (&self->cache);
+    zlistx_destroy (&self->cache_order);
+
+    self->cache_sub = zsock_new_sub (endpoint, "");
+    if (!self->cache_sub)
+        return -1;
+    self->cache = zhashx_new ();
+    assert (self->cache);
+    zhashx_set_destructor (self->cache, s_cache_item_destroy);
+    self->cache_order = zlistx_new ();
+    assert (self->cache_order);
+    zlistx_set_duplicator (self->cache_order, (zlistx_duplicator_fn *) strdup);
+    zlistx_set_destructor (self->cache_order, (zlistx_destructor_fn *) zstr_free);
+    self->cache_size = size;
+    self->cache_max_age = max_age;
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Talk to store with given name hosted by zns_host, NULL for plain zns_srv
+
+void
+zns_client_set_store (zns_client_t *self, const char *name)
+{
+    assert (self);
+    zstr_free (&self->store);
+    if (name)
+        self->store = strdup (name);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the socket connected to zns_srv
+
+zsock_t *
+zns_client_sock (zns_client_t *self)
+{
+    assert (self);
+    return self->sock;
+}
+
+static int
+    s_popu64 (zmsg_t *msg, uint64_t *value_p);
+
+//  --------------------------------------------------------------------------
+//  Subscribe to changes of keys starting with prefix, published by zns_srv
+//  on endpoint (see PUBLISH). Return 0 for success, -1 for error.
+
+int
+zns_client_watch (zns_client_t *self, const char *endpoint, const char *prefix)
+{
+    assert (self);
+    assert (endpoint);
+    assert (prefix);
+    if (!self->watch) {
+        self->watch = zsock_new (ZMQ_SUB);
+        if (!self->watch)
+            return -1;
+    }
+    if (!self->watch_endpoint || !streq (self->watch_endpoint, endpoint)) {
+        if (zsock_connect (self->watch, "%s", endpoint) == -1)
+            return -1;
+        zstr_free (&self->watch_endpoint);
+        self->watch_endpoint = strdup (endpoint);
+    }
+    zsock_set_subscribe (self->watch, prefix);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Wait up to timeout msec for change of watched key. Return 0 and fill key,
+//  operation (PUT or DELETE) and version, or -1 on timeout. Caller is
+//  responsible for freeing key and operation.
+
+int
+zns_client_watch_recv (zns_client_t *self, char **key_p, char **op_p, uint64_t *version_p, int timeout)
+{
+    assert (self);
+    assert (key_p);
+    assert (op_p);
+    assert (version_p);
+    if (!self->watch)
+        return -1;
+
+    zpoller_t *poller = zpoller_new (self->watch, NULL);
+    zsock_t *which = (zsock_t *) zpoller_wait (poller, timeout);
+    zpoller_destroy (&poller);
+    if (which != self->watch)
+        return -1;
+
+    zmsg_t *event = zmsg_recv (self->watch);
+    if (!event)
+        return -1;
+    char *key = zmsg_popstr (event);
+    char *op = zmsg_popstr (event);
+    uint64_t version;
+    int r = (key && op && s_popu64 (event, &version) == 0) ? 0 : -1;
+    zmsg_destroy (&event);
+    if (r == -1) {
+        zstr_free (&key);
+        zstr_free (&op);
+        return -1;
+    }
+    *key_p = key;
+    *op_p = op;
+    *version_p = version;
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the socket receiving changes of watched keys or NULL
+
+zsock_t *
+zns_client_watch_sock (zns_client_t *self)
+{
+    assert (self);
+    return self->watch;
+}
+
+//  Send request, with name of store if talking to zns_host
+
+static void
+s_send (zns_client_t *self, zmsg_t **request_p)
+{
+    if (self->store)
+        zmsg_pushstr (*request_p, self->store);
+    zmsg_send (request_p, self->sock);
+}
+
+//  Wait for next reply, return NULL on timeout or interrupt
+
+static zmsg_t *
+s_recv (zns_client_t *self)
+{
+    while (true) {
+        zsock_t *which = (zsock_t *) zpoller_wait (self->poller, self->timeout);
+        if (which != self->sock)
+            return NULL;
+        zmsg_t *reply = zmsg_recv (self->sock);
+        if (!reply || !self->store)
+            return reply;
+        //  Reply of zns_host starts with name of store
+        char *store = zmsg_popstr (reply);
+        bool mine = store && streq (store, self->store);
+        zstr_free (&store);
+        if (mine)
+            return reply;
+        zmsg_destroy (&reply);
+    }
+}
+
+//  Pop decimal number from message, return 0 on success, -1 otherwise
+
+static int
+s_popu64 (zmsg_t *msg, uint64_t *value_p)
+{
+    char *str = zmsg_popstr (msg);
+    if (!str)
+        return -1;
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull (str, &end, 10);
+    int r = (errno != 0 || *end != '\0' || str [0] == '-') ? -1 : 0;
+    zstr_free (&str);
+    if (r == 0)
+        *value_p = (uint64_t) value;
+    return r;
+}
+
+//  Pop signed decimal number from message, return 0 on success, -1
+//  otherwise
+
+static int
+s_popi64 (zmsg_t *msg, int64_t *value_p)
+{
+    char *str = zmsg_popstr (msg);
+    if (!str)
+        return -1;
+    char *end;
+    errno = 0;
+    long long value = strtoll (str, &end, 10);
+    int r = (errno != 0 || !*str || *end != '\0') ? -1 : 0;
+    zstr_free (&str);
+    if (r == 0)
+        *value_p = (int64_t) value;
+    return r;
+}
+
+//  --------------------------------------------------------------------------
+//  Put value to store. Value is streamed in chunks, with at most credit
+//  chunks unacknowledged. Return 0 for success, -1 for error, errno is set
+//  to EBUSY when server refused the request because of client's quota.
+
+int
+zns_client_put (zns_client_t *self, const char *key, zchunk_t *value)
+{
+    return zns_client_put_ttl (self, key, value, 0);
+}
+
+//  --------------------------------------------------------------------------
+//  Put value to store, which is deleted after ttl msec, 0 means never.
+//  Return 0 for success, -1 for error.
+
+int
+zns_client_put_ttl (zns_client_t *self, const char *key, zchunk_t *value, int64_t ttl)
+{
+    assert (self);
+    assert (key);
+    assert (value);
+
+    //  Own change must not be hidden by cached value
+    if (self->cache)
+        zhashx_delete (self->cache, key);
+
+    uint64_t total = zchunk_size (value);
+    uint64_t offset = 0;
+    size_t in_flight = 0;
+    bool sent_all = false;
+    int r = 0;
+
+    while (true) {
+        //  Spend the credit we have, empty value is sent as one empty chunk
+        while (!sent_all && in_flight < self->credit) {
+            size_t size = total - offset < self->chunk_size ? total - offset : self->chunk_size;
+            zmsg_t *request = zmsg_new ();
+            zmsg_addstr (request, "STREAM");
+            zmsg_addstr (request, key);
+            zmsg_addstrf (request, "%" PRIu64, offset);
+            zmsg_addstrf (request, "%" PRIu64, total);
+            zmsg_addmem (request, zchunk_data (value) + offset, size);
+            offset += size;
+            sent_all = offset == total;
+            if (sent_all && ttl > 0)
+                zmsg_addstrf (request, "ttl=%" PRId64, ttl);
+            s_send (self, &request);
+            in_flight++;
+        }
+        if (in_flight == 0)
+            break;
+
+        zmsg_t *reply = s_recv (self);
+        if (!reply)
+            return -1;          //  Timeout or interrupted, replies are lost
+
+        char *command = zmsg_popstr (reply);
+        char *reply_key = zmsg_popstr (reply);
+        if (command && reply_key && streq (reply_key, key)) {
+            if (streq (command, "STREAM"))
+                in_flight--;
+            else
+            if (streq (command, "ERROR") || streq (command, "BUSY")) {
+                if (streq (command, "ERROR")) {
+                    char *error = zmsg_popstr (reply);
+                    zsys_error ("zns_client_put %s: %s", key, error);
+                    zstr_free (&error);
+                }
+                else
+                    errno = EBUSY;
+                //  Stop sending, just collect the outstanding replies
+                in_flight--;
+                sent_all = true;
+                r = -1;
+            }
+        }
+        zstr_free (&reply_key);
+        zstr_free (&command);
+        zmsg_destroy (&reply);
+    }
+    return r;
+}
+
+//  Fetch value from zns_srv, return NULL if key does not exist or on error.
+//  Value is fetched in chunks, with at most credit chunks requested at once.
+//  If known version is still current, return NULL and set version to it.
+
+static zchunk_t *
+s_fetch (zns_client_t *self, const char *key, uint64_t known, uint64_t *version_p)
+{
+    *version_p = 0;
+    for (int attempt = 0; attempt != ZNS_CLIENT_RETRIES; attempt++) {
+        zchunk_t *value = NULL;
+        uint64_t total = UINT64_MAX;    //  Unknown until first reply
+        uint64_t version = 0;
+        uint64_t offset = 0;
+        uint64_t received = 0;
+        size_t in_flight = 0;
+        bool missing = false;
+        bool torn = false;
+        bool busy = false;
+        bool notmodified = false;
+
+        while (true) {
+            while (!missing && !torn && !notmodified && offset < total && in_flight < self->credit) {
+                zmsg_t *request = zmsg_new ();
+                zmsg_addstr (request, "FETCH");
+                zmsg_addstr (request, key);
+                zmsg_addstrf (request, "%" PRIu64, offset);
+                zmsg_addstrf (request, "%zu", self->chunk_size);
+                if (known)
+                    zmsg_addstrf (request, "%" PRIu64, known);
+                s_send (self, &request);
+                in_flight++;
+                offset += self->chunk_size;
+            }
+            if (in_flight == 0)
+                break;
+
+            zmsg_t *reply = s_recv (self);
+            if (!reply) {
+                zchunk_destroy (&value);
+                return NULL;
+            }
+
+            char *command = zmsg_popstr (reply);
+            char *reply_key = zmsg_popstr (reply);
+            uint64_t reply_offset, reply_total, reply_version;
+            if (command && reply_key && streq (reply_key, key)) {
+                if (streq (command, "ERROR") || streq (command, "BUSY")) {
+                    in_flight--;
+                    torn = true;
+                    busy = busy || streq (command, "BUSY");
+                }
+                else
+                if (streq (command, "NOTMODIFIED")) {
+                    in_flight--;
+                    notmodified = true;
+                }
+                else
+                if (streq (command, "FETCH")
+                &&  s_popu64 (reply, &reply_offset) == 0) {
+                    in_flight--;
+                    if (s_popu64 (reply, &reply_total) == -1
+                    ||  s_popu64 (reply, &reply_version) == -1)
+                        missing = true;
+                    else
+                    if (!value && reply_offset == 0 && total == UINT64_MAX) {
+                        total = reply_total;
+                        version = reply_version;
+                        value = zchunk_new (NULL, total);
+                        zchunk_fill (value, 0x00, total);
+                    }
+                    if (!missing && !torn && value) {
+                        zframe_t *frame = zmsg_pop (reply);
+                        //  Value has changed in between, start again
+                        if (reply_version != version || !frame
+                        ||  reply_offset + zframe_size (frame) > total)
+                            torn = true;
+                        else {
+                            memcpy (zchunk_data (value) + reply_offset, zframe_data (frame), zframe_size (frame));
+                            received += zframe_size (frame);
+                        }
+                        zframe_destroy (&frame);
+                    }
+                }
+            }
+            zstr_free (&reply_key);
+            zstr_free (&command);
+            zmsg_destroy (&reply);
+        }
+
+        if (missing) {
+            zchunk_destroy (&value);
+            return NULL;
+        }
+        if (notmodified && !value) {
+            *version_p = known;
+            return NULL;
+        }
+        //  Value changed while we were asking, start again
+        if (notmodified)
+            torn = true;
+        if (!torn && value && received == total) {
+            *version_p = version;
+            return value;
+        }
+        if (value) {
+            sodium_memzero (zchunk_data (value), zchunk_max_size (value));
+            zchunk_destroy (&value);
+        }
+        //  Server is over our quota, back off before next attempt
+        if (busy) {
+            errno = EBUSY;
+            zclock_sleep (10 << attempt);
+        }
+    }
+    return NULL;
+}
+
+//  Apply all pending invalidations from zns_srv to near cache
+
+static void
+s_cache_invalidate (zns_client_t *self)
+{
+    while (zsock_events (self->cache_sub) & ZMQ_POLLIN) {
+        zmsg_t *event = zmsg_recv (self->cache_sub);
+        if (!event)
+            break;
+        char *key = zmsg_popstr (event);
+        zframe_t *op = zmsg_pop (event);
+        zframe_destroy (&op);
+        uint64_t version;
+        if (key && s_popu64 (event, &version) == 0) {
+            s_cache_item_t *item = (s_cache_item_t *) zhashx_lookup (self->cache, key);
+            if (item && item->version < version)
+                zhashx_delete (self->cache, key);
+        }
+        zstr_free (&key);
+        zmsg_destroy (&event);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Get value from store, return NULL if key does not exist or on error.
+//  With near cache enabled, fresh cached values are returned without asking
+//  zns_srv and stale ones are transferred again only if changed. Request
+//  refused because of client's quota is retried with backoff, errno is set
+//  to EBUSY if all attempts are refused. Caller is responsible for
+//  destroying the returned chunk.
+
+zchunk_t *
+zns_client_get (zns_client_t *self, const char *key)
+{
+    assert (self);
+    assert (key);
+
+    if (!self->cache) {
+        uint64_t version;
+        return s_fetch (self, key, 0, &version);
+    }
+
+    s_cache_invalidate (self);
+    int64_t now = zclock_mono ();
+    s_cache_item_t *item = (s_cache_item_t *) zhashx_lookup (self->cache, key);
+    if (item && item->expires > now)
+        return zchunk_dup (item->value);
+
+    //  Stale value is revalidated, it is transferred again only if changed
+    uint64_t known = item ? item->version : 0;
+    uint64_t version;
+    zchunk_t *value = s_fetch (self, key, known, &version);
+    if (item && !value && known && version == known) {
+        item->expires = now + self->cache_max_age;
+        return zchunk_dup (item->value);
+    }
+    if (item)
+        zhashx_delete (self->cache, key);
+    if (!value)
+        return NULL;
+
+    //  Forget the oldest entry to keep the cache bounded
+    if (zhashx_size (self->cache) >= self->cache_size) {
+        char *oldest = (char *) zlistx_first (self->cache_order);
+        if (oldest)
+            zhashx_delete (self->cache, oldest);
+    }
+    item = s_cache_item_new (zchunk_dup (value), version, now + self->cache_max_age);
+    item->order = self->cache_order;
+    item->handle = zlistx_add_end (self->cache_order, (void *) key);
+    zhashx_update (self->cache, key, item);
+    return value;
+}
+
+//  Send request about key and wait for its reply. Return reply without
+//  command and key frames, NULL on error or timeout. errno is set to EBUSY
+//  when server refused the request because of client's quota. Reply must
+//  have the key and command of request, ERROR and BUSY name the command
+//  they refused.
+
+static zmsg_t *
+s_request (zns_client_t *self, const char *key, zmsg_t **request_p)
+{
+    if (self->cache)
+        zhashx_delete (self->cache, key);
+    char *request_command = zframe_strdup (zmsg_first (*request_p));
+    s_send (self, request_p);
+
+    while (true) {
+        zmsg_t *reply = s_recv (self);
+        if (!reply)
+            break;
+        char *command = zmsg_popstr (reply);
+        char *reply_key = zmsg_popstr (reply);
+        bool error = command && streq (command, "ERROR");
+        bool busy = command && streq (command, "BUSY");
+        char *reason = error ? zmsg_popstr (reply) : NULL;
+        char *refused = error || busy ? zmsg_popstr (reply) : NULL;
+        //  Late reply to earlier request which timed out, of the same key
+        //  or other command on it
+        bool mine = command && reply_key && streq (reply_key, key)
+                 && streq (error || busy ? (refused ? refused : "") : command, request_command);
+        if (mine && error) {
+            zsys_error ("zns_client %s: %s", key, reason);
+            zmsg_destroy (&reply);
+        }
+        else
+        if (mine && busy) {
+            errno = EBUSY;
+            zmsg_destroy (&reply);
+        }
+        zstr_free (&reason);
+        zstr_free (&refused);
+        zstr_free (&reply_key);
+        zstr_free (&command);
+        if (mine) {
+            zstr_free (&request_command);
+            return reply;
+        }
+        zmsg_destroy (&reply);
+    }
+    zstr_free (&request_command);
+    return NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Put the value only if key has still the expected version, 0 expects
+//  missing key, NULL value deletes the key. Return 0 and set version to the
+//  new one, or -1 on conflict or error. On conflict the version is set to
+//  the current one and current value is returned if current_p is not NULL,
+//  so caller can retry at once. Value is sent in single message.
+
+int
+zns_client_cas (zns_client_t *self, const char *key, uint64_t *version_p, zchunk_t *value, zchunk_t **current_p)
+{
+    assert (self);
+    assert (key);
+    assert (version_p);
+    if (current_p)
+        *current_p = NULL;
+
+    zmsg_t *request = zmsg_new ();
+    zmsg_addstr (request, "CAS");
+    zmsg_addstr (request, key);
+    zmsg_addstrf (request, "%" PRIu64, *version_p);
+    if (value)
+        zmsg_addmem (request, zchunk_data (value), zchunk_size (value));
+    zmsg_t *reply = s_request (self, key, &request);
+    if (!reply)
+        return -1;
+
+    char *result = zmsg_popstr (reply);
+    int r = -1;
+    if (result && s_popu64 (reply, version_p) == 0) {
+        r = streq (result, "OK") ? 0 : -1;
+        zframe_t *frame = zmsg_pop (reply);
+        if (frame && current_p)
+            *current_p = zchunk_new (zframe_data (frame), zframe_size (frame));
+        zframe_destroy (&frame);
+    }
+    zstr_free (&result);
+    zmsg_destroy (&reply);
+    return r;
+}
+
+//  --------------------------------------------------------------------------
+//  Add delta to the decimal number stored in key, missing key counts as 0.
+//  Return 0 and set value to the result, -1 on error.
+
+int
+zns_client_incr (zns_client_t *self, const char *key, int64_t delta, int64_t *value_p)
+{
+    assert (self);
+    assert (key);
+    assert (value_p);
+
+    zmsg_t *request = zmsg_new ();
+    zmsg_addstr (request, "INCR");
+    zmsg_addstr (request, key);
+    zmsg_addstrf (request, "%" PRId64, delta);
+    zmsg_t *reply = s_request (self, key, &request);
+    if (!reply)
+        return -1;
+
+    int r = s_popi64 (reply, value_p);
+    zmsg_destroy (&reply);
+    return r;
+}
+
+//  --------------------------------------------------------------------------
+//  Append value to the key, missing key is created. Return 0 for success,
+//  -1 for error. Value is sent in single message.
+
+int
+zns_client_append (zns_client_t *self, const char *key, zchunk_t *value)
+{
+    assert (self);
+    assert (key);
+    assert (value);
+
+    zmsg_t *request = zmsg_new ();
+    zmsg_addstr (request, "APPEND");
+    zmsg_addstr (request, key);
+    zmsg_addmem (request, zchunk_data (value), zchunk_size (value));
+    zmsg_t *reply = s_request (self, key, &request);
+    if (!reply)
+        return -1;
+    zmsg_destroy (&reply);
+    return 0;
+}
+
+//  Receive reply from zns_srv and check its command and key
+
+static void
+s_test_reply (zsock_t *sock, const char *command, const char *key)
+{
+    zmsg_t *reply = zmsg_recv (sock);
+    assert (reply);
+    char *reply_command = zmsg_popstr (reply);
+    char *reply_key = zmsg_popstr (reply);
+    assert (reply_command && streq (reply_command, command));
+    assert (reply_key && streq (reply_key, key));
+    zstr_free (&reply_command);
+    zstr_free (&reply_key);
+    zmsg_destroy (&reply);
+}
+
+//  Return number of requests refused by zns_srv
+
+static uint64_t
+s_test_refused (zactor_t *zns_srv)
+{
+    zstr_sendx (zns_srv, "STATS", NULL);
+    zmsg_t *stats = zmsg_recv (zns_srv);
+    assert (stats);
+    uint64_t refused = UINT64_MAX;
+    char *name = zmsg_popstr (stats);
+    zstr_free (&name);
+    while ((name = zmsg_popstr (stats))) {
+        char *value = zmsg_popstr (stats);
+        if (streq (name, "zns_refused_total"))
+            refused = strtoull (value, NULL, 10);
+        zstr_free (&name);
+        zstr_free (&value);
+    }
+    zmsg_destroy (&stats);
+    assert (refused != UINT64_MAX);
+    return refused;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zns_client_test (bool verbose)
+{
+    printf (" * zns_client: ");
+    zsys_file_delete ("src/test.zenstore");
+
+    //  @selftest
+    static const char* endpoint = "inproc://@/zns-client-test";
+
+    zactor_t *zns_srv = zactor_new (zns_srv_actor, NULL);
+    if (verbose)
+        zstr_send (zns_srv, "VERBOSE");
+    zstr_sendx (zns_srv, "STORE", "src/test.zenstore", NULL);
+    zstr_sendx (zns_srv, "PASSWORD", "S3cr3t!", NULL);
+    zstr_sendx (zns_srv, "BIND", endpoint, NULL);
+    assert (zsock_wait (zns_srv) == 0);
+
+    zns_client_t *client = zns_client_new (endpoint);
+    assert (client);
+    zns_client_set_chunk_size (client, 4096);
+    zns_client_set_credit (client, 4);
+
+    // small and empty values
+    zchunk_t *value = zchunk_new ("VALUE", 5);
+    int r = zns_client_put (client, "KEY", value);
+    assert (r == 0);
+    zchunk_destroy (&value);
+
+    value = zns_client_get (client, "KEY");
+    assert (value);
+    assert (zchunk_size (value) == 5);
+    assert (memcmp (zchunk_data (value), "VALUE", 5) == 0);
+    zchunk_destroy (&value);
+
+    value = zchunk_new (NULL, 0);
+    r = zns_client_put (client, "EMPTY", value);
+    assert (r == 0);
+    zchunk_destroy (&value);
+    value = zns_client_get (client, "EMPTY");
+    assert (value);
+    assert (zchunk_size (value) == 0);
+    zchunk_destroy (&value);
+
+    assert (!zns_client_get (client, "NOKEY"));
+
+    // value spanning many chunks, not aligned to chunk size
+    size_t big_size = 1024 * 1024 + 123;
+    zchunk_t *big = zchunk_new (NULL, big_size);
+    zchunk_fill (big, 0x00, big_size);
+    for (size_t i = 0; i != big_size; i++)
+        zchunk_data (big) [i] = (byte) (i % 251);
+    r = zns_client_put (client, "BIG", big);
+    assert (r == 0);
+
+    value = zns_client_get (client, "BIG");
+    assert (value);
+    assert (zchunk_size (value) == big_size);
+    assert (memcmp (zchunk_data (value), zchunk_data (big), big_size) == 0);
+    zchunk_destroy (&value);
+    zchunk_destroy (&big);
+
+    // uploads of two clients interleave chunk by chunk and other requests
+    // are served in between
+    zns_client_t *client2 = zns_client_new (endpoint);
+    assert (client2);
+    zsock_t *sock1 = zns_client_sock (client);
+    zsock_t *sock2 = zns_client_sock (client2);
+    zstr_sendx (sock1, "STREAM", "UP1", "0", "8", "AAAA", NULL);
+    zstr_sendx (sock2, "STREAM", "UP2", "0", "8", "CCCC", NULL);
+    zstr_sendx (sock1, "STREAM", "UP2", "0", "8", "EEEE", NULL);
+    s_test_reply (sock1, "STREAM", "UP1");
+    s_test_reply (sock2, "STREAM", "UP2");
+    s_test_reply (sock1, "STREAM", "UP2");
+    value = zns_client_get (client2, "KEY");
+    assert (value);
+    zchunk_destroy (&value);
+    zstr_sendx (sock2, "STREAM", "UP2", "4", "8", "DDDD", NULL);
+    zstr_sendx (sock1, "STREAM", "UP1", "4", "8", "BBBB", NULL);
+    zstr_sendx (sock1, "STREAM", "UP2", "4", "8", "FFFF", NULL);
+    s_test_reply (sock2, "STREAM", "UP2");
+    s_test_reply (sock1, "STREAM", "UP1");
+    s_test_reply (sock1, "STREAM", "UP2");
+    value = zns_client_get (client, "UP1");
+    assert (value);
+    assert (zchunk_size (value) == 8);
+    assert (memcmp (zchunk_data (value), "AAAABBBB", 8) == 0);
+    zchunk_destroy (&value);
+    //  UP2 of first client was committed last
+    value = zns_client_get (client2, "UP2");
+    assert (value);
+    assert (zchunk_size (value) == 8);
+    assert (memcmp (zchunk_data (value), "EEEEFFFF", 8) == 0);
+    zchunk_destroy (&value);
+    zns_client_destroy (&client2);
+
+    // value over max size is refused, upload idle for too long is dropped
+    zstr_sendx (zns_srv, "UPLOAD", "16", "100", NULL);
+    s_test_refused (zns_srv);
+    zstr_sendx (sock1, "STREAM", "HUGE", "0", "17", "DATA", NULL);
+    s_test_reply (sock1, "ERROR", "HUGE");
+    zstr_sendx (sock1, "STREAM", "IDLE", "0", "8", "DATA", NULL);
+    s_test_reply (sock1, "STREAM", "IDLE");
+    zclock_sleep (200);
+    zstr_sendx (sock1, "STREAM", "IDLE", "4", "8", "DATA", NULL);
+    s_test_reply (sock1, "ERROR", "IDLE");
+    zstr_sendx (zns_srv, "UPLOAD", "67108864", "30000", NULL);
+
+    // chunk out of order is refused
+    zstr_sendx (zns_client_sock (client), "STREAM", "KEY", "10", "20", "DATA", NULL);
+    zmsg_t *msg = zmsg_recv (zns_client_sock (client));
+    char *command = zmsg_popstr (msg);
+    char *key = zmsg_popstr (msg);
+    zmsg_destroy (&msg);
+    assert (streq (command, "ERROR"));
+    assert (streq (key, "KEY"));
+    zstr_free (&command);
+    zstr_free (&key);
+
+    // watch changes of keys with prefix
+    static const char* pub_endpoint = "inproc://@/zns-client-test-pub";
+    zstr_sendx (zns_srv, "PUBLISH", pub_endpoint, NULL);
+    r = zns_client_watch (client, pub_endpoint, "CERT/");
+    assert (r == 0);
+    zclock_sleep (100);     //  Let subscription propagate
+
+    value = zchunk_new ("PEM", 3);
+    zns_client_put (client, "KEY", value);
+    zns_client_put (client, "CERT/server", value);
+    zchunk_destroy (&value);
+
+    char *op;
+    uint64_t version;
+    r = zns_client_watch_recv (client, &key, &op, &version, 1000);
+    assert (r == 0);
+    assert (streq (key, "CERT/server"));
+    assert (streq (op, "PUT"));
+    assert (version > 0);
+    zstr_free (&key);
+    zstr_free (&op);
+
+    // near cache - published changes invalidate cached values
+    zns_client_t *cached = zns_client_new (endpoint);
+    assert (cached);
+    r = zns_client_set_cache (cached, pub_endpoint, 2, 60000);
+    assert (r == 0);
+    zclock_sleep (100);     //  Let subscription propagate
+
+    value = zns_client_get (cached, "KEY");
+    assert (value);
+    assert (zchunk_streq (value, "PEM"));
+    zchunk_destroy (&value);
+
+    value = zchunk_new ("PEM2", 4);
+    zns_client_put (client, "KEY", value);
+    zchunk_destroy (&value);
+    zclock_sleep (100);     //  Let invalidation arrive
+
+    value = zns_client_get (cached, "KEY");
+    assert (value);
+    assert (zchunk_streq (value, "PEM2"));
+    zchunk_destroy (&value);
+
+    // cache is bounded
+    value = zns_client_get (cached, "CERT/server");
+    assert (value);
+    zchunk_destroy (&value);
+    value = zns_client_get (cached, "BIG");
+    assert (value);
+    zchunk_destroy (&value);
+    zns_client_destroy (&cached);
+
+    // without notifications value is served from cache until it gets stale
+    cached = zns_client_new (endpoint);
+    assert (cached);
+    r = zns_client_set_cache (cached, "inproc://@/zns-client-test-nothing", 10, 200);
+    assert (r == 0);
+    value = zns_client_get (cached, "KEY");
+    assert (zchunk_streq (value, "PEM2"));
+    zchunk_destroy (&value);
+
+    value = zchunk_new ("PEM3", 4);
+    zns_client_put (client, "KEY", value);
+    zchunk_destroy (&value);
+
+    value = zns_client_get (cached, "KEY");
+    assert (zchunk_streq (value, "PEM2"));
+    zchunk_destroy (&value);
+    zclock_sleep (300);
+    value = zns_client_get (cached, "KEY");
+    assert (zchunk_streq (value, "PEM3"));
+    zchunk_destroy (&value);
+    zns_client_destroy (&cached);
+
+    // revalidated value is not sent again
+    cached = zns_client_new (endpoint);
+    assert (cached);
+    r = zns_client_set_cache (cached, "inproc://@/zns-client-test-nothing", 10, 1);
+    assert (r == 0);
+    value = zns_client_get (cached, "BIG");
+    assert (zchunk_size (value) == big_size);
+    zchunk_destroy (&value);
+    zclock_sleep (10);
+    value = zns_client_get (cached, "BIG");
+    assert (zchunk_size (value) == big_size);
+    zchunk_destroy (&value);
+    zns_client_destroy (&cached);
+
+    // atomic read-modify-write
+    int64_t counter;
+    r = zns_client_incr (client, "COUNTER", 1, &counter);
+    assert (r == 0);
+    assert (counter == 1);
+    r = zns_client_incr (client, "COUNTER", 41, &counter);
+    assert (r == 0);
+    assert (counter == 42);
+    //  Late reply of other command on the same key is not taken
+    zstr_sendx (zns_client_sock (client), "GET", "COUNTER", NULL);
+    r = zns_client_incr (client, "COUNTER", 1, &counter);
+    assert (r == 0);
+    assert (counter == 43);
+    r = zns_client_incr (client, "KEY", 1, &counter);
+    assert (r == -1);
+
+    value = zchunk_new ("-part1", 6);
+    r = zns_client_append (client, "LOG", value);
+    assert (r == 0);
+    r = zns_client_append (client, "LOG", value);
+    assert (r == 0);
+    zchunk_destroy (&value);
+    value = zns_client_get (client, "LOG");
+    assert (zchunk_streq (value, "-part1-part1"));
+    zchunk_destroy (&value);
+
+    version = 0;
+    value = zchunk_new ("V1", 2);
+    r = zns_client_cas (client, "CAS", &version, value, NULL);
+    assert (r == 0);
+    assert (version > 0);
+    uint64_t stale = 0;
+    zchunk_t *current;
+    r = zns_client_cas (client, "CAS", &stale, value, &current);
+    assert (r == -1);
+    assert (stale == version);
+    assert (zchunk_streq (current, "V1"));
+    zchunk_destroy (&current);
+    zchunk_destroy (&value);
+    value = zchunk_new ("V2", 2);
+    r = zns_client_cas (client, "CAS", &stale, value, NULL);
+    assert (r == 0);
+    assert (stale > version);
+    zchunk_destroy (&value);
+
+    // short lived values
+    value = zchunk_new ("TOKEN", 5);
+    r = zns_client_put_ttl (client, "TOKEN", value, 100);
+    assert (r == 0);
+    zchunk_destroy (&value);
+    value = zns_client_get (client, "TOKEN");
+    assert (value);
+    zchunk_destroy (&value);
+    zclock_sleep (200);
+    assert (!zns_client_get (client, "TOKEN"));
+
+    // client over its quota gets EBUSY, get is retried with backoff first
+    zstr_sendx (zns_srv, "RATELIMIT", "1", "1", NULL);
+    uint64_t refused = s_test_refused (zns_srv);
+    zns_client_t *limited = zns_client_new (endpoint);
+    assert (limited);
+    zns_client_set_credit (limited, 1);
+    value = zns_client_get (limited, "KEY");
+    assert (value);
+    zchunk_destroy (&value);
+    errno = 0;
+    assert (!zns_client_get (limited, "KEY"));
+    assert (errno == EBUSY);
+    assert (s_test_refused (zns_srv) == refused + ZNS_CLIENT_RETRIES);
+    value = zchunk_new ("BUSY", 4);
+    errno = 0;
+    assert (zns_client_put (limited, "KEY", value) == -1);
+    assert (errno == EBUSY);
+    version = 0;
+    errno = 0;
+    assert (zns_client_cas (limited, "NEW", &version, value, NULL) == -1);
+    assert (errno == EBUSY);
+    zchunk_destroy (&value);
+    //  Tokens come back within the backoff
+    zstr_sendx (zns_srv, "RATELIMIT", "1000", "1", NULL);
+    s_test_refused (zns_srv);
+    value = zns_client_get (limited, "KEY");
+    assert (value);
+    zchunk_destroy (&value);
+    zstr_sendx (zns_srv, "RATELIMIT", "0", NULL);
+    zns_client_destroy (&limited);
+
+    zns_client_destroy (&client);
+    zactor_destroy (&zns_srv);
+    //  @end
+
+    zsys_file_delete ("src/test.zenstore");
+    printf ("OK\n");
+}
@@ -0,0 +1,774 @@
+/*  =========================================================================
+    zns_dump - Dump files of store records, NDJSON or binary
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_dump - Dump files of store records, NDJSON or binary
+@discuss
+    Reads and writes dump files of zenstore_tool. NDJSON dump has one
+    object per line:
+
+        {"key":"name","value":"base64","version":1,"expires":0}
+
+    Reader takes "text" with a JSON string instead of "value" too, version
+    and expires (wall clock msec, 0 never) are optional, other members are
+    skipped. Binary dump starts by "ZNSDUMP1", then every record is the key
+    and the value, each with its size as big endian u32 in front, and the
+    version and expiry time as big endian u64.
+
+    Import applies records in file order, so the later of two records of
+    one key wins, even if its version is lower.
+@end
+*/
+
+#include "zns_classes.h"
+
+#include <inttypes.h>
+
+#define ZNS_DUMP_MAGIC "ZNSDUMP1"
+#define ZNS_DUMP_MAGIC_SIZE 8
+
+//  Record of dump file
+
+typedef struct {
+    char *key;
+    zchunk_t *value;
+    uint64_t version;           //  0 if not given
+    int64_t expires;            //  Wall clock msec, 0 never
+} s_record_t;
+
+//  Structure of our class
+
+struct _zns_dump_t {
+    FILE *file;                 //  Owned by caller
+    bool binary;
+    bool started;               //  Magic of binary dump read or written
+    s_record_t record;          //  Record read last
+    char *line;                 //  Line of NDJSON dump
+    size_t line_size;
+};
+
+static void
+s_record_reset (s_record_t *record)
+{
+    zstr_free (&record->key);
+    if (record->value)
+        zchunk_fill (record->value, 0x00, zchunk_max_size (record->value));
+    zchunk_destroy (&record->value);
+    record->version = 0;
+    record->expires = 0;
+}
+
+static void
+s_put_u32 (byte *buffer, uint32_t value)
+{
+    for (int i = 0; i != 4; i++)
+        buffer [i] = (byte) (value >> (8 * (3 - i)));
+}
+
+static void
+s_put_u64 (byte *buffer, uint64_t value)
+{
+    for (int i = 0; i != 8; i++)
+        buffer [i] = (byte) (value >> (8 * (7 - i)));
+}
+
+static uint64_t
+s_get_uint (const byte *buffer, int size)
+{
+    uint64_t value = 0;
+    for (int i = 0; i != size; i++)
+        value = (value << 8) | buffer [i];
+    return value;
+}
+
+//  Read size bytes of binary dump, return 0 for success, 1 at the end of
+//  input and -1 for truncated record
+
+static int
+s_read (FILE *input, void *buffer, size_t size, bool first)
+{
+    size_t done = fread (buffer, 1, size, input);
+    if (done == size)
+        return 0;
+    return first && done == 0 && feof (input) ? 1 : -1;
+}
+
+//  Read next record of binary dump, return 0 for success, 1 at the end of
+//  input and -1 for error
+
+static int
+s_binary_record (FILE *input, s_record_t *record)
+{
+    byte size [4];
+    int r = s_read (input, size, sizeof size, true);
+    if (r != 0)
+        return r;
+    size_t key_size = (size_t) s_get_uint (size, 4);
+    record->key = (char *) zmalloc (key_size + 1);
+    assert (record->key);
+    if (s_read (input, record->key, key_size, false) != 0
+    ||  strlen (record->key) != key_size
+    ||  s_read (input, size, sizeof size, false) != 0)
+        return -1;
+    size_t value_size = (size_t) s_get_uint (size, 4);
+    record->value = zchunk_read (input, value_size);
+    byte meta [16];
+    if (!record->value
+    ||  zchunk_size (record->value) != value_size
+    ||  s_read (input, meta, sizeof meta, false) != 0)
+        return -1;
+    record->version = s_get_uint (meta, 8);
+    record->expires = (int64_t) s_get_uint (meta + 8, 8);
+    return 0;
+}
+
+static const char *
+s_json_space (const char *cursor)
+{
+    while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r' || *cursor == '\n')
+        cursor++;
+    return cursor;
+}
+
+static int
+s_json_hex4 (const char *cursor)
+{
+    int code = 0;
+    for (int i = 0; i != 4; i++) {
+        char c = cursor [i];
+        int digit = c >= '0' && c <= '9' ? c - '0'
+                  : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit == -1)
+            return -1;
+        code = code * 16 + digit;
+    }
+    return code;
+}
+
+//  Parse JSON string at cursor and move cursor past it. Return allocated
+//  string in UTF-8 or NULL for error, \u0000 is refused.
+
+static char *
+s_json_string (const char **cursor_p)
+{
+    const char *cursor = *cursor_p;
+    if (*cursor++ != '"')
+        return NULL;
+    //  Escapes are never shorter than what they stand for
+    char *string = (char *) zmalloc (strlen (cursor) + 1);
+    assert (string);
+    char *out = string;
+    while (*cursor != '"') {
+        if ((unsigned char) *cursor < 0x20)
+            goto error;
+        if (*cursor != '\\') {
+            *out++ = *cursor++;
+            continue;
+        }
+        cursor++;
+        char c = *cursor++;
+        if (c == '"' || c == '\\' || c == '/')
+            *out++ = c;
+        else
+        if (c == 'b')
+            *out++ = '\b';
+        else
+        if (c == 'f')
+            *out++ = '\f';
+        else
+        if (c == 'n')
+            *out++ = '\n';
+        else
+        if (c == 'r')
+            *out++ = '\r';
+        else
+        if (c == 't')
+            *out++ = '\t';
+        else
+        if (c == 'u') {
+            int code = s_json_hex4 (cursor);
+            if (code <= 0)
+                goto error;
+            cursor += 4;
+            if (code >= 0xD800 && code < 0xDC00) {
+                int low = cursor [0] == '\\' && cursor [1] == 'u' ? s_json_hex4 (cursor + 2) : -1;
+                if (low < 0xDC00 || low >= 0xE000)
+                    goto error;
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                cursor += 6;
+            }
+            else
+            if (code >= 0xDC00 && code < 0xE000)
+                goto error;
+            if (code < 0x80)
+                *out++ = (char) code;
+            else
+            if (code < 0x800) {
+                *out++ = (char) (0xC0 | (code >> 6));
+                *out++ = (char) (0x80 | (code & 0x3F));
+            }
+            else
+            if (code < 0x10000) {
+                *out++ = (char) (0xE0 | (code >> 12));
+                *out++ = (char) (0x80 | ((code >> 6) & 0x3F));
+                *out++ = (char) (0x80 | (code & 0x3F));
+            }
+            else {
+                *out++ = (char) (0xF0 | (code >> 18));
+                *out++ = (char) (0x80 | ((code >> 12) & 0x3F));
+                *out++ = (char) (0x80 | ((code >> 6) & 0x3F));
+                *out++ = (char) (0x80 | (code & 0x3F));
+            }
+        }
+        else
+            goto error;
+    }
+    *out = '\0';
+    *cursor_p = cursor + 1;
+    return string;
+
+error:
+    free (string);
+    return NULL;
+}
+
+//  Parse JSON number at cursor, only integers are used
+
+static int
+s_json_number (const char **cursor_p, int64_t *number_p)
+{
+    char *end;
+    errno = 0;
+    long long number = strtoll (*cursor_p, &end, 10);
+    if (end == *cursor_p || errno != 0 || *end == '.' || *end == 'e' || *end == 'E')
+        return -1;
+    *number_p = (int64_t) number;
+    *cursor_p = end;
+    return 0;
+}
+
+//  Parse line of NDJSON dump, other members than key, value, text, version
+//  and expires are skipped if they are strings, numbers, true, false or
+//  null. Return 0 for success, -1 for error.
+
+static int
+s_json_record (const char *line, s_record_t *record)
+{
+    const char *cursor = s_json_space (line);
+    if (*cursor++ != '{')
+        return -1;
+    cursor = s_json_space (cursor);
+    bool done = *cursor == '}';
+    if (done)
+        cursor++;
+    while (!done) {
+        char *name = s_json_string (&cursor);
+        if (!name)
+            return -1;
+        cursor = s_json_space (cursor);
+        int r = *cursor++ == ':' ? 0 : -1;
+        cursor = s_json_space (cursor);
+        int64_t number;
+        if (r == -1)
+            ;
+        else
+        if (streq (name, "key")) {
+            zstr_free (&record->key);
+            record->key = s_json_string (&cursor);
+            r = record->key ? 0 : -1;
+        }
+        else
+        if (streq (name, "value") || streq (name, "text")) {
+            char *string = s_json_string (&cursor);
+            if (record->value)
+                zchunk_fill (record->value, 0x00, zchunk_max_size (record->value));
+            zchunk_destroy (&record->value);
+            if (!string)
+                r = -1;
+            else
+            if (streq (name, "text"))
+                record->value = zchunk_new (string, strlen (string));
+            else {
+                size_t size = strlen (string);
+                size_t value_size;
+                byte *buffer = (byte *) zmalloc (size / 4 * 3 + 3);
+                assert (buffer);
+                r = sodium_base642bin (
+                        buffer, size / 4 * 3 + 3, string, size, NULL, &value_size, NULL,
+                        sodium_base64_VARIANT_ORIGINAL);
+                if (r == 0)
+                    record->value = zchunk_new (buffer, value_size);
+                sodium_memzero (buffer, size / 4 * 3 + 3);
+                free (buffer);
+            }
+            if (string)
+                sodium_memzero (string, strlen (string));
+            zstr_free (&string);
+        }
+        else
+        if (streq (name, "version")) {
+            r = s_json_number (&cursor, &number);
+            record->version = (uint64_t) number;
+            if (number < 0)
+                r = -1;
+        }
+        else
+        if (streq (name, "expires")) {
+            r = s_json_number (&cursor, &number);
+            record->expires = number;
+            if (number < 0)
+                r = -1;
+        }
+        else
+        if (*cursor == '"') {
+            char *string = s_json_string (&cursor);
+            r = string ? 0 : -1;
+            zstr_free (&string);
+        }
+        else
+        if (strncmp (cursor, "true", 4) == 0 || strncmp (cursor, "null", 4) == 0)
+            cursor += 4;
+        else
+        if (strncmp (cursor, "false", 5) == 0)
+            cursor += 5;
+        else {
+            double skipped;
+            char *end;
+            skipped = strtod (cursor, &end);
+            (void) skipped;
+            r = end == cursor ? -1 : 0;
+            cursor = end;
+        }
+        zstr_free (&name);
+        if (r == -1)
+            return -1;
+        cursor = s_json_space (cursor);
+        if (*cursor == '}') {
+            cursor++;
+            done = true;
+        }
+        else
+        if (*cursor++ == ',')
+            cursor = s_json_space (cursor);
+        else
+            return -1;
+    }
+    if (*s_json_space (cursor) != '\0' || !record->key || !record->value)
+        return -1;
+    return 0;
+}
+
+//  Write string as JSON string
+
+static void
+s_json_write (FILE *output, const char *string)
+{
+    fputc ('"', output);
+    for (const unsigned char *cursor = (const unsigned char *) string; *cursor; cursor++) {
+        if (*cursor == '"' || *cursor == '\\')
+            fprintf (output, "\\%c", *cursor);
+        else
+        if (*cursor < 0x20)
+            fprintf (output, "\\u%04x", *cursor);
+        else
+            fputc (*cursor, output);
+    }
+    fputc ('"', output);
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new zns_dump reading or writing file, NDJSON or binary dump.
+//  The file stays owned by caller.
+
+zns_dump_t *
+zns_dump_new (FILE *file, bool binary)
+{
+    assert (file);
+    zns_dump_t *self = (zns_dump_t *) zmalloc (sizeof (zns_dump_t));
+    assert (self);
+    self->file = file;
+    self->binary = binary;
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the zns_dump, value of the last record read is wiped
+
+void
+zns_dump_destroy (zns_dump_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zns_dump_t *self = *self_p;
+        s_record_reset (&self->record);
+        if (self->line)
+            sodium_memzero (self->line, self->line_size);
+        free (self->line);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Read next record, return 0 for success, 1 at the end of input and -1 for
+//  invalid record or binary input without magic.
+
+int
+zns_dump_read (zns_dump_t *self)
+{
+    assert (self);
+    s_record_reset (&self->record);
+    if (self->binary && !self->started) {
+        char magic [ZNS_DUMP_MAGIC_SIZE];
+        if (s_read (self->file, magic, sizeof magic, false) != 0
+        ||  memcmp (magic, ZNS_DUMP_MAGIC, ZNS_DUMP_MAGIC_SIZE) != 0) {
+            zsys_error ("Input is not binary dump");
+            return -1;
+        }
+        self->started = true;
+    }
+    if (self->binary)
+        return s_binary_record (self->file, &self->record);
+
+    while (true) {
+        ssize_t size = getline (&self->line, &self->line_size, self->file);
+        if (size == -1)
+            return ferror (self->file) ? -1 : 1;
+        int r = *s_json_space (self->line) == '\0' ? 1
+              : s_json_record (self->line, &self->record);
+        sodium_memzero (self->line, self->line_size);
+        //  Empty lines are skipped
+        if (r != 1)
+            return r;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return key of the last record read
+
+const char *
+zns_dump_key (zns_dump_t *self)
+{
+    assert (self);
+    return self->record.key;
+}
+
+//  --------------------------------------------------------------------------
+//  Return value of the last record read, owned by zns_dump
+
+zchunk_t *
+zns_dump_value (zns_dump_t *self)
+{
+    assert (self);
+    return self->record.value;
+}
+
+//  --------------------------------------------------------------------------
+//  Return version of the last record read, 0 if the record has none
+
+uint64_t
+zns_dump_version (zns_dump_t *self)
+{
+    assert (self);
+    return self->record.version;
+}
+
+//  --------------------------------------------------------------------------
+//  Return wall clock msec when the last record read expires, 0 never
+
+int64_t
+zns_dump_expires (zns_dump_t *self)
+{
+    assert (self);
+    return self->record.expires;
+}
+
+//  --------------------------------------------------------------------------
+//  Write record, binary dump gets its magic before the first one. Return 0
+//  for success, -1 for error.
+
+int
+zns_dump_write (zns_dump_t *self, const char *key, zchunk_t *value, uint64_t version, int64_t expires)
+{
+    assert (self);
+    assert (key);
+    assert (value);
+    if (self->binary && !self->started)
+        fwrite (ZNS_DUMP_MAGIC, 1, ZNS_DUMP_MAGIC_SIZE, self->file);
+    self->started = true;
+    if (self->binary) {
+        byte size [4];
+        byte meta [16];
+        s_put_u32 (size, (uint32_t) strlen (key));
+        fwrite (size, 1, sizeof size, self->file);
+        fwrite (key, 1, strlen (key), self->file);
+        s_put_u32 (size, (uint32_t) zchunk_size (value));
+        fwrite (size, 1, sizeof size, self->file);
+        fwrite (zchunk_data (value), 1, zchunk_size (value), self->file);
+        s_put_u64 (meta, version);
+        s_put_u64 (meta + 8, (uint64_t) expires);
+        fwrite (meta, 1, sizeof meta, self->file);
+    }
+    else {
+        size_t size = sodium_base64_ENCODED_LEN (zchunk_size (value), sodium_base64_VARIANT_ORIGINAL);
+        char *base64 = (char *) zmalloc (size);
+        assert (base64);
+        sodium_bin2base64 (base64, size, zchunk_data (value), zchunk_size (value), sodium_base64_VARIANT_ORIGINAL);
+        fputs ("{\"key\":", self->file);
+        s_json_write (self->file, key);
+        fprintf (self->file, ",\"value\":\"%s\",\"version\":%" PRIu64 ",\"expires\":%" PRId64 "}\n",
+                 base64, version, expires);
+        sodium_memzero (base64, size);
+        free (base64);
+    }
+    return ferror (self->file) ? -1 : 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Finish writing and flush the file, binary dump without records gets its
+//  magic. Return 0 for success, -1 for error.
+
+int
+zns_dump_finish (zns_dump_t *self)
+{
+    assert (self);
+    if (self->binary && !self->started)
+        fwrite (ZNS_DUMP_MAGIC, 1, ZNS_DUMP_MAGIC_SIZE, self->file);
+    self->started = true;
+    return fflush (self->file) == 0 && !ferror (self->file) ? 0 : -1;
+}
+
+//  --------------------------------------------------------------------------
+//  Apply the rest of records of input to store in file order, the later of
+//  two records of one key wins. Record keeps its version, unless the key
+//  has the same or newer one already or the record has none, then it gets
+//  the next version of the store. Return number of records or -1 for
+//  invalid record.
+
+int64_t
+zns_dump_import (zns_dump_t *self, zns_store_t *store, bool verbose)
+{
+    assert (self);
+    assert (store);
+    int64_t count = 0;
+    int64_t renumbered = 0;
+    int r;
+    while ((r = zns_dump_read (self)) == 0) {
+        s_record_t *record = &self->record;
+        if (!record->version
+        ||  zns_store_apply (store, record->key, record->value, record->version, record->expires) == -1) {
+            //  Store is not shared, nothing else takes the next version
+            int rc = zns_store_apply (store, record->key, record->value,
+                                      zns_store_sequence (store) + 1, record->expires);
+            assert (rc == 0);
+            if (record->version)
+                renumbered++;
+        }
+        count++;
+        if (verbose && count % 100000 == 0)
+            zsys_info ("imported %" PRId64 " records", count);
+    }
+    s_record_reset (&self->record);
+    if (r == -1) {
+        zsys_error ("Record %" PRId64 " of input is not valid", count + 1);
+        return -1;
+    }
+    if (renumbered)
+        zsys_info ("%" PRId64 " records replaced keys with the same or newer version, they got next versions",
+                   renumbered);
+    return count;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static int
+s_test_export (const char *key, zchunk_t *value, uint64_t version, int64_t expires, void *arg)
+{
+    return zns_dump_write ((zns_dump_t *) arg, key, value, version, expires);
+}
+
+//  Write text to new file at path and open it for reading
+
+static FILE *
+s_test_file (const char *path, const char *text)
+{
+    FILE *file = fopen (path, "wb");
+    assert (file);
+    fputs (text, file);
+    fclose (file);
+    file = fopen (path, "rb");
+    assert (file);
+    return file;
+}
+
+void
+zns_dump_test (bool verbose)
+{
+    printf (" * zns_dump: ");
+    zsys_file_delete ("src/test-dump.zenstore");
+
+    //  @selftest
+    //  NDJSON takes escapes, text and base64 values, skips other members
+    //  and empty lines
+    FILE *file = s_test_file ("src/test-dump.ndjson",
+        "{\"key\":\"a\\\"b\\u00e9\",\"value\":\"AAEC\",\"version\":7,\"expires\":0}\n"
+        "\n"
+        " { \"text\" : \"line\\n\", \"other\": [1], \"key\": \"k\" }\n");
+    zns_dump_t *dump = zns_dump_new (file, false);
+    assert (dump);
+    assert (zns_dump_read (dump) == 0);
+    assert (streq (zns_dump_key (dump), "a\"b\xc3\xa9"));
+    assert (zchunk_size (zns_dump_value (dump)) == 3);
+    assert (memcmp (zchunk_data (zns_dump_value (dump)), "\x00\x01\x02", 3) == 0);
+    assert (zns_dump_version (dump) == 7);
+    //  Arrays are not skipped
+    assert (zns_dump_read (dump) == -1);
+    zns_dump_destroy (&dump);
+    fclose (file);
+
+    file = s_test_file ("src/test-dump.ndjson",
+        "{\"key\":\"k\",\"text\":\"line\\n\",\"other\":null,\"n\":1.5}\n");
+    dump = zns_dump_new (file, false);
+    assert (zns_dump_read (dump) == 0);
+    assert (streq (zns_dump_key (dump), "k"));
+    assert (zchunk_streq (zns_dump_value (dump), "line\n"));
+    assert (zns_dump_version (dump) == 0);
+    assert (zns_dump_expires (dump) == 0);
+    assert (zns_dump_read (dump) == 1);
+    zns_dump_destroy (&dump);
+    fclose (file);
+
+    const char *invalid [] = {
+        "{\"key\":\"k\"}\n",                                //  No value
+        "{\"key\":\"k\\u0000\",\"text\":\"\"}\n",           //  NUL in key
+        "{\"key\":\"k\",\"value\":\"!!\"}\n",               //  Not base64
+        "{\"key\":\"k\",\"text\":\"\",\"version\":-1}\n",   //  Negative version
+        "{\"key\":\"k\",\"text\":\"\"} x\n",                //  Trailing garbage
+        "{\"key\":\"\\ud800\",\"text\":\"\"}\n"             //  Lone surrogate
+    };
+    for (size_t i = 0; i != sizeof invalid / sizeof invalid [0]; i++) {
+        file = s_test_file ("src/test-dump.ndjson", invalid [i]);
+        dump = zns_dump_new (file, false);
+        assert (zns_dump_read (dump) == -1);
+        zns_dump_destroy (&dump);
+        fclose (file);
+    }
+
+    //  Binary dump gives back what was written, truncated record and input
+    //  without magic are refused
+    file = fopen ("src/test-dump.bin", "w+b");
+    assert (file);
+    dump = zns_dump_new (file, true);
+    zchunk_t *chunk = zchunk_new ("VALUE\0", 6);
+    assert (zns_dump_write (dump, "KEY", chunk, 42, 1234) == 0);
+    assert (zns_dump_finish (dump) == 0);
+    zns_dump_destroy (&dump);
+    rewind (file);
+    dump = zns_dump_new (file, true);
+    assert (zns_dump_read (dump) == 0);
+    assert (streq (zns_dump_key (dump), "KEY"));
+    assert (zchunk_size (zns_dump_value (dump)) == 6);
+    assert (memcmp (zchunk_data (zns_dump_value (dump)), "VALUE\0", 6) == 0);
+    assert (zns_dump_version (dump) == 42);
+    assert (zns_dump_expires (dump) == 1234);
+    assert (zns_dump_read (dump) == 1);
+    zns_dump_destroy (&dump);
+    fclose (file);
+    assert (truncate ("src/test-dump.bin", zsys_file_size ("src/test-dump.bin") - 1) == 0);
+    file = fopen ("src/test-dump.bin", "rb");
+    dump = zns_dump_new (file, true);
+    assert (zns_dump_read (dump) == -1);
+    zns_dump_destroy (&dump);
+    fclose (file);
+    //  Binary dump without records is valid
+    file = fopen ("src/test-dump.bin", "w+b");
+    assert (file);
+    dump = zns_dump_new (file, true);
+    assert (zns_dump_finish (dump) == 0);
+    zns_dump_destroy (&dump);
+    rewind (file);
+    dump = zns_dump_new (file, true);
+    assert (zns_dump_read (dump) == 1);
+    zns_dump_destroy (&dump);
+    fclose (file);
+    file = s_test_file ("src/test-dump.bin", "ZNSDUMP2");
+    dump = zns_dump_new (file, true);
+    assert (zns_dump_read (dump) == -1);
+    zns_dump_destroy (&dump);
+    fclose (file);
+
+    //  The later record of key wins, even by lower version or into store
+    //  which has newer one
+    zns_store_t *store = zns_store_new ();
+    zns_store_apply (store, "OLD", chunk, 100, 0);
+    file = s_test_file ("src/test-dump.ndjson",
+        "{\"key\":\"K\",\"text\":\"first\",\"version\":5}\n"
+        "{\"key\":\"K\",\"text\":\"second\",\"version\":3}\n"
+        "{\"key\":\"OLD\",\"text\":\"new\",\"version\":2}\n"
+        "{\"key\":\"NEW\",\"text\":\"kept\",\"version\":200}\n");
+    dump = zns_dump_new (file, false);
+    assert (zns_dump_import (dump, store, verbose) == 4);
+    zns_dump_destroy (&dump);
+    fclose (file);
+    zchunk_t *value = zns_store_lookup (store, "K", NULL);
+    assert (zchunk_streq (value, "second"));
+    zchunk_destroy (&value);
+    assert (zns_store_version (store, "K") > 5);
+    value = zns_store_lookup (store, "OLD", NULL);
+    assert (zchunk_streq (value, "new"));
+    zchunk_destroy (&value);
+    assert (zns_store_version (store, "OLD") > 100);
+    assert (zns_store_version (store, "NEW") == 200);
+
+    //  Export imported again gives the same store, in both formats
+    int64_t expires = zclock_time () + 60000;
+    zns_store_apply (store, "TTL", chunk, 300, expires);
+    zns_store_set_dir (store, "src");
+    zns_store_set_file (store, "test-dump.zenstore");
+    assert (zns_store_save (store, (byte *) "S3cr3t!") == 0);
+    for (int binary = 0; binary != 2; binary++) {
+        file = fopen ("src/test-dump.bin", "w+b");
+        assert (file);
+        dump = zns_dump_new (file, binary);
+        assert (zns_store_scan (store, (byte *) "S3cr3t!", s_test_export, dump) == 0);
+        assert (zns_dump_finish (dump) == 0);
+        zns_dump_destroy (&dump);
+        rewind (file);
+        zns_store_t *imported = zns_store_new ();
+        dump = zns_dump_new (file, binary);
+        assert (zns_dump_import (dump, imported, verbose) == (int64_t) zns_store_size (store));
+        zns_dump_destroy (&dump);
+        fclose (file);
+        const char *keys [] = {"K", "OLD", "NEW", "TTL"};
+        for (int i = 0; i != 4; i++) {
+            assert (zns_store_version (imported, keys [i]) == zns_store_version (store, keys [i]));
+            assert (zns_store_expires (imported, keys [i]) == zns_store_expires (store, keys [i]));
+            zchunk_t *original = zns_store_lookup (store, keys [i], NULL);
+            value = zns_store_lookup (imported, keys [i], NULL);
+            assert (zchunk_size (value) == zchunk_size (original));
+            assert (memcmp (zchunk_data (value), zchunk_data (original), zchunk_size (value)) == 0);
+            zchunk_destroy (&value);
+            zchunk_destroy (&original);
+        }
+        zns_store_destroy (&imported);
+    }
+    zns_store_destroy (&store);
+    zchunk_destroy (&chunk);
+    zsys_file_delete ("src/test-dump.ndjson");
+    zsys_file_delete ("src/test-dump.bin");
+    zsys_file_delete ("src/test-dump.zenstore");
+    //  @end
+
+    printf ("OK\n");
+}
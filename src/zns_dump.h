@@ -0,0 +1,79 @@
+/*  =========================================================================
+    zns_dump - Dump files of store records, NDJSON or binary
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_DUMP_H_INCLUDED
+#define ZNS_DUMP_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _zns_dump_t zns_dump_t;
+
+//  @interface
+//  Create a new zns_dump reading or writing file, NDJSON or binary dump.
+//  The file stays owned by caller.
+ZNS_EXPORT zns_dump_t *
+    zns_dump_new (FILE *file, bool binary);
+
+//  Destroy the zns_dump, value of the last record read is wiped
+ZNS_EXPORT void
+    zns_dump_destroy (zns_dump_t **self_p);
+
+//  Read next record, return 0 for success, 1 at the end of input and -1 for
+//  invalid record or binary input without magic.
+ZNS_EXPORT int
+    zns_dump_read (zns_dump_t *self);
+
+//  Return key of the last record read
+ZNS_EXPORT const char *
+    zns_dump_key (zns_dump_t *self);
+
+//  Return value of the last record read, owned by zns_dump
+ZNS_EXPORT zchunk_t *
+    zns_dump_value (zns_dump_t *self);
+
+//  Return version of the last record read, 0 if the record has none
+ZNS_EXPORT uint64_t
+    zns_dump_version (zns_dump_t *self);
+
+//  Return wall clock msec when the last record read expires, 0 never
+ZNS_EXPORT int64_t
+    zns_dump_expires (zns_dump_t *self);
+
+//  Write record, binary dump gets its magic before the first one. Return 0
+//  for success, -1 for error.
+ZNS_EXPORT int
+    zns_dump_write (zns_dump_t *self, const char *key, zchunk_t *value, uint64_t version, int64_t expires);
+
+//  Finish writing and flush the file, binary dump without records gets its
+//  magic. Return 0 for success, -1 for error.
+ZNS_EXPORT int
+    zns_dump_finish (zns_dump_t *self);
+
+//  Apply the rest of records of input to store in file order, the later of
+//  two records of one key wins. Record keeps its version, unless the key
+//  has the same or newer one already or the record has none, then it gets
+//  the next version of the store. Return number of records or -1 for
+//  invalid record.
+ZNS_EXPORT int64_t
+    zns_dump_import (zns_dump_t *self, zns_store_t *store, bool verbose);
+
+//  Self test of this class
+ZNS_EXPORT void
+    zns_dump_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
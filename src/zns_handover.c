@@ -0,0 +1,254 @@
+/*  =========================================================================
+    zns_handover - Handover of store to new zenstore process
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_handover - Handover of store to new zenstore process
+@discuss
+    Upgrade of zenstore without long outage. Running process listens on a
+    unix socket, new process connects to it, gets decrypted store in sealed
+    memory file (see zns_store_handover) and binds the endpoints the old
+    process has just unbound. The memory file goes as SCM_RIGHTS, so the
+    store never touches the disk. Only process of the same user is accepted.
+    When the new process tells it took over, the old one exits without
+    saving, otherwise it binds again and goes on serving.
+@end
+*/
+
+#include "zns_classes.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//  Fill address of unix socket path, return -1 if path is too long
+
+static int
+s_address (struct sockaddr_un *address, const char *path)
+{
+    memset (address, 0, sizeof (*address));
+    address->sun_family = AF_UNIX;
+    if (strlen (path) >= sizeof (address->sun_path)) {
+        zsys_error ("Handover socket path '%s' is too long", path);
+        return -1;
+    }
+    strcpy (address->sun_path, path);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Listen for new process on unix socket path, which is readable and
+//  writable only by user. Return listening socket or -1 for error.
+
+int
+zns_handover_listen (const char *path)
+{
+    assert (path);
+    struct sockaddr_un address;
+    if (s_address (&address, path) == -1)
+        return -1;
+    int listener = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1)
+        return -1;
+    //  Socket left by crashed process is replaced
+    unlink (path);
+    mode_t mask = umask (0077);
+    int r = bind (listener, (struct sockaddr *) &address, sizeof (address));
+    umask (mask);
+    if (r == -1 || listen (listener, 1) == -1) {
+        zsys_error ("Can't listen for handover on '%s': %s", path, strerror (errno));
+        close (listener);
+        return -1;
+    }
+    return listener;
+}
+
+//  --------------------------------------------------------------------------
+//  Accept new process from listening socket, it must run as the same user.
+//  Return connected socket or -1 for error.
+
+int
+zns_handover_accept (int listener)
+{
+    int sock = accept (listener, NULL, NULL);
+    if (sock == -1)
+        return -1;
+#if defined (SO_PEERCRED)
+    struct ucred peer;
+    socklen_t size = sizeof (peer);
+    if (getsockopt (sock, SOL_SOCKET, SO_PEERCRED, &peer, &size) == -1
+    ||  peer.uid != getuid ()) {
+        zsys_error ("Handover refused to process of other user");
+        close (sock);
+        return -1;
+    }
+#endif
+    return sock;
+}
+
+//  --------------------------------------------------------------------------
+//  Connect to process listening on unix socket path. Return connected socket
+//  or -1 for error.
+
+int
+zns_handover_connect (const char *path)
+{
+    assert (path);
+    struct sockaddr_un address;
+    if (s_address (&address, path) == -1)
+        return -1;
+    int sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return -1;
+    if (connect (sock, (struct sockaddr *) &address, sizeof (address)) == -1) {
+        zsys_error ("Can't connect for handover to '%s': %s", path, strerror (errno));
+        close (sock);
+        return -1;
+    }
+    return sock;
+}
+
+//  --------------------------------------------------------------------------
+//  Send file descriptor to peer, -1 tells the peer handover failed. Return 0
+//  for success, -1 for error.
+
+int
+zns_handover_send (int sock, int fd)
+{
+    //  One byte of data carries the descriptor, 'F' without one is failure
+    char data = fd == -1 ? 'F' : 'H';
+    struct iovec iov = {&data, 1};
+    union {
+        struct cmsghdr header;
+        char buffer [CMSG_SPACE (sizeof (int))];
+    } control;
+    memset (&control, 0, sizeof (control));
+    struct msghdr msg;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1) {
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof (control.buffer);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+        memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+    }
+    return sendmsg (sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+//  --------------------------------------------------------------------------
+//  Receive file descriptor from peer. Return it or -1 if handover failed.
+
+int
+zns_handover_recv (int sock)
+{
+    char data;
+    struct iovec iov = {&data, 1};
+    union {
+        struct cmsghdr header;
+        char buffer [CMSG_SPACE (sizeof (int))];
+    } control;
+    struct msghdr msg;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof (control.buffer);
+    if (recvmsg (sock, &msg, MSG_CMSG_CLOEXEC) != 1 || data != 'H')
+        return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+    if (!cmsg
+    ||  cmsg->cmsg_level != SOL_SOCKET
+    ||  cmsg->cmsg_type != SCM_RIGHTS
+    ||  cmsg->cmsg_len != CMSG_LEN (sizeof (int)))
+        return -1;
+    int fd;
+    memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+    return fd;
+}
+
+//  --------------------------------------------------------------------------
+//  Tell peer whether the store was taken over, result 0 if it was. Return 0
+//  for success, -1 for error.
+
+int
+zns_handover_done (int sock, int result)
+{
+    char data = result == 0 ? 'K' : 'F';
+    return send (sock, &data, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+//  --------------------------------------------------------------------------
+//  Wait until peer tells the store was taken over. Return 0 if it was, -1
+//  if it failed or the peer is gone.
+
+int
+zns_handover_wait (int sock)
+{
+    char data;
+    ssize_t r;
+    do
+        r = recv (sock, &data, 1, 0);
+    while (r == -1 && errno == EINTR);
+    return r == 1 && data == 'K' ? 0 : -1;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zns_handover_test (bool verbose)
+{
+    printf (" * zns_handover: ");
+
+    //  @selftest
+    const char *path = "src/zns-handover-test.sock";
+    int listener = zns_handover_listen (path);
+    assert (listener != -1);
+    assert ((zsys_file_mode (path) & 0077) == 0);
+    int client = zns_handover_connect (path);
+    assert (client != -1);
+    int server = zns_handover_accept (listener);
+    assert (server != -1);
+
+    //  Descriptor arrives as new one to the same file
+    int pipe_fds [2];
+    assert (pipe (pipe_fds) == 0);
+    assert (zns_handover_send (server, pipe_fds [1]) == 0);
+    int fd = zns_handover_recv (client);
+    assert (fd != -1 && fd != pipe_fds [1]);
+    assert (write (fd, "STORE", 5) == 5);
+    char data [5];
+    assert (read (pipe_fds [0], data, 5) == 5);
+    assert (memcmp (data, "STORE", 5) == 0);
+    close (fd);
+    close (pipe_fds [0]);
+    close (pipe_fds [1]);
+
+    //  Failed handover and confirmation
+    assert (zns_handover_send (server, -1) == 0);
+    assert (zns_handover_recv (client) == -1);
+    assert (zns_handover_done (client, -1) == 0);
+    assert (zns_handover_wait (server) == -1);
+    assert (zns_handover_done (client, 0) == 0);
+    assert (zns_handover_wait (server) == 0);
+    close (client);
+    assert (zns_handover_wait (server) == -1);
+
+    close (server);
+    close (listener);
+    zsys_file_delete (path);
+    //  @end
+
+    printf ("OK\n");
+}
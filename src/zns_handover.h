@@ -0,0 +1,63 @@
+/*  =========================================================================
+    zns_handover - Handover of store to new zenstore process
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_HANDOVER_H_INCLUDED
+#define ZNS_HANDOVER_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Listen for new process on unix socket path, which is readable and
+//  writable only by user. Return listening socket or -1 for error.
+ZNS_EXPORT int
+    zns_handover_listen (const char *path);
+
+//  Accept new process from listening socket, it must run as the same user.
+//  Return connected socket or -1 for error.
+ZNS_EXPORT int
+    zns_handover_accept (int listener);
+
+//  Connect to process listening on unix socket path. Return connected socket
+//  or -1 for error.
+ZNS_EXPORT int
+    zns_handover_connect (const char *path);
+
+//  Send file descriptor to peer, -1 tells the peer handover failed. Return 0
+//  for success, -1 for error.
+ZNS_EXPORT int
+    zns_handover_send (int sock, int fd);
+
+//  Receive file descriptor from peer. Return it or -1 if handover failed.
+ZNS_EXPORT int
+    zns_handover_recv (int sock);
+
+//  Tell peer whether the store was taken over, result 0 if it was. Return 0
+//  for success, -1 for error.
+ZNS_EXPORT int
+    zns_handover_done (int sock, int result);
+
+//  Wait until peer tells the store was taken over. Return 0 if it was, -1
+//  if it failed or the peer is gone.
+ZNS_EXPORT int
+    zns_handover_wait (int sock);
+
+//  Self test of this class
+ZNS_EXPORT void
+    zns_handover_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
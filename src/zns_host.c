@@ -0,0 +1,401 @@
+/*  =========================================================================
+    zns_host - Actor hosting many named stores
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of zenstore - ZeroMQ based encrypted store.      
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_host - Actor hosting many named stores
+@discuss
+    Every store is served by its own zns_srv actor, so it has its own key,
+    file and thread; save of one store does not block the others. Clients
+    talk to the front socket and put name of store before every request,
+    replies come with the name as well. Backends connect their DEALER to
+    inproc ROUTER of host with identity set to name of store and requests
+    are routed there with routing id of client, so backends see clients
+    the same way as on their own rw socket.
+@end
+*/
+
+#include "zns_classes.h"
+
+//  Structure of our actor
+
+struct _zns_host_t {
+    zsock_t *pipe;              //  Actor command pipe
+    zpoller_t *poller;          //  Socket poller
+    bool terminated;            //  Did caller ask us to quit?
+    bool verbose;               //  Verbose logging enabled?
+    //  Declare properties
+    zsock_t *front;             //  Clients, bound by BIND
+    zsock_t *back;              //  Backends of stores
+    char *back_endpoint;        //  Endpoint of back socket
+    zhashx_t *stores;           //  Hosted stores, name : s_backend_t
+};
+
+//  Store served by zns_srv actor
+
+typedef struct {
+    zactor_t *actor;            //  zns_srv serving the store
+    bool ready;                 //  Has backend connected?
+    zlistx_t *pending;          //  Requests received before it did
+} s_backend_t;
+
+static s_backend_t *
+s_backend_new (zactor_t *actor)
+{
+    s_backend_t *self = (s_backend_t *) zmalloc (sizeof (s_backend_t));
+    assert (self);
+    self->actor = actor;
+    self->pending = zlistx_new ();
+    assert (self->pending);
+    zlistx_set_destructor (self->pending, (zlistx_destructor_fn *) zmsg_destroy);
+    return self;
+}
+
+static void
+s_backend_destroy (void **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_backend_t *self = (s_backend_t *) *self_p;
+        //  Actor saves the store before it ends
+        zactor_destroy (&self->actor);
+        zlistx_destroy (&self->pending);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zns_host instance
+
+static zns_host_t *
+zns_host_new (zsock_t *pipe, void *args)
+{
+    zns_host_t *self = (zns_host_t *) zmalloc (sizeof (zns_host_t));
+    assert (self);
+
+    self->pipe = pipe;
+    self->terminated = false;
+    self->poller = zpoller_new (self->pipe, NULL);
+
+    //  Initialize properties
+    self->back_endpoint = zsys_sprintf ("inproc://zns-host-%p", (void *) self);
+    self->back = zsock_new (ZMQ_ROUTER);
+    assert (self->back);
+    int r = zsock_bind (self->back, "%s", self->back_endpoint);
+    assert (r == 0);
+    zpoller_add (self->poller, self->back);
+    self->stores = zhashx_new ();
+    zhashx_set_destructor (self->stores, s_backend_destroy);
+
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zns_host instance
+
+static void
+zns_host_destroy (zns_host_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zns_host_t *self = *self_p;
+
+        //  Free actor properties
+        zhashx_destroy (&self->stores);
+        zsock_destroy (&self->front);
+        zsock_destroy (&self->back);
+        zstr_free (&self->back_endpoint);
+
+        //  Free object itself
+        zpoller_destroy (&self->poller);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Start serving the store in its own zns_srv actor
+
+static void
+s_zns_host_store (zns_host_t *self, const char *name, const char *path, const char *password)
+{
+    if (zhashx_lookup (self->stores, name)) {
+        zsys_error ("Store '%s' is hosted already", name);
+        return;
+    }
+    zactor_t *actor = zactor_new (zns_srv_actor, NULL);
+    assert (actor);
+    if (self->verbose)
+        zstr_send (actor, "VERBOSE");
+    zstr_sendx (actor, "STORE", path, NULL);
+    zstr_sendx (actor, "PASSWORD", password, NULL);
+    zstr_sendx (actor, "START", NULL);
+    zstr_sendx (actor, "BACKEND", self->back_endpoint, name, NULL);
+    zhashx_insert (self->stores, name, s_backend_new (actor));
+}
+
+//  Here we handle incoming message from the node
+
+static void
+zns_host_recv_api (zns_host_t *self)
+{
+    //  Get the whole message of the pipe in one go
+    zmsg_t *request = zmsg_recv (self->pipe);
+    if (!request)
+       return;        //  Interrupted
+
+    char *command = zmsg_popstr (request);
+    if (self->verbose)
+        zsys_debug ("API command=%s", command);
+
+    if (streq (command, "VERBOSE"))
+        self->verbose = true;
+    else
+    if (streq (command, "$TERM"))
+        //  The $TERM command is send by zactor_destroy() method
+        self->terminated = true;
+    else
+    if (streq (command, "BIND")) {
+        char *endpoint = zmsg_popstr (request);
+        if (!self->front) {
+            self->front = zsock_new (ZMQ_ROUTER);
+            assert (self->front);
+            zpoller_add (self->poller, self->front);
+        }
+        if (zsock_bind (self->front, "%s", endpoint) == -1)
+            zsys_error ("Can't bind to '%s': %s", endpoint, zmq_strerror (zmq_errno ()));
+        zstr_free (&endpoint);
+    }
+    else
+    if (streq (command, "STORE")) {
+        char *name = zmsg_popstr (request);
+        char *path = zmsg_popstr (request);
+        char *password = zmsg_popstr (request);
+        if (!name || !path || !password)
+            zsys_error ("STORE needs name, path and password");
+        else
+            s_zns_host_store (self, name, path, password);
+        if (password)
+            sodium_memzero (password, strlen (password));
+        zstr_free (&password);
+        zstr_free (&path);
+        zstr_free (&name);
+    }
+    else {
+        zsys_error ("invalid API command '%s'", command);
+        assert (false);
+    }
+    zstr_free (&command);
+    zmsg_destroy (&request);
+}
+
+//  Route request of client to backend of the store, [routing_id, name, ...]
+//  becomes [name, routing_id, ...]
+
+static void
+s_zns_host_recv_front (zns_host_t *self)
+{
+    zmsg_t *msg = zmsg_recv (self->front);
+    if (!msg)
+        return;
+    zframe_t *routing_id = zmsg_pop (msg);
+    zframe_t *name = zmsg_pop (msg);
+    char *name_str = name ? zframe_strdup (name) : NULL;
+    s_backend_t *backend = name_str ? (s_backend_t *) zhashx_lookup (self->stores, name_str) : NULL;
+
+    if (!backend) {
+        zsys_error ("Request for unknown store '%s'", name_str);
+        zmsg_t *reply = zmsg_new ();
+        zmsg_append (reply, &routing_id);
+        if (name)
+            zmsg_append (reply, &name);
+        zmsg_addstr (reply, "ERROR");
+        zframe_t *command = zmsg_pop (msg);
+        zframe_t *key = zmsg_pop (msg);
+        if (key)
+            zmsg_append (reply, &key);
+        else
+            zmsg_addstr (reply, "");
+        zmsg_addstr (reply, "unknown store");
+        if (command)
+            zmsg_append (reply, &command);
+        else
+            zmsg_addstr (reply, "");
+        zmsg_send (&reply, self->front);
+        zmsg_destroy (&msg);
+    }
+    else {
+        zmsg_prepend (msg, &routing_id);
+        zmsg_prepend (msg, &name);
+        if (backend->ready)
+            zmsg_send (&msg, self->back);
+        else
+            zlistx_add_end (backend->pending, msg);
+    }
+    zstr_free (&name_str);
+    zframe_destroy (&name);
+    zframe_destroy (&routing_id);
+}
+
+//  Route reply of backend to client, [name, routing_id, ...] becomes
+//  [routing_id, name, ...]. Backend announces itself by READY.
+
+static void
+s_zns_host_recv_back (zns_host_t *self)
+{
+    zmsg_t *msg = zmsg_recv (self->back);
+    if (!msg)
+        return;
+    zframe_t *name = zmsg_pop (msg);
+    if (zmsg_size (msg) == 1) {
+        char *command = zmsg_popstr (msg);
+        char *name_str = zframe_strdup (name);
+        s_backend_t *backend = (s_backend_t *) zhashx_lookup (self->stores, name_str);
+        if (backend && streq (command, "READY")) {
+            if (self->verbose)
+                zsys_debug ("Store '%s' is ready", name_str);
+            backend->ready = true;
+            zmsg_t *pending;
+            while ((pending = (zmsg_t *) zlistx_detach (backend->pending, NULL)))
+                zmsg_send (&pending, self->back);
+        }
+        zstr_free (&name_str);
+        zstr_free (&command);
+        zframe_destroy (&name);
+        zmsg_destroy (&msg);
+        return;
+    }
+    zframe_t *routing_id = zmsg_pop (msg);
+    zmsg_prepend (msg, &name);
+    zmsg_prepend (msg, &routing_id);
+    if (self->front)
+        zmsg_send (&msg, self->front);
+    zmsg_destroy (&msg);
+}
+
+
+//  --------------------------------------------------------------------------
+//  This is the actor which runs in its own thread.
+
+void
+zns_host_actor (zsock_t *pipe, void *args)
+{
+    zns_host_t * self = zns_host_new (pipe, args);
+    if (!self)
+        return;          //  Interrupted
+
+    //  Signal actor successfully initiated
+    zsock_signal (self->pipe, 0);
+
+    while (!self->terminated) {
+        zsock_t *which = (zsock_t *) zpoller_wait (self->poller, -1);
+        if (which == self->pipe)
+            zns_host_recv_api (self);
+        else
+        if (self->front && which == self->front)
+            s_zns_host_recv_front (self);
+        else
+        if (which == self->back)
+            s_zns_host_recv_back (self);
+    }
+    zns_host_destroy (&self);
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this actor.
+
+void
+zns_host_test (bool verbose)
+{
+    printf (" * zns_host: ");
+    zsys_file_delete ("src/test-a.zenstore");
+    zsys_file_delete ("src/test-b.zenstore");
+    //  @selftest
+    static const char* endpoint = "inproc://zns-host-test";
+
+    zactor_t *zns_host = zactor_new (zns_host_actor, NULL);
+    if (verbose)
+        zstr_send (zns_host, "VERBOSE");
+    zstr_sendx (zns_host, "STORE", "A", "src/test-a.zenstore", "passw0rdA", NULL);
+    zstr_sendx (zns_host, "STORE", "B", "src/test-b.zenstore", "passw0rdB", NULL);
+    zstr_sendx (zns_host, "BIND", endpoint, NULL);
+
+    // the same key in two stores
+    zsock_t *sock = zsock_new_dealer (endpoint);
+    assert (sock);
+    zstr_sendx (sock, "A", "PUT", "KEY", "VALUE-A", NULL);
+    zstr_sendx (sock, "B", "PUT", "KEY", "VALUE-B", NULL);
+    const char *names [] = {"A", "B"};
+    const char *values [] = {"VALUE-A", "VALUE-B"};
+    for (int i = 0; i != 2; i++) {
+        zstr_sendx (sock, names [i], "GET", "KEY", NULL);
+        zmsg_t *msg = zmsg_recv (sock);
+        char *name = zmsg_popstr (msg);
+        char *command = zmsg_popstr (msg);
+        char *key = zmsg_popstr (msg);
+        char *value = zmsg_popstr (msg);
+        zmsg_destroy (&msg);
+        assert (streq (name, names [i]));
+        assert (streq (command, "GET"));
+        assert (streq (key, "KEY"));
+        assert (streq (value, values [i]));
+        zstr_free (&name);
+        zstr_free (&command);
+        zstr_free (&key);
+        zstr_free (&value);
+    }
+
+    // unknown store
+    zstr_sendx (sock, "C", "GET", "KEY", NULL);
+    zmsg_t *msg = zmsg_recv (sock);
+    char *name = zmsg_popstr (msg);
+    char *command = zmsg_popstr (msg);
+    zmsg_destroy (&msg);
+    assert (streq (name, "C"));
+    assert (streq (command, "ERROR"));
+    zstr_free (&name);
+    zstr_free (&command);
+    zsock_destroy (&sock);
+
+    // zns_client talks to one of the stores
+    zns_client_t *client = zns_client_new (endpoint);
+    assert (client);
+    zns_client_set_store (client, "B");
+    zchunk_t *value = zns_client_get (client, "KEY");
+    assert (zchunk_streq (value, "VALUE-B"));
+    zchunk_destroy (&value);
+    zns_client_destroy (&client);
+
+    // every store is saved with its own password
+    zactor_destroy (&zns_host);
+    zns_store_t *store = zns_store_new ();
+    zns_store_set_dir (store, "src");
+    zns_store_set_file (store, "test-b.zenstore");
+    zns_kdf_t *kdf = zns_store_read_kdf (store);
+    assert (kdf);
+    int r = zns_kdf_derive (kdf, "passw0rdB");
+    assert (r == 0);
+    byte key [crypto_secretbox_KEYBYTES];
+    memcpy (key, zns_kdf_key (kdf), crypto_secretbox_KEYBYTES);
+    zns_kdf_destroy (&kdf);
+    r = zns_store_load (store, key);
+    assert (r == 0);
+    assert (zchunk_streq ((zchunk_t *) zns_store_get (store, "KEY"), "VALUE-B"));
+    zns_store_destroy (&store);
+    //  @end
+
+    zsys_file_delete ("src/test-a.zenstore");
+    zsys_file_delete ("src/test-b.zenstore");
+    printf ("OK\n");
+}
@@ -0,0 +1,421 @@
+/*  =========================================================================
+    zns_io - Asynchronous file I/O of store files
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_io - Asynchronous file I/O of store files
+@discuss
+    Writes go one after another to the end of the file, so save can queue
+    a batch of encrypted values and encrypt the next one while the kernel
+    writes. Fsync is queued behind the writes instead of blocking, reads of
+    big ranges are split to chunks read at once.
+
+    Built with liburing, requests go to io_uring in batches and up to 64 are
+    in flight. Without it, or on kernel which refuses io_uring (too old or
+    seccomp), the same calls are done by pwrite, pread and fsync at once.
+    Short reads and writes are continued in both cases.
+
+    Not thread safe, every save or load has its own zns_io.
+@end
+*/
+
+#include "zns_classes.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define ZNS_IO_DEPTH    64              //  Requests in flight at once
+#define ZNS_IO_BATCH    16              //  Requests submitted at once
+#define ZNS_IO_CHUNK    (1024 * 1024)   //  Bytes per read request
+
+//  Request in flight, data is frame written or part of buffer read
+
+typedef struct {
+    zframe_t *frame;            //  NULL for read
+    byte *data;
+    size_t size;
+    uint64_t offset;
+} s_request_t;
+
+//  Structure of our class
+
+struct _zns_io_t {
+    int fd;                     //  File, owned by caller
+    uint64_t offset;            //  End of data written so far
+    int result;                 //  -1 if any request failed
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    bool uring;                 //  Ring is set up, otherwise POSIX calls
+    size_t inflight;            //  Requests queued or submitted
+    size_t queued;              //  Requests not submitted yet
+#endif
+};
+
+//  Write all of data at offset, return 0 for success, -1 for error
+
+static int
+s_pwrite_all (int fd, const byte *data, size_t size, uint64_t offset)
+{
+    while (size) {
+        ssize_t written = pwrite (fd, data, size, (off_t) offset);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            zsys_error ("Write failed: %s", written ? strerror (errno) : "no space");
+            return -1;
+        }
+        data += written;
+        size -= (size_t) written;
+        offset += (uint64_t) written;
+    }
+    return 0;
+}
+
+//  Read all of size bytes at offset, return 0 for success, -1 for error or
+//  end of file
+
+static int
+s_pread_all (int fd, byte *data, size_t size, uint64_t offset)
+{
+    while (size) {
+        ssize_t read_ = pread (fd, data, size, (off_t) offset);
+        if (read_ == -1 && errno == EINTR)
+            continue;
+        if (read_ <= 0) {
+            zsys_error ("Read failed: %s", read_ ? strerror (errno) : "end of file");
+            return -1;
+        }
+        data += read_;
+        size -= (size_t) read_;
+        offset += (uint64_t) read_;
+    }
+    return 0;
+}
+
+#ifdef HAVE_LIBURING
+//  Handle completion of request, short transfer is finished by POSIX call
+
+static void
+s_complete (zns_io_t *self, struct io_uring_cqe *cqe)
+{
+    s_request_t *request = (s_request_t *) io_uring_cqe_get_data (cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen (&self->ring, cqe);
+    self->inflight--;
+
+    if (!request) {
+        if (res < 0) {
+            zsys_error ("Fsync failed: %s", strerror (-res));
+            self->result = -1;
+        }
+        return;
+    }
+    if (res < 0) {
+        zsys_error ("%s failed: %s", request->frame ? "Write" : "Read", strerror (-res));
+        self->result = -1;
+    }
+    else
+    if ((size_t) res < request->size) {
+        size_t done = (size_t) res;
+        int r = request->frame
+              ? s_pwrite_all (self->fd, request->data + done, request->size - done, request->offset + done)
+              : s_pread_all (self->fd, request->data + done, request->size - done, request->offset + done);
+        if (r == -1)
+            self->result = -1;
+    }
+    zframe_destroy (&request->frame);
+    free (request);
+}
+
+//  Submit queued requests and handle completions, wait for at least wait
+//  of them
+
+static void
+s_reap (zns_io_t *self, size_t wait)
+{
+    struct io_uring_cqe *cqe;
+    while (self->queued) {
+        int r = io_uring_submit (&self->ring);
+        if (r > 0)
+            self->queued -= (size_t) r < self->queued ? (size_t) r : self->queued;
+        else
+        if (r == -EINTR || r == -EAGAIN || r == -EBUSY) {
+            //  Completion queue is full, make room and try again
+            while (io_uring_peek_cqe (&self->ring, &cqe) == 0)
+                s_complete (self, cqe);
+        }
+        else {
+            //  Requests never submitted are given up
+            zsys_error ("Submit to io_uring failed: %s", r ? strerror (-r) : "nothing submitted");
+            self->result = -1;
+            self->inflight -= self->queued;
+            self->queued = 0;
+        }
+    }
+    for (; wait && self->inflight; wait--) {
+        int r = io_uring_wait_cqe (&self->ring, &cqe);
+        if (r == -EINTR) {
+            wait++;
+            continue;
+        }
+        if (r < 0) {
+            zsys_error ("Wait for io_uring failed: %s", strerror (-r));
+            self->result = -1;
+            break;
+        }
+        s_complete (self, cqe);
+    }
+    while (io_uring_peek_cqe (&self->ring, &cqe) == 0)
+        s_complete (self, cqe);
+}
+
+//  Return free submission entry, waits while too many requests are in
+//  flight and submits full batch
+
+static struct io_uring_sqe *
+s_sqe (zns_io_t *self)
+{
+    while (self->inflight >= ZNS_IO_DEPTH)
+        s_reap (self, 1);
+    if (self->queued >= ZNS_IO_BATCH)
+        s_reap (self, 0);
+    struct io_uring_sqe *sqe = io_uring_get_sqe (&self->ring);
+    assert (sqe);
+    self->inflight++;
+    self->queued++;
+    return sqe;
+}
+#endif
+
+//  --------------------------------------------------------------------------
+//  Create a new zns_io on open file descriptor, writes start at offset 0.
+//  The descriptor stays owned by caller.
+
+zns_io_t *
+zns_io_new (int fd)
+{
+    zns_io_t *self = (zns_io_t *) zmalloc (sizeof (zns_io_t));
+    assert (self);
+    self->fd = fd;
+#ifdef HAVE_LIBURING
+    //  Kernel without io_uring or denied by seccomp falls back to POSIX
+    self->uring = io_uring_queue_init (ZNS_IO_DEPTH, &self->ring, 0) == 0;
+#endif
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the zns_io, waits for all requests first
+
+void
+zns_io_destroy (zns_io_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zns_io_t *self = *self_p;
+        zns_io_wait (self);
+#ifdef HAVE_LIBURING
+        if (self->uring)
+            io_uring_queue_exit (&self->ring);
+#endif
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Queue write of frame after the data written so far, takes ownership of
+//  frame, which is destroyed once written. Return 0 for success, -1 if any
+//  write has failed.
+
+int
+zns_io_write (zns_io_t *self, zframe_t **frame_p)
+{
+    assert (self);
+    assert (frame_p && *frame_p);
+    zframe_t *frame = *frame_p;
+    *frame_p = NULL;
+    size_t size = zframe_size (frame);
+    uint64_t offset = self->offset;
+    self->offset += size;
+
+#ifdef HAVE_LIBURING
+    if (self->uring && size) {
+        s_request_t *request = (s_request_t *) zmalloc (sizeof (s_request_t));
+        assert (request);
+        request->frame = frame;
+        request->data = zframe_data (frame);
+        request->size = size;
+        request->offset = offset;
+        struct io_uring_sqe *sqe = s_sqe (self);
+        io_uring_prep_write (sqe, self->fd, request->data, (unsigned) size, offset);
+        io_uring_sqe_set_data (sqe, request);
+        //  Write starts at once, caller prepares the next one meanwhile
+        s_reap (self, 0);
+        return self->result;
+    }
+#endif
+    if (s_pwrite_all (self->fd, zframe_data (frame), size, offset) == -1)
+        self->result = -1;
+    zframe_destroy (&frame);
+    return self->result;
+}
+
+//  --------------------------------------------------------------------------
+//  Queue fsync of the file, it runs after all writes queued before. Return 0
+//  for success, -1 if any write has failed.
+
+int
+zns_io_fsync (zns_io_t *self)
+{
+    assert (self);
+#ifdef HAVE_LIBURING
+    if (self->uring) {
+        struct io_uring_sqe *sqe = s_sqe (self);
+        io_uring_prep_fsync (sqe, self->fd, 0);
+        io_uring_sqe_set_data (sqe, NULL);
+        //  Drain orders fsync after writes in flight
+        sqe->flags |= IOSQE_IO_DRAIN;
+        s_reap (self, 0);
+        return self->result;
+    }
+#endif
+    if (fsync (self->fd) == -1) {
+        zsys_error ("Fsync failed: %s", strerror (errno));
+        self->result = -1;
+    }
+    return self->result;
+}
+
+//  --------------------------------------------------------------------------
+//  Read size bytes at offset to buffer, in chunks read at once. Return 0 for
+//  success, -1 for error or end of file.
+
+int
+zns_io_read (zns_io_t *self, void *buffer, size_t size, uint64_t offset)
+{
+    assert (self);
+    assert (buffer || !size);
+#ifdef HAVE_LIBURING
+    if (self->uring) {
+        for (size_t done = 0; done < size; done += ZNS_IO_CHUNK) {
+            s_request_t *request = (s_request_t *) zmalloc (sizeof (s_request_t));
+            assert (request);
+            request->data = (byte *) buffer + done;
+            request->size = size - done < ZNS_IO_CHUNK ? size - done : ZNS_IO_CHUNK;
+            request->offset = offset + done;
+            struct io_uring_sqe *sqe = s_sqe (self);
+            io_uring_prep_read (sqe, self->fd, request->data, (unsigned) request->size, request->offset);
+            io_uring_sqe_set_data (sqe, request);
+        }
+        return zns_io_wait (self);
+    }
+#endif
+    if (s_pread_all (self->fd, (byte *) buffer, size, offset) == -1)
+        self->result = -1;
+    return self->result;
+}
+
+//  --------------------------------------------------------------------------
+//  Wait for all queued requests. Return 0 if all succeeded, -1 otherwise.
+
+int
+zns_io_wait (zns_io_t *self)
+{
+    assert (self);
+#ifdef HAVE_LIBURING
+    if (self->uring)
+        while (self->inflight)
+            s_reap (self, self->inflight);
+#endif
+    return self->result;
+}
+
+//  --------------------------------------------------------------------------
+//  Return bytes written so far, queued writes included
+
+uint64_t
+zns_io_written (zns_io_t *self)
+{
+    assert (self);
+    return self->offset;
+}
+
+//  --------------------------------------------------------------------------
+//  Return name of backend, io_uring or posix
+
+const char *
+zns_io_backend (zns_io_t *self)
+{
+    assert (self);
+#ifdef HAVE_LIBURING
+    if (self->uring)
+        return "io_uring";
+#endif
+    return "posix";
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zns_io_test (bool verbose)
+{
+    printf (" * zns_io: ");
+
+    //  @selftest
+    const char *path = "src/test-io.bin";
+    int fd = open (path, O_CLOEXEC | O_RDWR | O_CREAT | O_TRUNC, 0600);
+    assert (fd != -1);
+    zns_io_t *io = zns_io_new (fd);
+    assert (io);
+    if (verbose)
+        printf ("%s ", zns_io_backend (io));
+
+    //  Frames are written one after another, bigger than read chunk too
+    size_t big_size = 3 * 1024 * 1024 + 17;
+    zframe_t *frame = zframe_new ("HELLO", 5);
+    assert (zns_io_write (io, &frame) == 0);
+    assert (!frame);
+    frame = zframe_new (NULL, big_size);
+    for (size_t i = 0; i != big_size; i++)
+        zframe_data (frame) [i] = (byte) (i % 251);
+    assert (zns_io_write (io, &frame) == 0);
+    frame = zframe_new (NULL, 0);
+    assert (zns_io_write (io, &frame) == 0);
+    frame = zframe_new ("WORLD", 5);
+    assert (zns_io_write (io, &frame) == 0);
+    assert (zns_io_written (io) == 10 + big_size);
+    assert (zns_io_fsync (io) == 0);
+    assert (zns_io_wait (io) == 0);
+    zns_io_destroy (&io);
+    assert (!io);
+    assert (zsys_file_size (path) == (ssize_t) (10 + big_size));
+
+    //  Read back in chunks, past the end fails
+    io = zns_io_new (fd);
+    byte *buffer = (byte *) zmalloc (10 + big_size);
+    assert (buffer);
+    assert (zns_io_read (io, buffer, 10 + big_size, 0) == 0);
+    assert (memcmp (buffer, "HELLO", 5) == 0);
+    for (size_t i = 0; i != big_size; i++)
+        assert (buffer [5 + i] == (byte) (i % 251));
+    assert (memcmp (buffer + 5 + big_size, "WORLD", 5) == 0);
+    assert (zns_io_read (io, buffer, 5, 10 + big_size - 2) == -1);
+    zns_io_destroy (&io);
+    free (buffer);
+    close (fd);
+    zsys_file_delete (path);
+    //  @end
+
+    printf ("OK\n");
+}
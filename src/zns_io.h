@@ -0,0 +1,68 @@
+/*  =========================================================================
+    zns_io - Asynchronous file I/O of store files
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_IO_H_INCLUDED
+#define ZNS_IO_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _zns_io_t zns_io_t;
+
+//  @interface
+//  Create a new zns_io on open file descriptor, writes start at offset 0.
+//  The descriptor stays owned by caller.
+ZNS_EXPORT zns_io_t *
+    zns_io_new (int fd);
+
+//  Destroy the zns_io, waits for all requests first
+ZNS_EXPORT void
+    zns_io_destroy (zns_io_t **self_p);
+
+//  Queue write of frame after the data written so far, takes ownership of
+//  frame, which is destroyed once written. Return 0 for success, -1 if any
+//  write has failed.
+ZNS_EXPORT int
+    zns_io_write (zns_io_t *self, zframe_t **frame_p);
+
+//  Queue fsync of the file, it runs after all writes queued before. Return 0
+//  for success, -1 if any write has failed.
+ZNS_EXPORT int
+    zns_io_fsync (zns_io_t *self);
+
+//  Read size bytes at offset to buffer, in chunks read at once. Return 0 for
+//  success, -1 for error or end of file.
+ZNS_EXPORT int
+    zns_io_read (zns_io_t *self, void *buffer, size_t size, uint64_t offset);
+
+//  Wait for all queued requests. Return 0 if all succeeded, -1 otherwise.
+ZNS_EXPORT int
+    zns_io_wait (zns_io_t *self);
+
+//  Return bytes written so far, queued writes included
+ZNS_EXPORT uint64_t
+    zns_io_written (zns_io_t *self);
+
+//  Return name of backend, io_uring or posix
+ZNS_EXPORT const char *
+    zns_io_backend (zns_io_t *self);
+
+//  Self test of this class
+ZNS_EXPORT void
+    zns_io_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,359 @@
+/*  =========================================================================
+    zns_kdf - Password based key derivation
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of zenstore - ZeroMQ based encrypted store.      
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_kdf - Password based key derivation
+@discuss
+    Derives the key of store from password by Argon2id. Salt and limits are
+    kept in the header of store file, so the same password gives the same
+    key. Derivation is slow on purpose, so it runs once per process and the
+    key stays in locked memory (sodium_malloc) until zns_kdf is destroyed.
+@end
+*/
+
+#include "zns_classes.h"
+
+#include <inttypes.h>
+
+#define ZNS_KDF_NAME "argon2id13"
+
+//  Limits over the maximum are refused, so a crafted header can't make the
+//  process derive for hours or run out of memory
+static uint64_t s_opslimit_max = 64;
+static size_t s_memlimit_max = crypto_pwhash_MEMLIMIT_SENSITIVE;
+
+//  Structure of our class
+
+struct _zns_kdf_t {
+    byte salt [crypto_pwhash_SALTBYTES];
+    uint64_t opslimit;          //  Number of passes
+    size_t memlimit;            //  Memory in bytes
+    byte *key;                  //  Derived key, locked memory
+    bool derived;               //  Is key derived?
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zns_kdf with random salt and interactive limits of Argon2id
+
+zns_kdf_t *
+zns_kdf_new (void)
+{
+    zns_kdf_t *self = (zns_kdf_t *) zmalloc (sizeof (zns_kdf_t));
+    assert (self);
+    //  Initialize class properties here
+    randombytes_buf (self->salt, sizeof self->salt);
+    self->opslimit = crypto_pwhash_OPSLIMIT_INTERACTIVE;
+    self->memlimit = crypto_pwhash_MEMLIMIT_INTERACTIVE;
+    self->key = (byte *) sodium_malloc (crypto_secretbox_KEYBYTES);
+    assert (self->key);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the zns_kdf, derived key is wiped
+
+void
+zns_kdf_destroy (zns_kdf_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zns_kdf_t *self = *self_p;
+        //  Free class properties here
+        sodium_free (self->key);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Create a copy of zns_kdf with the same salt, limits and derived key
+
+zns_kdf_t *
+zns_kdf_dup (zns_kdf_t *self)
+{
+    assert (self);
+    zns_kdf_t *copy = zns_kdf_new ();
+    memcpy (copy->salt, self->salt, sizeof self->salt);
+    copy->opslimit = self->opslimit;
+    copy->memlimit = self->memlimit;
+    memcpy (copy->key, self->key, crypto_secretbox_KEYBYTES);
+    copy->derived = self->derived;
+    return copy;
+}
+
+//  --------------------------------------------------------------------------
+//  Set maximum number of passes and memory in bytes of all key derivations
+//  of the process, 64 passes and 1GB by default. Header with higher limits
+//  is refused by decode. Call it before any zns_kdf is used.
+
+void
+zns_kdf_set_max_limits (uint64_t opslimit, size_t memlimit)
+{
+    s_opslimit_max = opslimit < crypto_pwhash_OPSLIMIT_MIN ? crypto_pwhash_OPSLIMIT_MIN : opslimit;
+    s_memlimit_max = memlimit < crypto_pwhash_MEMLIMIT_MIN ? crypto_pwhash_MEMLIMIT_MIN : memlimit;
+}
+
+//  --------------------------------------------------------------------------
+//  Set number of passes and memory in bytes used by key derivation, values
+//  under minimum of Argon2id are raised to it and values over maximum are
+//  lowered to it. Derived key is dropped.
+
+void
+zns_kdf_set_limits (zns_kdf_t *self, uint64_t opslimit, size_t memlimit)
+{
+    assert (self);
+    self->opslimit = opslimit < crypto_pwhash_OPSLIMIT_MIN ? crypto_pwhash_OPSLIMIT_MIN : opslimit;
+    self->memlimit = memlimit < crypto_pwhash_MEMLIMIT_MIN ? crypto_pwhash_MEMLIMIT_MIN : memlimit;
+    if (self->opslimit > s_opslimit_max)
+        self->opslimit = s_opslimit_max;
+    if (self->memlimit > s_memlimit_max)
+        self->memlimit = s_memlimit_max;
+    self->derived = false;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of passes of key derivation
+
+uint64_t
+zns_kdf_opslimit (zns_kdf_t *self)
+{
+    assert (self);
+    return self->opslimit;
+}
+
+//  --------------------------------------------------------------------------
+//  Return memory in bytes used by key derivation
+
+size_t
+zns_kdf_memlimit (zns_kdf_t *self)
+{
+    assert (self);
+    return self->memlimit;
+}
+
+//  --------------------------------------------------------------------------
+//  Derive the key from password, return 0 for success, -1 for error, e.g.
+//  if there is not enough memory.
+
+int
+zns_kdf_derive (zns_kdf_t *self, const char *password)
+{
+    assert (self);
+    assert (password);
+    self->derived = crypto_pwhash (
+            self->key, crypto_secretbox_KEYBYTES,
+            password, strlen (password),
+            self->salt, self->opslimit, self->memlimit,
+            crypto_pwhash_ALG_ARGON2ID13) == 0;
+    if (!self->derived) {
+        zsys_error ("Key derivation failed, opslimit=%" PRIu64 " memlimit=%zu", self->opslimit, self->memlimit);
+        sodium_memzero (self->key, crypto_secretbox_KEYBYTES);
+    }
+    return self->derived ? 0 : -1;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the derived key of crypto_secretbox_KEYBYTES kept in locked
+//  memory, NULL if no key was derived yet
+
+const byte *
+zns_kdf_key (zns_kdf_t *self)
+{
+    assert (self);
+    return self->derived ? self->key : NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Return true if both derive the same key from the same password
+
+bool
+zns_kdf_eq (zns_kdf_t *self, zns_kdf_t *other)
+{
+    assert (self);
+    assert (other);
+    return memcmp (self->salt, other->salt, sizeof self->salt) == 0
+        && self->opslimit == other->opslimit
+        && self->memlimit == other->memlimit;
+}
+
+//  Return usecs of one derivation with current limits, -1 for error
+
+static int64_t
+s_measure (zns_kdf_t *self)
+{
+    int64_t start = zclock_usecs ();
+    if (zns_kdf_derive (self, "calibrate") == -1)
+        return -1;
+    self->derived = false;
+    return zclock_usecs () - start;
+}
+
+//  --------------------------------------------------------------------------
+//  Pick number of passes for current memory, so derivation takes about
+//  msecs on this machine, memory is lowered only if a single pass takes
+//  longer. Derived key is dropped. Return msecs the derivation takes.
+
+int64_t
+zns_kdf_calibrate (zns_kdf_t *self, int64_t msecs)
+{
+    assert (self);
+    int64_t target = msecs * 1000;
+    self->opslimit = crypto_pwhash_OPSLIMIT_MIN;
+    int64_t took = s_measure (self);
+    while (took > target && self->memlimit / 2 >= crypto_pwhash_MEMLIMIT_MIN) {
+        self->memlimit /= 2;
+        took = s_measure (self);
+    }
+    //  Time grows with passes linearly, the second guess corrects the first
+    for (int round = 0; round != 2 && took > 0 && took < target; round++) {
+        uint64_t opslimit = self->opslimit * (uint64_t) target / (uint64_t) took;
+        if (opslimit > s_opslimit_max)
+            opslimit = s_opslimit_max;
+        if (opslimit <= self->opslimit)
+            break;
+        self->opslimit = opslimit;
+        took = s_measure (self);
+    }
+    return took < 0 ? -1 : (took + 500) / 1000;
+}
+
+//  --------------------------------------------------------------------------
+//  Store salt and limits in header of store file
+
+void
+zns_kdf_encode (zns_kdf_t *self, zconfig_t *header)
+{
+    assert (self);
+    assert (header);
+    char salt [crypto_pwhash_SALTBYTES * 2 + 1];
+    sodium_bin2hex (salt, sizeof salt, self->salt, sizeof self->salt);
+    zconfig_put (header, "kdf", ZNS_KDF_NAME);
+    zconfig_put (header, "salt", salt);
+    zconfig_putf (header, "opslimit", "%" PRIu64, self->opslimit);
+    zconfig_putf (header, "memlimit", "%zu", self->memlimit);
+}
+
+//  --------------------------------------------------------------------------
+//  Create zns_kdf with salt and limits from header, NULL if header has none
+//  or its limits are over the maximum
+
+zns_kdf_t *
+zns_kdf_decode (zconfig_t *header)
+{
+    assert (header);
+    if (!streq (zconfig_get (header, "kdf", ""), ZNS_KDF_NAME))
+        return NULL;
+    zns_kdf_t *self = zns_kdf_new ();
+    const char *salt = zconfig_get (header, "salt", "");
+    size_t salt_size = 0;
+    if (sodium_hex2bin (self->salt, sizeof self->salt, salt, strlen (salt), NULL, &salt_size, NULL) != 0
+    ||  salt_size != sizeof self->salt) {
+        zsys_error ("Can't decode salt: '%s'", salt);
+        zns_kdf_destroy (&self);
+        return NULL;
+    }
+    uint64_t opslimit = strtoull (zconfig_get (header, "opslimit", "0"), NULL, 10);
+    uint64_t memlimit = strtoull (zconfig_get (header, "memlimit", "0"), NULL, 10);
+    if (opslimit > s_opslimit_max || memlimit > s_memlimit_max) {
+        zsys_error ("Limits of key derivation over maximum, opslimit=%" PRIu64 " memlimit=%" PRIu64,
+                    opslimit, memlimit);
+        zns_kdf_destroy (&self);
+        return NULL;
+    }
+    zns_kdf_set_limits (self, opslimit, (size_t) memlimit);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zns_kdf_test (bool verbose)
+{
+    printf (" * zns_kdf: ");
+
+    //  @selftest
+    //  Cheap limits, tests check the logic, not the strength
+    zns_kdf_t *self = zns_kdf_new ();
+    assert (self);
+    assert (zns_kdf_opslimit (self) == crypto_pwhash_OPSLIMIT_INTERACTIVE);
+    assert (!zns_kdf_key (self));
+    zns_kdf_set_limits (self, 0, 0);
+    assert (zns_kdf_opslimit (self) == crypto_pwhash_OPSLIMIT_MIN);
+    assert (zns_kdf_memlimit (self) == crypto_pwhash_MEMLIMIT_MIN);
+    zns_kdf_set_limits (self, 2, 1024 * 1024);
+    assert (zns_kdf_derive (self, "S3cr3t!") == 0);
+    byte key [crypto_secretbox_KEYBYTES];
+    memcpy (key, zns_kdf_key (self), sizeof key);
+
+    //  The same salt and limits from header give the same key
+    zconfig_t *header = zconfig_new ("header", NULL);
+    zns_kdf_encode (self, header);
+    zns_kdf_t *copy = zns_kdf_decode (header);
+    assert (copy);
+    assert (zns_kdf_eq (self, copy));
+    assert (zns_kdf_derive (copy, "S3cr3t!") == 0);
+    assert (memcmp (zns_kdf_key (copy), key, sizeof key) == 0);
+    assert (zns_kdf_derive (copy, "wr0ng!!") == 0);
+    assert (memcmp (zns_kdf_key (copy), key, sizeof key) != 0);
+    zns_kdf_destroy (&copy);
+    copy = zns_kdf_dup (self);
+    assert (zns_kdf_eq (self, copy));
+    assert (memcmp (zns_kdf_key (copy), key, sizeof key) == 0);
+    zns_kdf_destroy (&copy);
+
+    //  Other salt gives other key
+    zns_kdf_t *other = zns_kdf_new ();
+    zns_kdf_set_limits (other, 2, 1024 * 1024);
+    assert (!zns_kdf_eq (self, other));
+    assert (zns_kdf_derive (other, "S3cr3t!") == 0);
+    assert (memcmp (zns_kdf_key (other), key, sizeof key) != 0);
+    zns_kdf_destroy (&other);
+
+    //  Limits over maximum are refused by decode and lowered by set
+    zconfig_putf (header, "opslimit", "%" PRIu64, (uint64_t) 1000000);
+    assert (!zns_kdf_decode (header));
+    zconfig_putf (header, "opslimit", "%d", 2);
+    zconfig_putf (header, "memlimit", "%" PRIu64, (uint64_t) 1 << 40);
+    assert (!zns_kdf_decode (header));
+    zns_kdf_set_max_limits (2, 2 * 1024 * 1024);
+    zconfig_putf (header, "memlimit", "%d", 4 * 1024 * 1024);
+    assert (!zns_kdf_decode (header));
+    zconfig_putf (header, "memlimit", "%d", 1024 * 1024);
+    copy = zns_kdf_decode (header);
+    assert (copy);
+    zns_kdf_set_limits (copy, 3, 4 * 1024 * 1024);
+    assert (zns_kdf_opslimit (copy) == 2);
+    assert (zns_kdf_memlimit (copy) == 2 * 1024 * 1024);
+    zns_kdf_destroy (&copy);
+    zns_kdf_set_max_limits (64, crypto_pwhash_MEMLIMIT_SENSITIVE);
+
+    zconfig_put (header, "kdf", "scrypt");
+    assert (!zns_kdf_decode (header));
+    zconfig_destroy (&header);
+
+    //  Calibration hits the target within reason
+    zns_kdf_set_limits (self, 1, 1024 * 1024);
+    int64_t took = zns_kdf_calibrate (self, 50);
+    if (verbose)
+        zsys_info ("calibrated opslimit=%" PRIu64 " memlimit=%zu took=%" PRId64 "ms",
+                   zns_kdf_opslimit (self), zns_kdf_memlimit (self), took);
+    assert (took >= 0);
+    assert (!zns_kdf_key (self));
+    zns_kdf_destroy (&self);
+    //  @end
+
+    printf ("OK\n");
+}
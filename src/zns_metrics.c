@@ -0,0 +1,395 @@
+/*  =========================================================================
+    zns_metrics - Counters and latency histograms of zns_srv
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_metrics - Counters and latency histograms of zns_srv
+@discuss
+    Metrics live in fixed array, so registered metric never moves and its
+    updates are single atomic adds without locks. Histogram has buckets of
+    powers of two usecs, bucket i counts samples up to 2^i usecs and the
+    last one all longer.
+
+    The same metrics are reported by STATS command as name and value pairs
+    and in Prometheus text format with histograms in seconds.
+@end
+*/
+
+#include "zns_classes.h"
+
+#include <inttypes.h>
+
+#define ZNS_METRICS_MAX     64
+#define ZNS_METRICS_BUCKETS 26      //  The last but one is 2^24 usecs, ~17s
+
+typedef enum {
+    ZNS_METRICS_COUNTER,
+    ZNS_METRICS_GAUGE,
+    ZNS_METRICS_HISTOGRAM
+} s_type_t;
+
+typedef struct {
+    char *name;                 //  Name with labels
+    char *help;
+    s_type_t type;
+    uint64_t value;             //  Counter, gauge or number of samples
+    uint64_t sum;               //  Sum of samples in usecs
+    uint64_t buckets [ZNS_METRICS_BUCKETS];
+} s_metric_t;
+
+//  Structure of our class
+
+struct _zns_metrics_t {
+    s_metric_t metrics [ZNS_METRICS_MAX];
+    int size;                   //  Number of registered metrics
+};
+
+//  --------------------------------------------------------------------------
+//  Create a new zns_metrics
+
+zns_metrics_t *
+zns_metrics_new (void)
+{
+    zns_metrics_t *self = (zns_metrics_t *) zmalloc (sizeof (zns_metrics_t));
+    assert (self);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the zns_metrics
+
+void
+zns_metrics_destroy (zns_metrics_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zns_metrics_t *self = *self_p;
+        for (int i = 0; i != self->size; i++) {
+            zstr_free (&self->metrics [i].name);
+            zstr_free (&self->metrics [i].help);
+        }
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static int
+s_register (zns_metrics_t *self, const char *name, const char *help, s_type_t type)
+{
+    assert (self);
+    assert (name);
+    if (self->size == ZNS_METRICS_MAX)
+        return -1;
+    s_metric_t *metric = &self->metrics [self->size];
+    metric->name = strdup (name);
+    metric->help = strdup (help ? help : "");
+    metric->type = type;
+    return self->size++;
+}
+
+//  --------------------------------------------------------------------------
+//  Register counter, gauge or histogram of usecs, return its id or -1
+
+int
+zns_metrics_counter (zns_metrics_t *self, const char *name, const char *help)
+{
+    return s_register (self, name, help, ZNS_METRICS_COUNTER);
+}
+
+int
+zns_metrics_gauge (zns_metrics_t *self, const char *name, const char *help)
+{
+    return s_register (self, name, help, ZNS_METRICS_GAUGE);
+}
+
+int
+zns_metrics_histogram (zns_metrics_t *self, const char *name, const char *help)
+{
+    return s_register (self, name, help, ZNS_METRICS_HISTOGRAM);
+}
+
+//  --------------------------------------------------------------------------
+//  Add delta to counter
+
+void
+zns_metrics_add (zns_metrics_t *self, int id, uint64_t delta)
+{
+    assert (self);
+    if (id >= 0 && id < self->size)
+        __atomic_fetch_add (&self->metrics [id].value, delta, __ATOMIC_RELAXED);
+}
+
+//  --------------------------------------------------------------------------
+//  Set value of gauge
+
+void
+zns_metrics_set (zns_metrics_t *self, int id, uint64_t value)
+{
+    assert (self);
+    if (id >= 0 && id < self->size)
+        __atomic_store_n (&self->metrics [id].value, value, __ATOMIC_RELAXED);
+}
+
+//  --------------------------------------------------------------------------
+//  Record usecs in histogram
+
+void
+zns_metrics_observe (zns_metrics_t *self, int id, int64_t usecs)
+{
+    assert (self);
+    if (id < 0 || id >= self->size)
+        return;
+    if (usecs < 0)
+        usecs = 0;
+    int bucket = 0;
+    while (bucket < ZNS_METRICS_BUCKETS - 1 && usecs > ((int64_t) 1 << bucket))
+        bucket++;
+    s_metric_t *metric = &self->metrics [id];
+    __atomic_fetch_add (&metric->buckets [bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&metric->sum, (uint64_t) usecs, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&metric->value, 1, __ATOMIC_RELAXED);
+}
+
+//  --------------------------------------------------------------------------
+//  Return value of counter or gauge, number of samples of histogram
+
+uint64_t
+zns_metrics_value (zns_metrics_t *self, int id)
+{
+    assert (self);
+    if (id < 0 || id >= self->size)
+        return 0;
+    return __atomic_load_n (&self->metrics [id].value, __ATOMIC_RELAXED);
+}
+
+//  --------------------------------------------------------------------------
+//  Return upper bound in usecs of quantile of histogram
+
+int64_t
+zns_metrics_quantile (zns_metrics_t *self, int id, double quantile)
+{
+    assert (self);
+    if (id < 0 || id >= self->size)
+        return 0;
+    s_metric_t *metric = &self->metrics [id];
+    uint64_t counts [ZNS_METRICS_BUCKETS];
+    uint64_t total = 0;
+    for (int i = 0; i != ZNS_METRICS_BUCKETS; i++) {
+        counts [i] = __atomic_load_n (&metric->buckets [i], __ATOMIC_RELAXED);
+        total += counts [i];
+    }
+    if (total == 0)
+        return 0;
+    //  Rank of the sample, the first one is 1
+    uint64_t rank = (uint64_t) (quantile * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i != ZNS_METRICS_BUCKETS; i++) {
+        seen += counts [i];
+        if (seen >= rank)
+            return (int64_t) 1 << i;
+    }
+    return (int64_t) 1 << (ZNS_METRICS_BUCKETS - 1);
+}
+
+//  --------------------------------------------------------------------------
+//  Append name and value frames of all metrics to msg
+
+void
+zns_metrics_stats (zns_metrics_t *self, zmsg_t *msg)
+{
+    assert (self);
+    assert (msg);
+    for (int i = 0; i != self->size; i++) {
+        s_metric_t *metric = &self->metrics [i];
+        if (metric->type != ZNS_METRICS_HISTOGRAM) {
+            zmsg_addstr (msg, metric->name);
+            zmsg_addstrf (msg, "%" PRIu64, zns_metrics_value (self, i));
+            continue;
+        }
+        zmsg_addstrf (msg, "%s_count", metric->name);
+        zmsg_addstrf (msg, "%" PRIu64, zns_metrics_value (self, i));
+        zmsg_addstrf (msg, "%s_sum", metric->name);
+        zmsg_addstrf (msg, "%" PRIu64, __atomic_load_n (&metric->sum, __ATOMIC_RELAXED));
+        zmsg_addstrf (msg, "%s_p50", metric->name);
+        zmsg_addstrf (msg, "%" PRId64, zns_metrics_quantile (self, i, 0.5));
+        zmsg_addstrf (msg, "%s_p99", metric->name);
+        zmsg_addstrf (msg, "%" PRId64, zns_metrics_quantile (self, i, 0.99));
+        zmsg_addstrf (msg, "%s_p999", metric->name);
+        zmsg_addstrf (msg, "%" PRId64, zns_metrics_quantile (self, i, 0.999));
+    }
+}
+
+//  Append formatted text to chunk
+
+static void
+s_textf (zchunk_t *text, const char *format, ...)
+{
+    va_list argptr;
+    va_start (argptr, format);
+    char *string = zsys_vprintf (format, argptr);
+    va_end (argptr);
+    assert (string);
+    zchunk_extend (text, string, strlen (string));
+    zstr_free (&string);
+}
+
+//  Return true if both metrics are of the same family, labels are not part
+//  of the name of family
+
+static bool
+s_same_family (s_metric_t *metric, s_metric_t *other)
+{
+    size_t length = strcspn (metric->name, "{");
+    return strncmp (other->name, metric->name, length) == 0
+        && strcspn (other->name, "{") == length;
+}
+
+//  Append samples of metric to text
+
+static void
+s_samples (zns_metrics_t *self, int id, zchunk_t *text)
+{
+    s_metric_t *metric = &self->metrics [id];
+    if (metric->type != ZNS_METRICS_HISTOGRAM) {
+        s_textf (text, "%s %" PRIu64 "\n", metric->name, zns_metrics_value (self, id));
+        return;
+    }
+    //  Buckets are cumulative in Prometheus
+    uint64_t cumulative = 0;
+    for (int bucket = 0; bucket != ZNS_METRICS_BUCKETS - 1; bucket++) {
+        cumulative += __atomic_load_n (&metric->buckets [bucket], __ATOMIC_RELAXED);
+        s_textf (text, "%s_bucket{le=\"%g\"} %" PRIu64 "\n",
+                 metric->name, (double) ((int64_t) 1 << bucket) / 1000000, cumulative);
+    }
+    cumulative += __atomic_load_n (&metric->buckets [ZNS_METRICS_BUCKETS - 1], __ATOMIC_RELAXED);
+    s_textf (text, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", metric->name, cumulative);
+    s_textf (text, "%s_sum %g\n", metric->name,
+             (double) __atomic_load_n (&metric->sum, __ATOMIC_RELAXED) / 1000000);
+    s_textf (text, "%s_count %" PRIu64 "\n", metric->name, cumulative);
+}
+
+//  --------------------------------------------------------------------------
+//  Return all metrics in Prometheus text format, histograms in seconds.
+//  Samples of one family are grouped under its help even if they were
+//  registered apart. Caller must free it.
+
+char *
+zns_metrics_prometheus (zns_metrics_t *self)
+{
+    assert (self);
+    zchunk_t *text = zchunk_new (NULL, 4096);
+    assert (text);
+    for (int i = 0; i != self->size; i++) {
+        s_metric_t *metric = &self->metrics [i];
+        //  Family is written with its first metric
+        bool first = true;
+        for (int j = 0; j != i && first; j++)
+            if (s_same_family (metric, &self->metrics [j]))
+                first = false;
+        if (!first)
+            continue;
+        size_t length = strcspn (metric->name, "{");
+        s_textf (text, "# HELP %.*s %s\n# TYPE %.*s %s\n",
+                 (int) length, metric->name, metric->help,
+                 (int) length, metric->name,
+                 metric->type == ZNS_METRICS_COUNTER ? "counter"
+               : metric->type == ZNS_METRICS_GAUGE ? "gauge" : "histogram");
+        for (int j = i; j != self->size; j++)
+            if (s_same_family (metric, &self->metrics [j]))
+                s_samples (self, j, text);
+    }
+    char *string = zchunk_strdup (text);
+    zchunk_destroy (&text);
+    return string;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static void *
+s_test_observer (void *args)
+{
+    zns_metrics_t *self = (zns_metrics_t *) args;
+    for (int i = 0; i != 10000; i++) {
+        zns_metrics_add (self, 0, 1);
+        zns_metrics_observe (self, 2, i % 100);
+    }
+    return NULL;
+}
+
+void
+zns_metrics_test (bool verbose)
+{
+    printf (" * zns_metrics: ");
+
+    //  @selftest
+    zns_metrics_t *self = zns_metrics_new ();
+    assert (self);
+    int requests = zns_metrics_counter (self, "zns_requests_total{command=\"GET\"}", "Requests served.");
+    int keys = zns_metrics_gauge (self, "zns_keys", "Keys in store.");
+    int latency = zns_metrics_histogram (self, "zns_request_duration_seconds", "Time of request.");
+    int puts = zns_metrics_counter (self, "zns_requests_total{command=\"PUT\"}", "Requests served.");
+    assert (requests == 0 && keys == 1 && latency == 2 && puts == 3);
+
+    //  Updates from more threads are not lost
+    pthread_t threads [4];
+    for (int i = 0; i != 4; i++)
+        pthread_create (&threads [i], NULL, s_test_observer, self);
+    for (int i = 0; i != 4; i++)
+        pthread_join (threads [i], NULL);
+    assert (zns_metrics_value (self, requests) == 40000);
+    assert (zns_metrics_value (self, latency) == 40000);
+    zns_metrics_set (self, keys, 42);
+    zns_metrics_set (self, keys, 7);
+    assert (zns_metrics_value (self, keys) == 7);
+    zns_metrics_add (self, -1, 1);
+    assert (zns_metrics_value (self, 100) == 0);
+
+    //  Samples 0..99 usecs, half of them up to 64
+    assert (zns_metrics_quantile (self, latency, 0.5) == 64);
+    assert (zns_metrics_quantile (self, latency, 0.99) == 128);
+    assert (zns_metrics_quantile (self, keys + 100, 0.5) == 0);
+
+    zmsg_t *msg = zmsg_new ();
+    zns_metrics_stats (self, msg);
+    assert (zmsg_size (msg) == 2 * 8);
+    char *name = zmsg_popstr (msg);
+    char *value = zmsg_popstr (msg);
+    assert (streq (name, "zns_requests_total{command=\"GET\"}"));
+    assert (streq (value, "40000"));
+    zstr_free (&name);
+    zstr_free (&value);
+    zmsg_destroy (&msg);
+
+    char *text = zns_metrics_prometheus (self);
+    assert (text);
+    if (verbose)
+        printf ("\n%s", text);
+    assert (strstr (text, "# TYPE zns_requests_total counter\n"));
+    assert (strstr (text, "zns_requests_total{command=\"PUT\"} 0\n"));
+    assert (strstr (text, "# TYPE zns_keys gauge\nzns_keys 7\n"));
+    assert (strstr (text, "zns_request_duration_seconds_bucket{le=\"+Inf\"} 40000\n"));
+    assert (strstr (text, "zns_request_duration_seconds_count 40000\n"));
+    //  Help of family is printed once and its samples follow it together,
+    //  though other metrics were registered in between
+    assert (!strstr (strstr (text, "# HELP zns_requests_total") + 1, "# HELP zns_requests_total"));
+    assert (strstr (text, "zns_requests_total{command=\"GET\"} 40000\n"
+                          "zns_requests_total{command=\"PUT\"} 0\n"));
+    zstr_free (&text);
+
+    zns_metrics_destroy (&self);
+    assert (!self);
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,84 @@
+/*  =========================================================================
+    zns_metrics - Counters and latency histograms of zns_srv
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_METRICS_H_INCLUDED
+#define ZNS_METRICS_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _zns_metrics_t zns_metrics_t;
+
+//  @interface
+//  Create a new zns_metrics
+ZNS_EXPORT zns_metrics_t *
+    zns_metrics_new (void);
+
+//  Destroy the zns_metrics
+ZNS_EXPORT void
+    zns_metrics_destroy (zns_metrics_t **self_p);
+
+//  Register counter, gauge or histogram of usecs. Name can carry Prometheus
+//  labels, e.g. zns_requests_total{command="GET"}, metrics of the same name
+//  share help. Return id of the metric, -1 if there are too many. Metrics
+//  must be registered before they are updated from more threads.
+ZNS_EXPORT int
+    zns_metrics_counter (zns_metrics_t *self, const char *name, const char *help);
+
+ZNS_EXPORT int
+    zns_metrics_gauge (zns_metrics_t *self, const char *name, const char *help);
+
+ZNS_EXPORT int
+    zns_metrics_histogram (zns_metrics_t *self, const char *name, const char *help);
+
+//  Add delta to counter, lock free
+ZNS_EXPORT void
+    zns_metrics_add (zns_metrics_t *self, int id, uint64_t delta);
+
+//  Set value of gauge, lock free
+ZNS_EXPORT void
+    zns_metrics_set (zns_metrics_t *self, int id, uint64_t value);
+
+//  Record usecs in histogram, lock free
+ZNS_EXPORT void
+    zns_metrics_observe (zns_metrics_t *self, int id, int64_t usecs);
+
+//  Return value of counter or gauge, number of samples of histogram
+ZNS_EXPORT uint64_t
+    zns_metrics_value (zns_metrics_t *self, int id);
+
+//  Return upper bound in usecs of quantile (0.0 to 1.0) of histogram, 0 if
+//  there are no samples
+ZNS_EXPORT int64_t
+    zns_metrics_quantile (zns_metrics_t *self, int id, double quantile);
+
+//  Append name and value frames of all metrics to msg, histograms as
+//  count, sum, p50, p99 and p999 in usecs
+ZNS_EXPORT void
+    zns_metrics_stats (zns_metrics_t *self, zmsg_t *msg);
+
+//  Return all metrics in Prometheus text format, histograms in seconds.
+//  Samples of one family are grouped under its help even if they were
+//  registered apart. Caller must free it.
+ZNS_EXPORT char *
+    zns_metrics_prometheus (zns_metrics_t *self);
+
+//  Self test of this class
+ZNS_EXPORT void
+    zns_metrics_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,324 @@
+/*  =========================================================================
+    zns_perf - Performance regression checks against budgets
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_perf - Performance regression checks against budgets
+@discuss
+    Runs standard workloads, put and get of many keys, save and load of big
+    store and GET requests to zns_srv one at a time and batched, and checks
+    throughput and peak RSS against budgets. Result may be worse than its
+    budget by tolerance percent, anything more is a regression and fails the
+    run the same way as failed selftest. Budget file looks like
+
+        perf
+            keys = 1000000
+            store_mb = 256
+            requests = 100000
+            batch = 100
+            tolerance = 20
+        budget
+            put = 200000
+            get = 500000
+            save = 50
+            load = 50
+            single = 5000
+            batched = 20000
+            rss = 2097152
+
+    put, get, single and batched are operations per second, save and load
+    MB per second and rss peak RSS in kB. Missing budget is not checked.
+    Budgets depend on the machine, so record them on the build host by
+
+        zns_selftest --perf src/zns_perf.cfg --record src/zns_perf.cfg
+@end
+*/
+
+#include "zns_classes.h"
+
+#define ZNS_PERF_FILE "zns-perf.zenstore"
+
+//  Measured result
+
+typedef struct {
+    const char *name;
+    const char *unit;
+    bool lower;                 //  Lower is better, e.g. memory
+    double value;               //  Negative if not measured
+} s_result_t;
+
+static double
+s_per_second (double count, int64_t usecs)
+{
+    return count * 1000000 / (usecs ? usecs : 1);
+}
+
+//  Put and get keys of 100 bytes
+
+static void
+s_perf_keys (size_t keys, s_result_t *put, s_result_t *get)
+{
+    zns_store_t *store = zns_store_new ();
+    zchunk_t *value = zchunk_new (NULL, 100);
+    zchunk_fill (value, 'x', 100);
+    char name [32];
+    int64_t start = zclock_usecs ();
+    for (size_t i = 0; i != keys; i++) {
+        snprintf (name, sizeof name, "perf-%zu", i);
+        zns_store_put (store, name, value);
+    }
+    put->value = s_per_second (keys, zclock_usecs () - start);
+    zchunk_destroy (&value);
+
+    start = zclock_usecs ();
+    for (size_t i = 0; i != keys; i++) {
+        snprintf (name, sizeof name, "perf-%zu", i);
+        value = zns_store_lookup (store, name, NULL);
+        assert (value);
+        zchunk_destroy (&value);
+    }
+    get->value = s_per_second (keys, zclock_usecs () - start);
+    zns_store_destroy (&store);
+}
+
+//  Save and load store of megabytes in values of 4 kB
+
+static void
+s_perf_persist (size_t megabytes, s_result_t *save, s_result_t *load)
+{
+    byte key [crypto_secretbox_KEYBYTES];
+    randombytes_buf (key, sizeof key);
+    zns_store_t *store = zns_store_new ();
+    zns_store_set_dir (store, "src");
+    zns_store_set_file (store, ZNS_PERF_FILE);
+    zchunk_t *value = zchunk_new (NULL, 4096);
+    zchunk_fill (value, 'x', 4096);
+    for (size_t i = 0; i != megabytes * 256; i++) {
+        char name [32];
+        snprintf (name, sizeof name, "perf-%zu", i);
+        zns_store_put (store, name, value);
+    }
+    zchunk_destroy (&value);
+
+    int64_t start = zclock_usecs ();
+    int r = zns_store_save (store, key);
+    save->value = r == 0 ? s_per_second (megabytes, zclock_usecs () - start) : 0;
+    zns_store_destroy (&store);
+
+    store = zns_store_new ();
+    zns_store_set_dir (store, "src");
+    zns_store_set_file (store, ZNS_PERF_FILE);
+    start = zclock_usecs ();
+    r = zns_store_load (store, key);
+    load->value = r == 0 ? s_per_second (megabytes, zclock_usecs () - start) : 0;
+    zns_store_destroy (&store);
+    zsys_file_delete ("src/" ZNS_PERF_FILE);
+}
+
+//  GET requests to zns_srv, batch of them in flight
+
+static double
+s_perf_requests (const char *endpoint, size_t requests, size_t batch)
+{
+    zsock_t *sock = zsock_new_dealer (endpoint);
+    assert (sock);
+    size_t sent = 0;
+    size_t answered = 0;
+    int64_t start = zclock_usecs ();
+    while (answered < requests) {
+        while (sent < requests && sent - answered < batch) {
+            zstr_sendx (sock, "GET", "KEY", NULL);
+            sent++;
+        }
+        zmsg_t *reply = zmsg_recv (sock);
+        if (!reply)
+            break;              //  Interrupted
+        zmsg_destroy (&reply);
+        answered++;
+    }
+    double rate = s_per_second (answered, zclock_usecs () - start);
+    zsock_destroy (&sock);
+    return rate;
+}
+
+//  Run workloads of config, compare with its budgets and write results as
+//  budgets to record, results are printed if report. Return 0 or -1 for
+//  regression or error.
+
+static int
+s_perf_run (zconfig_t *config, const char *record, bool report, bool verbose)
+{
+    size_t keys = (size_t) atol (zconfig_get (config, "perf/keys", "1000000"));
+    size_t megabytes = (size_t) atol (zconfig_get (config, "perf/store_mb", "256"));
+    size_t requests = (size_t) atol (zconfig_get (config, "perf/requests", "100000"));
+    size_t batch = (size_t) atol (zconfig_get (config, "perf/batch", "100"));
+    double tolerance = atof (zconfig_get (config, "perf/tolerance", "20"));
+    if (batch == 0)
+        batch = 1;
+
+    s_result_t results [] = {
+        {"put", "ops/s", false, -1},
+        {"get", "ops/s", false, -1},
+        {"save", "MB/s", false, -1},
+        {"load", "MB/s", false, -1},
+        {"single", "req/s", false, -1},
+        {"batched", "req/s", false, -1},
+        {"rss", "kB", true, -1}
+    };
+    size_t count = sizeof (results) / sizeof (results [0]);
+
+    s_perf_keys (keys, &results [0], &results [1]);
+    s_perf_persist (megabytes, &results [2], &results [3]);
+
+    zns_store_t *store = zns_store_new ();
+    zchunk_t *value = zchunk_new (NULL, 100);
+    zchunk_fill (value, 'x', 100);
+    zns_store_put (store, "KEY", value);
+    zchunk_destroy (&value);
+    zactor_t *zns_srv = zactor_new (zns_srv_actor, store);
+    zstr_sendx (zns_srv, "BIND", "inproc://zns-perf", NULL);
+    int bound = zsock_wait (zns_srv);
+    if (bound != 0) {
+        zsys_error ("Can't bind to 'inproc://zns-perf'");
+        zactor_destroy (&zns_srv);
+        zns_store_destroy (&store);
+        return -1;
+    }
+    results [4].value = s_perf_requests ("inproc://zns-perf", requests, 1);
+    results [5].value = s_perf_requests ("inproc://zns-perf", requests, batch);
+    zactor_destroy (&zns_srv);
+    zns_store_destroy (&store);
+    results [6].value = (double) zns_perf_rss_peak ();
+
+    int rc = 0;
+    for (size_t i = 0; i != count; i++) {
+        s_result_t *result = &results [i];
+        char path [32];
+        snprintf (path, sizeof path, "budget/%s", result->name);
+        const char *budget_str = zconfig_get (config, path, NULL);
+        const char *verdict = "not checked";
+        if (budget_str && result->value >= 0) {
+            double budget = atof (budget_str);
+            bool regression = result->lower
+                ? result->value > budget * (100 + tolerance) / 100
+                : result->value < budget * (100 - tolerance) / 100;
+            verdict = regression ? "REGRESSION" : "OK";
+            if (regression)
+                rc = -1;
+        }
+        if (report)
+            printf ("  %-8s %14.0f %-6s budget %-12s %s\n",
+                    result->name, result->value, result->unit,
+                    budget_str ? budget_str : "-", verdict);
+        if (record && result->value >= 0)
+            zconfig_putf (config, path, "%.0f", result->value);
+    }
+    if (record && zconfig_save (config, record) == -1) {
+        zsys_error ("Can't write budgets to '%s'", record);
+        rc = -1;
+    }
+    if (verbose)
+        zsys_debug ("keys=%zu store_mb=%zu requests=%zu batch=%zu tolerance=%.0f%%",
+                    keys, megabytes, requests, batch, tolerance);
+    return rc;
+}
+
+//  --------------------------------------------------------------------------
+//  Run standard workloads and compare results with budgets
+
+int
+zns_perf_run (const char *budget, const char *record, bool verbose)
+{
+    assert (budget);
+    zconfig_t *config = zconfig_load (budget);
+    if (!config) {
+        zsys_error ("Can't load budgets from '%s'", budget);
+        return -1;
+    }
+    printf ("Running zenstore performance checks against '%s'...\n", budget);
+    int rc = s_perf_run (config, record, true, verbose);
+    zconfig_destroy (&config);
+    printf (rc == 0 ? "Performance OK\n" : "Performance regression\n");
+    return rc;
+}
+
+//  --------------------------------------------------------------------------
+//  Return peak RSS of the process in kB since start or last rss_reset, -1 if
+//  unknown
+
+int64_t
+zns_perf_rss_peak (void)
+{
+    int64_t peak = -1;
+    FILE *status = fopen ("/proc/self/status", "r");
+    if (!status)
+        return -1;
+    char line [256];
+    while (fgets (line, sizeof line, status))
+        if (strncmp (line, "VmHWM:", 6) == 0) {
+            peak = strtoll (line + 6, NULL, 10);
+            break;
+        }
+    fclose (status);
+    return peak;
+}
+
+//  --------------------------------------------------------------------------
+//  Start measuring peak RSS again, on Linux 4.0 and newer
+
+void
+zns_perf_rss_reset (void)
+{
+    FILE *clear_refs = fopen ("/proc/self/clear_refs", "w");
+    if (clear_refs) {
+        fputs ("5", clear_refs);
+        fclose (clear_refs);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zns_perf_test (bool verbose)
+{
+    printf (" * zns_perf: ");
+
+    //  @selftest
+    //  Small workloads without budgets pass and record budgets
+    zconfig_t *config = zconfig_new ("root", NULL);
+    zconfig_put (config, "perf/keys", "1000");
+    zconfig_put (config, "perf/store_mb", "1");
+    zconfig_put (config, "perf/requests", "200");
+    zconfig_put (config, "perf/batch", "10");
+    assert (s_perf_run (config, "src/zns-perf-test.cfg", verbose, verbose) == 0);
+    zconfig_destroy (&config);
+
+    //  Recorded budgets are met again within tolerance of whole 100%, then
+    //  impossible budget is a regression
+    config = zconfig_load ("src/zns-perf-test.cfg");
+    assert (config);
+    assert (atof (zconfig_get (config, "budget/put", "0")) > 0);
+    zconfig_put (config, "perf/tolerance", "100");
+    assert (s_perf_run (config, NULL, verbose, verbose) == 0);
+    zconfig_put (config, "budget/get", "1000000000000000");
+    assert (s_perf_run (config, NULL, verbose, verbose) == -1);
+    zconfig_destroy (&config);
+    zsys_file_delete ("src/zns-perf-test.cfg");
+
+    //  Peak RSS is known where /proc is
+    int64_t peak = zns_perf_rss_peak ();
+    assert (peak == -1 || peak > 0);
+    zns_perf_rss_reset ();
+    //  @end
+
+    printf ("OK\n");
+}
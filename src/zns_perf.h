@@ -0,0 +1,45 @@
+/*  =========================================================================
+    zns_perf - Performance regression checks against budgets
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_PERF_H_INCLUDED
+#define ZNS_PERF_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Run standard workloads with sizes from budget file and compare results
+//  with its budgets, results are written to record file if not NULL, e.g.
+//  to make new baseline. Return 0 if all results are within tolerance, -1
+//  for regression or error.
+ZNS_EXPORT int
+    zns_perf_run (const char *budget, const char *record, bool verbose);
+
+//  Return peak RSS of the process in kB since start or last rss_reset, -1 if
+//  unknown
+ZNS_EXPORT int64_t
+    zns_perf_rss_peak (void);
+
+//  Start measuring peak RSS again, on Linux 4.0 and newer
+ZNS_EXPORT void
+    zns_perf_rss_reset (void);
+
+//  Self test of this class
+ZNS_EXPORT void
+    zns_perf_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -28,9 +28,20 @@ typedef struct {
 static test_item_t
 all_tests [] = {
     { "zns_nonce", zns_nonce_test },
+    { "zns_wheel", zns_wheel_test },
+    { "zns_cipher", zns_cipher_test },
+    { "zns_metrics", zns_metrics_test },
+    { "zns_trace", zns_trace_test },
+    { "zns_handover", zns_handover_test },
+    { "zns_io", zns_io_test },
 #ifdef ZNS_BUILD_DRAFT_API
+    { "zns_kdf", zns_kdf_test },
     { "zns_store", zns_store_test },
     { "zns_srv", zns_srv_test },
+    { "zns_client", zns_client_test },
+    { "zns_host", zns_host_test },
+    { "zns_perf", zns_perf_test },
+    { "zns_dump", zns_dump_test },
 #endif // ZNS_BUILD_DRAFT_API
     {0, 0}          //  Sentinel
 };
@@ -71,6 +82,8 @@ main (int argc, char **argv)
 {
     bool verbose = false;
     test_item_t *test = 0;
+    const char *perf = NULL;
+    const char *record = NULL;
     int argn;
     for (argn = 1; argn < argc; argn++) {
         if (streq (argv [argn], "--help")
@@ -81,6 +94,8 @@ main (int argc, char **argv)
             puts ("  --list / -l            list all tests");
             puts ("  --test / -t [name]     run only test 'name'");
             puts ("  --continue / -c        continue on exception (on Windows)");
+            puts ("  --perf / -p [budget]   run performance checks against budget file");
+            puts ("  --record / -r [file]   write results of --perf as new budgets");
             return 0;
         }
         if (streq (argv [argn], "--verbose")
@@ -89,7 +104,7 @@ main (int argc, char **argv)
         else
         if (streq (argv [argn], "--number")
         ||  streq (argv [argn], "-n")) {
-            puts ("3");
+            puts ("14");
             return 0;
         }
         else
@@ -97,8 +112,19 @@ main (int argc, char **argv)
         ||  streq (argv [argn], "-l")) {
             puts ("Available tests:");
             puts ("    zns_nonce");
+            puts ("    zns_wheel");
+            puts ("    zns_cipher");
+            puts ("    zns_metrics");
+            puts ("    zns_trace");
+            puts ("    zns_handover");
+            puts ("    zns_io");
+            puts ("    zns_kdf");
             puts ("    zns_store");
             puts ("    zns_srv");
+            puts ("    zns_client");
+            puts ("    zns_host");
+            puts ("    zns_perf");
+            puts ("    zns_dump");
             return 0;
         }
         else
@@ -123,11 +149,43 @@ main (int argc, char **argv)
             _set_abort_behavior (0, _WRITE_ABORT_MSG);
 #endif
         }
+        else
+        if (streq (argv [argn], "--perf")
+        ||  streq (argv [argn], "-p")) {
+            argn++;
+            if (argn >= argc) {
+                fprintf (stderr, "--perf needs an argument\n");
+                return 1;
+            }
+            perf = argv [argn];
+        }
+        else
+        if (streq (argv [argn], "--record")
+        ||  streq (argv [argn], "-r")) {
+            argn++;
+            if (argn >= argc) {
+                fprintf (stderr, "--record needs an argument\n");
+                return 1;
+            }
+            record = argv [argn];
+        }
         else {
             printf ("Unknown option: %s\n", argv [argn]);
             return 1;
         }
     }
+    if (perf) {
+#ifdef ZNS_BUILD_DRAFT_API
+        return zns_perf_run (perf, record, verbose) == 0? 0: 1;
+#else
+        fprintf (stderr, "--perf needs draft API\n");
+        return 1;
+#endif
+    }
+    if (record) {
+        fprintf (stderr, "--record needs --perf\n");
+        return 1;
+    }
     if (test) {
         printf ("Running zenstore test '%s'...\n", test->testname);
         test->test (verbose);
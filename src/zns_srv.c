@@ -20,6 +20,25 @@
 #include "zns_classes.h"
 
 #include <libgen.h>
+#include <inttypes.h>
+
+#define ZNS_SRV_BATCH           256     //  Max messages read in one turn
+#define ZNS_SRV_CLIENT_IDLE     10000   //  Forget idle client after msec
+#define ZNS_SRV_MAX_VALUE       (64 * 1024 * 1024)  //  Default max STREAM value
+#define ZNS_SRV_UPLOAD_IDLE     30000   //  Default drop idle STREAM after msec
+#define ZNS_SRV_HEARTBEAT       1000    //  Replication heartbeat in msec
+#define ZNS_SRV_REPL_TIMEOUT    5000    //  Replication peer is gone after msec
+#define ZNS_SRV_REKEY_BATCH     1024    //  Data keys rewrapped between requests
+#define ZNS_SRV_LOAD_BATCH      1024    //  Values loaded between requests
+#define ZNS_SRV_TRACES          1024    //  Sampled traces kept for TRACE DUMP
+#define ZNS_SRV_VERIFY_BATCH    (256 * 1024)        //  Bytes verified between requests
+#define ZNS_SRV_VERIFY_RATE     (8 * 1024 * 1024)   //  Bytes per second read by verify
+
+//  Commands of rw socket counted by metrics, others are counted as other
+static const char *s_commands [] = {
+    "GET", "PUT", "DELETE", "FETCH", "STREAM", "CAS", "INCR", "APPEND", "STATS", "other"
+};
+#define ZNS_SRV_COMMANDS (sizeof (s_commands) / sizeof (s_commands [0]))
 
 //  Structure of our actor
 
@@ -31,9 +50,328 @@ struct _zns_srv_t {
     //  Declare properties
     zsock_t *rw_socket;         //  Read write socket
     zns_store_t *store;         //  encrypted store
-    byte password[crypto_secretbox_KEYBYTES];   //password
+    bool shared_store;          //  Store is owned and used by application
+    byte *password;             //  Key of store, derived by kdf, locked memory
+    char *passphrase;           //  Password the key is derived from, locked memory
+    zns_kdf_t *kdf;             //  Derivation of key, NULL for legacy raw key
+    uint64_t kdf_opslimit;      //  Limits of new derivations, 0 default
+    byte *file_key;             //  Key of last load or save of file, locked memory
+    zns_kdf_t *file_kdf;        //  Its derivation, NULL for raw key
+    bool file_keyed;            //  Is file_key known?
+    size_t kdf_memlimit;
+    zhashx_t *uploads;          //  Streamed values being received, routing_id/key : s_upload_t
+    size_t max_value;           //  Max size of streamed value
+    int64_t upload_idle;        //  Drop upload idle for msecs
+    zsock_t *pub_socket;        //  Change notifications
+    int sndhwm;                 //  High water marks of rw socket, 0 default
+    int rcvhwm;
+    double rate;                //  Requests per second per client, 0 unlimited
+    double burst;               //  Size of client's token bucket
+    size_t max_queue;           //  Max queued requests per client, 0 unlimited
+    zhashx_t *clients;          //  Known clients, routing_id : s_client_t
+    zlistx_t *ready;            //  Clients with queued requests, in turns
+    int64_t swept;              //  Last time idle clients were forgotten
+    zsock_t *repl_socket;       //  Replication, ROUTER on primary, DEALER on follower
+    bool following;             //  Read only replica of other zns_srv?
+    zhashx_t *followers;        //  Primary: routing_id : s_follower_t
+    uint64_t repl_seq;          //  Last change sent (primary) or applied (follower)
+    uint64_t primary_seq;       //  Follower: last change known to primary
+    bool syncing;               //  Follower: waiting for snapshot
+    int64_t sync_sent;          //  Follower: time of last SYNC
+    int64_t heard;              //  Follower: time of last message from primary
+    int64_t synced;             //  Follower: last time it was up to date
+    int64_t hugz_at;            //  Time of next heartbeat
+    bool rekeying;              //  Rewrapping data keys by new password?
+    zlistx_t *bound;            //  Endpoints of BIND, PUBLISH, REPLICATE, METRICS
+    bool handing_over;          //  Handing store over when requests are done?
+    bool handed_over;           //  Store is served by new process, not saved
+    size_t loading;             //  Values of store still being loaded
+    int64_t load_started;       //  Time START began loading, usecs
+    bool verifying;             //  Verifying store file between requests?
+    bool verify_reply;          //  Reply VERIFY when done, scrub does not
+    size_t verify_rate;         //  Bytes of file read per second
+    int64_t verify_started;     //  Time verify began, usecs
+    int64_t verify_at;          //  Time of next step of verify, usecs
+    uint64_t verify_read;       //  Bytes read since verify began
+    int64_t scrub_interval;     //  Verify every msecs, 0 never
+    size_t scrub_rate;          //  Bytes per second read by scrub
+    int64_t scrub_at;           //  Time of next scrub, msecs
+    char *path;                 //  Path of store file set by STORE, or NULL
+    bool unloaded;              //  Store file is there but failed to load
+    zactor_t *backup;           //  Writing BACKUP in its own thread, or NULL
+    struct _s_backup_t *backup_job; //  Its arguments, owned by us
+    zactor_t *saver;            //  Saving store after REKEY, or NULL
+    struct _s_backup_t *save_job;   //  Its arguments, owned by us
+    zactor_t *deriver;          //  Deriving REKEY or CALIBRATE key, or NULL
+    struct _s_derive_t *derive; //  Its arguments, owned by us
+    zns_metrics_t *metrics;     //  Counters and histograms, ids follow
+    int m_requests [ZNS_SRV_COMMANDS];
+    int m_request_time;
+    int m_refused;
+    int m_save_time;
+    int m_save_failures;
+    int m_load_time;
+    int m_snapshots;
+    int m_keys;
+    int m_ready;
+    int m_loading;
+    int m_unreadable;
+    int m_followers;
+    int m_repl_seq;
+    int m_verifications;
+    int m_corrupted;
+    int m_backup_time;
+    int m_backup_failures;
+    zsock_t *metrics_socket;    //  Prometheus text over STREAM socket
+    zns_trace_t *trace;         //  Sampled traces and slow operation log
 };
 
+//  Client of the rw socket, for admission control and fair scheduling
+
+typedef struct {
+    zlistx_t *queue;            //  Admitted requests
+    void *ready_handle;         //  Handle in ready list or NULL
+    zlistx_t *ready;            //  The ready list
+    double tokens;              //  Token bucket
+    int64_t refilled;           //  Time of last refill
+} s_client_t;
+
+static s_client_t *
+s_client_new (double tokens, zlistx_t *ready)
+{
+    s_client_t *self = (s_client_t *) zmalloc (sizeof (s_client_t));
+    assert (self);
+    self->queue = zlistx_new ();
+    assert (self->queue);
+    zlistx_set_destructor (self->queue, (zlistx_destructor_fn *) zmsg_destroy);
+    self->ready = ready;
+    self->tokens = tokens;
+    self->refilled = zclock_mono ();
+    return self;
+}
+
+static void
+s_client_destroy (void **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_client_t *self = (s_client_t *) *self_p;
+        if (self->ready_handle)
+            zlistx_delete (self->ready, self->ready_handle);
+        zlistx_destroy (&self->queue);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Follower connected to replication socket of primary
+
+typedef struct {
+    zframe_t *routing_id;
+    uint64_t applied;           //  Last change follower confirmed
+    int64_t seen;               //  Time of last message from follower
+} s_follower_t;
+
+static s_follower_t *
+s_follower_new (zframe_t *routing_id)
+{
+    s_follower_t *self = (s_follower_t *) zmalloc (sizeof (s_follower_t));
+    assert (self);
+    self->routing_id = zframe_dup (routing_id);
+    self->seen = zclock_mono ();
+    return self;
+}
+
+static void
+s_follower_destroy (void **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_follower_t *self = (s_follower_t *) *self_p;
+        zframe_destroy (&self->routing_id);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Value streamed by client, dropped when client stops sending chunks
+
+typedef struct {
+    zchunk_t *value;            //  Chunks received so far
+    int64_t touched;            //  Time of last chunk
+} s_upload_t;
+
+static void
+s_upload_destructor (void **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_upload_t *self = (s_upload_t *) *self_p;
+        sodium_memzero (zchunk_data (self->value), zchunk_max_size (self->value));
+        zchunk_destroy (&self->value);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Endpoint bound by the actor, HANDOVER unbinds it for new process and
+//  RESUME binds it again
+
+typedef struct {
+    zsock_t *socket;
+    char *endpoint;             //  Resolved, e.g. tcp://0.0.0.0:5670
+} s_bound_t;
+
+static void
+s_bound_destroy (void **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_bound_t *self = (s_bound_t *) *self_p;
+        zstr_free (&self->endpoint);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Parse unsigned decimal number from string, return 0 on success, -1 otherwise
+
+static int
+s_str2u64 (const char *str, uint64_t *value_p)
+{
+    assert (value_p);
+    if (!str || !*str)
+        return -1;
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull (str, &end, 10);
+    if (errno != 0 || *end != '\0' || str [0] == '-')
+        return -1;
+    *value_p = (uint64_t) value;
+    return 0;
+}
+
+//  Pop optional ttl=<msec> frame, return 0 on success or if frame is
+//  missing, -1 if it is invalid
+
+static int
+s_popttl (zmsg_t *msg, int64_t *ttl_p)
+{
+    *ttl_p = 0;
+    char *str = zmsg_popstr (msg);
+    if (!str)
+        return 0;
+    uint64_t ttl;
+    int r = strncmp (str, "ttl=", 4) == 0 ? s_str2u64 (str + 4, &ttl) : -1;
+    if (r == 0 && ttl > INT64_MAX)
+        r = -1;
+    if (r == 0)
+        *ttl_p = (int64_t) ttl;
+    zstr_free (&str);
+    return r;
+}
+
+//  Phases of save and load are spans of traced operation
+
+static void
+s_zns_srv_phase (const char *phase, int64_t usecs, void *arg)
+{
+    zns_trace_add ((zns_trace_t *) arg, phase, usecs);
+}
+
+//  Backup is written by its own actor, so requests are served meanwhile and
+//  wait only while the store is packed. It has its own copy of the key and
+//  its derivation, so REKEY meanwhile changes neither the backup nor the
+//  store file. The store file saved after REKEY is written the same way.
+//  Reply is bytes written, -1 for error, and usecs taken.
+
+typedef struct _s_backup_t {
+    zns_store_t *store;
+    byte *key;                  //  Copy of key, REKEY may change it meanwhile
+    zns_kdf_t *kdf;             //  Copy of its derivation, NULL for raw key
+    char *path;
+} s_backup_t;
+
+static void
+s_zns_srv_backup_actor (zsock_t *pipe, void *args)
+{
+    s_backup_t *backup = (s_backup_t *) args;
+    zsock_signal (pipe, 0);
+    int64_t start = zclock_usecs ();
+    int64_t bytes = zns_store_backup (backup->store, backup->key, backup->kdf, backup->path);
+    zstr_sendf (pipe, "%" PRId64 " %" PRId64, bytes, zclock_usecs () - start);
+
+    //  Wait for zactor_destroy
+    char *command = zstr_recv (pipe);
+    zstr_free (&command);
+}
+
+//  Argon2 takes up to seconds by design, so keys of REKEY and CALIBRATE are
+//  derived by their own actor and requests are served meanwhile. Reply is
+//  result of derive or msecs taken by calibrate, -1 for error, and msecs.
+
+typedef struct _s_derive_t {
+    zns_kdf_t *kdf;
+    char *passphrase;           //  New password of REKEY, NULL for CALIBRATE
+    int64_t msecs;              //  Target of CALIBRATE
+} s_derive_t;
+
+static void
+s_zns_srv_derive_actor (zsock_t *pipe, void *args)
+{
+    s_derive_t *derive = (s_derive_t *) args;
+    zsock_signal (pipe, 0);
+    int64_t start = zclock_mono ();
+    int64_t r = derive->passphrase
+              ? zns_kdf_derive (derive->kdf, derive->passphrase)
+              : zns_kdf_calibrate (derive->kdf, derive->msecs);
+    zstr_sendf (pipe, "%" PRId64 " %" PRId64, r, zclock_mono () - start);
+
+    //  Wait for zactor_destroy
+    char *command = zstr_recv (pipe);
+    zstr_free (&command);
+}
+
+//  Remember key and its kdf as the key of store file after load or save
+
+static void
+s_zns_srv_file_keyed (zns_srv_t *self, const byte *key, zns_kdf_t *kdf)
+{
+    memcpy (self->file_key, key, crypto_secretbox_KEYBYTES);
+    zns_kdf_destroy (&self->file_kdf);
+    self->file_kdf = kdf ? zns_kdf_dup (kdf) : NULL;
+    self->file_keyed = true;
+}
+
+//  Create job of backup actor writing store to path by current key, takes
+//  ownership of path
+
+static s_backup_t *
+s_zns_srv_backup_new (zns_srv_t *self, char *path)
+{
+    s_backup_t *backup = (s_backup_t *) zmalloc (sizeof (s_backup_t));
+    assert (backup);
+    backup->store = self->store;
+    backup->key = (byte *) sodium_malloc (crypto_secretbox_KEYBYTES);
+    assert (backup->key);
+    memcpy (backup->key, self->password, crypto_secretbox_KEYBYTES);
+    backup->kdf = self->kdf ? zns_kdf_dup (self->kdf) : NULL;
+    backup->path = path;
+    return backup;
+}
+
+static void
+s_zns_srv_backup_destroy (s_backup_t **backup_p)
+{
+    s_backup_t *backup = *backup_p;
+    if (backup) {
+        sodium_free (backup->key);
+        zns_kdf_destroy (&backup->kdf);
+        zstr_free (&backup->path);
+        free (backup);
+        *backup_p = NULL;
+    }
+}
 
 //  --------------------------------------------------------------------------
 //  Create a new zns_srv instance
@@ -50,8 +388,73 @@ zns_srv_new (zsock_t *pipe, void *args)
 
     // Initialize properties
     self->rw_socket = NULL;
-    self->store = zns_store_new ();
+    self->pub_socket = NULL;
+    //  Application can pass its own store and keep using it directly
+    self->shared_store = args != NULL;
+    self->store = self->shared_store ? (zns_store_t *) args : zns_store_new ();
+    self->password = (byte *) sodium_malloc (crypto_secretbox_KEYBYTES);
+    assert (self->password);
     sodium_memzero (self->password, crypto_secretbox_KEYBYTES);
+    self->passphrase = NULL;
+    self->kdf = NULL;
+    self->file_key = (byte *) sodium_malloc (crypto_secretbox_KEYBYTES);
+    assert (self->file_key);
+    self->uploads = zhashx_new ();
+    zhashx_set_destructor (self->uploads, s_upload_destructor);
+    self->max_value = ZNS_SRV_MAX_VALUE;
+    self->upload_idle = ZNS_SRV_UPLOAD_IDLE;
+    self->ready = zlistx_new ();
+    self->clients = zhashx_new ();
+    zhashx_set_destructor (self->clients, s_client_destroy);
+    self->swept = zclock_mono ();
+    self->repl_socket = NULL;
+    self->followers = zhashx_new ();
+    zhashx_set_destructor (self->followers, s_follower_destroy);
+    self->bound = zlistx_new ();
+    zlistx_set_destructor (self->bound, s_bound_destroy);
+    self->metrics = zns_metrics_new ();
+    for (size_t i = 0; i != ZNS_SRV_COMMANDS; i++) {
+        char name [64];
+        snprintf (name, sizeof name, "zns_requests_total{command=\"%s\"}", s_commands [i]);
+        self->m_requests [i] = zns_metrics_counter (self->metrics, name, "Requests handled by command.");
+    }
+    self->m_request_time = zns_metrics_histogram (self->metrics,
+        "zns_request_duration_seconds", "Time of handling of request.");
+    self->m_refused = zns_metrics_counter (self->metrics,
+        "zns_refused_total", "Requests refused by BUSY over rate or queue limits.");
+    self->m_save_time = zns_metrics_histogram (self->metrics,
+        "zns_save_duration_seconds", "Time of saving of store file.");
+    self->m_save_failures = zns_metrics_counter (self->metrics,
+        "zns_save_failures_total", "Saves of store file which failed.");
+    self->m_load_time = zns_metrics_histogram (self->metrics,
+        "zns_load_duration_seconds", "Time of loading of store file or snapshot.");
+    self->m_snapshots = zns_metrics_counter (self->metrics,
+        "zns_snapshots_total", "Snapshots sent to followers.");
+    self->m_keys = zns_metrics_gauge (self->metrics,
+        "zns_keys", "Keys in store.");
+    self->m_ready = zns_metrics_gauge (self->metrics,
+        "zns_ready", "1 when store is loaded, 0 while values are loaded in background.");
+    self->m_loading = zns_metrics_gauge (self->metrics,
+        "zns_loading_keys", "Keys of store waiting to be loaded.");
+    self->m_unreadable = zns_metrics_gauge (self->metrics,
+        "zns_unreadable_values", "Values which failed to open on load, store is not saved meanwhile.");
+    self->m_followers = zns_metrics_gauge (self->metrics,
+        "zns_followers", "Followers connected to primary.");
+    self->m_repl_seq = zns_metrics_gauge (self->metrics,
+        "zns_replication_sequence", "Last change sent by primary or applied by follower.");
+    self->m_verifications = zns_metrics_counter (self->metrics,
+        "zns_verifications_total", "Verifications of store file by VERIFY or SCRUB.");
+    self->m_corrupted = zns_metrics_counter (self->metrics,
+        "zns_corrupted_ranges_total", "Corrupted ranges of store file found by verification.");
+    self->m_backup_time = zns_metrics_histogram (self->metrics,
+        "zns_backup_duration_seconds", "Time of writing of BACKUP.");
+    self->m_backup_failures = zns_metrics_counter (self->metrics,
+        "zns_backup_failures_total", "BACKUPs which failed.");
+    self->trace = zns_trace_new (ZNS_SRV_TRACES);
+    //  Application may save shared store from other thread, so only phases
+    //  of own store are traced
+    if (!self->shared_store)
+        zns_store_set_phase_fn (self->store, s_zns_srv_phase, self->trace);
 
     return self;
 }
@@ -68,162 +471,1993 @@ zns_srv_destroy (zns_srv_t **self_p)
         zns_srv_t *self = *self_p;
 
         // Free actor properties
+        zlistx_destroy (&self->bound);
         zsock_destroy (&self->rw_socket);
-        zns_store_destroy (&self->store);
-        sodium_memzero (self->password, crypto_secretbox_KEYBYTES);
+        if (self->verifying)
+            zns_store_verify_end (self->store);
+        //  Backup and save use the store until they are done
+        zactor_destroy (&self->backup);
+        s_zns_srv_backup_destroy (&self->backup_job);
+        zactor_destroy (&self->saver);
+        s_zns_srv_backup_destroy (&self->save_job);
+        zstr_free (&self->path);
+        zactor_destroy (&self->deriver);
+        if (self->derive) {
+            zns_kdf_destroy (&self->derive->kdf);
+            sodium_free (self->derive->passphrase);
+            free (self->derive);
+        }
+        zsock_destroy (&self->pub_socket);
+        if (!self->shared_store)
+            zns_store_destroy (&self->store);
+        else
+            zns_store_set_kdf (self->store, NULL);
+        sodium_free (self->password);
+        sodium_free (self->passphrase);
+        zns_kdf_destroy (&self->kdf);
+        sodium_free (self->file_key);
+        zns_kdf_destroy (&self->file_kdf);
+        zhashx_destroy (&self->uploads);
+        zhashx_destroy (&self->clients);
+        zlistx_destroy (&self->ready);
+        zsock_destroy (&self->repl_socket);
+        zhashx_destroy (&self->followers);
+        zsock_destroy (&self->metrics_socket);
+        zns_metrics_destroy (&self->metrics);
+        zns_trace_destroy (&self->trace);
+
+        //  Free object itself
+        zpoller_destroy (&self->poller);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Keep the password for key derivation, until then the key is the password
+//  itself, as in store files of older versions
+
+void
+zns_srv_set_password (zns_srv_t *self, const char *password)
+{
+    assert (self);
+    size_t n = strlen (password) < crypto_secretbox_KEYBYTES ? strlen (password) : crypto_secretbox_KEYBYTES;
+    sodium_memzero (self->password, crypto_secretbox_KEYBYTES);
+    memcpy (self->password, password, n);
+    sodium_free (self->passphrase);
+    self->passphrase = (char *) sodium_malloc (strlen (password) + 1);
+    assert (self->passphrase);
+    strcpy (self->passphrase, password);
+    zns_kdf_destroy (&self->kdf);
+    zns_store_set_kdf (self->store, NULL);
+}
+
+//  Use the key derived by kdf for the store, takes ownership of kdf
+
+static void
+s_zns_srv_set_kdf (zns_srv_t *self, zns_kdf_t **kdf_p)
+{
+    zns_kdf_t *kdf = *kdf_p;
+    *kdf_p = NULL;
+    memcpy (self->password, zns_kdf_key (kdf), crypto_secretbox_KEYBYTES);
+    //  Store may be saved by other thread, it lets go of the old one first
+    zns_store_set_kdf (self->store, kdf);
+    zns_kdf_destroy (&self->kdf);
+    self->kdf = kdf;
+}
+
+//  Derive the key by kdf and use it for the store, takes ownership of kdf.
+//  Return 0 for success, -1 if the key can't be derived.
+
+static int
+s_zns_srv_use_kdf (zns_srv_t *self, zns_kdf_t **kdf_p)
+{
+    zns_kdf_t *kdf = *kdf_p;
+    *kdf_p = NULL;
+    int64_t start = zclock_mono ();
+    if (!self->passphrase || zns_kdf_derive (kdf, self->passphrase) == -1) {
+        zsys_error ("Can't derive key of store from password");
+        zns_kdf_destroy (&kdf);
+        return -1;
+    }
+    if (self->verbose)
+        zsys_debug ("Key derived in %" PRId64 " msecs, opslimit=%" PRIu64 " memlimit=%zu",
+                    zclock_mono () - start, zns_kdf_opslimit (kdf), zns_kdf_memlimit (kdf));
+    s_zns_srv_set_kdf (self, &kdf);
+    return 0;
+}
+
+//  Create derivation with new salt and limits set by KDF command
+
+static zns_kdf_t *
+s_zns_srv_new_kdf (zns_srv_t *self)
+{
+    zns_kdf_t *kdf = zns_kdf_new ();
+    assert (kdf);
+    if (self->kdf_opslimit || self->kdf_memlimit)
+        zns_kdf_set_limits (kdf,
+            self->kdf_opslimit ? self->kdf_opslimit : zns_kdf_opslimit (kdf),
+            self->kdf_memlimit ? self->kdf_memlimit : zns_kdf_memlimit (kdf));
+    return kdf;
+}
+
+//  Start deriving by its own actor, takes ownership of passphrase, which is
+//  NULL to calibrate
+
+static void
+s_zns_srv_derive_begin (zns_srv_t *self, char *passphrase, int64_t msecs)
+{
+    assert (!self->deriver);
+    s_derive_t *derive = (s_derive_t *) zmalloc (sizeof (s_derive_t));
+    assert (derive);
+    derive->kdf = s_zns_srv_new_kdf (self);
+    derive->passphrase = passphrase;
+    derive->msecs = msecs;
+    self->derive = derive;
+    self->deriver = zactor_new (s_zns_srv_derive_actor, derive);
+    assert (self->deriver);
+    zpoller_add (self->poller, self->deriver);
+}
+
+//  Use key derived by its actor. REKEY starts rewrapping of data keys by it,
+//  CALIBRATE replies with limits and msecs taken, -1 for error.
+
+static void
+s_zns_srv_recv_derive (zns_srv_t *self)
+{
+    char *result = zstr_recv (self->deriver);
+    int64_t r = -1, msecs = 0;
+    if (!result || sscanf (result, "%" SCNd64 " %" SCNd64, &r, &msecs) != 2)
+        r = -1;
+    zstr_free (&result);
+    zpoller_remove (self->poller, self->deriver);
+    zactor_destroy (&self->deriver);
+    s_derive_t *derive = self->derive;
+    self->derive = NULL;
+
+    if (derive->passphrase) {
+        if (r == -1)
+            zsys_error ("Can't derive new key of store, REKEY failed");
+        else {
+            if (self->verbose)
+                zsys_debug ("Key derived in %" PRId64 " msecs, opslimit=%" PRIu64 " memlimit=%zu",
+                            msecs, zns_kdf_opslimit (derive->kdf), zns_kdf_memlimit (derive->kdf));
+            sodium_free (self->passphrase);
+            self->passphrase = derive->passphrase;
+            derive->passphrase = NULL;
+            s_zns_srv_set_kdf (self, &derive->kdf);
+            zns_store_rekey (self->store, self->password);
+            self->rekeying = true;
+        }
+    }
+    else {
+        if (r >= 0) {
+            self->kdf_opslimit = zns_kdf_opslimit (derive->kdf);
+            self->kdf_memlimit = zns_kdf_memlimit (derive->kdf);
+        }
+        zmsg_t *reply = zmsg_new ();
+        zmsg_addstr (reply, "CALIBRATE");
+        zmsg_addstrf (reply, "%" PRIu64, self->kdf_opslimit);
+        zmsg_addstrf (reply, "%zu", self->kdf_memlimit);
+        zmsg_addstrf (reply, "%" PRId64, r);
+        zmsg_send (&reply, self->pipe);
+    }
+    zns_kdf_destroy (&derive->kdf);
+    sodium_free (derive->passphrase);
+    free (derive);
+}
+
+//  Report store saved by its actor after REKEY, the file has its key then
+
+static void
+s_zns_srv_recv_save (zns_srv_t *self)
+{
+    char *result = zstr_recv (self->saver);
+    int64_t bytes = -1, usecs = 0;
+    if (!result || sscanf (result, "%" SCNd64 " %" SCNd64, &bytes, &usecs) != 2)
+        bytes = -1;
+    zstr_free (&result);
+    zpoller_remove (self->poller, self->saver);
+    zactor_destroy (&self->saver);
+
+    if (bytes == -1) {
+        zns_metrics_add (self->metrics, self->m_save_failures, 1);
+        zsys_error ("Can't save store with new password");
+    }
+    else {
+        zns_metrics_observe (self->metrics, self->m_save_time, usecs);
+        s_zns_srv_file_keyed (self, self->save_job->key, self->save_job->kdf);
+        if (self->verbose)
+            zsys_info ("Store rekeyed");
+    }
+    s_zns_srv_backup_destroy (&self->save_job);
+}
+
+//  Start this actor. Return a value greater or equal to zero if initialization
+//  was successful. Otherwise -1.
+
+static int
+zns_srv_start (zns_srv_t *self)
+{
+    assert (self);
+    //  Header of the file tells how the key is derived, the key of older
+    //  file is the password itself and it gets new salt on next save
+    zns_kdf_t *kdf = zns_store_read_kdf (self->store);
+    if (kdf)
+        s_zns_srv_use_kdf (self, &kdf);
+    //  Only the index is read at once, values are loaded in batches between
+    //  requests or on demand when their key is asked for
+    self->load_started = zclock_usecs ();
+    zns_trace_begin (self->trace, "LOAD", NULL);
+    self->unloaded = false;
+    if (zns_store_load_begin (self->store, self->password) == 0) {
+        self->loading = zns_store_load_step (self->store, 0);
+        s_zns_srv_file_keyed (self, self->password, self->kdf);
+    }
+    else {
+        self->load_started = 0;
+        //  Empty store must not replace file which e.g. other password opens
+        if (self->path && zsys_file_exists (self->path)) {
+            zsys_error ("Can't load '%s', it won't be saved over", self->path);
+            self->unloaded = true;
+        }
+    }
+    zns_trace_end (self->trace);
+    if (self->load_started && !self->loading)
+        zns_metrics_observe (self->metrics, self->m_load_time, zclock_usecs () - self->load_started);
+    if (!self->kdf) {
+        kdf = s_zns_srv_new_kdf (self);
+        s_zns_srv_use_kdf (self, &kdf);
+    }
+    return 0;
+}
+
+
+//  Save the store, time of save is recorded in metrics
+
+static int
+s_zns_srv_save (zns_srv_t *self)
+{
+    if (self->unloaded) {
+        zns_metrics_add (self->metrics, self->m_save_failures, 1);
+        zsys_error ("Store file '%s' failed to load, not saved over", self->path);
+        return -1;
+    }
+    int64_t start = zclock_usecs ();
+    zns_trace_begin (self->trace, "SAVE", NULL);
+    int r = zns_store_save (self->store, self->password);
+    zns_trace_end (self->trace);
+    if (r == 0) {
+        zns_metrics_observe (self->metrics, self->m_save_time, zclock_usecs () - start);
+        s_zns_srv_file_keyed (self, self->password, self->kdf);
+    }
+    else
+        zns_metrics_add (self->metrics, self->m_save_failures, 1);
+    return r;
+}
+
+//  Stop this actor. Return a value greater or equal to zero if stopping 
+//  was successful. Otherwise -1.
+
+static int
+zns_srv_stop (zns_srv_t *self)
+{
+    assert (self);
+
+    int r = s_zns_srv_save (self);
+    if (r == -1)
+        zsys_error ("Failed to open crypto store");
+    if (self->verbose)
+        zsys_debug ("\tzns_store_save -> %d", r);
+
+    return r;
+}
+
+
+//  Update gauges of metrics, they are read on demand
+
+static void
+s_zns_srv_gauges (zns_srv_t *self)
+{
+    zns_metrics_set (self->metrics, self->m_keys, zns_store_size (self->store));
+    zns_metrics_set (self->metrics, self->m_ready, self->loading == 0);
+    zns_metrics_set (self->metrics, self->m_loading, self->loading);
+    zns_metrics_set (self->metrics, self->m_unreadable, zns_store_unreadable (self->store));
+    zns_metrics_set (self->metrics, self->m_followers, zhashx_size (self->followers));
+    zns_metrics_set (self->metrics, self->m_repl_seq, self->repl_seq);
+}
+
+//  Return STATS reply with all metrics
+
+static zmsg_t *
+s_zns_srv_stats (zns_srv_t *self)
+{
+    s_zns_srv_gauges (self);
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, "STATS");
+    zns_metrics_stats (self->metrics, reply);
+    return reply;
+}
+
+//  Answer request of Prometheus, or any HTTP client, by metrics in text
+//  format and close the connection
+
+static void
+s_zns_srv_recv_metrics (zns_srv_t *self)
+{
+    zmsg_t *msg = zmsg_recv (self->metrics_socket);
+    if (!msg)
+        return;
+    zframe_t *routing_id = zmsg_pop (msg);
+    zframe_t *request = zmsg_pop (msg);
+    //  Empty frame tells peer has connected or disconnected
+    if (routing_id && request && zframe_size (request) > 0) {
+        s_zns_srv_gauges (self);
+        char *text = zns_metrics_prometheus (self->metrics);
+        zmsg_t *response = zmsg_new ();
+        zmsg_addmem (response, zframe_data (routing_id), zframe_size (routing_id));
+        zmsg_addstrf (response,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n%s", strlen (text), text);
+        zmsg_send (&response, self->metrics_socket);
+        zstr_free (&text);
+        //  Empty message closes the connection
+        zmsg_t *close = zmsg_new ();
+        zmsg_append (close, &routing_id);
+        zmsg_addmem (close, NULL, 0);
+        zmsg_send (&close, self->metrics_socket);
+    }
+    zframe_destroy (&routing_id);
+    zframe_destroy (&request);
+    zmsg_destroy (&msg);
+}
+
+//  Bind socket to endpoint and remember it for HANDOVER, return 0 for
+//  success, -1 for error
+
+static int
+s_zns_srv_bind (zns_srv_t *self, zsock_t *socket, const char *endpoint)
+{
+    if (!endpoint || zsock_bind (socket, "%s", endpoint) == -1)
+        return -1;
+    s_bound_t *bound = (s_bound_t *) zmalloc (sizeof (s_bound_t));
+    assert (bound);
+    bound->socket = socket;
+    bound->endpoint = zsock_last_endpoint (socket);
+    if (!bound->endpoint)
+        bound->endpoint = strdup (endpoint);
+    zlistx_add_end (self->bound, bound);
+    return 0;
+}
+
+//  Unbind or bind again all bound endpoints
+
+static void
+s_zns_srv_rebind (zns_srv_t *self, bool bind)
+{
+    for (s_bound_t *bound = (s_bound_t *) zlistx_first (self->bound);
+                    bound != NULL;
+                    bound = (s_bound_t *) zlistx_next (self->bound)) {
+        int r = bind
+            ? zsock_bind (bound->socket, "%s", bound->endpoint)
+            : zsock_unbind (bound->socket, "%s", bound->endpoint);
+        if (r == -1)
+            zsys_error ("Can't %s '%s': %s", bind ? "bind to" : "unbind from",
+                        bound->endpoint, zmq_strerror (zmq_errno ()));
+    }
+}
+
+//  Take over store from memory file of zenstore handing it over, instead
+//  of START. Return 0 for success, -1 for error.
+
+static int
+s_zns_srv_takeover (zns_srv_t *self, int fd)
+{
+    //  Key is derived the same way as by the other process
+    zns_kdf_t *kdf = zns_store_handover_kdf (fd);
+    if (kdf && s_zns_srv_use_kdf (self, &kdf) == -1)
+        return -1;
+    int64_t start = zclock_usecs ();
+    zns_trace_begin (self->trace, "TAKEOVER", NULL);
+    int r = zns_store_takeover (self->store, fd, self->password);
+    zns_trace_end (self->trace);
+    if (r == -1) {
+        zsys_error ("Can't take over store, is the password the same?");
+        return -1;
+    }
+    zns_metrics_observe (self->metrics, self->m_load_time, zclock_usecs () - start);
+    self->unloaded = false;
+    if (!self->kdf) {
+        kdf = s_zns_srv_new_kdf (self);
+        s_zns_srv_use_kdf (self, &kdf);
+    }
+    return 0;
+}
+
+//  Ask primary for snapshot, changes are ignored until it arrives
+
+static void
+s_zns_srv_sync (zns_srv_t *self)
+{
+    if (self->verbose)
+        zsys_debug ("Requesting snapshot from primary");
+    zstr_send (self->repl_socket, "SYNC");
+    self->syncing = true;
+    self->sync_sent = zclock_mono ();
+}
+
+//  Report corrupted range of store file found by verify
+
+static void
+s_zns_srv_corrupt (uint64_t offset, uint64_t size, const char *what, void *arg)
+{
+    zns_srv_t *self = (zns_srv_t *) arg;
+    zns_metrics_add (self->metrics, self->m_corrupted, 1);
+    zsys_error ("Store file corrupted at %" PRIu64 ", %" PRIu64 " bytes: %s", offset, size, what);
+}
+
+//  Return key the store file is written with, which is not the current one
+//  e.g. after REKEY until the file is saved, NULL if it is not known. KDF in
+//  header of the file tells which one it is.
+
+static const byte *
+s_zns_srv_file_key (zns_srv_t *self)
+{
+    zns_kdf_t *kdf = zns_store_read_kdf (self->store);
+    const byte *key = NULL;
+    if (kdf ? self->kdf && zns_kdf_eq (kdf, self->kdf) : !self->kdf)
+        key = self->password;
+    else
+    if (self->file_keyed
+    &&  (kdf ? self->file_kdf && zns_kdf_eq (kdf, self->file_kdf) : !self->file_kdf))
+        key = self->file_key;
+    zns_kdf_destroy (&kdf);
+    return key;
+}
+
+//  Start verifying the store file at rate bytes per second, reply VERIFY
+//  when done if asked to. Scrub in progress starts again, VERIFY in
+//  progress makes the new one fail.
+
+static void
+s_zns_srv_verify_begin (zns_srv_t *self, size_t rate, bool reply)
+{
+    if (self->verifying && self->verify_reply) {
+        zsys_error ("VERIFY is already running");
+        if (reply)
+            zstr_sendx (self->pipe, "VERIFY", "-1", NULL);
+        return;
+    }
+    if (self->verifying)
+        zns_store_verify_end (self->store);
+    const byte *key = s_zns_srv_file_key (self);
+    if (!key)
+        zsys_error ("Key of store file is not known, it can't be verified");
+    self->verifying = key && zns_store_verify_begin (self->store, (byte *) key, s_zns_srv_corrupt, self) == 0;
+    self->verify_reply = reply;
+    self->verify_rate = rate;
+    self->verify_started = zclock_usecs ();
+    self->verify_at = self->verify_started;
+    self->verify_read = 0;
+    if (!self->verifying && reply)
+        zstr_sendx (self->pipe, "VERIFY", "-1", NULL);
+}
+
+//  Here we handle incoming message from the node
+
+static void
+zns_srv_recv_api (zns_srv_t *self)
+{
+    //  Get the whole message of the pipe in one go
+    zmsg_t *request = zmsg_recv (self->pipe);
+    if (!request)
+       return;        //  Interrupted
+
+    char *command = zmsg_popstr (request);
+    if (self->verbose)
+        zsys_debug ("API command=%s", command);
+
+    if (streq (command, "START"))
+        zns_srv_start (self);
+    else
+    if (streq (command, "STOP"))
+        zns_srv_stop (self);
+    else
+    if (streq (command, "TAKEOVER")) {
+        char *fd = zmsg_popstr (request);
+        int r = fd ? s_zns_srv_takeover (self, atoi (fd)) : -1;
+        zstr_sendx (self->pipe, "TAKEOVER", r == 0 ? "0" : "-1", NULL);
+        zstr_free (&fd);
+    }
+    else
+    if (streq (command, "HANDOVER")) {
+        //  Endpoints are unbound at once, the store is written out when
+        //  requests received until now are handled
+        s_zns_srv_rebind (self, false);
+        self->handing_over = true;
+    }
+    else
+    if (streq (command, "RESUME")) {
+        //  New process failed to take over
+        if (self->handed_over)
+            s_zns_srv_rebind (self, true);
+        self->handed_over = false;
+    }
+    else
+    if (streq (command, "VERBOSE"))
+        self->verbose = true;
+    else
+    if (streq (command, "$TERM")) {
+        //  The $TERM command is send by zactor_destroy() method, shared
+        //  store is saved by application
+        //  REKEY being derived is applied first, so the file gets the new
+        //  password, and save of previous REKEY is not left behind
+        if (self->deriver)
+            s_zns_srv_recv_derive (self);
+        if (self->saver)
+            s_zns_srv_recv_save (self);
+        if (!self->shared_store && !self->handed_over)
+            zns_srv_stop (self);
+        self->terminated = true;
+    }
+    else
+    if (streq (command, "BIND")) {
+        //  One socket serves all endpoints, e.g. tcp:// for remote and
+        //  ipc:// or inproc:// for local clients
+        char *endpoint = zmsg_popstr (request);
+        int r = -1;
+        if (self->rw_socket && zsock_type (self->rw_socket) != ZMQ_ROUTER)
+            zsys_error ("Backend of zns_host can't bind to '%s'", endpoint);
+        else {
+            if (!self->rw_socket) {
+                self->rw_socket = zsock_new (ZMQ_ROUTER);
+                assert (self->rw_socket);
+                if (self->sndhwm)
+                    zsock_set_sndhwm (self->rw_socket, self->sndhwm);
+                if (self->rcvhwm)
+                    zsock_set_rcvhwm (self->rw_socket, self->rcvhwm);
+                zpoller_add (self->poller, self->rw_socket);
+            }
+            r = s_zns_srv_bind (self, self->rw_socket, endpoint);
+            if (r == -1)
+                zsys_error ("Can't bind to '%s': %s", endpoint, zmq_strerror (zmq_errno ()));
+        }
+        zsock_signal (self->pipe, r == 0 ? 0 : 1);
+        zstr_free (&endpoint);
+    }
+    else
+    if (streq (command, "BACKEND")) {
+        //  Serve clients of zns_host, which sends requests with routing id
+        //  of client, the same as rw socket does
+        char *endpoint = zmsg_popstr (request);
+        char *name = zmsg_popstr (request);
+        if (self->rw_socket || !endpoint || !name)
+            zsys_error ("Can't be backend of '%s' as '%s'", endpoint, name);
+        else {
+            self->rw_socket = zsock_new (ZMQ_DEALER);
+            assert (self->rw_socket);
+            zsock_set_identity (self->rw_socket, name);
+            if (self->sndhwm)
+                zsock_set_sndhwm (self->rw_socket, self->sndhwm);
+            if (self->rcvhwm)
+                zsock_set_rcvhwm (self->rw_socket, self->rcvhwm);
+            if (zsock_connect (self->rw_socket, "%s", endpoint) == -1)
+                zsys_error ("Can't connect to '%s': %s", endpoint, zmq_strerror (zmq_errno ()));
+            zpoller_add (self->poller, self->rw_socket);
+            zstr_send (self->rw_socket, "READY");
+        }
+        zstr_free (&name);
+        zstr_free (&endpoint);
+    }
+    else
+    if (streq (command, "HWM")) {
+        //  Applies to rw socket bound afterwards
+        char *sndhwm = zmsg_popstr (request);
+        char *rcvhwm = zmsg_popstr (request);
+        self->sndhwm = sndhwm ? atoi (sndhwm) : 0;
+        self->rcvhwm = rcvhwm ? atoi (rcvhwm) : self->sndhwm;
+        zstr_free (&sndhwm);
+        zstr_free (&rcvhwm);
+    }
+    else
+    if (streq (command, "RATELIMIT")) {
+        char *rate = zmsg_popstr (request);
+        char *burst = zmsg_popstr (request);
+        self->rate = rate ? atof (rate) : 0;
+        self->burst = burst ? atof (burst) : self->rate;
+        if (self->burst < 1)
+            self->burst = 1;
+        zstr_free (&rate);
+        zstr_free (&burst);
+    }
+    else
+    if (streq (command, "QUEUE")) {
+        char *max_queue = zmsg_popstr (request);
+        self->max_queue = max_queue ? (size_t) atol (max_queue) : 0;
+        zstr_free (&max_queue);
+    }
+    else
+    if (streq (command, "UPLOAD")) {
+        char *max_value = zmsg_popstr (request);
+        char *idle = zmsg_popstr (request);
+        uint64_t bytes, msecs;
+        if (s_str2u64 (max_value, &bytes) == 0 && bytes <= SIZE_MAX)
+            self->max_value = (size_t) bytes;
+        if (s_str2u64 (idle, &msecs) == 0 && msecs > 0 && msecs <= INT64_MAX)
+            self->upload_idle = (int64_t) msecs;
+        zstr_free (&max_value);
+        zstr_free (&idle);
+    }
+    else
+    if (streq (command, "PUBLISH")) {
+        char *endpoint = zmsg_popstr (request);
+        if (!self->pub_socket) {
+            self->pub_socket = zsock_new (ZMQ_PUB);
+            assert (self->pub_socket);
+        }
+        if (s_zns_srv_bind (self, self->pub_socket, endpoint) == -1)
+            zsys_error ("Can't bind publish socket to '%s': %s", endpoint, zmq_strerror (zmq_errno ()));
+        zstr_free (&endpoint);
+    }
+    else
+    if (streq (command, "STORE")) {
+        char *str = zmsg_popstr (request);
+        if (!str)
+            zsys_error ("Missing STORE path");
+        else {
+            zstr_free (&self->path);
+            self->path = strdup (str);
+            char *path = strdup (str);
+            zns_store_set_dir (self->store, dirname (path));
+            zstr_free (&path);
+
+            path = strdup (str);
+            zns_store_set_file (self->store, basename (path));
+            zstr_free (&path);
+            zstr_free (&str);
+        }
+    }
+    else
+    if (streq (command, "CIPHER")) {
+        char *cipher = zmsg_popstr (request);
+        zns_store_set_cipher (self->store, cipher);
+        zstr_free (&cipher);
+    }
+    else
+    if (streq (command, "REPLICATE")) {
+        char *endpoint = zmsg_popstr (request);
+        if (self->following)
+            zsys_error ("Follower can't replicate to '%s'", endpoint);
+        else {
+            if (!self->repl_socket) {
+                self->repl_socket = zsock_new (ZMQ_ROUTER);
+                assert (self->repl_socket);
+                zpoller_add (self->poller, self->repl_socket);
+            }
+            if (s_zns_srv_bind (self, self->repl_socket, endpoint) == -1)
+                zsys_error ("Can't bind replication socket to '%s': %s", endpoint, zmq_strerror (zmq_errno ()));
+        }
+        zstr_free (&endpoint);
+    }
+    else
+    if (streq (command, "FOLLOW")) {
+        char *endpoint = zmsg_popstr (request);
+        if (self->repl_socket)
+            zsys_error ("Already replicating, can't follow '%s'", endpoint);
+        else {
+            self->repl_socket = zsock_new (ZMQ_DEALER);
+            assert (self->repl_socket);
+            if (zsock_connect (self->repl_socket, "%s", endpoint) == -1)
+                zsys_error ("Can't connect to primary '%s': %s", endpoint, zmq_strerror (zmq_errno ()));
+            zpoller_add (self->poller, self->repl_socket);
+            self->following = true;
+            self->synced = zclock_mono ();
+            s_zns_srv_sync (self);
+        }
+        zstr_free (&endpoint);
+    }
+    else
+    if (streq (command, "STATS")) {
+        zmsg_t *reply = s_zns_srv_stats (self);
+        zmsg_send (&reply, self->pipe);
+    }
+    else
+    if (streq (command, "TRACE")) {
+        //  TRACE SAMPLE n, TRACE SLOW usecs or TRACE DUMP
+        char *what = zmsg_popstr (request);
+        char *arg = zmsg_popstr (request);
+        uint64_t value = 0;
+        if (what && streq (what, "DUMP")) {
+            zmsg_t *reply = zmsg_new ();
+            zmsg_addstr (reply, "TRACE");
+            zns_trace_dump (self->trace, reply);
+            zmsg_send (&reply, self->pipe);
+        }
+        else
+        if (what && streq (what, "SAMPLE") && s_str2u64 (arg, &value) == 0 && value <= UINT_MAX)
+            zns_trace_set_sample (self->trace, (unsigned) value);
+        else
+        if (what && streq (what, "SLOW") && s_str2u64 (arg, &value) == 0 && value <= INT64_MAX)
+            zns_trace_set_slow (self->trace, (int64_t) value);
+        else
+            zsys_error ("Invalid TRACE %s %s", what, arg);
+        zstr_free (&what);
+        zstr_free (&arg);
+    }
+    else
+    if (streq (command, "METRICS")) {
+        char *endpoint = zmsg_popstr (request);
+        if (!self->metrics_socket) {
+            self->metrics_socket = zsock_new (ZMQ_STREAM);
+            assert (self->metrics_socket);
+            zpoller_add (self->poller, self->metrics_socket);
+        }
+        if (s_zns_srv_bind (self, self->metrics_socket, endpoint) == -1)
+            zsys_error ("Can't bind metrics socket to '%s': %s", endpoint, zmq_strerror (zmq_errno ()));
+        zstr_free (&endpoint);
+    }
+    else
+    if (streq (command, "LAG")) {
+        //  Number of changes follower is behind and msecs since it was
+        //  last up to date, primary is never behind
+        uint64_t changes = 0;
+        int64_t msecs = 0;
+        if (self->following) {
+            if (self->primary_seq > self->repl_seq)
+                changes = self->primary_seq - self->repl_seq;
+            if (self->syncing || changes)
+                msecs = zclock_mono () - self->synced;
+        }
+        zmsg_t *reply = zmsg_new ();
+        zmsg_addstr (reply, "LAG");
+        zmsg_addstrf (reply, "%" PRIu64, changes);
+        zmsg_addstrf (reply, "%" PRId64, msecs);
+        zmsg_send (&reply, self->pipe);
+    }
+    else
+    if (streq (command, "PASSWORD")) {
+        char *passwd = zmsg_popstr (request);
+        zns_srv_set_password (self, passwd);
+        zstr_free (&passwd);
+    }
+    else
+    if (streq (command, "REKEY")) {
+        //  New key gets new salt and is derived by its own actor, then data
+        //  keys are rewrapped in batches between requests
+        char *passwd = zmsg_popstr (request);
+        if (passwd && self->deriver)
+            zsys_error ("REKEY or CALIBRATE is already running");
+        else
+        if (passwd) {
+            char *passphrase = (char *) sodium_malloc (strlen (passwd) + 1);
+            assert (passphrase);
+            strcpy (passphrase, passwd);
+            s_zns_srv_derive_begin (self, passphrase, 0);
+        }
+        if (passwd)
+            sodium_memzero (passwd, strlen (passwd));
+        zstr_free (&passwd);
+    }
+    else
+    if (streq (command, "VERIFY")) {
+        //  File is read in steps between requests at rate, reply comes
+        //  when all is done
+        char *rate = zmsg_popstr (request);
+        uint64_t bytes;
+        if (s_str2u64 (rate, &bytes) == -1 || bytes == 0)
+            bytes = ZNS_SRV_VERIFY_RATE;
+        s_zns_srv_verify_begin (self, (size_t) bytes, true);
+        zstr_free (&rate);
+    }
+    else
+    if (streq (command, "SCRUB")) {
+        char *msecs = zmsg_popstr (request);
+        char *rate = zmsg_popstr (request);
+        uint64_t interval, bytes;
+        if (s_str2u64 (msecs, &interval) == -1 || interval > INT64_MAX)
+            zsys_error ("Invalid SCRUB interval");
+        else {
+            if (s_str2u64 (rate, &bytes) == -1 || bytes == 0)
+                bytes = ZNS_SRV_VERIFY_RATE;
+            self->scrub_interval = (int64_t) interval;
+            self->scrub_rate = (size_t) bytes;
+            self->scrub_at = zclock_mono () + self->scrub_interval;
+        }
+        zstr_free (&msecs);
+        zstr_free (&rate);
+    }
+    else
+    if (streq (command, "BACKUP")) {
+        //  Reply comes when the backup is written
+        char *path = zmsg_popstr (request);
+        if (!path || self->backup) {
+            zsys_error (path ? "BACKUP is already running" : "Missing BACKUP path");
+            zstr_sendx (self->pipe, "BACKUP", "-1", "0", NULL);
+            zstr_free (&path);
+        }
+        else {
+            self->backup_job = s_zns_srv_backup_new (self, path);
+            self->backup = zactor_new (s_zns_srv_backup_actor, self->backup_job);
+            assert (self->backup);
+            zpoller_add (self->poller, self->backup);
+        }
+    }
+    else
+    if (streq (command, "KDF")) {
+        char *opslimit = zmsg_popstr (request);
+        char *memlimit = zmsg_popstr (request);
+        uint64_t ops, mem;
+        if (s_str2u64 (opslimit, &ops) == -1 || s_str2u64 (memlimit, &mem) == -1)
+            zsys_error ("Invalid KDF limits");
+        else {
+            self->kdf_opslimit = ops;
+            self->kdf_memlimit = (size_t) mem;
+        }
+        zstr_free (&opslimit);
+        zstr_free (&memlimit);
+    }
+    else
+    if (streq (command, "CALIBRATE")) {
+        //  Limits taking about msecs on this machine are used for new keys,
+        //  reply comes when its actor is done
+        char *msecs_str = zmsg_popstr (request);
+        uint64_t msecs;
+        if (s_str2u64 (msecs_str, &msecs) == -1 || msecs > INT64_MAX)
+            msecs = 1000;
+        if (self->deriver) {
+            zsys_error ("REKEY or CALIBRATE is already running");
+            zmsg_t *reply = zmsg_new ();
+            zmsg_addstr (reply, "CALIBRATE");
+            zmsg_addstrf (reply, "%" PRIu64, self->kdf_opslimit);
+            zmsg_addstrf (reply, "%zu", self->kdf_memlimit);
+            zmsg_addstr (reply, "-1");
+            zmsg_send (&reply, self->pipe);
+        }
+        else
+            s_zns_srv_derive_begin (self, NULL, (int64_t) msecs);
+        zstr_free (&msecs_str);
+    }
+    else {
+        zsys_error ("invalid API command '%s'", command);
+        assert (false);
+    }
+    zstr_free (&command);
+    zmsg_destroy (&request);
+}
+
+//  Get value of key with its version. Store shared with application threads
+//  can change under our hands, so value is copied, otherwise borrowed. Call
+//  s_zns_srv_release when done.
+
+static zchunk_t *
+s_zns_srv_lookup (zns_srv_t *self, const char *key, uint64_t *version_p)
+{
+    if (self->shared_store)
+        return zns_store_lookup (self->store, key, version_p);
+    *version_p = zns_store_version (self->store, key);
+    return (zchunk_t *) zns_store_get (self->store, key);
+}
+
+static void
+s_zns_srv_release (zns_srv_t *self, zchunk_t **value_p)
+{
+    if (self->shared_store)
+        zchunk_destroy (value_p);
+    *value_p = NULL;
+}
+
+//  Publish change of key, subscribers filter on key prefix
+
+static void
+s_zns_srv_publish (zns_srv_t *self, const char *key, const char *op, uint64_t version)
+{
+    if (!self->pub_socket)
+        return;
+    zmsg_t *event = zmsg_new ();
+    zmsg_addstr (event, key);
+    zmsg_addstr (event, op);
+    zmsg_addstrf (event, "%" PRIu64, version);
+    zmsg_send (&event, self->pub_socket);
+}
+
+//  Send change to all followers. Change is sealed by the store password, so
+//  the replication stream is as safe as the store file. Sequence number is
+//  sealed with the change, so old change can't be replayed under new one.
+
+static void
+s_zns_srv_replicate (zns_srv_t *self, const char *key, const char *op, uint64_t version, zchunk_t *value)
+{
+    if (!self->repl_socket || self->following)
+        return;
+
+    self->repl_seq++;
+    zmsg_t *change = zmsg_new ();
+    zmsg_addstrf (change, "%" PRIu64, self->repl_seq);
+    zmsg_addstr (change, op);
+    zmsg_addstr (change, key);
+    zmsg_addstrf (change, "%" PRIu64, version);
+    zmsg_addstrf (change, "%" PRId64, value ? zns_store_expires (self->store, key) : 0);
+    if (value)
+        zmsg_addmem (change, zchunk_data (value), zchunk_size (value));
+    byte *buffer;
+    size_t buffer_size = zmsg_encode (change, &buffer);
+    zmsg_destroy (&change);
+    assert (buffer);
+
+    byte nonce [crypto_secretbox_NONCEBYTES];
+    randombytes_buf (nonce, sizeof (nonce));
+    size_t sealed_size = crypto_secretbox_MACBYTES + buffer_size;
+    byte *sealed = (byte *) zmalloc (sealed_size);
+    assert (sealed);
+    crypto_secretbox_easy (sealed, buffer, buffer_size, nonce, self->password);
+    sodium_memzero (buffer, buffer_size);
+    free (buffer);
+
+    for (s_follower_t *follower = (s_follower_t *) zhashx_first (self->followers);
+                       follower != NULL;
+                       follower = (s_follower_t *) zhashx_next (self->followers)) {
+        zmsg_t *log = zmsg_new ();
+        zframe_t *routing_id = zframe_dup (follower->routing_id);
+        zmsg_append (log, &routing_id);
+        zmsg_addstr (log, "LOG");
+        zmsg_addstrf (log, "%" PRIu64, self->repl_seq);
+        zmsg_addmem (log, nonce, sizeof (nonce));
+        zmsg_addmem (log, sealed, sealed_size);
+        zmsg_send (&log, self->repl_socket);
+    }
+    free (sealed);
+}
+
+//  Announce change of key to subscribers and followers
+
+static void
+s_zns_srv_changed (zns_srv_t *self, const char *key, const char *op, uint64_t version, zchunk_t *value)
+{
+    s_zns_srv_publish (self, key, op, version);
+    s_zns_srv_replicate (self, key, op, version, value);
+}
+
+//  Send FETCH reply with a slice of value starting at offset. Missing key is
+//  signalled by reply without total, version and data frames.
+
+static void
+s_zns_srv_fetch (zns_srv_t *self, zframe_t **routing_id_p, const char *key, zmsg_t *msg)
+{
+    char *offset_str = zmsg_popstr (msg);
+    char *size_str = zmsg_popstr (msg);
+    char *known_str = zmsg_popstr (msg);
+    uint64_t offset, size, known = 0;
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_append (reply, routing_id_p);
+
+    if (s_str2u64 (offset_str, &offset) == -1
+    ||  s_str2u64 (size_str, &size) == -1
+    ||  (known_str && s_str2u64 (known_str, &known) == -1)) {
+        zsys_error ("Invalid FETCH arguments offset=%s, size=%s", offset_str, size_str);
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, "invalid arguments");
+        zmsg_addstr (reply, "FETCH");
+    }
+    else
+    if (known && zns_store_version (self->store, key) == known) {
+        zmsg_addstr (reply, "NOTMODIFIED");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, known_str);
+    }
+    else {
+        uint64_t version;
+        zchunk_t *chunk = s_zns_srv_lookup (self, key, &version);
+        zmsg_addstr (reply, "FETCH");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, offset_str);
+        if (chunk) {
+            uint64_t total = zchunk_size (chunk);
+            if (offset > total)
+                offset = total;
+            if (size > total - offset)
+                size = total - offset;
+            zmsg_addstrf (reply, "%" PRIu64, total);
+            zmsg_addstrf (reply, "%" PRIu64, version);
+            zmsg_addmem (reply, zchunk_data (chunk) + offset, size);
+            s_zns_srv_release (self, &chunk);
+        }
+    }
+    zmsg_send (&reply, self->rw_socket);
+    zstr_free (&known_str);
+    zstr_free (&size_str);
+    zstr_free (&offset_str);
+}
+
+//  Put the value only if key has still the expected version, reply with
+//  the new version or with current version and value on conflict
+
+static void
+s_zns_srv_cas (zns_srv_t *self, zframe_t **routing_id_p, const char *key, zmsg_t *msg)
+{
+    char *expected_str = zmsg_popstr (msg);
+    zframe_t *frame = zmsg_pop (msg);
+    uint64_t expected, version;
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_append (reply, routing_id_p);
+    if (s_str2u64 (expected_str, &expected) == -1) {
+        zsys_error ("Invalid CAS arguments expected=%s", expected_str);
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, "invalid arguments");
+        zmsg_addstr (reply, "CAS");
+    }
+    else {
+        //  Missing value frame deletes the key
+        zchunk_t *chunk = frame ? zchunk_new (zframe_data (frame), zframe_size (frame)) : NULL;
+        zmsg_addstr (reply, "CAS");
+        zmsg_addstr (reply, key);
+        if (zns_store_cas (self->store, key, expected, chunk, &version) == 0) {
+            zmsg_addstr (reply, "OK");
+            zmsg_addstrf (reply, "%" PRIu64, version);
+            if (version)
+                s_zns_srv_changed (self, key, chunk ? "PUT" : "DELETE", version, chunk);
+        }
+        else {
+            zmsg_addstr (reply, "CONFLICT");
+            //  Client can retry without GET round trip
+            zchunk_t *current = s_zns_srv_lookup (self, key, &version);
+            zmsg_addstrf (reply, "%" PRIu64, version);
+            if (current) {
+                zmsg_addmem (reply, zchunk_data (current), zchunk_size (current));
+                s_zns_srv_release (self, &current);
+            }
+        }
+        if (chunk)
+            sodium_memzero (zchunk_data (chunk), zchunk_size (chunk));
+        zchunk_destroy (&chunk);
+    }
+    zmsg_send (&reply, self->rw_socket);
+
+    if (frame)
+        sodium_memzero (zframe_data (frame), zframe_size (frame));
+    zframe_destroy (&frame);
+    zstr_free (&expected_str);
+}
+
+//  Add delta (default 1) to the number stored in key, reply with the result
+
+static void
+s_zns_srv_incr (zns_srv_t *self, zframe_t **routing_id_p, const char *key, zmsg_t *msg)
+{
+    char *delta_str = zmsg_popstr (msg);
+    long long delta = 1;
+    char *end = NULL;
+    if (delta_str) {
+        errno = 0;
+        delta = strtoll (delta_str, &end, 10);
+    }
+    int64_t value;
+    uint64_t version;
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_append (reply, routing_id_p);
+    if (delta_str && (errno != 0 || !*delta_str || *end != '\0')) {
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, "invalid arguments");
+        zmsg_addstr (reply, "INCR");
+    }
+    else
+    if (zns_store_incr (self->store, key, (int64_t) delta, &value, &version) == -1) {
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, "not a number");
+        zmsg_addstr (reply, "INCR");
+    }
+    else {
+        char *value_str = zsys_sprintf ("%" PRId64, value);
+        zmsg_addstr (reply, "INCR");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, value_str);
+        zmsg_addstrf (reply, "%" PRIu64, version);
+        zchunk_t *chunk = zchunk_new (value_str, strlen (value_str));
+        s_zns_srv_changed (self, key, "PUT", version, chunk);
+        zchunk_destroy (&chunk);
+        zstr_free (&value_str);
+    }
+    zmsg_send (&reply, self->rw_socket);
+    zstr_free (&delta_str);
+}
+
+//  Append data to the key, reply with the new version
+
+static void
+s_zns_srv_append (zns_srv_t *self, zframe_t **routing_id_p, const char *key, zmsg_t *msg)
+{
+    zframe_t *frame = zmsg_pop (msg);
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_append (reply, routing_id_p);
+    if (!frame) {
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, "invalid arguments");
+        zmsg_addstr (reply, "APPEND");
+    }
+    else {
+        zchunk_t *chunk = zchunk_new (zframe_data (frame), zframe_size (frame));
+        uint64_t version = zns_store_append (self->store, key, chunk);
+        sodium_memzero (zchunk_data (chunk), zchunk_size (chunk));
+        zchunk_destroy (&chunk);
+        zmsg_addstr (reply, "APPEND");
+        zmsg_addstr (reply, key);
+        zmsg_addstrf (reply, "%" PRIu64, version);
+
+        //  Followers get the whole value, so the change is idempotent
+        if (self->pub_socket || (self->repl_socket && !self->following)) {
+            uint64_t current;
+            chunk = s_zns_srv_lookup (self, key, &current);
+            if (chunk) {
+                s_zns_srv_changed (self, key, "PUT", current, chunk);
+                s_zns_srv_release (self, &chunk);
+            }
+        }
+        sodium_memzero (zframe_data (frame), zframe_size (frame));
+    }
+    zmsg_send (&reply, self->rw_socket);
+    zframe_destroy (&frame);
+}
+
+//  Receive one chunk of streamed value, commit it to store once all chunks
+//  are in. Every chunk is acknowledged, so the client gets its credit back.
+
+static void
+s_zns_srv_stream (zns_srv_t *self, zframe_t **routing_id_p, const char *key, zmsg_t *msg)
+{
+    char *offset_str = zmsg_popstr (msg);
+    char *total_str = zmsg_popstr (msg);
+    zframe_t *frame = zmsg_pop (msg);
+    uint64_t offset, total;
+    int64_t ttl;
+    const char *error = NULL;
+
+    char *routing_id_str = zframe_strhex (*routing_id_p);
+    char *upload_key = zsys_sprintf ("%s/%s", routing_id_str, key);
+    zstr_free (&routing_id_str);
+
+    if (!frame
+    ||  s_str2u64 (offset_str, &offset) == -1
+    ||  s_str2u64 (total_str, &total) == -1
+    ||  s_popttl (msg, &ttl) == -1)
+        error = "invalid arguments";
+    else
+    if (total > self->max_value)
+        error = "value too big";
+    else {
+        if (offset == 0) {
+            s_upload_t *upload = (s_upload_t *) zmalloc (sizeof (s_upload_t));
+            assert (upload);
+            upload->value = zchunk_new (NULL, total);
+            assert (upload->value);
+            zhashx_update (self->uploads, upload_key, upload);
+        }
+        s_upload_t *upload = (s_upload_t *) zhashx_lookup (self->uploads, upload_key);
+        if (!upload || zchunk_size (upload->value) != offset)
+            error = "unexpected offset";
+        else
+        if (zchunk_max_size (upload->value) != total
+        ||  zframe_size (frame) > total - offset)
+            error = "unexpected size";
+        else {
+            zchunk_append (upload->value, zframe_data (frame), zframe_size (frame));
+            upload->touched = zclock_mono ();
+            if (zchunk_size (upload->value) == total) {
+                //  ttl comes with the last chunk
+                uint64_t version = zns_store_put_ttl (self->store, key, upload->value, ttl);
+                s_zns_srv_changed (self, key, "PUT", version, upload->value);
+                zhashx_delete (self->uploads, upload_key);
+            }
+        }
+    }
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_append (reply, routing_id_p);
+    if (error) {
+        zsys_error ("STREAM %s failed: %s", key, error);
+        zhashx_delete (self->uploads, upload_key);
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, error);
+        zmsg_addstr (reply, "STREAM");
+    }
+    else {
+        zmsg_addstr (reply, "STREAM");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, offset_str);
+    }
+    zmsg_send (&reply, self->rw_socket);
+
+    if (frame)
+        sodium_memzero (zframe_data (frame), zframe_size (frame));
+    zframe_destroy (&frame);
+    zstr_free (&upload_key);
+    zstr_free (&total_str);
+    zstr_free (&offset_str);
+}
+
+// handle message from rw socket
+static void
+s_zns_srv_handle (zns_srv_t *self, zmsg_t *msg)
+{
+    assert (self);
+    char *command, *key;
+    int64_t start = zclock_usecs ();
+
+    zframe_t *routing_id = zmsg_pop (msg);
+
+    command = zmsg_popstr (msg);
+    key = zmsg_popstr (msg);
+
+    if (self->verbose)
+        zsys_debug ("Proto command=%s %s", command, key);
+    zns_trace_begin (self->trace, command ? command : "?", key);
+
+    if (command && streq (command, "STATS")) {
+        zmsg_t *reply = s_zns_srv_stats (self);
+        zmsg_prepend (reply, &routing_id);
+        zmsg_send (&reply, self->rw_socket);
+    }
+    else
+    if (!command || !key)
+        zsys_error ("Invalid message, command=%s, key=%s", command, key);
+    else
+    if (self->following
+    &&  (streq (command, "PUT") || streq (command, "DELETE") || streq (command, "STREAM")
+    ||   streq (command, "CAS") || streq (command, "INCR") || streq (command, "APPEND")))
+    {
+        //  Followers serve reads only, changes go to primary
+        zmsg_t *reply = zmsg_new ();
+        zmsg_append (reply, &routing_id);
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, key);
+        zmsg_addstr (reply, "read-only");
+        zmsg_addstr (reply, command);
+        zmsg_send (&reply, self->rw_socket);
+    }
+    else
+    if (streq (command, "GET"))
+    {
+        //  Client can send version it has, unchanged value is not sent again
+        char *known_str = zmsg_popstr (msg);
+        uint64_t known = 0;
+        if (known_str)
+            s_str2u64 (known_str, &known);
+        zstr_free (&known_str);
+        zns_trace_span (self->trace, "decode");
+
+        uint64_t version;
+        zchunk_t *chunk = s_zns_srv_lookup (self, key, &version);
+        zns_trace_span (self->trace, "lookup");
+
+        zmsg_t *reply = zmsg_new ();
+        zmsg_append (reply, &routing_id);
+        if (chunk && known && version == known) {
+            zmsg_addstr (reply, "NOTMODIFIED");
+            zmsg_addstr (reply, key);
+            zmsg_addstrf (reply, "%" PRIu64, version);
+            s_zns_srv_release (self, &chunk);
+        }
+        else {
+            zmsg_addstr (reply, command);
+            zmsg_addstr (reply, key);
+        }
+        if (chunk) {
+            zmsg_addmem (reply, zchunk_data (chunk), zchunk_size (chunk));
+            zmsg_addstrf (reply, "%" PRIu64, version);
+            s_zns_srv_release (self, &chunk);
+        }
+        zns_trace_span (self->trace, "copy");
+        zmsg_send (&reply, self->rw_socket);
+        zns_trace_span (self->trace, "send");
+    }
+    else
+    if (streq (command, "PUT"))
+    {
+        zframe_t *frame = zmsg_pop (msg);
+        int64_t ttl;
+        if (!frame || s_popttl (msg, &ttl) == -1)
+            zsys_error ("Invalid PUT arguments, key=%s", key);
+        else {
+            //TODO: interface with zchunk_t is not the best one ...
+            zchunk_t *chunk = zchunk_new (zframe_data (frame), zframe_size (frame));
+            zns_trace_span (self->trace, "decode");
+            uint64_t version = zns_store_put_ttl (self->store, key, chunk, ttl);
+            zns_trace_span (self->trace, "store");
+            s_zns_srv_changed (self, key, "PUT", version, chunk);
+            zns_trace_span (self->trace, "publish");
+            zchunk_destroy (&chunk);
+        }
+        zframe_destroy (&frame);
+    }
+    else
+    if (streq (command, "DELETE"))
+    {
+        if (zns_store_version (self->store, key)) {
+            uint64_t version = zns_store_put (self->store, key, NULL);
+            s_zns_srv_changed (self, key, "DELETE", version, NULL);
+        }
+    }
+    else
+    if (streq (command, "FETCH"))
+        s_zns_srv_fetch (self, &routing_id, key, msg);
+    else
+    if (streq (command, "STREAM"))
+        s_zns_srv_stream (self, &routing_id, key, msg);
+    else
+    if (streq (command, "CAS"))
+        s_zns_srv_cas (self, &routing_id, key, msg);
+    else
+    if (streq (command, "INCR"))
+        s_zns_srv_incr (self, &routing_id, key, msg);
+    else
+    if (streq (command, "APPEND"))
+        s_zns_srv_append (self, &routing_id, key, msg);
+    else
+        zsys_error ("Invalid command %s", command);
+
+    //  Time not covered by spans above, e.g. all of other commands
+    zns_trace_span (self->trace, "handle");
+    zns_trace_end (self->trace);
+
+    size_t index = 0;
+    while (index != ZNS_SRV_COMMANDS - 1 && !(command && streq (command, s_commands [index])))
+        index++;
+    zns_metrics_add (self->metrics, self->m_requests [index], 1);
+    zns_metrics_observe (self->metrics, self->m_request_time, zclock_usecs () - start);
+
+    zstr_free (&key);
+    zstr_free (&command);
+    zframe_destroy (&routing_id);
+    zmsg_destroy (&msg);
+}
+
+//  Refuse request of client over its quota, reply is BUSY key command, so
+//  clients match it to the request by key like any other reply
+
+static void
+s_zns_srv_busy (zns_srv_t *self, zmsg_t **msg_p)
+{
+    zmsg_t *msg = *msg_p;
+    zmsg_t *reply = zmsg_new ();
+    zframe_t *frame = zmsg_pop (msg);
+    zmsg_append (reply, &frame);
+    zmsg_addstr (reply, "BUSY");
+    zns_metrics_add (self->metrics, self->m_refused, 1);
+    zframe_t *command = zmsg_pop (msg);
+    frame = zmsg_pop (msg);
+    if (frame)
+        zmsg_append (reply, &frame);
+    if (command)
+        zmsg_append (reply, &command);
+    zmsg_send (&reply, self->rw_socket);
+    zmsg_destroy (msg_p);
+}
+
+//  Admit the request to client's queue, if its token bucket and queue allow
+
+static void
+s_zns_srv_admit (zns_srv_t *self, zmsg_t **msg_p, int64_t now)
+{
+    zframe_t *routing_id = zmsg_first (*msg_p);
+    if (!routing_id) {
+        zmsg_destroy (msg_p);
+        return;
+    }
+    char *client_id = zframe_strhex (routing_id);
+    s_client_t *client = (s_client_t *) zhashx_lookup (self->clients, client_id);
+    if (!client) {
+        client = s_client_new (self->burst, self->ready);
+        zhashx_insert (self->clients, client_id, client);
+    }
+    zstr_free (&client_id);
+
+    if (self->rate > 0) {
+        client->tokens += (now - client->refilled) * self->rate / 1000;
+        if (client->tokens > self->burst)
+            client->tokens = self->burst;
+        client->refilled = now;
+        if (client->tokens < 1) {
+            s_zns_srv_busy (self, msg_p);
+            return;
+        }
+        client->tokens -= 1;
+    }
+    else
+        client->refilled = now;
+
+    if (self->max_queue && zlistx_size (client->queue) >= self->max_queue) {
+        s_zns_srv_busy (self, msg_p);
+        return;
+    }
+    zlistx_add_end (client->queue, *msg_p);
+    *msg_p = NULL;
+    if (!client->ready_handle)
+        client->ready_handle = zlistx_add_end (self->ready, client);
+}
+
+//  Forget clients which have been idle for a while, they start over with
+//  full token bucket
+
+static void
+s_zns_srv_sweep (zns_srv_t *self, int64_t now)
+{
+    if (now - self->swept < ZNS_SRV_CLIENT_IDLE)
+        return;
+    self->swept = now;
+    zlistx_t *idle = zlistx_new ();
+    zlistx_set_duplicator (idle, (zlistx_duplicator_fn *) strdup);
+    zlistx_set_destructor (idle, (zlistx_destructor_fn *) zstr_free);
+    for (s_client_t *client = (s_client_t *) zhashx_first (self->clients);
+                     client != NULL;
+                     client = (s_client_t *) zhashx_next (self->clients)) {
+        if (!client->ready_handle && now - client->refilled > ZNS_SRV_CLIENT_IDLE)
+            zlistx_add_end (idle, (void *) zhashx_cursor (self->clients));
+    }
+    for (char *client_id = (char *) zlistx_first (idle);
+               client_id != NULL;
+               client_id = (char *) zlistx_next (idle))
+        zhashx_delete (self->clients, client_id);
+    zlistx_destroy (&idle);
+}
+
+// serve clients in turns, one request of every client with queued ones in
+// a turn, the rest waits for next turns across poll iterations. Turn reads
+// no more messages from rw socket than clients it serves, so client's
+// queue grows only while others are served and one client flooding the
+// socket can't starve the others.
+static void
+s_zns_srv_recv_rw (zns_srv_t *self)
+{
+    assert (self);
+    int64_t now = zclock_mono ();
+    size_t reads = zlistx_size (self->ready);
+    if (reads == 0)
+        reads = 1;
+    if (reads > ZNS_SRV_BATCH)
+        reads = ZNS_SRV_BATCH;
+    for (size_t i = 0; i != reads; i++) {
+        if (!(zsock_events (self->rw_socket) & ZMQ_POLLIN))
+            break;
+        zmsg_t *msg = zmsg_recv (self->rw_socket);
+        if (!msg)
+            break;
+        s_zns_srv_admit (self, &msg, now);
+    }
+
+    size_t turn = zlistx_size (self->ready);
+    for (size_t i = 0; i != turn; i++) {
+        s_client_t *client = (s_client_t *) zlistx_first (self->ready);
+        zmsg_t *msg = (zmsg_t *) zlistx_detach (client->queue, NULL);
+        if (zlistx_size (client->queue) > 0)
+            zlistx_move_end (self->ready, client->ready_handle);
+        else {
+            zlistx_detach (self->ready, client->ready_handle);
+            client->ready_handle = NULL;
+        }
+        s_zns_srv_handle (self, msg);
+    }
+    s_zns_srv_sweep (self, now);
+}
+
+//  Primary: handle message from follower. New follower gets snapshot of the
+//  store first, then the log of changes.
+
+static void
+s_zns_srv_recv_primary (zns_srv_t *self)
+{
+    zmsg_t *msg = zmsg_recv (self->repl_socket);
+    if (!msg)
+        return;
+    zframe_t *routing_id = zmsg_pop (msg);
+    char *command = zmsg_popstr (msg);
+    char *follower_id = zframe_strhex (routing_id);
+    s_follower_t *follower = (s_follower_t *) zhashx_lookup (self->followers, follower_id);
+
+    if (!command)
+        zsys_error ("Invalid replication message");
+    else
+    if (streq (command, "SYNC")
+    ||  (streq (command, "HUGZ") && !follower)) {
+        //  Follower we forgot, e.g. after restart, starts over
+        zns_trace_begin (self->trace, "SNAPSHOT", follower_id);
+        zchunk_t *snapshot = zns_store_export (self->store, self->password);
+        zns_trace_end (self->trace);
+        if (!snapshot)
+            zsys_error ("Can't export snapshot for follower %s", follower_id);
+        else {
+            zns_metrics_add (self->metrics, self->m_snapshots, 1);
+            if (!follower) {
+                follower = s_follower_new (routing_id);
+                zhashx_update (self->followers, follower_id, follower);
+            }
+            follower->applied = self->repl_seq;
+            follower->seen = zclock_mono ();
+            if (self->verbose)
+                zsys_debug ("Sending snapshot %" PRIu64 " to follower %s", self->repl_seq, follower_id);
+
+            zmsg_t *reply = zmsg_new ();
+            zframe_t *frame = zframe_dup (routing_id);
+            zmsg_append (reply, &frame);
+            zmsg_addstr (reply, "SNAPSHOT");
+            zmsg_addstrf (reply, "%" PRIu64, self->repl_seq);
+            zmsg_addmem (reply, zchunk_data (snapshot), zchunk_size (snapshot));
+            zmsg_send (&reply, self->repl_socket);
+            zchunk_destroy (&snapshot);
+        }
+    }
+    else
+    if (streq (command, "HUGZ")) {
+        char *applied = zmsg_popstr (msg);
+        s_str2u64 (applied, &follower->applied);
+        follower->seen = zclock_mono ();
+        if (self->verbose)
+            zsys_debug ("Follower %s is %" PRIu64 " changes behind",
+                    follower_id, self->repl_seq - follower->applied);
+        zstr_free (&applied);
+    }
+    else
+        zsys_error ("Invalid replication command %s", command);
+
+    zstr_free (&follower_id);
+    zstr_free (&command);
+    zframe_destroy (&routing_id);
+    zmsg_destroy (&msg);
+}
+
+//  Follower: open the sealed change with given sequence number and apply it
+//  to store, return 0 for success, -1 for error. Change sealed under other
+//  number or not newer than the store is refused.
+
+static int
+s_zns_srv_apply (zns_srv_t *self, uint64_t seq, zmsg_t *msg)
+{
+    zframe_t *nonce = zmsg_pop (msg);
+    zframe_t *sealed = zmsg_pop (msg);
+    if (!nonce || zframe_size (nonce) != crypto_secretbox_NONCEBYTES
+    ||  !sealed || zframe_size (sealed) < crypto_secretbox_MACBYTES) {
+        zsys_error ("Invalid change from primary");
+        zframe_destroy (&nonce);
+        zframe_destroy (&sealed);
+        return -1;
+    }
+
+    size_t buffer_size = zframe_size (sealed) - crypto_secretbox_MACBYTES;
+    byte *buffer = (byte *) zmalloc (buffer_size + 1);
+    assert (buffer);
+    int r = crypto_secretbox_open_easy (
+            buffer, zframe_data (sealed), zframe_size (sealed),
+            zframe_data (nonce), self->password);
+    zframe_destroy (&nonce);
+    zframe_destroy (&sealed);
+    zmsg_t *change = r == 0 ? zmsg_decode (buffer, buffer_size) : NULL;
+    sodium_memzero (buffer, buffer_size);
+    free (buffer);
+    if (!change) {
+        zsys_error ("Can't open change from primary, is the password the same?");
+        return -1;
+    }
+
+    char *seq_str = zmsg_popstr (change);
+    char *op = zmsg_popstr (change);
+    char *key = zmsg_popstr (change);
+    char *version_str = zmsg_popstr (change);
+    char *expires_str = zmsg_popstr (change);
+    zframe_t *frame = zmsg_pop (change);
+    uint64_t sealed_seq, version, expires;
+    r = -1;
+    if (op && key
+    &&  s_str2u64 (seq_str, &sealed_seq) == 0 && sealed_seq == seq
+    &&  s_str2u64 (version_str, &version) == 0
+    &&  s_str2u64 (expires_str, &expires) == 0
+    //  Primary hands out versions in order of changes
+    &&  version > zns_store_sequence (self->store)) {
+        if (streq (op, "PUT") && frame) {
+            zchunk_t *value = zchunk_new (zframe_data (frame), zframe_size (frame));
+            r = zns_store_apply (self->store, key, value, version, (int64_t) expires);
+            sodium_memzero (zchunk_data (value), zchunk_size (value));
+            zchunk_destroy (&value);
+        }
+        else
+        if (streq (op, "DELETE"))
+            r = zns_store_apply (self->store, key, NULL, version, 0);
+        if (r == 0)
+            s_zns_srv_publish (self, key, op, version);
+    }
+    if (r == -1)
+        zsys_error ("Invalid change %s %s from primary", op, key);
+
+    if (frame)
+        sodium_memzero (zframe_data (frame), zframe_size (frame));
+    zframe_destroy (&frame);
+    zstr_free (&seq_str);
+    zstr_free (&expires_str);
+    zstr_free (&version_str);
+    zstr_free (&key);
+    zstr_free (&op);
+    zmsg_destroy (&change);
+    return r;
+}
+
+//  Follower: handle message from primary. Changes are numbered, missing one
+//  means the follower starts over with new snapshot.
+
+static void
+s_zns_srv_recv_follower (zns_srv_t *self)
+{
+    zmsg_t *msg = zmsg_recv (self->repl_socket);
+    if (!msg)
+        return;
+    int64_t now = zclock_mono ();
+    self->heard = now;
+    char *command = zmsg_popstr (msg);
+    char *seq_str = zmsg_popstr (msg);
+    uint64_t seq;
+
+    if (!command || s_str2u64 (seq_str, &seq) == -1)
+        zsys_error ("Invalid replication message, command=%s", command);
+    else
+    if (streq (command, "SNAPSHOT")) {
+        zframe_t *frame = zmsg_pop (msg);
+        zchunk_t *snapshot = frame ? zchunk_new (zframe_data (frame), zframe_size (frame)) : NULL;
+        zframe_destroy (&frame);
+        //  Key is derived the same way as on primary, once per salt
+        zns_kdf_t *kdf = snapshot ? zns_store_image_kdf (snapshot) : NULL;
+        if (kdf && !(self->kdf && zns_kdf_eq (kdf, self->kdf)))
+            s_zns_srv_use_kdf (self, &kdf);
+        else
+        if (!kdf && self->kdf) {
+            //  Primary uses the password itself
+            char *passphrase = self->passphrase;
+            self->passphrase = NULL;
+            zns_srv_set_password (self, passphrase);
+            sodium_free (passphrase);
+        }
+        zns_kdf_destroy (&kdf);
+        //  On error keep syncing, request is repeated after timeout
+        int64_t start = zclock_usecs ();
+        zns_trace_begin (self->trace, "IMPORT", NULL);
+        int r = snapshot ? zns_store_import (self->store, snapshot, self->password) : -1;
+        zns_trace_end (self->trace);
+        if (r == 0) {
+            zns_metrics_observe (self->metrics, self->m_load_time, zclock_usecs () - start);
+            if (self->verbose)
+                zsys_debug ("Loaded snapshot %" PRIu64 " from primary", seq);
+            self->repl_seq = self->primary_seq = seq;
+            self->syncing = false;
+            self->synced = now;
+        }
+        else
+            zsys_error ("Can't load snapshot from primary, is the password the same?");
+        zchunk_destroy (&snapshot);
+    }
+    else
+    if (streq (command, "LOG")) {
+        if (seq > self->primary_seq)
+            self->primary_seq = seq;
+        //  Snapshot on the way or change already in it
+        if (self->syncing || seq <= self->repl_seq)
+            ;
+        else
+        if (seq != self->repl_seq + 1 || s_zns_srv_apply (self, seq, msg) == -1)
+            s_zns_srv_sync (self);
+        else {
+            self->repl_seq = seq;
+            if (self->repl_seq == self->primary_seq)
+                self->synced = now;
+        }
+    }
+    else
+    if (streq (command, "HUGZ")) {
+        //  Heartbeat follows all changes sent before it
+        self->primary_seq = seq;
+        if (self->syncing)
+            ;
+        else
+        if (seq != self->repl_seq)
+            s_zns_srv_sync (self);
+        else
+            self->synced = now;
+    }
+    else
+        zsys_error ("Invalid replication command %s", command);
+
+    zstr_free (&seq_str);
+    zstr_free (&command);
+    zmsg_destroy (&msg);
+}
+
+//  Exchange heartbeats with replication peers, primary forgets silent
+//  followers and follower resyncs when primary went silent
+
+static void
+s_zns_srv_heartbeat (zns_srv_t *self)
+{
+    if (!self->repl_socket)
+        return;
+    int64_t now = zclock_mono ();
+
+    if (self->following
+    &&  now - (self->syncing ? self->sync_sent : self->heard) > ZNS_SRV_REPL_TIMEOUT) {
+        zsys_warning ("No news from primary for %d msecs, requesting snapshot", ZNS_SRV_REPL_TIMEOUT);
+        self->heard = now;
+        s_zns_srv_sync (self);
+    }
+
+    if (now < self->hugz_at)
+        return;
+    self->hugz_at = now + ZNS_SRV_HEARTBEAT;
 
-        //  Free object itself
-        zpoller_destroy (&self->poller);
-        free (self);
-        *self_p = NULL;
+    if (self->following) {
+        zmsg_t *hugz = zmsg_new ();
+        zmsg_addstr (hugz, "HUGZ");
+        zmsg_addstrf (hugz, "%" PRIu64, self->repl_seq);
+        zmsg_send (&hugz, self->repl_socket);
+        return;
     }
-}
 
-void
-zns_srv_set_password (zns_srv_t *self, const char *password)
-{
-    assert (self);
-    size_t n = strlen (password) < crypto_secretbox_KEYBYTES ? strlen (password) : crypto_secretbox_KEYBYTES;
-    memcpy (self->password, password, n);
+    zlistx_t *silent = zlistx_new ();
+    zlistx_set_duplicator (silent, (zlistx_duplicator_fn *) strdup);
+    zlistx_set_destructor (silent, (zlistx_destructor_fn *) zstr_free);
+    for (s_follower_t *follower = (s_follower_t *) zhashx_first (self->followers);
+                       follower != NULL;
+                       follower = (s_follower_t *) zhashx_next (self->followers)) {
+        if (now - follower->seen > ZNS_SRV_REPL_TIMEOUT) {
+            zlistx_add_end (silent, (void *) zhashx_cursor (self->followers));
+            continue;
+        }
+        zmsg_t *hugz = zmsg_new ();
+        zframe_t *routing_id = zframe_dup (follower->routing_id);
+        zmsg_append (hugz, &routing_id);
+        zmsg_addstr (hugz, "HUGZ");
+        zmsg_addstrf (hugz, "%" PRIu64, self->repl_seq);
+        zmsg_send (&hugz, self->repl_socket);
+    }
+    for (char *follower_id = (char *) zlistx_first (silent);
+               follower_id != NULL;
+               follower_id = (char *) zlistx_next (silent)) {
+        zsys_info ("Follower %s is gone", follower_id);
+        zhashx_delete (self->followers, follower_id);
+    }
+    zlistx_destroy (&silent);
 }
 
-//  Start this actor. Return a value greater or equal to zero if initialization
-//  was successful. Otherwise -1.
+//  Announce key deleted by expiry
 
-static int
-zns_srv_start (zns_srv_t *self)
+static void
+s_zns_srv_expired (const char *key, uint64_t version, void *arg)
 {
-    assert (self);
-    zns_store_load (self->store, self->password);
-    return 0;
+    zns_srv_t *self = (zns_srv_t *) arg;
+    if (self->verbose)
+        zsys_debug ("Key %s expired", key);
+    s_zns_srv_changed (self, key, "DELETE", version, NULL);
 }
 
+//  Delete expired keys, followers get the deletions from primary
 
-//  Stop this actor. Return a value greater or equal to zero if stopping 
-//  was successful. Otherwise -1.
-
-static int
-zns_srv_stop (zns_srv_t *self)
+static void
+s_zns_srv_expire (zns_srv_t *self)
 {
-    assert (self);
+    int64_t now = zclock_time ();
+    if (!self->following && zns_store_expire_timeout (self->store, now) == 0)
+        zns_store_expire (self->store, now, s_zns_srv_expired, self);
+}
 
-    int r = zns_store_save (self->store, self->password);
-    if (r == -1)
-        zsys_error ("Failed to open crypto store");
-    if (self->verbose)
-        zsys_debug ("\tzns_store_save -> %d", r);
+//  Rewrap one batch of data keys by new password, save the store by its own
+//  actor when all are done. Next REKEY waits for the save of previous one.
 
-    return r;
+static void
+s_zns_srv_rekey (zns_srv_t *self)
+{
+    if (!self->rekeying || self->saver
+    ||  zns_store_rewrap (self->store, ZNS_SRV_REKEY_BATCH) > 0)
+        return;
+    self->rekeying = false;
+    if (self->shared_store) {
+        if (self->verbose)
+            zsys_info ("Store rekeyed");
+    }
+    else
+    if (!self->path || self->unloaded) {
+        zns_metrics_add (self->metrics, self->m_save_failures, 1);
+        zsys_error ("Can't save store with new password");
+    }
+    else {
+        //  Written like BACKUP to the store file, as master key is the key
+        self->save_job = s_zns_srv_backup_new (self, strdup (self->path));
+        self->saver = zactor_new (s_zns_srv_backup_actor, self->save_job);
+        assert (self->saver);
+        zpoller_add (self->poller, self->saver);
+    }
 }
 
-
-//  Here we handle incoming message from the node
+//  Load one batch of values of store, the store is ready when all are done.
+//  Save, rekey or snapshot may finish the load meanwhile.
 
 static void
-zns_srv_recv_api (zns_srv_t *self)
+s_zns_srv_load (zns_srv_t *self)
 {
-    //  Get the whole message of the pipe in one go
-    zmsg_t *request = zmsg_recv (self->pipe);
-    if (!request)
-       return;        //  Interrupted
-
-    char *command = zmsg_popstr (request);
+    if (!self->loading)
+        return;
+    self->loading = zns_store_load_step (self->store, ZNS_SRV_LOAD_BATCH);
+    if (self->loading)
+        return;
+    zns_metrics_observe (self->metrics, self->m_load_time, zclock_usecs () - self->load_started);
     if (self->verbose)
-        zsys_debug ("API command=%s", command);
+        zsys_info ("Store loaded in %" PRId64 " msecs", (zclock_usecs () - self->load_started) / 1000);
+}
 
-    if (streq (command, "START"))
-        zns_srv_start (self);
-    else
-    if (streq (command, "STOP"))
-        zns_srv_stop (self);
-    else
-    if (streq (command, "VERBOSE"))
-        self->verbose = true;
-    else
-    if (streq (command, "$TERM")) {
-        //  The $TERM command is send by zactor_destroy() method
-        zns_srv_stop (self);
-        self->terminated = true;
+//  Report backup written by its actor, reply is BACKUP, bytes written or -1
+//  for error and msecs taken
+
+static void
+s_zns_srv_recv_backup (zns_srv_t *self)
+{
+    char *result = zstr_recv (self->backup);
+    int64_t bytes = -1, usecs = 0;
+    if (!result || sscanf (result, "%" SCNd64 " %" SCNd64, &bytes, &usecs) != 2)
+        bytes = -1;
+    zstr_free (&result);
+    zpoller_remove (self->poller, self->backup);
+    zactor_destroy (&self->backup);
+    s_zns_srv_backup_destroy (&self->backup_job);
+
+    if (bytes == -1) {
+        zns_metrics_add (self->metrics, self->m_backup_failures, 1);
+        zsys_error ("BACKUP failed");
     }
-    else
-    if (streq (command, "BIND")) {
-        char *endpoint = zmsg_popstr (request);
-        self->rw_socket = zsock_new_router (endpoint);
-        zpoller_add (self->poller, self->rw_socket);
-        zstr_free (&endpoint);
+    else {
+        zns_metrics_observe (self->metrics, self->m_backup_time, usecs);
+        if (self->verbose)
+            zsys_debug ("Backup of %" PRId64 " bytes written in %" PRId64 " msecs", bytes, usecs / 1000);
     }
-    else
-    if (streq (command, "STORE")) {
-        char *str = zmsg_popstr (request);
-        char *abspath = realpath (str, NULL);
-        char *dir = dirname (abspath);
-        zns_store_set_dir (self->store, dirname (dir));
-        zstr_free (&abspath);
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, "BACKUP");
+    zmsg_addstrf (reply, "%" PRId64, bytes);
+    zmsg_addstrf (reply, "%" PRId64, usecs / 1000);
+    zmsg_send (&reply, self->pipe);
+}
+
+//  Verify one batch of store file once it is due by the rate, start scrub
+//  when it is time. Reply is VERIFY and number of corrupted ranges.
 
-        char *file = strdup (str);
-        zns_store_set_file (self->store, file);
-        zstr_free (&file);
-        zstr_free (&str);
+static void
+s_zns_srv_verify (zns_srv_t *self)
+{
+    if (!self->verifying && self->scrub_interval && zclock_mono () >= self->scrub_at) {
+        self->scrub_at = zclock_mono () + self->scrub_interval;
+        s_zns_srv_verify_begin (self, self->scrub_rate, false);
     }
-    else
-    if (streq (command, "PASSWORD")) {
-        char *passwd = zmsg_popstr (request);
-        zns_srv_set_password (self, passwd);
-        zstr_free (&passwd);
+    if (!self->verifying || zclock_usecs () < self->verify_at)
+        return;
+    size_t read = zns_store_verify_step (self->store, ZNS_SRV_VERIFY_BATCH);
+    if (read) {
+        //  Next step waits until the rate allows it
+        self->verify_read += read;
+        self->verify_at = self->verify_started + (int64_t) ((double) self->verify_read * 1000000.0 / self->verify_rate);
+        return;
     }
-    else {
-        zsys_error ("invalid API command '%s'", command);
-        assert (false);
+    self->verifying = false;
+    int corrupted = zns_store_verify_end (self->store);
+    zns_metrics_add (self->metrics, self->m_verifications, 1);
+    if (self->verbose || corrupted)
+        zsys_info ("Store file verified in %" PRId64 " msecs, %d corrupted ranges",
+                   (zclock_usecs () - self->verify_started) / 1000, corrupted);
+    if (self->verify_reply) {
+        zmsg_t *reply = zmsg_new ();
+        zmsg_addstr (reply, "VERIFY");
+        zmsg_addstrf (reply, "%d", corrupted);
+        zmsg_send (&reply, self->pipe);
     }
-    zstr_free (&command);
-    zmsg_destroy (&request);
 }
 
-// receive message from rw socket
+//  Hand store over to new process in memory file once requests received
+//  before HANDOVER are handled, so no change is lost. Reply is HANDOVER
+//  and descriptor of the file, -1 for error.
+
 static void
-s_zns_srv_recv_rw (zns_srv_t *self)
+s_zns_srv_handover (zns_srv_t *self)
 {
-    assert (self);
-    char *command, *key;
-    zmsg_t *msg = zmsg_recv (self->rw_socket);
-
-    zframe_t *routing_id = zmsg_pop (msg);
+    if (!self->handing_over)
+        return;
+    if (self->rw_socket
+    &&  (zlistx_size (self->ready) > 0 || (zsock_events (self->rw_socket) & ZMQ_POLLIN))) {
+        s_zns_srv_recv_rw (self);
+        return;
+    }
+    self->handing_over = false;
+    int fd = -1;
+    if (self->shared_store)
+        zsys_error ("Store of application can't be handed over");
+    else {
+        zns_trace_begin (self->trace, "HANDOVER", NULL);
+        fd = zns_store_handover (self->store, self->password);
+        zns_trace_end (self->trace);
+    }
+    if (fd == -1)
+        s_zns_srv_rebind (self, true);
+    self->handed_over = fd != -1;
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, "HANDOVER");
+    zmsg_addstrf (reply, "%d", fd);
+    zmsg_send (&reply, self->pipe);
+}
 
-    command = zmsg_popstr (msg);
-    key = zmsg_popstr (msg);
+//  Drop uploads whose client stopped sending chunks, so they don't hold
+//  memory forever
 
-    if (self->verbose)
-        zsys_debug ("Proto command=%s %s", command, key);
+static void
+s_zns_srv_uploads (zns_srv_t *self)
+{
+    if (zhashx_size (self->uploads) == 0)
+        return;
+    int64_t now = zclock_mono ();
+    zlistx_t *idle = zlistx_new ();
+    zlistx_set_duplicator (idle, (zlistx_duplicator_fn *) strdup);
+    zlistx_set_destructor (idle, (zlistx_destructor_fn *) zstr_free);
+    for (s_upload_t *upload = (s_upload_t *) zhashx_first (self->uploads);
+                     upload != NULL;
+                     upload = (s_upload_t *) zhashx_next (self->uploads)) {
+        if (now - upload->touched >= self->upload_idle)
+            zlistx_add_end (idle, (void *) zhashx_cursor (self->uploads));
+    }
+    for (char *upload_key = (char *) zlistx_first (idle);
+               upload_key != NULL;
+               upload_key = (char *) zlistx_next (idle)) {
+        zsys_warning ("STREAM %s dropped, idle", upload_key);
+        zhashx_delete (self->uploads, upload_key);
+    }
+    zlistx_destroy (&idle);
+}
 
-    if (streq (command, "GET"))
-    {
-        zchunk_t *chunk = (zchunk_t*) zns_store_get (self->store, key);
+//  Return msecs poller can wait for sockets before next heartbeat is due,
+//  keys expire, idle upload is dropped or verify goes on
 
-        zmsg_t *reply = zmsg_new ();
-        zmsg_append (reply, &routing_id);
-        zmsg_addstr (reply, command);
-        zmsg_addstr (reply, key);
-        if (chunk)
-            zmsg_addmem (reply, zchunk_data (chunk), zchunk_size (chunk));
-        zmsg_send (&reply, self->rw_socket);
+static int
+s_zns_srv_timeout (zns_srv_t *self)
+{
+    if ((self->rekeying && !self->saver) || self->loading || self->handing_over
+    ||  zlistx_size (self->ready) > 0)
+        return 0;
+    int64_t timeout = -1;
+    if (self->repl_socket) {
+        timeout = self->hugz_at - zclock_mono ();
+        if (timeout < 0)
+            timeout = 0;
     }
-    else
-    if (streq (command, "PUT"))
-    {
-        zframe_t *frame = zmsg_pop (msg);
-        //TODO: interface with zchunk_t is not the best one ...
-        zchunk_t *chunk = zchunk_new (zframe_data (frame), zframe_size (frame));
-        zframe_destroy (&frame);
-        zns_store_put (self->store, key, chunk);
-        zchunk_destroy (&chunk);
+    if (!self->following) {
+        int64_t expire = zns_store_expire_timeout (self->store, zclock_time ());
+        if (expire >= 0 && (timeout < 0 || expire < timeout))
+            timeout = expire;
     }
+    int64_t verify = -1;
+    if (self->verifying)
+        verify = (self->verify_at - zclock_usecs () + 999) / 1000;
     else
-        zsys_error ("Invalid command %s", command);
-
-    zstr_free (&key);
-    zstr_free (&command);
-    zframe_destroy (&routing_id);
-    zmsg_destroy (&msg);
+    if (self->scrub_interval)
+        verify = self->scrub_at - zclock_mono ();
+    if (verify < 0 && (self->verifying || self->scrub_interval))
+        verify = 0;
+    if (verify >= 0 && (timeout < 0 || verify < timeout))
+        timeout = verify;
+    for (s_upload_t *upload = (s_upload_t *) zhashx_first (self->uploads);
+                     upload != NULL;
+                     upload = (s_upload_t *) zhashx_next (self->uploads)) {
+        int64_t idle = upload->touched + self->upload_idle - zclock_mono ();
+        if (idle < 0)
+            idle = 0;
+        if (timeout < 0 || idle < timeout)
+            timeout = idle;
+    }
+    return timeout > INT_MAX ? INT_MAX : (int) timeout;
 }
 
 //  --------------------------------------------------------------------------
@@ -240,12 +2474,39 @@ zns_srv_actor (zsock_t *pipe, void *args)
     zsock_signal (self->pipe, 0);
 
     while (!self->terminated) {
-        zsock_t *which = (zsock_t *) zpoller_wait (self->poller, 0);
+        zsock_t *which = (zsock_t *) zpoller_wait (self->poller, s_zns_srv_timeout (self));
         if (which == self->pipe)
             zns_srv_recv_api (self);
         else
-        if (self->rw_socket && which == self->rw_socket)
+        if (self->rw_socket
+        &&  (which == self->rw_socket || (!which && zlistx_size (self->ready) > 0)))
             s_zns_srv_recv_rw (self);
+        else
+        if (self->repl_socket && which == self->repl_socket) {
+            if (self->following)
+                s_zns_srv_recv_follower (self);
+            else
+                s_zns_srv_recv_primary (self);
+        }
+        else
+        if (self->metrics_socket && which == self->metrics_socket)
+            s_zns_srv_recv_metrics (self);
+        else
+        if (self->backup && (void *) which == (void *) self->backup)
+            s_zns_srv_recv_backup (self);
+        else
+        if (self->saver && (void *) which == (void *) self->saver)
+            s_zns_srv_recv_save (self);
+        else
+        if (self->deriver && (void *) which == (void *) self->deriver)
+            s_zns_srv_recv_derive (self);
+        s_zns_srv_heartbeat (self);
+        s_zns_srv_expire (self);
+        s_zns_srv_uploads (self);
+        s_zns_srv_rekey (self);
+        s_zns_srv_load (self);
+        s_zns_srv_handover (self);
+        s_zns_srv_verify (self);
     }
     zns_srv_destroy (&self);
 }
@@ -260,7 +2521,6 @@ zns_srv_test (bool verbose)
 
     printf (" * zns_srv: ");
     zsys_file_delete ("src/test.zenstore");
-    zsys_file_delete ("src/test.zenstore.tmp");
     //  @selftest
     //  Simple create/destroy test
 
@@ -269,11 +2529,13 @@ zns_srv_test (bool verbose)
 
     zactor_t *zns_srv = zactor_new (zns_srv_actor, NULL);
 
-    // start an actor
+    // start an actor, cheap key derivation keeps the test fast
     zstr_sendx (zns_srv, "STORE", "src/test.zenstore", NULL);
+    zstr_sendx (zns_srv, "KDF", "1", "8192", NULL);
     zstr_sendx (zns_srv, "PASSWORD", password, NULL);
     zstr_sendx (zns_srv, "START", NULL);
     zstr_sendx (zns_srv, "BIND", endpoint, NULL);
+    assert (zsock_wait (zns_srv) == 0);
 
     zsock_t *sock = zsock_new_dealer (endpoint);
     assert (sock);
@@ -299,6 +2561,89 @@ zns_srv_test (bool verbose)
     zstr_free (&key);
     zstr_free (&value);
 
+    // STATS - the same metrics on pipe and rw socket
+    zstr_sendx (zns_srv, "STATS", NULL);
+    msg = zmsg_recv (zns_srv);
+    command = zmsg_popstr (msg);
+    assert (streq (command, "STATS"));
+    zstr_free (&command);
+    bool counted = false;
+    bool ready = false;
+    char *name;
+    while ((name = zmsg_popstr (msg))) {
+        value = zmsg_popstr (msg);
+        assert (value);
+        if (streq (name, "zns_requests_total{command=\"GET\"}"))
+            counted = streq (value, "1");
+        if (streq (name, "zns_ready"))
+            ready = streq (value, "1");
+        zstr_free (&name);
+        zstr_free (&value);
+    }
+    zmsg_destroy (&msg);
+    assert (counted);
+    assert (ready);
+
+    zstr_sendx (sock, "STATS", NULL);
+    msg = zmsg_recv (sock);
+    command = zmsg_popstr (msg);
+    assert (streq (command, "STATS"));
+    assert (zmsg_size (msg) % 2 == 0);
+    zstr_free (&command);
+    zmsg_destroy (&msg);
+
+    // METRICS - Prometheus scrapes text over plain TCP
+    zstr_sendx (zns_srv, "METRICS", "tcp://127.0.0.1:5682", NULL);
+    zsock_t *scraper = zsock_new_stream ("tcp://127.0.0.1:5682");
+    assert (scraper);
+    zsock_set_rcvtimeo (scraper, 5000);
+    zframe_t *peer = zframe_recv (scraper);
+    zframe_t *empty = zframe_recv (scraper);
+    assert (peer && empty);
+    zframe_destroy (&empty);
+    zframe_send (&peer, scraper, ZFRAME_MORE + ZFRAME_REUSE);
+    zstr_send (scraper, "GET /metrics HTTP/1.0\r\n\r\n");
+    zchunk_t *response = zchunk_new (NULL, 0);
+    while (true) {
+        msg = zmsg_recv (scraper);
+        assert (msg);
+        zframe_t *data = zmsg_last (msg);
+        bool closed = zframe_size (data) == 0;
+        zchunk_extend (response, zframe_data (data), zframe_size (data));
+        zmsg_destroy (&msg);
+        if (closed)
+            break;
+    }
+    zchunk_extend (response, "", 1);
+    assert (strncmp ((char *) zchunk_data (response), "HTTP/1.0 200 OK\r\n", 17) == 0);
+    assert (strstr ((char *) zchunk_data (response), "\nzns_keys 1\n"));
+    zchunk_destroy (&response);
+    zframe_destroy (&peer);
+    zsock_destroy (&scraper);
+
+    // TRACE - sampled requests are kept with their spans
+    zstr_sendx (zns_srv, "TRACE", "SAMPLE", "1", NULL);
+    zstr_sendx (zns_srv, "TRACE", "DUMP", NULL);
+    msg = zmsg_recv (zns_srv);
+    assert (zmsg_size (msg) == 1);
+    zmsg_destroy (&msg);
+    zstr_sendx (sock, "GET", "KEY", NULL);
+    msg = zmsg_recv (sock);
+    zmsg_destroy (&msg);
+    zstr_sendx (zns_srv, "TRACE", "SAMPLE", "0", NULL);
+    zstr_sendx (zns_srv, "TRACE", "DUMP", NULL);
+    msg = zmsg_recv (zns_srv);
+    command = zmsg_popstr (msg);
+    assert (streq (command, "TRACE"));
+    zstr_free (&command);
+    assert (zmsg_size (msg) == 1);
+    char *trace = zmsg_popstr (msg);
+    assert (strstr (trace, " GET KEY total="));
+    assert (strstr (trace, " lookup="));
+    assert (strstr (trace, " send="));
+    zstr_free (&trace);
+    zmsg_destroy (&msg);
+
     // GET - no key
     zstr_sendx (sock, "GET", "NOKEY", NULL);
 
@@ -315,10 +2660,58 @@ zns_srv_test (bool verbose)
     zstr_free (&key);
     zstr_free (&value);
 
+    // WATCH - subscribers get changes of keys with given prefix
+    static const char* pub_endpoint = "inproc://@/zns-srv-test-pub";
+    zstr_sendx (zns_srv, "PUBLISH", pub_endpoint, NULL);
+    zsock_t *watch = zsock_new_sub (pub_endpoint, "WATCHED/");
+    assert (watch);
+    zclock_sleep (100);     //  Let subscription propagate
+
+    zstr_sendx (sock, "PUT", "OTHER", "VALUE", NULL);
+    zstr_sendx (sock, "PUT", "WATCHED/KEY", "VALUE", NULL);
+    zstr_sendx (sock, "DELETE", "WATCHED/KEY", NULL);
+
+    char *op, *version;
+    msg = zmsg_recv (watch);
+    key = zmsg_popstr (msg);
+    op = zmsg_popstr (msg);
+    version = zmsg_popstr (msg);
+    zmsg_destroy (&msg);
+    assert (streq (key, "WATCHED/KEY"));
+    assert (streq (op, "PUT"));
+    uint64_t put_version = strtoull (version, NULL, 10);
+    assert (put_version > 0);
+    zstr_free (&key);
+    zstr_free (&op);
+    zstr_free (&version);
+
+    msg = zmsg_recv (watch);
+    key = zmsg_popstr (msg);
+    op = zmsg_popstr (msg);
+    version = zmsg_popstr (msg);
+    zmsg_destroy (&msg);
+    assert (streq (key, "WATCHED/KEY"));
+    assert (streq (op, "DELETE"));
+    assert (strtoull (version, NULL, 10) > put_version);
+    zstr_free (&key);
+    zstr_free (&op);
+    zstr_free (&version);
+    zsock_destroy (&watch);
+
     zsock_destroy (&sock);
 
     zactor_destroy (&zns_srv);
 
+    // Wrong password - file which can't be loaded is not saved over
+    ssize_t saved_size = zsys_file_size ("src/test.zenstore");
+    zns_srv = zactor_new (zns_srv_actor, NULL);
+    zstr_sendx (zns_srv, "STORE", "src/test.zenstore", NULL);
+    zstr_sendx (zns_srv, "PASSWORD", "wrong", NULL);
+    zstr_sendx (zns_srv, "START", NULL);
+    zstr_sendx (zns_srv, "STOP", NULL);
+    zactor_destroy (&zns_srv);
+    assert (zsys_file_size ("src/test.zenstore") == saved_size);
+
     // The second round - keystore should have been stored, so can be loaded
     zns_srv = zactor_new (zns_srv_actor, NULL);
 
@@ -327,6 +2720,57 @@ zns_srv_test (bool verbose)
     zstr_sendx (zns_srv, "PASSWORD", password, NULL);
     zstr_sendx (zns_srv, "START", NULL);
     zstr_sendx (zns_srv, "BIND", endpoint, NULL);
+    assert (zsock_wait (zns_srv) == 0);
+
+    // CALIBRATE - limits of new keys take about given msecs
+    zstr_sendx (zns_srv, "CALIBRATE", "20", NULL);
+    char *opslimit, *memlimit, *took;
+    zstr_recvx (zns_srv, &command, &opslimit, &memlimit, &took, NULL);
+    assert (streq (command, "CALIBRATE"));
+    assert (strtoull (opslimit, NULL, 10) >= 1);
+    assert (strtoull (memlimit, NULL, 10) >= 8192);
+    zstr_free (&command);
+    zstr_free (&opslimit);
+    zstr_free (&memlimit);
+    zstr_free (&took);
+
+    // BACKUP - copy is written while requests are served
+    zsys_file_delete ("src/test-backup.zenstore");
+    zstr_sendx (zns_srv, "BACKUP", "src/test-backup.zenstore", NULL);
+    char *backup_bytes, *backup_msecs;
+    zstr_recvx (zns_srv, &command, &backup_bytes, &backup_msecs, NULL);
+    assert (streq (command, "BACKUP"));
+    assert (strtoll (backup_bytes, NULL, 10) > 0);
+    assert (zsys_file_size ("src/test-backup.zenstore") == (ssize_t) strtoll (backup_bytes, NULL, 10));
+    zstr_free (&command);
+    zstr_free (&backup_bytes);
+    zstr_free (&backup_msecs);
+    zsys_file_delete ("src/test-backup.zenstore");
+
+    // VERIFY - store file saved by the first round is intact
+    zstr_sendx (zns_srv, "VERIFY", NULL);
+    char *corrupted;
+    zstr_recvx (zns_srv, &command, &corrupted, NULL);
+    assert (streq (command, "VERIFY"));
+    assert (streq (corrupted, "0"));
+    zstr_free (&command);
+    zstr_free (&corrupted);
+
+    // VERIFY while other one runs fails, the first one goes on
+    char verify_rate [32];
+    snprintf (verify_rate, sizeof verify_rate, "%zd", zsys_file_size ("src/test.zenstore") * 4);
+    zstr_sendx (zns_srv, "VERIFY", verify_rate, NULL);
+    zstr_sendx (zns_srv, "VERIFY", NULL);
+    zstr_recvx (zns_srv, &command, &corrupted, NULL);
+    assert (streq (command, "VERIFY"));
+    assert (streq (corrupted, "-1"));
+    zstr_free (&command);
+    zstr_free (&corrupted);
+    zstr_recvx (zns_srv, &command, &corrupted, NULL);
+    assert (streq (command, "VERIFY"));
+    assert (streq (corrupted, "0"));
+    zstr_free (&command);
+    zstr_free (&corrupted);
 
     sock = zsock_new_dealer (endpoint);
     assert (sock);
@@ -364,9 +2808,281 @@ zns_srv_test (bool verbose)
     zstr_free (&key);
     zstr_free (&value);
 
+    // REKEY - store is saved with new password, requests are served meanwhile
+    // and BACKUP running meanwhile is written by the old one
+    zsys_file_delete ("src/test-backup.zenstore");
+    zstr_sendx (zns_srv, "BACKUP", "src/test-backup.zenstore", NULL);
+    zstr_sendx (zns_srv, "REKEY", "N3w S3cr3t!", NULL);
+    zstr_sendx (sock, "GET", "KEY", NULL);
+    msg = zmsg_recv (sock);
+    command = zmsg_popstr (msg);
+    assert (streq (command, "GET"));
+    zstr_free (&command);
+    zmsg_destroy (&msg);
+    zstr_recvx (zns_srv, &command, &backup_bytes, &backup_msecs, NULL);
+    assert (streq (command, "BACKUP"));
+    assert (strtoll (backup_bytes, NULL, 10) > 0);
+    zstr_free (&command);
+    zstr_free (&backup_bytes);
+    zstr_free (&backup_msecs);
+
+    zsock_destroy (&sock);
+
+    zactor_destroy (&zns_srv);
+
+    // the key is derived by salt and limits from the header
+    zns_store_t *rekeyed = zns_store_new ();
+    zns_store_set_dir (rekeyed, "src");
+    zns_store_set_file (rekeyed, "test.zenstore");
+    zns_kdf_t *kdf = zns_store_read_kdf (rekeyed);
+    assert (kdf);
+    assert (zns_kdf_derive (kdf, "N3w S3cr3t!") == 0);
+    byte new_key [crypto_secretbox_KEYBYTES];
+    memcpy (new_key, zns_kdf_key (kdf), crypto_secretbox_KEYBYTES);
+    zns_kdf_destroy (&kdf);
+    assert (zns_store_load (rekeyed, new_key) == 0);
+    assert (zns_store_get (rekeyed, "KEY"));
+    zns_store_destroy (&rekeyed);
+
+    zns_store_t *backup = zns_store_new ();
+    zns_store_set_dir (backup, "src");
+    zns_store_set_file (backup, "test-backup.zenstore");
+    kdf = zns_store_read_kdf (backup);
+    assert (kdf);
+    assert (zns_kdf_derive (kdf, password) == 0);
+    byte old_key [crypto_secretbox_KEYBYTES];
+    memcpy (old_key, zns_kdf_key (kdf), crypto_secretbox_KEYBYTES);
+    zns_kdf_destroy (&kdf);
+    assert (zns_store_load (backup, old_key) == 0);
+    assert (zns_store_get (backup, "KEY"));
+    zns_store_destroy (&backup);
+    zsys_file_delete ("src/test-backup.zenstore");
+
+    // Embedded mode - application shares the store with actor, which is
+    // bound to more endpoints at once
+    zns_store_t *store = zns_store_new ();
+    zns_srv = zactor_new (zns_srv_actor, store);
+    zstr_sendx (zns_srv, "BIND", endpoint, NULL);
+    assert (zsock_wait (zns_srv) == 0);
+    zstr_sendx (zns_srv, "BIND", "ipc://@/zns-srv-test", NULL);
+    assert (zsock_wait (zns_srv) == 0);
+
+    zchunk_t *chunk = zchunk_new ("EMBEDDED", 8);
+    zns_store_put (store, "KEY", chunk);
+    zchunk_destroy (&chunk);
+
+    const char *endpoints [] = {endpoint, "ipc://@/zns-srv-test"};
+    for (int i = 0; i != 2; i++) {
+        sock = zsock_new_dealer (endpoints [i]);
+        assert (sock);
+        zstr_sendx (sock, "GET", "KEY", NULL);
+        msg = zmsg_recv (sock);
+        command = zmsg_popstr (msg);
+        key = zmsg_popstr (msg);
+        value = zmsg_popstr (msg);
+        zmsg_destroy (&msg);
+        assert (streq (value, "EMBEDDED"));
+        zstr_free (&command);
+        zstr_free (&key);
+        zstr_free (&value);
+        zsock_destroy (&sock);
+    }
+
+    // Admission control - client over its quota gets BUSY, others not
+    zstr_sendx (zns_srv, "RATELIMIT", "1", "2", NULL);
+    zclock_sleep (50);
+    sock = zsock_new_dealer (endpoint);
+    assert (sock);
+    for (int i = 0; i != 5; i++)
+        zstr_sendx (sock, "GET", "KEY", NULL);
+    int replies = 0, busy = 0;
+    for (int i = 0; i != 5; i++) {
+        msg = zmsg_recv (sock);
+        command = zmsg_popstr (msg);
+        key = zmsg_popstr (msg);
+        assert (streq (key, "KEY"));
+        if (streq (command, "GET"))
+            replies++;
+        else
+        if (streq (command, "BUSY")) {
+            //  Refused command follows the key
+            char *refused = zmsg_popstr (msg);
+            assert (streq (refused, "GET"));
+            zstr_free (&refused);
+            busy++;
+        }
+        zmsg_destroy (&msg);
+        zstr_free (&command);
+        zstr_free (&key);
+    }
+    assert (replies == 2);
+    assert (busy == 3);
+
+    zsock_t *sock2 = zsock_new_dealer (endpoint);
+    assert (sock2);
+    zstr_sendx (sock2, "GET", "KEY", NULL);
+    msg = zmsg_recv (sock2);
+    command = zmsg_popstr (msg);
+    zmsg_destroy (&msg);
+    assert (streq (command, "GET"));
+    zstr_free (&command);
+    zsock_destroy (&sock2);
+    zsock_destroy (&sock);
+
+    //  Pipelined burst of lone client is served, not refused by queue limit
+    zstr_sendx (zns_srv, "RATELIMIT", "0", NULL);
+    zstr_sendx (zns_srv, "QUEUE", "2", NULL);
+    sock = zsock_new_dealer (endpoint);
+    assert (sock);
+    for (int i = 0; i != 50; i++)
+        zstr_sendx (sock, "GET", "KEY", NULL);
+    for (int i = 0; i != 50; i++) {
+        msg = zmsg_recv (sock);
+        command = zmsg_popstr (msg);
+        assert (streq (command, "GET"));
+        zmsg_destroy (&msg);
+        zstr_free (&command);
+    }
     zsock_destroy (&sock);
 
     zactor_destroy (&zns_srv);
+    assert (zns_store_get (store, "KEY"));
+    zns_store_destroy (&store);
+
+    // Replication - follower gets snapshot, then changes and serves reads
+    static const char* repl_endpoint = "inproc://zns-srv-test-repl";
+    static const char* follower_endpoint = "inproc://zns-srv-test-follower";
+    store = zns_store_new ();
+    zactor_t *primary = zactor_new (zns_srv_actor, store);
+    zstr_sendx (primary, "PASSWORD", password, NULL);
+    zstr_sendx (primary, "BIND", endpoint, NULL);
+    assert (zsock_wait (primary) == 0);
+    zstr_sendx (primary, "REPLICATE", repl_endpoint, NULL);
+    sock = zsock_new_dealer (endpoint);
+    assert (sock);
+    zstr_sendx (sock, "PUT", "KEY", "SNAPSHOT", NULL);
+    zstr_sendx (sock, "GET", "KEY", NULL);
+    msg = zmsg_recv (sock);
+    zmsg_destroy (&msg);
+
+    zns_store_t *replica = zns_store_new ();
+    zactor_t *follower = zactor_new (zns_srv_actor, replica);
+    zstr_sendx (follower, "PASSWORD", password, NULL);
+    zstr_sendx (follower, "BIND", follower_endpoint, NULL);
+    assert (zsock_wait (follower) == 0);
+    zstr_sendx (follower, "FOLLOW", repl_endpoint, NULL);
+
+    int64_t deadline = zclock_mono () + 5000;
+    while (!zns_store_get (replica, "KEY") && zclock_mono () < deadline)
+        zclock_sleep (10);
+    zstr_sendx (sock, "PUT", "KEY2", "LOG", NULL);
+    zstr_sendx (sock, "DELETE", "KEY", NULL);
+    while (zns_store_get (replica, "KEY") && zclock_mono () < deadline)
+        zclock_sleep (10);
+    assert (!zns_store_get (replica, "KEY"));
+    assert (zns_store_version (replica, "KEY2") == zns_store_version (store, "KEY2"));
+
+    zsock_t *reader = zsock_new_dealer (follower_endpoint);
+    assert (reader);
+    zstr_sendx (reader, "GET", "KEY2", NULL);
+    msg = zmsg_recv (reader);
+    command = zmsg_popstr (msg);
+    key = zmsg_popstr (msg);
+    value = zmsg_popstr (msg);
+    zmsg_destroy (&msg);
+    assert (streq (value, "LOG"));
+    zstr_free (&command);
+    zstr_free (&key);
+    zstr_free (&value);
+
+    zstr_sendx (reader, "PUT", "KEY2", "CHANGED", NULL);
+    msg = zmsg_recv (reader);
+    command = zmsg_popstr (msg);
+    key = zmsg_popstr (msg);
+    value = zmsg_popstr (msg);
+    zmsg_destroy (&msg);
+    assert (streq (command, "ERROR"));
+    assert (streq (value, "read-only"));
+    zstr_free (&command);
+    zstr_free (&key);
+    zstr_free (&value);
+
+    char *changes, *msecs;
+    zstr_sendx (follower, "LAG", NULL);
+    msg = zmsg_recv (follower);
+    command = zmsg_popstr (msg);
+    changes = zmsg_popstr (msg);
+    msecs = zmsg_popstr (msg);
+    zmsg_destroy (&msg);
+    assert (streq (command, "LAG"));
+    assert (streq (changes, "0"));
+    zstr_free (&command);
+    zstr_free (&changes);
+    zstr_free (&msecs);
+
+    zsock_destroy (&reader);
+    zsock_destroy (&sock);
+    zactor_destroy (&follower);
+    zactor_destroy (&primary);
+    zns_store_destroy (&replica);
+    zns_store_destroy (&store);
+
+#if defined (__UTYPE_LINUX)
+    // HANDOVER - new actor takes over decrypted store and endpoints, memory
+    // files need Linux
+    static const char *handover_endpoint = "tcp://127.0.0.1:5683";
+    zactor_t *old = zactor_new (zns_srv_actor, NULL);
+    zstr_sendx (old, "STORE", "src/test.zenstore", NULL);
+    zstr_sendx (old, "PASSWORD", password, NULL);
+    zstr_sendx (old, "START", NULL);
+    zstr_sendx (old, "BIND", handover_endpoint, NULL);
+    assert (zsock_wait (old) == 0);
+    sock = zsock_new_dealer (handover_endpoint);
+    assert (sock);
+    zstr_sendx (sock, "PUT", "HANDED", "OVER", NULL);
+    zstr_sendx (sock, "INCR", "HANDED/COUNT", NULL);
+    msg = zmsg_recv (sock);
+    zmsg_destroy (&msg);
+    zstr_sendx (old, "HANDOVER", NULL);
+    char *fd;
+    zstr_recvx (old, &command, &fd, NULL);
+    assert (streq (command, "HANDOVER"));
+    zstr_free (&command);
+
+    zactor_t *new_ = zactor_new (zns_srv_actor, NULL);
+    zstr_sendx (new_, "STORE", "src/test.zenstore", NULL);
+    zstr_sendx (new_, "PASSWORD", password, NULL);
+    zstr_sendx (new_, "TAKEOVER", fd, NULL);
+    zstr_recvx (new_, &command, &value, NULL);
+    assert (streq (command, "TAKEOVER"));
+    assert (streq (value, "0"));
+    close (atoi (fd));
+    zstr_free (&command);
+    zstr_free (&value);
+    zstr_free (&fd);
+    zsock_destroy (&sock);
+    zactor_destroy (&old);
+    zstr_sendx (new_, "BIND", handover_endpoint, NULL);
+    assert (zsock_wait (new_) == 0);
+    zstr_sendx (new_, "BIND", handover_endpoint, NULL);
+    assert (zsock_wait (new_) == 1);
+
+    sock = zsock_new_dealer (handover_endpoint);
+    assert (sock);
+    zstr_sendx (sock, "GET", "HANDED", NULL);
+    msg = zmsg_recv (sock);
+    command = zmsg_popstr (msg);
+    key = zmsg_popstr (msg);
+    value = zmsg_popstr (msg);
+    zmsg_destroy (&msg);
+    assert (streq (command, "GET"));
+    assert (streq (value, "OVER"));
+    zstr_free (&command);
+    zstr_free (&key);
+    zstr_free (&value);
+    zsock_destroy (&sock);
+    zactor_destroy (&new_);
+#endif
     //  @end
 
     printf ("OK\n");
@@ -14,67 +14,225 @@
 @header
     zns_store - Class implementing access to encrypted storage
 @discuss
+    All methods are thread safe, so application can link libzns and use the
+    store directly, while zns_srv serves remote clients. The only exception
+    is zns_store_get, which returns a reference that can be changed by other
+    thread; use zns_store_lookup for a private copy.
+
+    Keys can expire. Expiry times are kept in a zns_wheel, so
+    zns_store_expire touches only the keys which expired. Until then,
+    expired keys are treated as missing.
+
+    Every value is sealed by its own random data key, which is wrapped by
+    the master key (the password). The index of keys, versions and wrapped
+    data keys is encrypted by the master key in segments of 4MB, values
+    follow it. Both are encrypted by all cores, writers wait only until the
+    store is packed. Load decrypts the same way. zns_store_extract decrypts
+    only the index and one value and zns_store_rekey changes the master key
+    by rewrapping data keys in batches, without touching values.
+
+    zns_store_load_begin decrypts only the index and leaves values sealed,
+    they are opened in batches by zns_store_load_step, so the store serves
+    right after the index is read. Value of key used before its batch comes
+    is opened on demand. zns_store_scan reads the file value by value
+    without loading it, so dumps need memory for the index only.
+
+    zns_store_verify authenticates every segment of the index and every
+    value of the file in steps, reading the index and the values by two
+    handles, so it needs memory for one segment and one value. Corrupted
+    ranges are reported by offset and size.
+
+    Save writes by zns_io, io_uring where available. Values are encrypted in
+    batches and each batch is written while the next one is encrypted, load
+    reads the file in chunks at once. The new file is anonymous (O_TMPFILE)
+    and preallocated, it gets a unique name and replaces the old one only
+    once it is complete and synced, so crash at any time leaves the old file
+    and saves of the same file at once don't meet.
+
+    zns_store_handover writes the decrypted store to a sealed memory file,
+    which zenstore passes to its new process on upgrade. zns_store_takeover
+    reads it back without touching the store file or decrypting anything.
 @end
 */
 
 #include "zns_classes.h"
 
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <libgen.h>
+#include <dirent.h>
+
+//  Version of file format, 1 has no versions of keys, 2 has one encrypted
+//  frame, 3 has segments, 4 has values sealed by their own data keys
+#define ZNS_STORE_FORMAT 4
+
+//  Version of memory file of handover
+#define ZNS_STORE_HANDOVER 1
+
+//  Header is read first to get key derivation, it is never this long
+#define ZNS_STORE_HEADER_MAX 65536
+
+//  Data key of value wrapped by master key, nonce followed by the box
+#define ZNS_STORE_WRAPPED (crypto_secretbox_NONCEBYTES + crypto_secretbox_KEYBYTES + crypto_secretbox_MACBYTES)
+
+//  Size of segment encrypted independently of others and number of threads
+//  encrypting or decrypting segments at most
+#define ZNS_STORE_SEGMENT   (4 * 1024 * 1024)
+#define ZNS_STORE_THREADS   64
+
+//  Plain bytes of values encrypted by save before they are written, the
+//  next batch is encrypted while the kernel writes
+#define ZNS_STORE_SAVE_BATCH (4 * 1024 * 1024)
+
+//  Bytes of store file read by one step of zns_store_verify
+#define ZNS_STORE_VERIFY_STEP (1024 * 1024)
+
+//  Values of store loaded by load_begin, which are not opened yet
+
+typedef struct _s_loader_t s_loader_t;
+
+//  Verify of store file started by verify_begin
+
+typedef struct _s_verifier_t s_verifier_t;
+
 //  Structure of our class
 
 struct _zns_store_t {
     bool verbose;
     zhashx_t *hash;
     zns_nonce_t *nonce;
+    zns_cipher_t *cipher;       //  Cipher of saved and exported store
+    bool cipher_set;            //  Cipher chosen by set_cipher
+    zns_kdf_t *kdf;             //  Derivation of key from password, not owned
     char *dir;
     char *file;
+    uint64_t sequence;          //  Last version assigned to a change
+    zns_wheel_t *wheel;         //  Expiry timers of keys
+    byte *master;               //  Master key wrapping data keys of values
+    uint64_t generation;        //  Generation of master key, 0 not set yet
+    zlistx_t *rekey;            //  Keys waiting for rewrap by new master key
+    s_loader_t *loader;         //  Values waiting for load_step, NULL none
+    size_t unreadable;          //  Values which failed to open since load
+    s_verifier_t *verifier;     //  Verify in progress, NULL none
+    zns_store_phase_fn *phase_fn;   //  Reports phases of save and load
+    void *phase_arg;
+    pthread_rwlock_t lock;      //  Guards all of above
 };
 
+//  Value stored in hash
+
+typedef struct {
+    zchunk_t *value;
+    uint64_t version;           //  Sequence of last change of the key
+    int64_t expires;            //  Wall clock time in msec, 0 never
+    void *timer;                //  Expiry timer, carries copy of the key
+    zns_wheel_t *wheel;         //  Wheel of the timer
+    byte dek [crypto_secretbox_KEYBYTES];   //  Data key sealing the value
+    byte wrapped [ZNS_STORE_WRAPPED];       //  Data key wrapped by master key
+    uint64_t wrapped_by;        //  Generation of master key of wrapped, 0 none
+} s_entry_t;
+
+static s_entry_t *
+s_entry_new (zchunk_t *value, uint64_t version)
+{
+    s_entry_t *self = (s_entry_t *) zmalloc (sizeof (s_entry_t));
+    assert (self);
+    self->value = value;
+    self->version = version;
+    randombytes_buf (self->dek, sizeof self->dek);
+    return self;
+}
+
 static void
 s_destructor (void **self_p)
 {
     assert (self_p);
     if (*self_p) {
-        zchunk_t *chunk = (zchunk_t*) *self_p;
-        zchunk_fill (chunk, 0x00, zchunk_max_size (chunk));
-        zchunk_destroy (&chunk);
+        s_entry_t *self = (s_entry_t*) *self_p;
+        if (self->timer)
+            free (zns_wheel_cancel (self->wheel, self->timer));
+        zchunk_fill (self->value, 0x00, zchunk_max_size (self->value));
+        zchunk_destroy (&self->value);
+        sodium_memzero (self->dek, sizeof self->dek);
+        free (self);
+        *self_p = NULL;
     }
 }
 
-static void*
-s_duplicator (const void *self)
+//  Set expiry time of entry and arm its timer
+
+static void
+s_entry_expire_at (zns_store_t *self, s_entry_t *entry, const char *key, int64_t expires)
 {
-    assert (self);
-    return (void*) zchunk_dup ((zchunk_t*) self);
+    entry->expires = expires;
+    if (expires) {
+        entry->wheel = self->wheel;
+        entry->timer = zns_wheel_add (self->wheel, expires, strdup (key));
+    }
 }
 
-// pack the hashx in form string : zchunk_t
-static zframe_t*
-s_zhashx_pack (zhashx_t *hash)
+//  Make key the master key, data keys wrapped by another key get stale.
+//  Caller holds the write lock.
+
+static void
+s_set_master (zns_store_t *self, const byte *key)
 {
-    assert (hash);
-    zmsg_t *msg = zmsg_new ();
+    if (self->generation
+    &&  sodium_memcmp (self->master, key, crypto_secretbox_KEYBYTES) == 0)
+        return;
+    memcpy (self->master, key, crypto_secretbox_KEYBYTES);
+    self->generation++;
+    zlistx_destroy (&self->rekey);
+}
 
-    for (void *it = zhashx_first (hash);
-               it != NULL;
-               it = zhashx_next (hash))
-    {
-        zmsg_addstr (msg, (char*) zhashx_cursor (hash));
-        zchunk_t *chunk = (zchunk_t *) it;
-        zmsg_addmem (msg, zchunk_data (chunk), zchunk_size (chunk));
-    }
+//  Wrap data key of entry by master key unless it is wrapped already
 
-    byte *buffer;
-    size_t size = zmsg_encode (msg, &buffer);
-    zmsg_destroy (&msg);
+static void
+s_entry_wrap (zns_store_t *self, s_entry_t *entry)
+{
+    if (entry->wrapped_by == self->generation)
+        return;
+    randombytes_buf (entry->wrapped, crypto_secretbox_NONCEBYTES);
+    crypto_secretbox_easy (
+            entry->wrapped + crypto_secretbox_NONCEBYTES,
+            entry->dek, sizeof entry->dek,
+            entry->wrapped, self->master);
+    entry->wrapped_by = self->generation;
+}
 
-    zframe_t *frame = zframe_new (buffer, size);
-    free (buffer);
-    return frame;
+//  Return entry of key or NULL. Expired entries wait for zns_store_expire,
+//  until then they are treated as missing.
+
+static s_entry_t *
+s_lookup (zns_store_t *self, const char *key)
+{
+    s_entry_t *entry = (s_entry_t *) zhashx_lookup (self->hash, key);
+    if (entry && entry->expires && entry->expires <= zclock_time ())
+        return NULL;
+    return entry;
+}
+
+static void
+s_put_u64 (byte *buffer, uint64_t value)
+{
+    for (int i = 0; i != 8; i++)
+        buffer [i] = (byte) (value >> (8 * (7 - i)));
 }
 
-//unpack the zhashx (string : zchunk_t)
+static uint64_t
+s_get_u64 (const byte *buffer)
+{
+    uint64_t value = 0;
+    for (int i = 0; i != 8; i++)
+        value = (value << 8) | buffer [i];
+    return value;
+}
+
+//unpack the zhashx, format 1 has only key : value pairs and all keys get
+//the given version, keys expired in between are dropped
 static zhashx_t*
-s_zhashx_unpack (zframe_t *frame)
+s_zhashx_unpack (zframe_t *frame, int format, uint64_t version)
 {
     assert (frame);
     zmsg_t *msg = zmsg_decode (zframe_data (frame), zframe_size (frame));
@@ -84,8 +242,15 @@ s_zhashx_unpack (zframe_t *frame)
     // zns_store_new
     zhashx_t *hash = zhashx_new ();
     zhashx_set_destructor (hash, s_destructor);
-    zhashx_set_duplicator (hash, s_duplicator);
 
+    size_t record = format == 1 ? 2 : 3;
+    if (zmsg_size (msg) % record != 0) {
+        zmsg_destroy (&msg);
+        zhashx_destroy (&hash);
+        return NULL;
+    }
+
+    int64_t now = zclock_time ();
     while (zmsg_size (msg) > 0)
     {
         char *key = zmsg_popstr (msg);
@@ -93,18 +258,89 @@ s_zhashx_unpack (zframe_t *frame)
         assert (key);
         assert (frame);
 
-        zchunk_t *chunk = zchunk_new (zframe_data (frame), zframe_size (frame));
+        uint64_t key_version = version;
+        int64_t expires = 0;
+        if (format > 1) {
+            zframe_t *meta = zmsg_pop (msg);
+            if (zframe_size (meta) >= 8)
+                key_version = s_get_u64 (zframe_data (meta));
+            if (zframe_size (meta) >= 16)
+                expires = (int64_t) s_get_u64 (zframe_data (meta) + 8);
+            zframe_destroy (&meta);
+        }
+
+        if (!expires || expires > now) {
+            zchunk_t *chunk = zchunk_new (zframe_data (frame), zframe_size (frame));
+            s_entry_t *entry = s_entry_new (chunk, key_version);
+            entry->expires = expires;
+            zhashx_update (hash, key, (void*) entry);
+        }
+        sodium_memzero (zframe_data (frame), zframe_size (frame));
         zframe_destroy (&frame);
-
-        zhashx_update (hash, key, (void*) chunk);
         zstr_free (&key);
-        zchunk_destroy (&chunk);
     }
     zmsg_destroy (&msg);
 
     return hash;
 }
 
+//  Values of store loaded by load_begin, format 4 only. Values are taken
+//  in order by load_step or by their key on demand.
+
+struct _s_loader_t {
+    zns_cipher_t *cipher;       //  Cipher of the values
+    size_t count;               //  Number of values
+    zframe_t **records;         //  Name, meta and wrapped data key of values
+    zframe_t **sealed;          //  Sealed values, NULL once taken
+    size_t next;                //  Next value to take by load_step
+    zhashx_t *pending;          //  Name : index + 1 of values not taken yet
+};
+
+static void
+s_loader_destroy (s_loader_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_loader_t *self = *self_p;
+        for (size_t i = 0; i != self->count; i++) {
+            zframe_destroy (&self->records [i * 3]);
+            zframe_destroy (&self->records [i * 3 + 1]);
+            zframe_destroy (&self->records [i * 3 + 2]);
+            zframe_destroy (&self->sealed [i]);
+        }
+        free (self->records);
+        free (self->sealed);
+        zhashx_destroy (&self->pending);
+        zns_cipher_destroy (&self->cipher);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Changes and reads of key waiting for load_step take it first, the value
+//  is opened or, if it is going to be replaced, forgotten. Defined below.
+//  Caller holds the write lock.
+
+static void
+s_loader_take (zns_store_t *self, const char *key, bool open);
+
+//  Take key for reader, which holds no lock
+
+static void
+s_loader_read (zns_store_t *self, const char *key)
+{
+    if (!__atomic_load_n (&self->loader, __ATOMIC_ACQUIRE))
+        return;
+    pthread_rwlock_wrlock (&self->lock);
+    s_loader_take (self, key, true);
+    pthread_rwlock_unlock (&self->lock);
+}
+
+//  Defined with verify below
+
+static void
+s_verifier_destroy (s_verifier_t **self_p);
+
 //  --------------------------------------------------------------------------
 //  Create a new zns_store
 
@@ -117,13 +353,19 @@ zns_store_new (void)
     self->hash = zhashx_new ();
     assert (self->hash);
     zhashx_set_destructor (self->hash, s_destructor);
-    zhashx_set_duplicator (self->hash, s_duplicator);
 
     self->nonce = zns_nonce_new ();
     assert (self->nonce);
+    self->cipher = zns_cipher_new ("salsa20poly1305");
+    assert (self->cipher);
 
     self->dir = NULL;
     self->file = NULL;
+    self->wheel = zns_wheel_new (zclock_time ());
+    assert (self->wheel);
+    self->master = (byte *) sodium_malloc (crypto_secretbox_KEYBYTES);
+    assert (self->master);
+    pthread_rwlock_init (&self->lock, NULL);
 
     return self;
 }
@@ -139,9 +381,16 @@ zns_store_destroy (zns_store_t **self_p)
         zns_store_t *self = *self_p;
         //  Free class properties here
         zhashx_destroy (&self->hash);
+        zns_wheel_destroy (&self->wheel);
+        zlistx_destroy (&self->rekey);
+        s_loader_destroy (&self->loader);
+        s_verifier_destroy (&self->verifier);
+        sodium_free (self->master);
         zns_nonce_destroy (&self->nonce);
+        zns_cipher_destroy (&self->cipher);
         zstr_free (&self->dir);
         zstr_free (&self->file);
+        pthread_rwlock_destroy (&self->lock);
         //  Free object itself
         free (self);
         *self_p = NULL;
@@ -149,223 +398,2484 @@ zns_store_destroy (zns_store_t **self_p)
 }
 
 //  --------------------------------------------------------------------------
-//  Put the binary chunk with given key to store
+//  Put the binary chunk with given key to store, NULL value deletes the key.
+//  Return the version assigned to the change.
 
-void
+uint64_t
 zns_store_put (zns_store_t *self, const char* key, zchunk_t *value)
+{
+    return zns_store_put_ttl (self, key, value, 0);
+}
+
+//  --------------------------------------------------------------------------
+//  Put the binary chunk, which expires after ttl msec, 0 means never.
+//  Return the version assigned to the change.
+
+uint64_t
+zns_store_put_ttl (zns_store_t *self, const char* key, zchunk_t *value, int64_t ttl)
 {
     assert (self);
     assert (key);
-    if (!value)
+    zchunk_t *dup = value ? zchunk_dup (value) : NULL;
+    pthread_rwlock_wrlock (&self->lock);
+    s_loader_take (self, key, false);
+    uint64_t version = ++self->sequence;
+    if (!dup)
         zhashx_delete (self->hash, key);
-    else
-        zhashx_update (self->hash, key, value);
+    else {
+        s_entry_t *entry = s_entry_new (dup, version);
+        zhashx_update (self->hash, key, entry);
+        if (ttl > 0)
+            s_entry_expire_at (self, entry, key, zclock_time () + ttl);
+    }
+    pthread_rwlock_unlock (&self->lock);
+    return version;
 }
 
 //  --------------------------------------------------------------------------
-//  Get the reference to the store or NULL if not there - ownership is NOT
-//  passed
+//  Put the value only if version of key is still expected one, 0 expects
+//  missing key. NULL value deletes the key. The key keeps its expiry time,
+//  as with incr and append. Return 0 and store the new version to version_p
+//  or -1 with the current version if key has changed.
 
-const zchunk_t *
-zns_store_get (zns_store_t *self, const char* key)
+int
+zns_store_cas (zns_store_t *self, const char* key, uint64_t expected, zchunk_t *value, uint64_t *version_p)
 {
     assert (self);
     assert (key);
-    return (zchunk_t*) zhashx_lookup (self->hash, key);
+    assert (version_p);
+    zchunk_t *dup = value ? zchunk_dup (value) : NULL;
+    pthread_rwlock_wrlock (&self->lock);
+    s_loader_take (self, key, true);
+    s_entry_t *entry = s_lookup (self, key);
+    uint64_t current = entry ? entry->version : 0;
+    int r = 0;
+    if (current != expected) {
+        *version_p = current;
+        r = -1;
+    }
+    else
+    if (!dup && !entry)
+        *version_p = 0;
+    else {
+        *version_p = ++self->sequence;
+        if (!dup)
+            zhashx_delete (self->hash, key);
+        else {
+            //  Value keeps its expiry time, as with INCR and APPEND
+            int64_t expires = entry ? entry->expires : 0;
+            entry = s_entry_new (dup, *version_p);
+            zhashx_update (self->hash, key, entry);
+            s_entry_expire_at (self, entry, key, expires);
+        }
+        dup = NULL;
+    }
+    pthread_rwlock_unlock (&self->lock);
+    zchunk_destroy (&dup);
+    return r;
 }
 
 //  --------------------------------------------------------------------------
-//  Set directory to store into
+//  Add delta to the decimal number stored in key, missing key counts as 0.
+//  Return 0 and store the result and new version, or -1 if the value is not
+//  a number or the result would overflow.
 
-void
-zns_store_set_dir (zns_store_t *self, const char *dir)
+int
+zns_store_incr (zns_store_t *self, const char* key, int64_t delta, int64_t *value_p, uint64_t *version_p)
 {
     assert (self);
-    self->dir = strdup (dir);
+    assert (key);
+    assert (value_p);
+    assert (version_p);
+    pthread_rwlock_wrlock (&self->lock);
+    s_loader_take (self, key, true);
+    s_entry_t *entry = s_lookup (self, key);
+    long long number = 0;
+    int r = 0;
+    if (entry) {
+        char buffer [32];
+        size_t size = zchunk_size (entry->value);
+        char *end;
+        if (size == 0 || size >= sizeof (buffer))
+            r = -1;
+        else {
+            memcpy (buffer, zchunk_data (entry->value), size);
+            buffer [size] = '\0';
+            errno = 0;
+            number = strtoll (buffer, &end, 10);
+            if (errno != 0 || *end != '\0')
+                r = -1;
+        }
+    }
+    if (r == 0
+    &&  ((delta > 0 && number > INT64_MAX - delta)
+    ||   (delta < 0 && number < INT64_MIN - delta)))
+        r = -1;
+    if (r == 0) {
+        //  Counter keeps its expiry time
+        int64_t expires = entry ? entry->expires : 0;
+        number += delta;
+        char buffer [32];
+        int size = snprintf (buffer, sizeof (buffer), "%lld", number);
+        *value_p = (int64_t) number;
+        *version_p = ++self->sequence;
+        entry = s_entry_new (zchunk_new (buffer, size), *version_p);
+        zhashx_update (self->hash, key, entry);
+        s_entry_expire_at (self, entry, key, expires);
+    }
+    pthread_rwlock_unlock (&self->lock);
+    return r;
 }
 
 //  --------------------------------------------------------------------------
-//  Set file name inside path
+//  Append the value to the key, missing key is created. Return the version
+//  assigned to the change.
 
-void
-zns_store_set_file (zns_store_t *self, const char *file)
+uint64_t
+zns_store_append (zns_store_t *self, const char* key, zchunk_t *value)
 {
     assert (self);
-    self->file = strdup (file);
+    assert (key);
+    assert (value);
+    pthread_rwlock_wrlock (&self->lock);
+    s_loader_take (self, key, true);
+    uint64_t version = ++self->sequence;
+    s_entry_t *entry = s_lookup (self, key);
+    if (entry) {
+        //  Old buffer is wiped when chunk grows
+        size_t size = zchunk_size (entry->value) + zchunk_size (value);
+        if (size > zchunk_max_size (entry->value)) {
+            zchunk_t *grown = zchunk_new (NULL, size * 2);
+            zchunk_append (grown, zchunk_data (entry->value), zchunk_size (entry->value));
+            zchunk_fill (entry->value, 0x00, zchunk_max_size (entry->value));
+            zchunk_destroy (&entry->value);
+            entry->value = grown;
+        }
+        zchunk_append (entry->value, zchunk_data (value), zchunk_size (value));
+        entry->version = version;
+    }
+    else
+        zhashx_update (self->hash, key, s_entry_new (zchunk_dup (value), version));
+    pthread_rwlock_unlock (&self->lock);
+    return version;
 }
 
-static int
-s_add_header (zns_store_t *self, zmsg_t *msg)
-{
+//  --------------------------------------------------------------------------
+//  Get the reference to the store or NULL if not there - ownership is NOT
+//  passed. Reference is valid until key is changed, so it is not safe to
+//  use it when other threads write to the store.
 
-    zconfig_t *header = zconfig_new ("header", NULL);
-    if (!header)
-        return -1;
+const zchunk_t *
+zns_store_get (zns_store_t *self, const char* key)
+{
+    assert (self);
+    assert (key);
+    s_loader_read (self, key);
+    pthread_rwlock_rdlock (&self->lock);
+    s_entry_t *entry = s_lookup (self, key);
+    pthread_rwlock_unlock (&self->lock);
+    return entry ? entry->value : NULL;
+}
 
-    zconfig_t *version = zconfig_new ("version", header);
-    zconfig_set_value (version, "1");
+//  --------------------------------------------------------------------------
+//  Get the copy of value or NULL if not there, optionally with its version.
+//  Caller is responsible for destroying the returned chunk.
 
-    zconfig_t *method = zconfig_new ("method", header);
-    zconfig_set_value (method, "crypto_secretbox");
+zchunk_t *
+zns_store_lookup (zns_store_t *self, const char* key, uint64_t *version_p)
+{
+    assert (self);
+    assert (key);
+    zchunk_t *value = NULL;
+    s_loader_read (self, key);
+    pthread_rwlock_rdlock (&self->lock);
+    s_entry_t *entry = s_lookup (self, key);
+    if (entry) {
+        value = zchunk_dup (entry->value);
+        if (version_p)
+            *version_p = entry->version;
+    }
+    pthread_rwlock_unlock (&self->lock);
+    return value;
+}
 
-    zconfig_t *cipher = zconfig_new ("cipher", header);
-    zconfig_set_value (cipher, "salsa20poly1305");
+//  --------------------------------------------------------------------------
+//  Return version of the key or 0 if not there. Versions only grow, even
+//  across save and load.
 
-    zconfig_t *nonce = zconfig_new ("nonce", header);
-    if (!zns_nonce_initialized (self->nonce))
-        zns_nonce_rand (self->nonce);
-    char *nonce_str = zns_nonce_str (self->nonce);
-    if (self->verbose)
-        zsys_debug ("\tnonce_str=%s", nonce_str);
-    zconfig_set_value (nonce, nonce_str, NULL);
-    zstr_free (&nonce_str);
+uint64_t
+zns_store_version (zns_store_t *self, const char* key)
+{
+    assert (self);
+    assert (key);
+    s_loader_read (self, key);
+    pthread_rwlock_rdlock (&self->lock);
+    s_entry_t *entry = s_lookup (self, key);
+    uint64_t version = entry ? entry->version : 0;
+    pthread_rwlock_unlock (&self->lock);
+    return version;
+}
 
-    zchunk_t *chunk = zconfig_chunk_save (header);
-    zconfig_destroy (&header);
-    if (!chunk)
-        return -1;
+//  --------------------------------------------------------------------------
+//  Return wall clock time in msec when the key expires, 0 if never or if
+//  the key is not there
 
-    int r = zmsg_addmem (msg, zchunk_data (chunk), zchunk_size (chunk));
-    if (self->verbose)
-        zsys_debug ("\theader size: %zu", zchunk_size (chunk));
-    zchunk_destroy (&chunk);
-    return r;
+int64_t
+zns_store_expires (zns_store_t *self, const char* key)
+{
+    assert (self);
+    assert (key);
+    s_loader_read (self, key);
+    pthread_rwlock_rdlock (&self->lock);
+    s_entry_t *entry = s_lookup (self, key);
+    int64_t expires = entry ? entry->expires : 0;
+    pthread_rwlock_unlock (&self->lock);
+    return expires;
 }
 
-static int
-s_add_encrypted_hash (zns_store_t *self, zmsg_t *msg, byte key [crypto_secretbox_KEYBYTES])
-{
-    zframe_t *frame = s_zhashx_pack (self->hash);
-    if (!frame)
-        return -1;
-    if (self->verbose)
-        zsys_debug ("\tpacked zhashx size: %zu", zframe_size (frame));
+//  --------------------------------------------------------------------------
+//  Delete keys expired before now (wall clock msec) and call expired_fn,
+//  if not NULL, with key and version of every deletion. Only keys which
+//  expired are touched. Return number of deleted keys.
 
-    size_t buffer_size = zframe_size (frame);
-    size_t encrypted_buffer_size = crypto_secretbox_MACBYTES + buffer_size;
-    byte* encrypted_buffer = (byte*) zmalloc (encrypted_buffer_size);
-    if (!encrypted_buffer) {
-        zframe_destroy (&frame);
-        return -1;
+size_t
+zns_store_expire (zns_store_t *self, int64_t now, zns_store_expired_fn *expired_fn, void *arg)
+{
+    assert (self);
+    zlistx_t *keys = zlistx_new ();
+    zlistx_set_destructor (keys, (zlistx_destructor_fn *) zstr_free);
+
+    pthread_rwlock_wrlock (&self->lock);
+    zns_wheel_advance (self->wheel, now, keys);
+    size_t count = zlistx_size (keys);
+    uint64_t *versions = (uint64_t *) zmalloc ((count + 1) * sizeof (uint64_t));
+    assert (versions);
+    size_t i = 0;
+    for (char *key = (char *) zlistx_first (keys);
+               key != NULL;
+               key = (char *) zlistx_next (keys), i++) {
+        //  Timer belongs to the current entry, others were cancelled
+        s_entry_t *entry = (s_entry_t *) zhashx_lookup (self->hash, key);
+        assert (entry);
+        entry->timer = NULL;
+        zhashx_delete (self->hash, key);
+        versions [i] = ++self->sequence;
     }
-
-    int r = crypto_secretbox_easy (
-            encrypted_buffer,
-            zframe_data (frame), buffer_size,
-            zns_nonce_raw (self->nonce),
-            key);
-    sodium_memzero (zframe_data (frame), buffer_size);
-    zframe_destroy (&frame);
-
-    if (r != 0) {
-        sodium_memzero (encrypted_buffer, encrypted_buffer_size);
-        free (encrypted_buffer);
-        return -1;
+    pthread_rwlock_unlock (&self->lock);
+
+    if (expired_fn) {
+        i = 0;
+        for (char *key = (char *) zlistx_first (keys);
+                   key != NULL;
+                   key = (char *) zlistx_next (keys), i++)
+            expired_fn (key, versions [i], arg);
     }
-
-    zmsg_addmem (msg, encrypted_buffer, encrypted_buffer_size);
-    if (self->verbose)
-        zsys_debug ("\tencrypted buffer size: %zu", encrypted_buffer_size);
-    sodium_memzero (encrypted_buffer, encrypted_buffer_size);
-    free (encrypted_buffer);
-    return 0;
+    free (versions);
+    zlistx_destroy (&keys);
+    return count;
 }
 
-static int
-s_save (zns_store_t *self, zmsg_t **msg_p)
+//  --------------------------------------------------------------------------
+//  Return msecs from now (wall clock) until zns_store_expire has work to do,
+//  -1 if no key expires
+
+int64_t
+zns_store_expire_timeout (zns_store_t *self, int64_t now)
 {
     assert (self);
-    assert (msg_p);
+    pthread_rwlock_rdlock (&self->lock);
+    int64_t timeout = zns_wheel_timeout (self->wheel, now);
+    pthread_rwlock_unlock (&self->lock);
+    return timeout;
+}
 
-    zmsg_t *msg = *msg_p;
+//  --------------------------------------------------------------------------
+//  Apply the change made by other store with given version and expiry time,
+//  NULL value deletes the key. Used by replicas, so versions stay the same
+//  as on the primary. Return 0 if applied, -1 if key has the same or newer
+//  version already, so old change can't roll it back.
 
-    char filename [PATH_MAX];
-    //TODO: maybe POSIX API is not the best here :) - lets investigate zfile /zsys_file API
-    //TODO O_TMPFILE sounds like an interesting feature here - lets check it
-    snprintf (filename, PATH_MAX, "%s/%s.tmp", self->dir, self->file);
-    int fd = open (filename, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_SYNC | O_TRUNC, 0600);
-    if (fd < 0) {
-        zsys_error ("Can't create '%s' : %s", filename, strerror (errno));
-        zmsg_destroy (&msg);
+int
+zns_store_apply (zns_store_t *self, const char* key, zchunk_t *value, uint64_t version, int64_t expires)
+{
+    assert (self);
+    assert (key);
+    zchunk_t *dup = value ? zchunk_dup (value) : NULL;
+    pthread_rwlock_wrlock (&self->lock);
+    //  Value waiting for load has its version checked like any other
+    s_loader_take (self, key, true);
+    s_entry_t *current = (s_entry_t *) zhashx_lookup (self->hash, key);
+    if (current && current->version >= version) {
+        pthread_rwlock_unlock (&self->lock);
+        if (dup) {
+            sodium_memzero (zchunk_data (dup), zchunk_size (dup));
+            zchunk_destroy (&dup);
+        }
         return -1;
     }
+    if (self->sequence < version)
+        self->sequence = version;
+    if (!dup)
+        zhashx_delete (self->hash, key);
+    else {
+        s_entry_t *entry = s_entry_new (dup, version);
+        zhashx_update (self->hash, key, entry);
+        s_entry_expire_at (self, entry, key, expires);
+    }
+    pthread_rwlock_unlock (&self->lock);
+    return 0;
+}
 
-    byte *buffer;
-    size_t buffer_size = zmsg_encode (msg, &buffer);
-    if (self->verbose)
-        zsys_debug ("\toverall buffer size: %zu", buffer_size);
-    zmsg_destroy (&msg);
-    //TODO decode error checking
+//  --------------------------------------------------------------------------
+//  Return the last version assigned to a change
 
-    ssize_t wr = write (fd, buffer, buffer_size);
-    if (self->verbose)
-        zsys_debug ("\tbytes written to file: %zd", wr);
-    sodium_memzero (buffer, buffer_size);
-    free (buffer);
-    fsync (fd);
-    close (fd);
+uint64_t
+zns_store_sequence (zns_store_t *self)
+{
+    assert (self);
+    pthread_rwlock_rdlock (&self->lock);
+    uint64_t sequence = self->sequence;
+    pthread_rwlock_unlock (&self->lock);
+    return sequence;
+}
 
-    if (wr != buffer_size) {
-        zsys_error ("Written less bytes '%zd' than expected '%zu', removing '%s': %s", wr, buffer_size, filename, strerror (errno));
-        unlink (filename);
-        return -1;
-    }
+//  --------------------------------------------------------------------------
+//  Return number of keys in the store, including keys still being loaded
 
-    char filename_new [PATH_MAX];
-    snprintf (filename_new, PATH_MAX, "%s/%s", self->dir, self->file);
-    int r = rename (filename, filename_new);
-    if (r == -1) {
-        zsys_error ("Rename failed: %s", strerror (errno));
-        return -1;
-    }
-    return 0;
+size_t
+zns_store_size (zns_store_t *self)
+{
+    assert (self);
+    pthread_rwlock_rdlock (&self->lock);
+    size_t size = zhashx_size (self->hash);
+    if (self->loader)
+        size += zhashx_size (self->loader->pending);
+    pthread_rwlock_unlock (&self->lock);
+    return size;
 }
 
 //  --------------------------------------------------------------------------
-//  Save the keystore to path/file, return 0 for success, -1 for error
+//  Return number of values which failed to open since the store was loaded.
+//  Store with any is not saved or exported, so the file keeps them.
 
-int zns_store_save (
-        zns_store_t *self,
-        byte key [crypto_secretbox_KEYBYTES])
+size_t
+zns_store_unreadable (zns_store_t *self)
 {
     assert (self);
+    pthread_rwlock_rdlock (&self->lock);
+    size_t unreadable = self->unreadable;
+    pthread_rwlock_unlock (&self->lock);
+    return unreadable;
+}
 
-    if (!self->dir || !self->file)
-        return -1;
-
-    zmsg_t *msg = zmsg_new ();
-    if (!msg) {
-        return -1;
-    }
+//  --------------------------------------------------------------------------
+//  Set directory to store into
 
-    int r = s_add_header (self, msg);
-    if (r == -1) {
-        zmsg_destroy (&msg);
-        return -1;
-    }
+void
+zns_store_set_dir (zns_store_t *self, const char *dir)
+{
+    assert (self);
+    zstr_free (&self->dir);
+    self->dir = strdup (dir);
+}
 
-    r = s_add_encrypted_hash (self, msg, key);
-    if (r == -1) {
-        zmsg_destroy (&msg);
-        return -1;
-    }
+//  --------------------------------------------------------------------------
+//  Set file name inside path
 
-    return s_save (self, &msg);
+void
+zns_store_set_file (zns_store_t *self, const char *file)
+{
+    assert (self);
+    zstr_free (&self->file);
+    self->file = strdup (file);
 }
 
 //  --------------------------------------------------------------------------
-//  Load the keystore from path/file, return 0 for success, -1 for error
+//  Set cipher of saved and exported store, salsa20poly1305 (default),
+//  xchacha20poly1305_ietf, aes256gcm or fastest one supported by this CPU.
+//  Load accepts any of them and keeps the cipher of the file unless one was
+//  set. Return 0 for success, -1 if the cipher is not known or supported.
 
 int
-zns_store_load (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES])
+zns_store_set_cipher (zns_store_t *self, const char *name)
 {
-    if (self->verbose)
-        zsys_debug ("zns_store_load:");
     assert (self);
-    if (!self->dir || !self->file)
+    zns_cipher_t *cipher = zns_cipher_new (name);
+    if (!cipher) {
+        zsys_error ("Cipher '%s' is not supported", name);
         return -1;
+    }
+    pthread_rwlock_wrlock (&self->lock);
+    zns_cipher_destroy (&self->cipher);
+    self->cipher = cipher;
+    self->cipher_set = true;
+    pthread_rwlock_unlock (&self->lock);
+    return 0;
+}
 
-    zfile_t *file = zfile_new (self->dir, self->file);
+//  --------------------------------------------------------------------------
+//  Return name of cipher of saved and exported store
+
+const char *
+zns_store_cipher (zns_store_t *self)
+{
+    assert (self);
+    pthread_rwlock_rdlock (&self->lock);
+    const char *name = zns_cipher_name (self->cipher);
+    pthread_rwlock_unlock (&self->lock);
+    return name;
+}
+
+//  --------------------------------------------------------------------------
+//  Key passed to save and export is derived by kdf, which stores its salt
+//  and limits in the header. The kdf is not owned by the store, NULL for
+//  key used as it is.
+
+void
+zns_store_set_kdf (zns_store_t *self, zns_kdf_t *kdf)
+{
+    assert (self);
+    pthread_rwlock_wrlock (&self->lock);
+    self->kdf = kdf;
+    pthread_rwlock_unlock (&self->lock);
+}
+
+//  --------------------------------------------------------------------------
+//  Call phase_fn at the end of every phase of save, export, load and import,
+//  NULL to stop.
+
+void
+zns_store_set_phase_fn (zns_store_t *self, zns_store_phase_fn *phase_fn, void *arg)
+{
+    assert (self);
+    pthread_rwlock_wrlock (&self->lock);
+    self->phase_fn = phase_fn;
+    self->phase_arg = arg;
+    pthread_rwlock_unlock (&self->lock);
+}
+
+//  Return header of content returned by export without decoding the rest,
+//  NULL for error
+
+static zconfig_t *
+s_header_peek (const byte *data, size_t size)
+{
+    //  The first frame of encoded zmsg
+    if (size < 1)
+        return NULL;
+    size_t frame_size = data [0];
+    size_t offset = 1;
+    if (frame_size == 0xFF) {
+        if (size < 5)
+            return NULL;
+        frame_size = ((size_t) data [1] << 24) | ((size_t) data [2] << 16)
+                   | ((size_t) data [3] << 8) | (size_t) data [4];
+        offset = 5;
+    }
+    if (size - offset < frame_size)
+        return NULL;
+    zchunk_t *chunk = zchunk_new (data + offset, frame_size);
+    zconfig_t *header = zconfig_chunk_load (chunk);
+    zchunk_destroy (&chunk);
+    return header;
+}
+
+//  --------------------------------------------------------------------------
+//  Return key derivation of content returned by export, NULL if the content
+//  is keyed by password itself. Caller is responsible for destroying it.
+
+zns_kdf_t *
+zns_store_image_kdf (zchunk_t *buffer)
+{
+    assert (buffer);
+    zconfig_t *header = s_header_peek (zchunk_data (buffer), zchunk_size (buffer));
+    zns_kdf_t *kdf = header ? zns_kdf_decode (header) : NULL;
+    zconfig_destroy (&header);
+    return kdf;
+}
+
+//  --------------------------------------------------------------------------
+//  Return key derivation of store file, NULL if there is no file or it is
+//  keyed by password itself. Only the header is read.
+
+zns_kdf_t *
+zns_store_read_kdf (zns_store_t *self)
+{
+    assert (self);
+    if (!self->dir || !self->file)
+        return NULL;
+    zfile_t *file = zfile_new (self->dir, self->file);
+    if (!file)
+        return NULL;
+    zns_kdf_t *kdf = NULL;
+    if (zfile_input (file) == 0) {
+        zchunk_t *chunk = zfile_read (file, ZNS_STORE_HEADER_MAX, 0);
+        if (chunk)
+            kdf = zns_store_image_kdf (chunk);
+        zchunk_destroy (&chunk);
+        zfile_close (file);
+    }
+    zfile_destroy (&file);
+    return kdf;
+}
+
+//  Split the data to segments encrypted in parallel. Segment i uses nonce
+//  of header plus i and the last segment has the top bit of nonce flipped,
+//  so segments can't be reordered, dropped or cut off unnoticed.
+
+typedef struct {
+    zns_cipher_t *cipher;
+    const byte *key;
+    const byte *nonce;          //  Nonce of header
+    bool open;                  //  Decrypt, otherwise encrypt
+    byte *plain;                //  Plain data of all segments
+    size_t *offsets;            //  Segment i is plain [offsets [i], offsets [i + 1])
+    zframe_t **sealed;          //  Encrypted segments
+    size_t count;               //  Number of segments
+    size_t next;                //  Next segment to take by worker
+    int result;                 //  -1 if any segment failed
+} s_segments_t;
+
+//  Report phase which began at start to phase_fn of store, which may be
+//  NULL. Return current time in usec as start of the next phase.
+
+static int64_t
+s_phase (zns_store_t *self, const char *phase, int64_t start)
+{
+    int64_t now = zclock_usecs ();
+    if (self && self->phase_fn)
+        self->phase_fn (phase, now - start, self->phase_arg);
+    return now;
+}
+
+static void
+s_segment_nonce (s_segments_t *job, size_t index, byte *nonce)
+{
+    size_t size = zns_cipher_nonce_size (job->cipher);
+    memcpy (nonce, job->nonce, crypto_secretbox_NONCEBYTES);
+    uint64_t carry = index;
+    for (size_t i = 0; i != size && carry; i++) {
+        carry += nonce [i];
+        nonce [i] = (byte) carry;
+        carry >>= 8;
+    }
+    if (index == job->count - 1)
+        nonce [size - 1] ^= 0x80;
+}
+
+static void *
+s_segment_worker (void *args)
+{
+    s_segments_t *job = (s_segments_t *) args;
+    while (true) {
+        size_t index = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED);
+        if (index >= job->count)
+            break;
+        byte nonce [crypto_secretbox_NONCEBYTES];
+        s_segment_nonce (job, index, nonce);
+        byte *plain = job->plain + job->offsets [index];
+        size_t plain_size = job->offsets [index + 1] - job->offsets [index];
+        zframe_t *sealed = job->sealed [index];
+        int r;
+        if (job->open)
+            r = zns_cipher_open (job->cipher, plain, zframe_data (sealed), zframe_size (sealed), nonce, job->key);
+        else
+            r = zns_cipher_seal (job->cipher, zframe_data (sealed), plain, plain_size, nonce, job->key);
+        if (r != 0)
+            __atomic_store_n (&job->result, -1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+//  Values of format 4 are sealed by their data keys, each by new nonce put
+//  in front of the box
+
+typedef struct {
+    zns_cipher_t *cipher;
+    bool open;                  //  Decrypt, otherwise encrypt
+    size_t count;               //  Number of values
+    zframe_t **plain;           //  Plain values
+    byte *deks;                 //  Data keys of values
+    zframe_t **sealed;          //  Sealed values
+    size_t next;                //  Next value to take by worker
+    int result;                 //  -1 if any value failed
+} s_values_t;
+
+static void *
+s_value_worker (void *args)
+{
+    s_values_t *job = (s_values_t *) args;
+    size_t nonce_size = zns_cipher_nonce_size (job->cipher);
+    size_t overhead = nonce_size + zns_cipher_mac_size (job->cipher);
+    while (true) {
+        size_t index = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED);
+        if (index >= job->count)
+            break;
+        const byte *dek = job->deks + index * crypto_secretbox_KEYBYTES;
+        int r = -1;
+        if (job->open) {
+            zframe_t *sealed = job->sealed [index];
+            if (zframe_size (sealed) >= overhead) {
+                job->plain [index] = zframe_new (NULL, zframe_size (sealed) - overhead);
+                r = zns_cipher_open (
+                        job->cipher, zframe_data (job->plain [index]),
+                        zframe_data (sealed) + nonce_size, zframe_size (sealed) - nonce_size,
+                        zframe_data (sealed), dek);
+            }
+            //  Value which failed is left out, others go on
+            if (r != 0)
+                zframe_destroy (&job->plain [index]);
+        }
+        else {
+            zframe_t *plain = job->plain [index];
+            job->sealed [index] = zframe_new (NULL, zframe_size (plain) + overhead);
+            byte *sealed = zframe_data (job->sealed [index]);
+            randombytes_buf (sealed, nonce_size);
+            r = zns_cipher_seal (
+                    job->cipher, sealed + nonce_size,
+                    zframe_data (plain), zframe_size (plain), sealed, dek);
+        }
+        if (r != 0)
+            __atomic_store_n (&job->result, -1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+//  Helper threads shared by all stores of the process. They are started
+//  on the first job and wait between jobs, so loader steps, save batches
+//  and imports don't create threads. One job runs at a time.
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t run;        //  Held by caller of the running job
+    pthread_mutex_t mutex;      //  Guards all of below
+    pthread_cond_t start;       //  Job is given to helpers
+    pthread_cond_t done;        //  Helper left the job
+    size_t size;                //  Number of helpers
+    void *(*worker) (void *);   //  Worker of the job
+    void *job;
+    size_t wanted;              //  Helpers still to join the job
+    size_t busy;                //  Helpers in the job
+} s_pool = {
+    PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL, NULL, 0, 0
+};
+
+static void *
+s_pool_helper (void *args)
+{
+    pthread_mutex_lock (&s_pool.mutex);
+    while (true) {
+        while (s_pool.wanted == 0)
+            pthread_cond_wait (&s_pool.start, &s_pool.mutex);
+        s_pool.wanted--;
+        s_pool.busy++;
+        void *(*worker) (void *) = s_pool.worker;
+        void *job = s_pool.job;
+        pthread_mutex_unlock (&s_pool.mutex);
+        worker (job);
+        pthread_mutex_lock (&s_pool.mutex);
+        if (--s_pool.busy == 0)
+            pthread_cond_signal (&s_pool.done);
+    }
+    return NULL;
+}
+
+//  Start one helper per core but the calling one
+
+static void
+s_pool_start (void)
+{
+    long cores = sysconf (_SC_NPROCESSORS_ONLN);
+    size_t helpers = cores > 1 ? (size_t) cores - 1 : 0;
+    if (helpers > ZNS_STORE_THREADS - 1)
+        helpers = ZNS_STORE_THREADS - 1;
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    for (; s_pool.size != helpers; s_pool.size++) {
+        pthread_t helper;
+        if (pthread_create (&helper, &attr, s_pool_helper, NULL) != 0)
+            break;
+    }
+    pthread_attr_destroy (&attr);
+}
+
+//  Run worker on all cores, but at most one thread per item of job. Worker
+//  takes items of job until none is left, the calling thread is one of
+//  workers and helpers of the pool are the others.
+
+static void
+s_run_workers (void *(*worker) (void *), void *job, size_t count)
+{
+    pthread_once (&s_pool.once, s_pool_start);
+    size_t helpers = count > 1 ? count - 1 : 0;
+    if (helpers > s_pool.size)
+        helpers = s_pool.size;
+    if (helpers == 0) {
+        worker (job);
+        return;
+    }
+    pthread_mutex_lock (&s_pool.run);
+    pthread_mutex_lock (&s_pool.mutex);
+    s_pool.worker = worker;
+    s_pool.job = job;
+    s_pool.wanted = helpers;
+    pthread_cond_broadcast (&s_pool.start);
+    pthread_mutex_unlock (&s_pool.mutex);
+
+    worker (job);
+
+    //  All items are taken once worker returns, helpers which didn't join
+    //  yet are not needed, those in the job finish their items
+    pthread_mutex_lock (&s_pool.mutex);
+    s_pool.wanted = 0;
+    while (s_pool.busy > 0)
+        pthread_cond_wait (&s_pool.done, &s_pool.mutex);
+    pthread_mutex_unlock (&s_pool.mutex);
+    pthread_mutex_unlock (&s_pool.run);
+}
+
+//  Pack index of the hash in form key : meta : wrapped, where meta is the
+//  big endian version and expiry time of the key and wrapped is its data
+//  key wrapped by master key, or by wrap_key if not NULL, which leaves the
+//  wrapping kept by entries alone. Values and data keys are copied to job
+//  in the same order. Caller holds the write lock.
+static zframe_t*
+s_index_pack (zns_store_t *self, s_values_t *job, const byte *wrap_key)
+{
+    job->count = zhashx_size (self->hash);
+    job->plain = (zframe_t **) zmalloc ((job->count + 1) * sizeof (zframe_t *));
+    job->sealed = (zframe_t **) zmalloc ((job->count + 1) * sizeof (zframe_t *));
+    job->deks = (byte *) zmalloc ((job->count + 1) * crypto_secretbox_KEYBYTES);
+    assert (job->plain && job->sealed && job->deks);
+    zmsg_t *msg = zmsg_new ();
+
+    size_t index = 0;
+    for (void *it = zhashx_first (self->hash);
+               it != NULL;
+               it = zhashx_next (self->hash))
+    {
+        s_entry_t *entry = (s_entry_t *) it;
+        zmsg_addstr (msg, (char*) zhashx_cursor (self->hash));
+        byte meta [16];
+        s_put_u64 (meta, entry->version);
+        s_put_u64 (meta + 8, (uint64_t) entry->expires);
+        zmsg_addmem (msg, meta, sizeof (meta));
+        if (wrap_key) {
+            byte wrapped [ZNS_STORE_WRAPPED];
+            randombytes_buf (wrapped, crypto_secretbox_NONCEBYTES);
+            crypto_secretbox_easy (
+                    wrapped + crypto_secretbox_NONCEBYTES,
+                    entry->dek, sizeof entry->dek,
+                    wrapped, wrap_key);
+            zmsg_addmem (msg, wrapped, sizeof (wrapped));
+        }
+        else {
+            s_entry_wrap (self, entry);
+            zmsg_addmem (msg, entry->wrapped, sizeof (entry->wrapped));
+        }
+        job->plain [index] = zframe_new (zchunk_data (entry->value), zchunk_size (entry->value));
+        memcpy (job->deks + index * crypto_secretbox_KEYBYTES, entry->dek, crypto_secretbox_KEYBYTES);
+        index++;
+    }
+
+    byte *buffer;
+    size_t size = zmsg_encode (msg, &buffer);
+    zmsg_destroy (&msg);
+
+    zframe_t *frame = zframe_new (buffer, size);
+    free (buffer);
+    return frame;
+}
+
+//  Wipe and free values and data keys of job
+
+static void
+s_values_free (s_values_t *job)
+{
+    for (size_t i = 0; i != job->count; i++) {
+        if (job->plain [i])
+            sodium_memzero (zframe_data (job->plain [i]), zframe_size (job->plain [i]));
+        zframe_destroy (&job->plain [i]);
+        zframe_destroy (&job->sealed [i]);
+    }
+    free (job->plain);
+    free (job->sealed);
+    sodium_memzero (job->deks, (job->count + 1) * crypto_secretbox_KEYBYTES);
+    free (job->deks);
+}
+
+//  Open values of loader at indexes and add them to the hash, keys expired
+//  in between are dropped. Value which fails to open is counted as
+//  unreadable, so the store is not saved without it. Caller holds the write
+//  lock.
+
+static void
+s_loader_open (zns_store_t *self, size_t *indexes, size_t count)
+{
+    s_loader_t *loader = self->loader;
+    s_values_t job = {loader->cipher, true, count, NULL, NULL, NULL, 0, 0};
+    job.plain = (zframe_t **) zmalloc ((count + 1) * sizeof (zframe_t *));
+    job.sealed = (zframe_t **) zmalloc ((count + 1) * sizeof (zframe_t *));
+    job.deks = (byte *) zmalloc ((count + 1) * crypto_secretbox_KEYBYTES);
+    assert (job.plain && job.sealed && job.deks);
+    for (size_t i = 0; i != count; i++) {
+        size_t index = indexes [i];
+        job.sealed [i] = loader->sealed [index];
+        loader->sealed [index] = NULL;
+        zframe_t *wrapped = loader->records [index * 3 + 2];
+        //  Value of data key which can't be unwrapped fails to open
+        if (zframe_size (wrapped) != ZNS_STORE_WRAPPED
+        ||  crypto_secretbox_open_easy (
+                job.deks + i * crypto_secretbox_KEYBYTES,
+                zframe_data (wrapped) + crypto_secretbox_NONCEBYTES,
+                ZNS_STORE_WRAPPED - crypto_secretbox_NONCEBYTES,
+                zframe_data (wrapped), self->master) != 0)
+            randombytes_buf (job.deks + i * crypto_secretbox_KEYBYTES, crypto_secretbox_KEYBYTES);
+    }
+    s_run_workers (s_value_worker, &job, count);
+
+    int64_t now = zclock_time ();
+    for (size_t i = 0; i != count; i++) {
+        size_t index = indexes [i];
+        zframe_t *meta = loader->records [index * 3 + 1];
+        char *name = zframe_strdup (loader->records [index * 3]);
+        zhashx_delete (loader->pending, name);
+        if (!job.plain [i] || zframe_size (meta) != 16) {
+            zsys_error ("Opening of loaded value '%s' failed, store is not saved until it is loaded again", name);
+            self->unreadable++;
+        }
+        int64_t expires = zframe_size (meta) == 16 ? (int64_t) s_get_u64 (zframe_data (meta) + 8) : 0;
+        if (job.plain [i] && zframe_size (meta) == 16 && (!expires || expires > now)) {
+            zchunk_t *chunk = zchunk_new (zframe_data (job.plain [i]), zframe_size (job.plain [i]));
+            s_entry_t *entry = s_entry_new (chunk, s_get_u64 (zframe_data (meta)));
+            memcpy (entry->dek, job.deks + i * crypto_secretbox_KEYBYTES, sizeof entry->dek);
+            memcpy (entry->wrapped, zframe_data (loader->records [index * 3 + 2]), sizeof entry->wrapped);
+            entry->wrapped_by = self->generation;
+            zhashx_update (self->hash, name, entry);
+            s_entry_expire_at (self, entry, name, expires);
+        }
+        zstr_free (&name);
+        zframe_destroy (&loader->records [index * 3]);
+        zframe_destroy (&loader->records [index * 3 + 1]);
+        zframe_destroy (&loader->records [index * 3 + 2]);
+    }
+    s_values_free (&job);
+}
+
+//  Open at most batch values in order, loader is done when none is left.
+//  Return number of values still waiting. Caller holds the write lock.
+
+static size_t
+s_loader_step (zns_store_t *self, size_t batch)
+{
+    s_loader_t *loader = self->loader;
+    if (!loader)
+        return 0;
+    size_t waiting = zhashx_size (loader->pending);
+    if (batch > waiting)
+        batch = waiting;
+    size_t *indexes = (size_t *) zmalloc ((batch + 1) * sizeof (size_t));
+    assert (indexes);
+    size_t count = 0;
+    //  Values taken on demand are skipped
+    for (; count != batch && loader->next != loader->count; loader->next++)
+        if (loader->sealed [loader->next])
+            indexes [count++] = loader->next;
+    if (count)
+        s_loader_open (self, indexes, count);
+    free (indexes);
+
+    waiting = zhashx_size (loader->pending);
+    if (waiting == 0) {
+        __atomic_store_n (&self->loader, NULL, __ATOMIC_RELEASE);
+        s_loader_destroy (&loader);
+    }
+    return waiting;
+}
+
+static void
+s_loader_take (zns_store_t *self, const char *key, bool open)
+{
+    if (!self->loader)
+        return;
+    s_loader_t *loader = self->loader;
+    size_t index = (size_t) (uintptr_t) zhashx_lookup (loader->pending, key);
+    if (!index)
+        return;
+    index--;
+    if (open)
+        s_loader_open (self, &index, 1);
+    else {
+        zhashx_delete (loader->pending, key);
+        for (int i = 0; i != 3; i++)
+            zframe_destroy (&loader->records [index * 3 + i]);
+        zframe_destroy (&loader->sealed [index]);
+    }
+    //  Last value may be taken before load_step
+    s_loader_step (self, 0);
+}
+
+//  Add header of file to msg, with salt and limits of kdf if not NULL
+
+static int
+s_add_header (zns_store_t *self, zmsg_t *msg, size_t segments, zns_kdf_t *kdf)
+{
+
+    zconfig_t *header = zconfig_new ("header", NULL);
+    if (!header)
+        return -1;
+
+    zconfig_t *version = zconfig_new ("version", header);
+    zconfig_set_value (version, "%d", ZNS_STORE_FORMAT);
+
+    zconfig_t *method = zconfig_new ("method", header);
+    zconfig_set_value (method, "%s", zns_cipher_method (self->cipher));
+
+    zconfig_t *cipher = zconfig_new ("cipher", header);
+    zconfig_set_value (cipher, "%s", zns_cipher_name (self->cipher));
+
+    //  Never encrypt two different contents with the same nonce
+    zconfig_t *nonce = zconfig_new ("nonce", header);
+    zns_nonce_rand (self->nonce);
+    char *nonce_str = zns_nonce_str (self->nonce);
+    if (self->verbose)
+        zsys_debug ("\tnonce_str=%s", nonce_str);
+    zconfig_set_value (nonce, nonce_str, NULL);
+    zstr_free (&nonce_str);
+
+    zconfig_t *sequence = zconfig_new ("sequence", header);
+    zconfig_set_value (sequence, "%" PRIu64, self->sequence);
+
+    zconfig_t *count = zconfig_new ("segments", header);
+    zconfig_set_value (count, "%zu", segments);
+
+    if (kdf)
+        zns_kdf_encode (kdf, header);
+
+    zchunk_t *chunk = zconfig_chunk_save (header);
+    zconfig_destroy (&header);
+    if (!chunk)
+        return -1;
+
+    int r = zmsg_addmem (msg, zchunk_data (chunk), zchunk_size (chunk));
+    if (self->verbose)
+        zsys_debug ("\theader size: %zu", zchunk_size (chunk));
+    zchunk_destroy (&chunk);
+    return r;
+}
+
+//  Encrypt packed index to segments added to msg
+
+static int
+s_add_encrypted_index (
+        zmsg_t *msg, zframe_t *frame, zns_cipher_t *cipher,
+        const byte *nonce, byte key [crypto_secretbox_KEYBYTES])
+{
+    size_t size = zframe_size (frame);
+    size_t count = size ? (size + ZNS_STORE_SEGMENT - 1) / ZNS_STORE_SEGMENT : 1;
+    s_segments_t job = {cipher, key, nonce, false, zframe_data (frame), NULL, NULL, count, 0, 0};
+    job.offsets = (size_t *) zmalloc ((count + 1) * sizeof (size_t));
+    job.sealed = (zframe_t **) zmalloc (count * sizeof (zframe_t *));
+    assert (job.offsets && job.sealed);
+    for (size_t i = 0; i != count; i++) {
+        job.offsets [i] = i * ZNS_STORE_SEGMENT;
+        job.offsets [i + 1] = i + 1 == count ? size : (i + 1) * ZNS_STORE_SEGMENT;
+        job.sealed [i] = zframe_new (NULL, job.offsets [i + 1] - job.offsets [i] + zns_cipher_mac_size (cipher));
+        assert (job.sealed [i]);
+    }
+
+    s_run_workers (s_segment_worker, &job, count);
+    int r = job.result;
+    for (size_t i = 0; i != count; i++)
+        if (r == 0)
+            zmsg_append (msg, &job.sealed [i]);
+        else
+            zframe_destroy (&job.sealed [i]);
+    free (job.offsets);
+    free (job.sealed);
+    return r;
+}
+
+//  Pack the store under the write lock, writers wait only for this, not for
+//  the encryption or the disk. Header goes to msg, values to be sealed to
+//  values, and cipher and nonce of the index are copied for use outside the
+//  lock. Export and save make key the master key and write KDF of the store,
+//  backup wraps data keys by key and writes kdf. Return packed index, NULL
+//  for error.
+
+static zframe_t *
+s_pack (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], zns_kdf_t *kdf, bool backup,
+        zmsg_t *msg, s_values_t *values, zns_cipher_t **cipher_p, byte nonce [crypto_secretbox_NONCEBYTES])
+{
+    pthread_rwlock_wrlock (&self->lock);
+    s_loader_step (self, SIZE_MAX);
+    if (!backup)
+        s_set_master (self, key);
+    //  Values which failed to open would be lost by the file
+    if (self->unreadable)
+        zsys_error ("Store has %zu unreadable values, not packed", self->unreadable);
+    zframe_t *frame = self->unreadable ? NULL : s_index_pack (self, values, backup ? key : NULL);
+    size_t size = frame ? zframe_size (frame) : 0;
+    if (frame && s_add_header (self, msg, size ? (size + ZNS_STORE_SEGMENT - 1) / ZNS_STORE_SEGMENT : 1, backup ? kdf : self->kdf) == -1) {
+        sodium_memzero (zframe_data (frame), size);
+        zframe_destroy (&frame);
+    }
+    *cipher_p = zns_cipher_new (zns_cipher_name (self->cipher));
+    memcpy (nonce, zns_nonce_raw (self->nonce), crypto_secretbox_NONCEBYTES);
+    pthread_rwlock_unlock (&self->lock);
+    if (self->verbose && frame)
+        zsys_debug ("\tpacked index size: %zu, values: %zu", size, values->count);
+    return frame;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the encrypted content of the store in the same format as the file,
+//  or NULL for error. Caller is responsible for destroying the chunk.
+
+zchunk_t *
+zns_store_export (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES])
+{
+    assert (self);
+
+    zmsg_t *msg = zmsg_new ();
+    if (!msg)
+        return NULL;
+
+    s_values_t values = {NULL, false, 0, NULL, NULL, NULL, 0, 0};
+    zns_cipher_t *cipher;
+    byte nonce [crypto_secretbox_NONCEBYTES];
+    int64_t start = zclock_usecs ();
+    zframe_t *frame = s_pack (self, key, NULL, false, msg, &values, &cipher, nonce);
+    start = s_phase (self, "pack", start);
+
+    int r = frame ? s_add_encrypted_index (msg, frame, cipher, nonce, key) : -1;
+    if (frame) {
+        sodium_memzero (zframe_data (frame), zframe_size (frame));
+        zframe_destroy (&frame);
+    }
+    if (r == 0) {
+        values.cipher = cipher;
+        s_run_workers (s_value_worker, &values, values.count);
+        r = values.result;
+        for (size_t i = 0; r == 0 && i != values.count; i++)
+            zmsg_append (msg, &values.sealed [i]);
+    }
+    s_values_free (&values);
+    zns_cipher_destroy (&cipher);
+    if (r == -1) {
+        zmsg_destroy (&msg);
+        return NULL;
+    }
+    start = s_phase (self, "encrypt", start);
+
+    byte *buffer;
+    size_t buffer_size = zmsg_encode (msg, &buffer);
+    zmsg_destroy (&msg);
+    s_phase (self, "encode", start);
+    if (!buffer)
+        return NULL;
+
+    zchunk_t *chunk = zchunk_new (buffer, buffer_size);
+    free (buffer);
+    return chunk;
+}
+
+//  Return size of frame of size bytes encoded like zmsg_encode
+
+static uint64_t
+s_frame_encoded (size_t size)
+{
+    return (size < 0xFF ? 1 : 5) + (uint64_t) size;
+}
+
+//  Write frames encoded like zmsg_encode to io as one buffer, frames are
+//  destroyed
+
+static int
+s_write_frames (zns_io_t *io, zframe_t **frames, size_t count)
+{
+    size_t size = 0;
+    for (size_t i = 0; i != count; i++)
+        size += (size_t) s_frame_encoded (zframe_size (frames [i]));
+    zframe_t *buffer = zframe_new (NULL, size);
+    assert (buffer);
+    byte *dest = zframe_data (buffer);
+    for (size_t i = 0; i != count; i++) {
+        size_t frame_size = zframe_size (frames [i]);
+        if (frame_size < 0xFF)
+            *dest++ = (byte) frame_size;
+        else {
+            *dest++ = 0xFF;
+            for (int j = 0; j != 4; j++)
+                *dest++ = (byte) (frame_size >> (8 * (3 - j)));
+        }
+        memcpy (dest, zframe_data (frames [i]), frame_size);
+        dest += frame_size;
+        zframe_destroy (&frames [i]);
+    }
+    return zns_io_write (io, &buffer);
+}
+
+//  Encrypt values of job in batches and write them to io, every batch is
+//  written while the next one is encrypted. Plain values are wiped as soon
+//  as they are sealed.
+
+static int
+s_write_values (zns_io_t *io, s_values_t *job)
+{
+    int r = 0;
+    size_t first = 0;
+    while (r == 0 && first != job->count) {
+        size_t last = first;
+        size_t bytes = 0;
+        while (last != job->count && (last == first || bytes < ZNS_STORE_SAVE_BATCH))
+            bytes += zframe_size (job->plain [last++]);
+
+        s_values_t batch = *job;
+        batch.count = last - first;
+        batch.plain = job->plain + first;
+        batch.sealed = job->sealed + first;
+        batch.deks = job->deks + first * crypto_secretbox_KEYBYTES;
+        batch.next = 0;
+        batch.result = 0;
+        s_run_workers (s_value_worker, &batch, batch.count);
+        for (size_t i = first; i != last; i++) {
+            sodium_memzero (zframe_data (job->plain [i]), zframe_size (job->plain [i]));
+            zframe_destroy (&job->plain [i]);
+        }
+        r = batch.result;
+        if (r == 0)
+            r = s_write_frames (io, job->sealed + first, batch.count);
+        first = last;
+    }
+    return r;
+}
+
+#if defined (__UTYPE_LINUX) && defined (O_TMPFILE)
+//  Set tmp to path with random suffix of six characters, as mkstemp does,
+//  so saves of the same path at once don't meet
+
+static void
+s_save_tmpname (const char *path, char *tmp)
+{
+    static const char chars [] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    char suffix [7];
+    for (int i = 0; i != 6; i++)
+        suffix [i] = chars [randombytes_uniform (sizeof chars - 1)];
+    suffix [6] = '\0';
+    snprintf (tmp, PATH_MAX, "%s.%s", path, suffix);
+}
+#endif
+
+//  Create file to be saved as path. It is anonymous file in the directory of
+//  path where O_TMPFILE is supported, tmp is set to empty string then.
+//  Otherwise it is tmp named path.XXXXXX by mkstemp, one left by crashed
+//  save stays. Return file descriptor or -1 for error.
+
+static int
+s_save_open (const char *path, char *tmp)
+{
+    int fd;
+#if defined (__UTYPE_LINUX) && defined (O_TMPFILE)
+    char dir [PATH_MAX];
+    strncpy (dir, path, PATH_MAX - 1);
+    dir [PATH_MAX - 1] = '\0';
+    fd = open (dirname (dir), O_TMPFILE | O_CLOEXEC | O_WRONLY, 0600);
+    if (fd != -1) {
+        *tmp = '\0';
+        return fd;
+    }
+    //  Filesystem without O_TMPFILE, e.g. older kernel, NFS or tmpfs of old
+    //  version, gets the named one
+#endif
+    snprintf (tmp, PATH_MAX, "%s.XXXXXX", path);
+    fd = mkstemp (tmp);
+    if (fd == -1) {
+        zsys_error ("Can't create '%s' : %s", tmp, strerror (errno));
+        *tmp = '\0';
+    }
+    else
+        fcntl (fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+//  Reserve size bytes of file at once, so it is not fragmented by growing.
+//  Filesystem which can't do it goes on without.
+
+static void
+s_save_reserve (int fd, uint64_t size)
+{
+#if defined (__UTYPE_LINUX)
+    if (size && fallocate (fd, 0, 0, (off_t) size) == -1
+    &&  errno != EOPNOTSUPP && errno != ENOSYS)
+        zsys_warning ("Can't preallocate %" PRIu64 " bytes: %s", size, strerror (errno));
+#endif
+}
+
+//  Give anonymous file of s_save_open unique name path.XXXXXX, so it can be
+//  renamed to path. Named file has it already. Return 0 for success, -1 for
+//  error.
+
+static int
+s_save_link (int fd, const char *path, char *tmp)
+{
+    if (*tmp)
+        return 0;
+#if defined (__UTYPE_LINUX) && defined (O_TMPFILE)
+    //  AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, /proc link needs /proc
+    //  mounted, either will do
+    char proc [64];
+    snprintf (proc, sizeof proc, "/proc/self/fd/%d", fd);
+    int r = -1;
+    for (int attempt = 0; r == -1 && attempt != 8; attempt++) {
+        s_save_tmpname (path, tmp);
+#   if defined (AT_EMPTY_PATH)
+        r = linkat (fd, "", AT_FDCWD, tmp, AT_EMPTY_PATH);
+        if (r == -1 && errno == EEXIST)
+            continue;
+        if (r == 0)
+            break;
+#   endif
+        r = linkat (AT_FDCWD, proc, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW);
+        if (r == -1 && errno != EEXIST)
+            break;
+    }
+    if (r == -1) {
+        zsys_error ("Can't link '%s' : %s", tmp, strerror (errno));
+        *tmp = '\0';
+    }
+    return r;
+#else
+    return -1;
+#endif
+}
+
+//  Sync directory of path, so rename in it survives crash
+
+static int
+s_save_sync_dir (const char *path)
+{
+    char dir [PATH_MAX];
+    strncpy (dir, path, PATH_MAX - 1);
+    dir [PATH_MAX - 1] = '\0';
+    int fd = open (dirname (dir), O_CLOEXEC | O_RDONLY | O_DIRECTORY);
+    int r = fd == -1 ? -1 : fsync (fd);
+    if (r == -1)
+        zsys_error ("Can't sync directory of '%s' : %s", path, strerror (errno));
+    if (fd != -1)
+        close (fd);
+    return r;
+}
+
+//  Write content of the store to path through temporary file, in the same
+//  format as export, and set size_p to bytes written. Save makes key the
+//  master key and writes KDF of the store. Backup wraps data keys by key
+//  and writes kdf given with it, master key and KDF of the store are left
+//  alone, so REKEY can run meanwhile, and phases are not reported. Return 0
+//  for success, -1 for error.
+
+static int
+s_save (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], zns_kdf_t *kdf, const char *path, bool backup, uint64_t *size_p)
+{
+    zns_store_t *reporter = backup ? NULL : self;
+    zmsg_t *msg = zmsg_new ();
+    if (!msg)
+        return -1;
+
+    s_values_t values = {NULL, false, 0, NULL, NULL, NULL, 0, 0};
+    zns_cipher_t *cipher;
+    byte nonce [crypto_secretbox_NONCEBYTES];
+    int64_t start = zclock_usecs ();
+    zframe_t *frame = s_pack (self, key, kdf, backup, msg, &values, &cipher, nonce);
+    start = s_phase (reporter, "pack", start);
+
+    int r = frame ? s_add_encrypted_index (msg, frame, cipher, nonce, key) : -1;
+    if (frame) {
+        sodium_memzero (zframe_data (frame), zframe_size (frame));
+        zframe_destroy (&frame);
+    }
+    start = s_phase (reporter, "encrypt", start);
+
+    char filename [PATH_MAX] = "";
+    int fd = r == 0 ? s_save_open (path, filename) : -1;
+    if (fd == -1)
+        r = -1;
+
+    //  Header and index first, then values as they are sealed
+    zns_io_t *io = fd == -1 ? NULL : zns_io_new (fd);
+    if (io) {
+        //  Size of the file is known before values are sealed
+        uint64_t total = 0;
+        for (zframe_t *frame = zmsg_first (msg); frame; frame = zmsg_next (msg))
+            total += s_frame_encoded (zframe_size (frame));
+        size_t overhead = zns_cipher_nonce_size (cipher) + zns_cipher_mac_size (cipher);
+        for (size_t i = 0; i != values.count; i++)
+            total += s_frame_encoded (zframe_size (values.plain [i]) + overhead);
+        s_save_reserve (fd, total);
+
+        size_t count = zmsg_size (msg);
+        zframe_t **frames = (zframe_t **) zmalloc ((count + 1) * sizeof (zframe_t *));
+        assert (frames);
+        for (size_t i = 0; i != count; i++)
+            frames [i] = zmsg_pop (msg);
+        r = s_write_frames (io, frames, count);
+        free (frames);
+        values.cipher = cipher;
+        if (r == 0)
+            r = s_write_values (io, &values);
+        if (r == 0)
+            r = zns_io_wait (io);
+        start = s_phase (reporter, "write", start);
+        if (r == 0)
+            r = zns_io_fsync (io);
+        if (r == 0)
+            r = zns_io_wait (io);
+        if (self->verbose)
+            zsys_debug ("\tbytes written to file by %s: %" PRIu64, zns_io_backend (io), zns_io_written (io));
+        //  Preallocated file must be filled exactly
+        if (r == 0 && zns_io_written (io) != total) {
+            zsys_error ("Written %" PRIu64 " bytes instead of %" PRIu64, zns_io_written (io), total);
+            r = -1;
+        }
+        *size_p = zns_io_written (io);
+        zns_io_destroy (&io);
+        if (r == 0)
+            r = s_save_link (fd, path, filename);
+        close (fd);
+        s_phase (reporter, "fsync", start);
+    }
+    zmsg_destroy (&msg);
+    s_values_free (&values);
+    zns_cipher_destroy (&cipher);
+
+    //  Anonymous file is gone with its descriptor
+    if (r == -1 && *filename) {
+        zsys_error ("Writing of '%s' failed, removing it", filename);
+        unlink (filename);
+    }
+    if (r == 0 && rename (filename, path) == -1) {
+        zsys_error ("Rename failed: %s", strerror (errno));
+        unlink (filename);
+        r = -1;
+    }
+    if (r == 0)
+        r = s_save_sync_dir (path);
+    return r;
+}
+
+//  --------------------------------------------------------------------------
+//  Save the keystore to path/file, return 0 for success, -1 for error. The
+//  store is locked only while it is packed, encryption and writing run
+//  after, so other threads using the store wait only for the pack.
+
+int zns_store_save (
+        zns_store_t *self,
+        byte key [crypto_secretbox_KEYBYTES])
+{
+    assert (self);
+
+    if (!self->dir || !self->file)
+        return -1;
+
+    char path [PATH_MAX];
+    snprintf (path, PATH_MAX, "%s/%s", self->dir, self->file);
+    uint64_t size;
+    return s_save (self, key, NULL, path, false, &size);
+}
+
+//  --------------------------------------------------------------------------
+//  Write point in time copy of the store to path in the same format as the
+//  file, return number of bytes written or -1 for error. Data keys are
+//  wrapped by key, which kdf derives, NULL for raw key. Master key and KDF
+//  of the store are not touched and the store is locked only while it is
+//  packed, so it can be called from another thread while the store is in
+//  use, rekeyed included. Phases are not reported.
+
+int64_t
+zns_store_backup (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], zns_kdf_t *kdf, const char *path)
+{
+    assert (self);
+    assert (path);
+
+    uint64_t size;
+    return s_save (self, key, kdf, path, true, &size) == 0 ? (int64_t) size : -1;
+}
+
+//  Decrypted content of exported store
+
+typedef struct {
+    int format;
+    uint64_t sequence;
+    zns_cipher_t *cipher;
+    zframe_t *index;            //  Packed hash, or index of format 4
+    zmsg_t *values;             //  Sealed values of format 4
+} s_image_t;
+
+static void
+s_image_destroy (s_image_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_image_t *self = *self_p;
+        sodium_memzero (zframe_data (self->index), zframe_size (self->index));
+        zframe_destroy (&self->index);
+        zmsg_destroy (&self->values);
+        zns_cipher_destroy (&self->cipher);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Header of store file
+
+typedef struct {
+    int format;
+    zns_cipher_t *cipher;
+    zns_nonce_t *nonce;
+    uint64_t sequence;
+    size_t segments;            //  Encrypted frames of the index
+} s_header_t;
+
+//  Check header frame and fill self, caller destroys its cipher and nonce.
+//  Return 0 for success, -1 for error.
+
+static int
+s_header_check (zframe_t *frame, s_header_t *self)
+{
+    zchunk_t *header_chunk = zchunk_new (zframe_data (frame), zframe_size (frame));
+    zconfig_t *header = zconfig_chunk_load (header_chunk);
+    zchunk_destroy (&header_chunk);
+    if (!header) {
+        zsys_error ("Decoding of header failed");
+        return -1;
+    }
+
+    // check the content of header zconfig
+    int format = atoi (zconfig_get (header, "version", ""));
+    if (format < 1 || format > ZNS_STORE_FORMAT) {
+        zsys_error ("Unsupported version, got '%s', expected '1' to '%d'", zconfig_get (header, "version", ""), ZNS_STORE_FORMAT);
+        zconfig_destroy (&header);
+        return -1;
+    }
+
+    //  Fastest of ciphers is not a name stored in the header
+    const char *cipher_name = zconfig_get (header, "cipher", "");
+    zns_cipher_t *cipher = streq (cipher_name, "fastest") ? NULL : zns_cipher_new (cipher_name);
+    if (!cipher) {
+        zsys_error ("Unsupported cipher, got '%s', expected 'salsa20poly1305', 'xchacha20poly1305_ietf' or 'aes256gcm' supported by this CPU", cipher_name);
+        zconfig_destroy (&header);
+        return -1;
+    }
+
+    if (!streq (zconfig_get (header, "method", ""), zns_cipher_method (cipher))) {
+        zsys_error ("Unsupported method, got '%s', expected '%s'", zconfig_get (header, "method", ""), zns_cipher_method (cipher));
+        zns_cipher_destroy (&cipher);
+        zconfig_destroy (&header);
+        return -1;
+    }
+
+    if (streq (zconfig_get (header, "nonce", "<nonce>"), "<nonce>")) {
+        zsys_error ("Missing nonce, got '%s', expected nonce", zconfig_get (header, "nonce", ""));
+        zns_cipher_destroy (&cipher);
+        zconfig_destroy (&header);
+        return -1;
+    }
+
+    zns_nonce_t *nonce = zns_nonce_new ();
+    int r = zns_nonce_from_str (nonce, zconfig_get (header, "nonce", ""));
+    if (r == -1) {
+        zsys_error ("Can't decode nonce: '%s'", zconfig_get (header, "nonce", ""));
+        zns_nonce_destroy (&nonce);
+        zns_cipher_destroy (&cipher);
+        zconfig_destroy (&header);
+        return -1;
+    }
+    uint64_t sequence = strtoull (zconfig_get (header, "sequence", "0"), NULL, 10);
+    size_t segments = (size_t) strtoull (zconfig_get (header, "segments", "1"), NULL, 10);
+    zconfig_destroy (&header);
+
+    //  Older formats have one frame encrypted by nonce of header, format 4
+    //  has sealed values after the index
+    if (format < 3)
+        segments = 1;
+    self->format = format;
+    self->cipher = cipher;
+    self->nonce = nonce;
+    self->sequence = sequence;
+    self->segments = segments;
+    return 0;
+}
+
+//  Check the header and decrypt the index of decoded content, values of
+//  format 4 stay sealed in the rest of msg. Takes ownership of msg. Store
+//  reporting phases may be NULL.
+
+static s_image_t *
+s_image_decode (zns_store_t *store, zmsg_t *msg, byte key [crypto_secretbox_KEYBYTES], int64_t start)
+{
+    bool verbose = store && store->verbose;
+
+    // header
+    zframe_t *frame = zmsg_pop (msg);
+    if (!frame) {
+        zsys_error ("Extracting of header failed");
+        zmsg_destroy (&msg);
+        return NULL;
+    }
+    if (verbose)
+        zsys_debug ("\theader size: %zu", zframe_size (frame));
+
+    s_header_t checked;
+    int r = s_header_check (frame, &checked);
+    zframe_destroy (&frame);
+    if (r == -1) {
+        zmsg_destroy (&msg);
+        return NULL;
+    }
+    int format = checked.format;
+    zns_cipher_t *cipher = checked.cipher;
+    zns_nonce_t *nonce = checked.nonce;
+    uint64_t sequence = checked.sequence;
+    size_t segments = checked.segments;
+    if (verbose) {
+        char *nonce_str = zns_nonce_str (nonce);
+        zsys_debug ("\tnonce_str=%s", nonce_str);
+        zstr_free (&nonce_str);
+    }
+
+    if (segments == 0 || zmsg_size (msg) < segments
+    ||  (format < 4 && zmsg_size (msg) != segments)) {
+        zsys_error ("Can't read encrypted data frame");
+        zmsg_destroy (&msg);
+        zns_nonce_destroy (&nonce);
+        zns_cipher_destroy (&cipher);
+        return NULL;
+    }
+    start = s_phase (store, "decode", start);
+    s_segments_t job = {cipher, key, zns_nonce_raw (nonce), true, NULL, NULL, NULL, segments, 0, 0};
+    job.offsets = (size_t *) zmalloc ((job.count + 1) * sizeof (size_t));
+    job.sealed = (zframe_t **) zmalloc (job.count * sizeof (zframe_t *));
+    assert (job.offsets && job.sealed);
+    r = 0;
+    for (size_t i = 0; i != job.count; i++) {
+        job.sealed [i] = zmsg_pop (msg);
+        if (zframe_size (job.sealed [i]) < zns_cipher_mac_size (cipher))
+            r = -1;
+        else
+            job.offsets [i + 1] = job.offsets [i] + zframe_size (job.sealed [i]) - zns_cipher_mac_size (cipher);
+    }
+    if (verbose)
+        zsys_debug ("\tencrypted segments: %zu", job.count);
+
+    zframe_t *decrypted = zframe_new (NULL, r == 0 ? job.offsets [job.count] : 0);
+    job.plain = zframe_data (decrypted);
+    if (r == -1)
+        zsys_error ("Can't read encrypted data frame");
+    else
+    if (format < 3)
+        r = zns_cipher_open (
+                cipher,
+                zframe_data (decrypted),
+                zframe_data (job.sealed [0]),
+                zframe_size (job.sealed [0]),
+                zns_nonce_raw (nonce),
+                key);
+    else {
+        s_run_workers (s_segment_worker, &job, job.count);
+        r = job.result;
+    }
+    for (size_t i = 0; i != job.count; i++)
+        zframe_destroy (&job.sealed [i]);
+    free (job.offsets);
+    free (job.sealed);
+    zns_nonce_destroy (&nonce);
+    s_phase (store, "decrypt", start);
+
+    if (r != 0) {
+        zsys_error ("Decrypting of storage failed");
+        sodium_memzero (zframe_data (decrypted), zframe_size (decrypted));
+        zframe_destroy (&decrypted);
+        zns_cipher_destroy (&cipher);
+        zmsg_destroy (&msg);
+        return NULL;
+    }
+    if (verbose)
+        zsys_debug ("\tpacked index size: %zu", zframe_size (decrypted));
+
+    s_image_t *self = (s_image_t *) zmalloc (sizeof (s_image_t));
+    assert (self);
+    self->format = format;
+    self->sequence = sequence;
+    self->cipher = cipher;
+    self->index = decrypted;
+    self->values = msg;
+    return self;
+}
+
+//  Decode content returned by export, check the header and decrypt the index
+
+static s_image_t *
+s_image_open (zns_store_t *store, zchunk_t *buffer, byte key [crypto_secretbox_KEYBYTES])
+{
+    int64_t start = zclock_usecs ();
+    zmsg_t *msg = zmsg_decode (zchunk_data (buffer), zchunk_size (buffer));
+    if (!msg) {
+        zsys_error ("Decoding of message have failed");
+        return NULL;
+    }
+    return s_image_decode (store, msg, key, start);
+}
+
+//  Unpack index of format 4 and open values by their data keys, keys
+//  expired in between are dropped
+
+static zhashx_t *
+s_index_unpack (zns_store_t *store, s_image_t *image, byte key [crypto_secretbox_KEYBYTES])
+{
+    int64_t start = zclock_usecs ();
+    zmsg_t *msg = zmsg_decode (zframe_data (image->index), zframe_size (image->index));
+    if (!msg)
+        return NULL;
+    size_t count = zmsg_size (image->values);
+    if (zmsg_size (msg) != count * 3) {
+        zmsg_destroy (&msg);
+        return NULL;
+    }
+
+    s_values_t job = {image->cipher, true, count, NULL, NULL, NULL, 0, 0};
+    job.plain = (zframe_t **) zmalloc ((count + 1) * sizeof (zframe_t *));
+    job.sealed = (zframe_t **) zmalloc ((count + 1) * sizeof (zframe_t *));
+    job.deks = (byte *) zmalloc ((count + 1) * crypto_secretbox_KEYBYTES);
+    zframe_t **records = (zframe_t **) zmalloc ((count * 3 + 1) * sizeof (zframe_t *));
+    assert (job.plain && job.sealed && job.deks && records);
+    for (size_t i = 0; i != count * 3; i++)
+        records [i] = zmsg_pop (msg);
+    zmsg_destroy (&msg);
+
+    start = s_phase (store, "unpack", start);
+
+    //  Data keys are small, unwrap them here and open values on all cores.
+    //  Record of wrong size fails the load as a bad segment does.
+    for (size_t i = 0; i != count; i++) {
+        job.sealed [i] = zmsg_pop (image->values);
+        zframe_t *wrapped = records [i * 3 + 2];
+        if (zframe_size (records [i * 3 + 1]) != 16
+        ||  zframe_size (wrapped) != ZNS_STORE_WRAPPED
+        ||  crypto_secretbox_open_easy (
+                job.deks + i * crypto_secretbox_KEYBYTES,
+                zframe_data (wrapped) + crypto_secretbox_NONCEBYTES,
+                ZNS_STORE_WRAPPED - crypto_secretbox_NONCEBYTES,
+                zframe_data (wrapped), key) != 0)
+            job.result = -1;
+    }
+    if (job.result == 0)
+        s_run_workers (s_value_worker, &job, count);
+    start = s_phase (store, "decrypt", start);
+
+    zhashx_t *hash = NULL;
+    if (job.result == 0) {
+        hash = zhashx_new ();
+        zhashx_set_destructor (hash, s_destructor);
+        int64_t now = zclock_time ();
+        for (size_t i = 0; i != count; i++) {
+            zframe_t *meta = records [i * 3 + 1];
+            int64_t expires = (int64_t) s_get_u64 (zframe_data (meta) + 8);
+            if (expires && expires <= now)
+                continue;
+            zchunk_t *chunk = zchunk_new (zframe_data (job.plain [i]), zframe_size (job.plain [i]));
+            s_entry_t *entry = s_entry_new (chunk, s_get_u64 (zframe_data (meta)));
+            entry->expires = expires;
+            memcpy (entry->dek, job.deks + i * crypto_secretbox_KEYBYTES, sizeof entry->dek);
+            memcpy (entry->wrapped, zframe_data (records [i * 3 + 2]), sizeof entry->wrapped);
+            char *name = zframe_strdup (records [i * 3]);
+            zhashx_update (hash, name, entry);
+            zstr_free (&name);
+        }
+    }
+    for (size_t i = 0; i != count * 3; i++)
+        zframe_destroy (&records [i]);
+    free (records);
+    s_values_free (&job);
+    s_phase (store, "unpack", start);
+    return hash;
+}
+
+//  Prepare loader of values of format 4, values stay sealed until they are
+//  taken. Return NULL for error.
+
+static s_loader_t *
+s_loader_new (zns_store_t *store, s_image_t *image)
+{
+    int64_t start = zclock_usecs ();
+    zmsg_t *msg = zmsg_decode (zframe_data (image->index), zframe_size (image->index));
+    if (!msg)
+        return NULL;
+    size_t count = zmsg_size (image->values);
+    if (zmsg_size (msg) != count * 3) {
+        zmsg_destroy (&msg);
+        return NULL;
+    }
+    s_loader_t *self = (s_loader_t *) zmalloc (sizeof (s_loader_t));
+    assert (self);
+    self->cipher = zns_cipher_new (zns_cipher_name (image->cipher));
+    self->count = count;
+    self->records = (zframe_t **) zmalloc ((count * 3 + 1) * sizeof (zframe_t *));
+    self->sealed = (zframe_t **) zmalloc ((count + 1) * sizeof (zframe_t *));
+    self->pending = zhashx_new ();
+    assert (self->cipher && self->records && self->sealed && self->pending);
+    for (size_t i = 0; i != count; i++) {
+        for (int j = 0; j != 3; j++)
+            self->records [i * 3 + j] = zmsg_pop (msg);
+        self->sealed [i] = zmsg_pop (image->values);
+        char *name = zframe_strdup (self->records [i * 3]);
+        zhashx_update (self->pending, name, (void *) (uintptr_t) (i + 1));
+        zstr_free (&name);
+    }
+    zmsg_destroy (&msg);
+    s_phase (store, "unpack", start);
+    return self;
+}
+
+//  Import content returned from export, values of format 4 are only
+//  prepared for load_step if lazy
+
+static int
+s_import (zns_store_t *self, zchunk_t *buffer, byte key [crypto_secretbox_KEYBYTES], bool lazy)
+{
+    s_image_t *image = s_image_open (self, buffer, key);
+    if (!image)
+        return -1;
+
+    //  Format 1 has no versions, loaded keys get version newer than
+    //  anything issued before save
+    uint64_t sequence = image->sequence;
+    int64_t start = zclock_usecs ();
+    zhashx_t *hash = NULL;
+    s_loader_t *loader = NULL;
+    if (image->format < 4) {
+        hash = s_zhashx_unpack (image->index, image->format, sequence + 1);
+        s_phase (self, "unpack", start);
+    }
+    else
+    if (lazy) {
+        loader = s_loader_new (self, image);
+        if (loader) {
+            hash = zhashx_new ();
+            zhashx_set_destructor (hash, s_destructor);
+        }
+    }
+    else
+        hash = s_index_unpack (self, image, key);
+    if (!hash) {
+        zsys_error ("Unpacking of storage failed");
+        s_image_destroy (&image);
+        return -1;
+    }
+    if (image->format == 1)
+        sequence++;
+
+    pthread_rwlock_wrlock (&self->lock);
+    zhashx_destroy (&self->hash);
+    self->hash = hash;
+    s_loader_destroy (&self->loader);
+    __atomic_store_n (&self->loader, loader, __ATOMIC_RELEASE);
+    self->unreadable = 0;
+    //  Store is saved again by the cipher it was loaded with, unless
+    //  application has chosen one
+    if (!self->cipher_set) {
+        zns_cipher_destroy (&self->cipher);
+        self->cipher = image->cipher;
+        image->cipher = NULL;
+    }
+    //  Data keys of format 4 come wrapped by the key
+    s_set_master (self, key);
+    for (s_entry_t *entry = (s_entry_t *) zhashx_first (hash);
+                    entry != NULL;
+                    entry = (s_entry_t *) zhashx_next (hash)) {
+        s_entry_expire_at (self, entry, (const char *) zhashx_cursor (hash), entry->expires);
+        if (image->format == 4)
+            entry->wrapped_by = self->generation;
+    }
+    if (self->sequence < sequence)
+        self->sequence = sequence;
+    pthread_rwlock_unlock (&self->lock);
+    s_image_destroy (&image);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Replace the content of the store by content returned from export, return
+//  0 for success, -1 for error
+
+int
+zns_store_import (zns_store_t *self, zchunk_t *buffer, byte key [crypto_secretbox_KEYBYTES])
+{
+    assert (self);
+    assert (buffer);
+    return s_import (self, buffer, key, false);
+}
+
+//  --------------------------------------------------------------------------
+//  Return copy of value of key from content returned by export or NULL if
+//  the key is missing or for error. Only the index and the value of key are
+//  decrypted, except for files saved before format 4.
+
+zchunk_t *
+zns_store_extract (zchunk_t *buffer, const char *name, byte key [crypto_secretbox_KEYBYTES])
+{
+    assert (buffer);
+    assert (name);
+
+    s_image_t *image = s_image_open (NULL, buffer, key);
+    if (!image)
+        return NULL;
+
+    zchunk_t *value = NULL;
+    if (image->format < 4) {
+        zhashx_t *hash = s_zhashx_unpack (image->index, image->format, 0);
+        s_entry_t *entry = hash ? (s_entry_t *) zhashx_lookup (hash, name) : NULL;
+        if (entry)
+            value = zchunk_dup (entry->value);
+        zhashx_destroy (&hash);
+        s_image_destroy (&image);
+        return value;
+    }
+
+    zmsg_t *msg = zmsg_decode (zframe_data (image->index), zframe_size (image->index));
+    if (!msg || zmsg_size (msg) != zmsg_size (image->values) * 3) {
+        zmsg_destroy (&msg);
+        s_image_destroy (&image);
+        return NULL;
+    }
+    zframe_t *sealed = zmsg_first (image->values);
+    while (zmsg_size (msg) > 0) {
+        zframe_t *record = zmsg_pop (msg);
+        zframe_t *meta = zmsg_pop (msg);
+        zframe_t *wrapped = zmsg_pop (msg);
+        int64_t expires = zframe_size (meta) == 16 ? (int64_t) s_get_u64 (zframe_data (meta) + 8) : 0;
+        if (zframe_streq (record, name)
+        &&  (!expires || expires > zclock_time ())
+        &&  zframe_size (wrapped) == ZNS_STORE_WRAPPED) {
+            //  The same as load, but for one value only
+            s_values_t job = {image->cipher, true, 1, NULL, NULL, NULL, 0, 0};
+            zframe_t *plain = NULL;
+            byte dek [crypto_secretbox_KEYBYTES];
+            job.plain = &plain;
+            job.sealed = &sealed;
+            job.deks = dek;
+            if (crypto_secretbox_open_easy (
+                    job.deks,
+                    zframe_data (wrapped) + crypto_secretbox_NONCEBYTES,
+                    ZNS_STORE_WRAPPED - crypto_secretbox_NONCEBYTES,
+                    zframe_data (wrapped), key) == 0) {
+                s_value_worker (&job);
+                if (job.result == 0)
+                    value = zchunk_new (zframe_data (plain), zframe_size (plain));
+            }
+            if (plain)
+                sodium_memzero (zframe_data (plain), zframe_size (plain));
+            zframe_destroy (&plain);
+            sodium_memzero (dek, sizeof dek);
+        }
+        zframe_destroy (&record);
+        zframe_destroy (&meta);
+        zframe_destroy (&wrapped);
+        if (value)
+            break;
+        sealed = zmsg_next (image->values);
+    }
+    zmsg_destroy (&msg);
+    s_image_destroy (&image);
+    return value;
+}
+
+//  Read size of next frame of encoded zmsg from file, return 0 for success,
+//  -1 at the end or for error
+
+static int
+s_frame_size (FILE *file, size_t *size_p)
+{
+    int c = fgetc (file);
+    if (c == EOF)
+        return -1;
+    size_t size = (size_t) c;
+    if (size == 0xFF) {
+        byte buffer [4];
+        if (fread (buffer, 1, sizeof buffer, file) != sizeof buffer)
+            return -1;
+        size = ((size_t) buffer [0] << 24) | ((size_t) buffer [1] << 16)
+             | ((size_t) buffer [2] << 8) | (size_t) buffer [3];
+    }
+    *size_p = size;
+    return 0;
+}
+
+//  Read next frame of encoded zmsg from file, NULL at the end or for error.
+//  Frame longer than the rest of the file is an error, so damaged size is
+//  not allocated.
+
+static zframe_t *
+s_frame_read (FILE *file)
+{
+    size_t size;
+    if (s_frame_size (file, &size) == -1)
+        return NULL;
+    struct stat stat;
+    off_t offset = ftello (file);
+    if (offset == -1 || fstat (fileno (file), &stat) == -1
+    ||  stat.st_size < offset || (uint64_t) size > (uint64_t) (stat.st_size - offset))
+        return NULL;
+    zframe_t *frame = zframe_new (NULL, size);
+    if (frame && size && fread (zframe_data (frame), 1, size, file) != size)
+        zframe_destroy (&frame);
+    return frame;
+}
+
+//  Read header and encrypted index of file, values are left in the file
+
+static s_image_t *
+s_image_read (zns_store_t *self, FILE *file, byte key [crypto_secretbox_KEYBYTES])
+{
+    int64_t start = zclock_usecs ();
+    zframe_t *frame = s_frame_read (file);
+    if (!frame) {
+        zsys_error ("Extracting of header failed");
+        return NULL;
+    }
+    s_header_t header;
+    if (s_header_check (frame, &header) == -1) {
+        zframe_destroy (&frame);
+        return NULL;
+    }
+    size_t segments = header.segments;
+    zns_cipher_destroy (&header.cipher);
+    zns_nonce_destroy (&header.nonce);
+
+    //  The header is checked again by decode
+    zmsg_t *msg = zmsg_new ();
+    zmsg_append (msg, &frame);
+    for (size_t i = 0; i != segments; i++) {
+        frame = s_frame_read (file);
+        if (!frame)
+            break;
+        zmsg_append (msg, &frame);
+    }
+    return s_image_decode (self, msg, key, start);
+}
+
+//  --------------------------------------------------------------------------
+//  Call scan_fn with every key of path/file which has not expired, the store
+//  itself is not changed. Values of format 4 are read from the file and
+//  opened one at a time, so only the index is held in memory, files of
+//  older formats are read whole. Return 0 for success, -1 for error or if
+//  scan_fn stopped the scan.
+
+int
+zns_store_scan (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], zns_store_scan_fn *scan_fn, void *arg)
+{
+    assert (self);
+    assert (scan_fn);
+    if (!self->dir || !self->file)
+        return -1;
+
+    char filename [PATH_MAX];
+    snprintf (filename, PATH_MAX, "%s/%s", self->dir, self->file);
+    FILE *file = fopen (filename, "rb");
+    if (!file) {
+        zsys_error ("Can't open '%s' for reading: %s", filename, strerror (errno));
+        return -1;
+    }
+    s_image_t *image = s_image_read (self, file, key);
+    if (!image) {
+        fclose (file);
+        return -1;
+    }
+
+    int r = 0;
+    bool broken = false;
+    if (image->format < 4) {
+        uint64_t sequence = image->sequence;
+        zhashx_t *hash = s_zhashx_unpack (image->index, image->format, sequence + 1);
+        broken = !hash;
+        for (s_entry_t *entry = hash ? (s_entry_t *) zhashx_first (hash) : NULL;
+                        entry != NULL && r == 0;
+                        entry = (s_entry_t *) zhashx_next (hash))
+            r = scan_fn ((const char *) zhashx_cursor (hash), entry->value, entry->version, entry->expires, arg);
+        zhashx_destroy (&hash);
+    }
+    else {
+        //  The same as extract, but value of every record is read in turn
+        zmsg_t *msg = zmsg_decode (zframe_data (image->index), zframe_size (image->index));
+        broken = !msg || zmsg_size (msg) % 3 != 0;
+        int64_t now = zclock_time ();
+        while (!broken && r == 0 && zmsg_size (msg) > 0) {
+            zframe_t *record = zmsg_pop (msg);
+            zframe_t *meta = zmsg_pop (msg);
+            zframe_t *wrapped = zmsg_pop (msg);
+            zframe_t *sealed = s_frame_read (file);
+            zframe_t *plain = NULL;
+            byte dek [crypto_secretbox_KEYBYTES];
+            s_values_t job = {image->cipher, true, 1, &plain, dek, &sealed, 0, 0};
+            broken = !sealed
+                  || zframe_size (meta) != 16
+                  || zframe_size (wrapped) != ZNS_STORE_WRAPPED
+                  || crypto_secretbox_open_easy (
+                        dek,
+                        zframe_data (wrapped) + crypto_secretbox_NONCEBYTES,
+                        ZNS_STORE_WRAPPED - crypto_secretbox_NONCEBYTES,
+                        zframe_data (wrapped), key) != 0;
+            if (!broken) {
+                s_value_worker (&job);
+                broken = job.result != 0;
+            }
+            int64_t expires = broken ? 0 : (int64_t) s_get_u64 (zframe_data (meta) + 8);
+            if (!broken && (!expires || expires > now)) {
+                zchunk_t *value = zchunk_new (zframe_data (plain), zframe_size (plain));
+                char *name = zframe_strdup (record);
+                r = scan_fn (name, value, s_get_u64 (zframe_data (meta)), expires, arg);
+                zstr_free (&name);
+                zchunk_fill (value, 0x00, zchunk_max_size (value));
+                zchunk_destroy (&value);
+            }
+            if (plain)
+                sodium_memzero (zframe_data (plain), zframe_size (plain));
+            zframe_destroy (&plain);
+            sodium_memzero (dek, sizeof dek);
+            zframe_destroy (&sealed);
+            zframe_destroy (&record);
+            zframe_destroy (&meta);
+            zframe_destroy (&wrapped);
+        }
+        zmsg_destroy (&msg);
+    }
+    if (broken) {
+        zsys_error ("Scanning of '%s' failed", filename);
+        r = -1;
+    }
+    s_image_destroy (&image);
+    fclose (file);
+    return r;
+}
+
+//  Verify reads the index and the values of store file by two handles in
+//  step, so only one segment of the index and one value are in memory
+
+struct _s_verifier_t {
+    FILE *index;                //  Reads header and segments of the index
+    FILE *values;               //  Reads values of format 4
+    uint64_t size;              //  Size of the file
+    s_header_t header;
+    byte *key;                  //  Key of the file, locked memory
+    size_t segment;             //  Next segment of the index
+    uint64_t index_at;          //  Offset of the first segment
+    uint64_t values_at;         //  Offset of the first value
+    byte *plain;                //  Plain index not parsed yet
+    size_t plain_size;
+    size_t parsed;              //  Bytes of plain already parsed
+    bool lost;                  //  Index is corrupted, values can't be checked
+    bool done;
+    int corrupted;              //  Number of corrupted ranges
+    zns_store_corrupt_fn *corrupt_fn;
+    void *corrupt_arg;
+};
+
+static void
+s_verifier_plain_free (s_verifier_t *self)
+{
+    if (self->plain)
+        sodium_memzero (self->plain, self->plain_size);
+    free (self->plain);
+    self->plain = NULL;
+    self->plain_size = 0;
+    self->parsed = 0;
+}
+
+static void
+s_verifier_destroy (s_verifier_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_verifier_t *self = *self_p;
+        if (self->index)
+            fclose (self->index);
+        if (self->values)
+            fclose (self->values);
+        zns_cipher_destroy (&self->header.cipher);
+        zns_nonce_destroy (&self->header.nonce);
+        sodium_free (self->key);
+        s_verifier_plain_free (self);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static void
+s_verifier_corrupt (s_verifier_t *self, uint64_t offset, uint64_t size, const char *what)
+{
+    self->corrupted++;
+    if (self->corrupt_fn)
+        self->corrupt_fn (offset, size, what, self->corrupt_arg);
+}
+
+//  Return size of frame of encoded zmsg in data, header included, 0 if the
+//  frame is not complete
+
+static size_t
+s_frame_peek (const byte *data, size_t size)
+{
+    if (size < 1)
+        return 0;
+    size_t frame_size = data [0];
+    size_t offset = 1;
+    if (frame_size == 0xFF) {
+        if (size < 5)
+            return 0;
+        frame_size = ((size_t) data [1] << 24) | ((size_t) data [2] << 16)
+                   | ((size_t) data [3] << 8) | (size_t) data [4];
+        offset = 5;
+    }
+    return size - offset < frame_size ? 0 : offset + frame_size;
+}
+
+//  Return size of the next record of parsed index, 0 if it is not complete
+//  yet. Sizes of its three frames are stored to frames.
+
+static size_t
+s_verifier_record (s_verifier_t *self, size_t frames [3])
+{
+    size_t offset = self->parsed;
+    for (int i = 0; i != 3; i++) {
+        frames [i] = s_frame_peek (self->plain + offset, self->plain_size - offset);
+        if (!frames [i])
+            return 0;
+        offset += frames [i];
+    }
+    return offset - self->parsed;
+}
+
+//  Authenticate next segment of the index, plain index of format 4 is kept
+//  for parsing. Return bytes read.
+
+static uint64_t
+s_verifier_segment (s_verifier_t *self)
+{
+    uint64_t offset = (uint64_t) ftello (self->index);
+    zframe_t *sealed = s_frame_read (self->index);
+    size_t index = self->segment++;
+    if (!sealed) {
+        //  File is cut off, nothing after can be read
+        s_verifier_corrupt (self, offset, self->size - offset, "index");
+        self->segment = self->header.segments;
+        self->lost = true;
+        s_verifier_plain_free (self);
+        return self->size - offset;
+    }
+    uint64_t size = (uint64_t) ftello (self->index) - offset;
+
+    //  Records may continue to the next segment
+    zns_cipher_t *cipher = self->header.cipher;
+    size_t kept = self->lost ? 0 : self->plain_size - self->parsed;
+    byte *plain = NULL;
+    size_t plain_size = 0;
+    int r = -1;
+    if (zframe_size (sealed) >= zns_cipher_mac_size (cipher)) {
+        plain_size = kept + zframe_size (sealed) - zns_cipher_mac_size (cipher);
+        plain = (byte *) zmalloc (plain_size + 1);
+        assert (plain);
+        if (kept)
+            memcpy (plain, self->plain + self->parsed, kept);
+        byte nonce [crypto_secretbox_NONCEBYTES];
+        memcpy (nonce, zns_nonce_raw (self->header.nonce), sizeof nonce);
+        if (self->header.format > 2) {
+            s_segments_t job = {cipher, self->key, zns_nonce_raw (self->header.nonce), true, NULL, NULL, NULL, self->header.segments, 0, 0};
+            s_segment_nonce (&job, index, nonce);
+        }
+        r = zns_cipher_open (cipher, plain + kept, zframe_data (sealed), zframe_size (sealed), nonce, self->key);
+    }
+    zframe_destroy (&sealed);
+    s_verifier_plain_free (self);
+    if (r != 0) {
+        s_verifier_corrupt (self, offset, size, "index");
+        self->lost = true;
+    }
+    if (plain && r == 0 && !self->lost && self->header.format == 4) {
+        self->plain = plain;
+        self->plain_size = plain_size;
+    }
+    else
+    if (plain) {
+        sodium_memzero (plain, plain_size);
+        free (plain);
+    }
+    return size;
+}
+
+//  Authenticate value of the next record of parsed index. Return bytes
+//  read.
+
+static uint64_t
+s_verifier_value (s_verifier_t *self, size_t frames [3])
+{
+    const byte *record = self->plain + self->parsed;
+    size_t name_at = record [0] == 0xFF ? 5 : 1;
+    char *name = strndup ((const char *) record + name_at, frames [0] - name_at);
+    const byte *meta = record + frames [0];
+    size_t meta_size = frames [1] - (meta [0] == 0xFF ? 5 : 1);
+    const byte *wrapped = meta + frames [1];
+    size_t wrapped_size = frames [2] - (wrapped [0] == 0xFF ? 5 : 1);
+    wrapped += wrapped [0] == 0xFF ? 5 : 1;
+    self->parsed += frames [0] + frames [1] + frames [2];
+
+    uint64_t offset = (uint64_t) ftello (self->values);
+    zframe_t *sealed = s_frame_read (self->values);
+    if (!sealed) {
+        //  Values after are missing too
+        s_verifier_corrupt (self, offset, self->size - offset, name);
+        self->lost = true;
+        fseeko (self->values, 0, SEEK_END);
+        zstr_free (&name);
+        return self->size - offset;
+    }
+    uint64_t size = (uint64_t) ftello (self->values) - offset;
+    zframe_t *plain = NULL;
+    byte dek [crypto_secretbox_KEYBYTES];
+    s_values_t job = {self->header.cipher, true, 1, &plain, dek, &sealed, 0, -1};
+    if (meta_size == 16
+    &&  wrapped_size == ZNS_STORE_WRAPPED
+    &&  crypto_secretbox_open_easy (
+            dek,
+            wrapped + crypto_secretbox_NONCEBYTES,
+            ZNS_STORE_WRAPPED - crypto_secretbox_NONCEBYTES,
+            wrapped, self->key) == 0) {
+        job.result = 0;
+        s_value_worker (&job);
+    }
+    if (job.result != 0)
+        s_verifier_corrupt (self, offset, size, name);
+    if (plain)
+        sodium_memzero (zframe_data (plain), zframe_size (plain));
+    zframe_destroy (&plain);
+    sodium_memzero (dek, sizeof dek);
+    zframe_destroy (&sealed);
+    zstr_free (&name);
+    return size;
+}
+
+//  Report what is left over once the index is done
+
+static void
+s_verifier_finish (s_verifier_t *self)
+{
+    if (self->header.format < 4) {
+        uint64_t offset = (uint64_t) ftello (self->index);
+        if (!self->lost && offset < self->size)
+            s_verifier_corrupt (self, offset, self->size - offset, "values");
+    }
+    else {
+        //  Authentic index must be parsed whole, values after the last one
+        //  belong to no key
+        if (!self->lost && self->parsed != self->plain_size)
+            s_verifier_corrupt (self, self->index_at, self->values_at - self->index_at, "index");
+        uint64_t offset = (uint64_t) ftello (self->values);
+        if (offset < self->size)
+            s_verifier_corrupt (self, offset, self->size - offset, self->lost ? "unverified" : "values");
+    }
+    s_verifier_plain_free (self);
+    self->done = true;
+}
+
+//  --------------------------------------------------------------------------
+//  Start verifying path/file by key, the store itself is not touched. Every
+//  corrupted range is reported to corrupt_fn, which may be NULL. Return 0
+//  for success, -1 if the file can't be read.
+
+int
+zns_store_verify_begin (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], zns_store_corrupt_fn *corrupt_fn, void *arg)
+{
+    assert (self);
+    s_verifier_destroy (&self->verifier);
+    char filename [PATH_MAX];
+    pthread_rwlock_rdlock (&self->lock);
+    bool named = self->dir && self->file;
+    if (named)
+        snprintf (filename, PATH_MAX, "%s/%s", self->dir, self->file);
+    pthread_rwlock_unlock (&self->lock);
+    if (!named)
+        return -1;
+
+    s_verifier_t *verifier = (s_verifier_t *) zmalloc (sizeof (s_verifier_t));
+    assert (verifier);
+    verifier->index = fopen (filename, "rb");
+    verifier->values = fopen (filename, "rb");
+    if (!verifier->index || !verifier->values) {
+        zsys_error ("Can't open '%s' for reading: %s", filename, strerror (errno));
+        s_verifier_destroy (&verifier);
+        return -1;
+    }
+    fseeko (verifier->index, 0, SEEK_END);
+    verifier->size = (uint64_t) ftello (verifier->index);
+    rewind (verifier->index);
+    verifier->key = (byte *) sodium_malloc (crypto_secretbox_KEYBYTES);
+    assert (verifier->key);
+    memcpy (verifier->key, key, crypto_secretbox_KEYBYTES);
+    verifier->corrupt_fn = corrupt_fn;
+    verifier->corrupt_arg = arg;
+    self->verifier = verifier;
+
+    zframe_t *frame = s_frame_read (verifier->index);
+    if (!frame || s_header_check (frame, &verifier->header) == -1) {
+        uint64_t size = frame ? (uint64_t) ftello (verifier->index) : verifier->size;
+        s_verifier_corrupt (verifier, 0, size, "header");
+        verifier->lost = true;
+        verifier->done = true;
+        zframe_destroy (&frame);
+        return 0;
+    }
+    zframe_destroy (&frame);
+
+    //  Values follow the index, sizes of its segments tell where
+    verifier->index_at = (uint64_t) ftello (verifier->index);
+    verifier->values_at = verifier->index_at;
+    fseeko (verifier->values, (off_t) verifier->values_at, SEEK_SET);
+    size_t size;
+    for (size_t i = 0; i != verifier->header.segments; i++) {
+        if (s_frame_size (verifier->values, &size) == -1
+        ||  verifier->size - (uint64_t) ftello (verifier->values) < size) {
+            //  Cut off, reported by the segment
+            fseeko (verifier->values, 0, SEEK_END);
+            break;
+        }
+        fseeko (verifier->values, (off_t) size, SEEK_CUR);
+    }
+    verifier->values_at = (uint64_t) ftello (verifier->values);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Authenticate next segments of the index and values until at least bytes
+//  of file are read. Index and values are read by two handles in step, so
+//  only one segment and one value are in memory. Return number of bytes
+//  read, 0 when the whole file is verified. Calls of verify must come from
+//  one thread.
+
+size_t
+zns_store_verify_step (zns_store_t *self, size_t bytes)
+{
+    assert (self);
+    s_verifier_t *verifier = self->verifier;
+    uint64_t read = 0;
+    while (verifier && !verifier->done && (read == 0 || read < bytes)) {
+        size_t frames [3];
+        if (!verifier->lost && s_verifier_record (verifier, frames))
+            read += s_verifier_value (verifier, frames);
+        else
+        if (verifier->segment < verifier->header.segments)
+            read += s_verifier_segment (verifier);
+        else
+            s_verifier_finish (verifier);
+    }
+    return (size_t) read;
+}
+
+//  --------------------------------------------------------------------------
+//  Finish verify, return number of corrupted ranges found, -1 if none was
+//  started
+
+int
+zns_store_verify_end (zns_store_t *self)
+{
+    assert (self);
+    if (!self->verifier)
+        return -1;
+    int corrupted = self->verifier->corrupted;
+    s_verifier_destroy (&self->verifier);
+    return corrupted;
+}
+
+//  --------------------------------------------------------------------------
+//  Verify path/file at once, reading at most rate bytes per second, 0 for
+//  no limit. Return number of corrupted ranges, -1 if the file can't be
+//  read.
+
+int
+zns_store_verify (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], size_t rate, zns_store_corrupt_fn *corrupt_fn, void *arg)
+{
+    assert (self);
+    if (zns_store_verify_begin (self, key, corrupt_fn, arg) == -1)
+        return -1;
+    int64_t start = zclock_usecs ();
+    uint64_t total = 0;
+    size_t read;
+    while ((read = zns_store_verify_step (self, ZNS_STORE_VERIFY_STEP)) > 0) {
+        total += read;
+        if (rate) {
+            //  Sleep until reading of total bytes at rate is due
+            int64_t due = start + (int64_t) ((double) total * 1000000.0 / rate);
+            int64_t now = zclock_usecs ();
+            if (due > now)
+                zclock_sleep ((int) ((due - now) / 1000));
+        }
+    }
+    return zns_store_verify_end (self);
+}
+
+//  --------------------------------------------------------------------------
+//  Start rewrapping data keys of all values by new master key used by next
+//  export and save. Values themselves are not encrypted again, so it keeps
+//  the store safe from leaked old password or master key, not from leaked
+//  data keys, which stay valid for values written before.
+
+void
+zns_store_rekey (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES])
+{
+    assert (self);
+    pthread_rwlock_wrlock (&self->lock);
+    //  Values still being loaded are wrapped by the old key
+    s_loader_step (self, SIZE_MAX);
+    s_set_master (self, key);
+    zlistx_destroy (&self->rekey);
+    self->rekey = zhashx_keys (self->hash);
+    pthread_rwlock_unlock (&self->lock);
+}
+
+//  --------------------------------------------------------------------------
+//  Rewrap at most batch data keys waiting for new master key, return number
+//  of keys still waiting. Export wraps the rest at once.
+
+size_t
+zns_store_rewrap (zns_store_t *self, size_t batch)
+{
+    assert (self);
+    pthread_rwlock_wrlock (&self->lock);
+    for (size_t i = 0; i != batch && self->rekey && zlistx_size (self->rekey); i++) {
+        //  Keys deleted since have nothing to rewrap
+        char *key = (char *) zlistx_detach (self->rekey, NULL);
+        s_entry_t *entry = (s_entry_t *) zhashx_lookup (self->hash, key);
+        if (entry)
+            s_entry_wrap (self, entry);
+        zstr_free (&key);
+    }
+    size_t waiting = self->rekey ? zlistx_size (self->rekey) : 0;
+    if (waiting == 0)
+        zlistx_destroy (&self->rekey);
+    pthread_rwlock_unlock (&self->lock);
+    return waiting;
+}
+
+//  Read and import path/file, lazy as in s_import
+
+static int
+s_load (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES], bool lazy)
+{
+    if (self->verbose)
+        zsys_debug ("zns_store_load:");
+    assert (self);
+    if (!self->dir || !self->file)
+        return -1;
+
+    zfile_t *file = zfile_new (self->dir, self->file);
     if (!file)
         return -1;
 
@@ -375,166 +2885,492 @@ zns_store_load (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES])
         return -1;
     }
 
-    if (!zsys_file_mode (zfile_filename (file, NULL)) == 0600) {
+    if ((zsys_file_mode (zfile_filename (file, NULL)) & 0777) != 0600) {
         zsys_error ("file '%s' must be readable/writable only by user", zfile_filename (file, NULL));
         zfile_destroy (&file);
         return -1;
     }
 
-    int r = zfile_input (file);
-    if (r != 0) {
+    int fd = open (zfile_filename (file, NULL), O_CLOEXEC | O_RDONLY);
+    if (fd == -1) {
         zsys_error ("Can't open '%s' for reading: %s", zfile_filename (file, NULL), strerror (errno));
         zfile_destroy (&file);
         return -1;
     }
+    zfile_destroy (&file);
 
-    zfile_restat (file);
-    size_t buffer_size = zfile_cursize (file);
+    struct stat st;
+    size_t buffer_size = fstat (fd, &st) == 0 ? (size_t) st.st_size : 0;
     if (self->verbose)
         zsys_debug ("\tfile size: %zu", buffer_size);
-    zchunk_t *buffer = zfile_read (file, buffer_size, 0);
-    if (self->verbose)
-        zsys_debug ("\toverall buffer size: %zu", zchunk_size (buffer));
-    const char *error_message = strerror (errno);
-    zfile_close (file);
-    zfile_destroy (&file);
+    int64_t start = zclock_usecs ();
+    //  Whole file is read by chunks in flight at once
+    zchunk_t *buffer = zchunk_new (NULL, buffer_size);
+    zchunk_fill (buffer, 0, buffer_size);
+    zns_io_t *io = zns_io_new (fd);
+    int r = zns_io_read (io, zchunk_data (buffer), buffer_size, 0);
+    zns_io_destroy (&io);
+    close (fd);
+    s_phase (self, "read", start);
 
-    if (!buffer) {
-        zsys_error ("Read failed: %s", error_message);
+    if (r == -1 || buffer_size == 0) {
+        zsys_error ("Read failed");
+        zchunk_destroy (&buffer);
         return -1;
     }
+    if (self->verbose)
+        zsys_debug ("\toverall buffer size: %zu", zchunk_size (buffer));
 
-    zmsg_t *msg = zmsg_decode (zchunk_data (buffer), zchunk_size (buffer));
+    r = s_import (self, buffer, key, lazy);
     zchunk_destroy (&buffer);
-    if (!msg) {
-        zsys_error ("Decoding of message have failed");
-        return -1;
-    }
+    return r;
+}
 
-    // header
-    zframe_t *frame = zmsg_pop (msg);
-    if (!frame) {
-        zsys_error ("Extracting of header failed");
-        zmsg_destroy (&msg);
-        return -1;
-    }
-    if (self->verbose)
-        zsys_debug ("\tpacked zhashx size: %zu", zframe_size (frame));
+//  --------------------------------------------------------------------------
+//  Load the keystore from path/file, return 0 for success, -1 for error
 
-    zchunk_t *header_chunk = zchunk_new (zframe_data (frame), zframe_size (frame));
-    zframe_destroy (&frame);
-    zconfig_t *header = zconfig_chunk_load (header_chunk);
-    zchunk_destroy (&header_chunk);
-    if (!header) {
-        zsys_error ("Decoding of header failed");
-        zconfig_destroy (&header);
-        zmsg_destroy (&msg);
-        return -1;
-    }
+int
+zns_store_load (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES])
+{
+    return s_load (self, key, false);
+}
 
-    // check the content of header zconfig
-    if (!streq (zconfig_get (header, "version", ""), "1")) {
-        zsys_error ("Unsupported version, got '%s', expected '1'", zconfig_get (header, "version", ""));
-        zconfig_destroy (&header);
-        zmsg_destroy (&msg);
+//  --------------------------------------------------------------------------
+//  Load the keystore from path/file like zns_store_load, but values sealed
+//  by their data keys stay sealed until load_step or until their key is
+//  used, so the store can serve at once. Store saved before format 4 is
+//  loaded whole. Return 0 for success, -1 for error.
+
+int
+zns_store_load_begin (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES])
+{
+    return s_load (self, key, true);
+}
+
+//  --------------------------------------------------------------------------
+//  Open at most batch values waiting since load_begin, return number of
+//  values still waiting. Save, export and rekey open the rest at once.
+
+size_t
+zns_store_load_step (zns_store_t *self, size_t batch)
+{
+    assert (self);
+    pthread_rwlock_wrlock (&self->lock);
+    size_t waiting = s_loader_step (self, batch);
+    pthread_rwlock_unlock (&self->lock);
+    return waiting;
+}
+
+//  --------------------------------------------------------------------------
+//  Memory file of handover has the header of store file as the first frame,
+//  then check of the key, a constant sealed by it, and all keys in form
+//  key, version, expiry time, data key, wrapped data key and value, sizes
+//  and numbers as big endian u64.
+
+#define ZNS_STORE_CHECK "zenstore"
+#define ZNS_STORE_CHECK_SIZE (crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + 8)
+
+static int
+s_write_u64 (FILE *file, uint64_t value)
+{
+    byte buffer [8];
+    s_put_u64 (buffer, value);
+    return fwrite (buffer, 8, 1, file) == 1 ? 0 : -1;
+}
+
+static int
+s_write_mem (FILE *file, const void *data, size_t size)
+{
+    if (s_write_u64 (file, size) == -1)
         return -1;
-    }
+    return size == 0 || fwrite (data, size, 1, file) == 1 ? 0 : -1;
+}
 
-    if (!streq (zconfig_get (header, "method", ""), "crypto_secretbox")) {
-        zsys_error ("Unsupported method, got '%s', expected 'crypto_secretbox'", zconfig_get (header, "method", ""));
-        zconfig_destroy (&header);
-        zmsg_destroy (&msg);
+//  Write content of the store to file, caller holds the write lock
+
+static int
+s_handover_write (zns_store_t *self, FILE *file, byte key [crypto_secretbox_KEYBYTES])
+{
+    zconfig_t *header = zconfig_new ("header", NULL);
+    zconfig_put (header, "handover", "1");
+    zconfig_put (header, "cipher", zns_cipher_name (self->cipher));
+    zconfig_putf (header, "sequence", "%" PRIu64, self->sequence);
+    zconfig_putf (header, "keys", "%zu", zhashx_size (self->hash));
+    if (self->kdf)
+        zns_kdf_encode (self->kdf, header);
+    zchunk_t *chunk = zconfig_chunk_save (header);
+    zconfig_destroy (&header);
+    if (!chunk)
         return -1;
+
+    //  Header is encoded as the first frame of zmsg, like in store file
+    byte size [5] = {0xFF, 0, 0, 0, 0};
+    for (int i = 0; i != 4; i++)
+        size [i + 1] = (byte) (zchunk_size (chunk) >> (8 * (3 - i)));
+    int r = fwrite (size, sizeof size, 1, file) == 1
+         && fwrite (zchunk_data (chunk), zchunk_size (chunk), 1, file) == 1 ? 0 : -1;
+    zchunk_destroy (&chunk);
+
+    byte check [ZNS_STORE_CHECK_SIZE];
+    randombytes_buf (check, crypto_secretbox_NONCEBYTES);
+    crypto_secretbox_easy (check + crypto_secretbox_NONCEBYTES,
+            (const byte *) ZNS_STORE_CHECK, 8, check, key);
+    if (r == 0 && fwrite (check, sizeof check, 1, file) != 1)
+        r = -1;
+
+    for (s_entry_t *entry = (s_entry_t *) zhashx_first (self->hash);
+                    entry != NULL && r == 0;
+                    entry = (s_entry_t *) zhashx_next (self->hash)) {
+        const char *name = (const char *) zhashx_cursor (self->hash);
+        s_entry_wrap (self, entry);
+        if (s_write_mem (file, name, strlen (name)) == -1
+        ||  s_write_u64 (file, entry->version) == -1
+        ||  s_write_u64 (file, (uint64_t) entry->expires) == -1
+        ||  fwrite (entry->dek, sizeof entry->dek, 1, file) != 1
+        ||  fwrite (entry->wrapped, sizeof entry->wrapped, 1, file) != 1
+        ||  s_write_mem (file, zchunk_data (entry->value), zchunk_size (entry->value)) == -1)
+            r = -1;
     }
+    return r;
+}
 
-    if (!streq (zconfig_get (header, "cipher", ""), "salsa20poly1305")) {
-        zsys_error ("Unsupported cipher, got '%s', expected 'salsa20poly1305'", zconfig_get (header, "cipher", ""));
-        zconfig_destroy (&header);
-        zmsg_destroy (&msg);
+//  --------------------------------------------------------------------------
+//  Write content of the store unencrypted to new memory file, sealed against
+//  any change, for zenstore process taking over this one. It carries key
+//  derivation and a check of the key. Return the file descriptor or -1 for
+//  error, memory files need Linux.
+
+int
+zns_store_handover (zns_store_t *self, byte key [crypto_secretbox_KEYBYTES])
+{
+    assert (self);
+#if defined (__UTYPE_LINUX) && defined (MFD_ALLOW_SEALING)
+    int fd = memfd_create ("zenstore", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        zsys_error ("Can't create memory file: %s", strerror (errno));
         return -1;
     }
-
-    if (streq (zconfig_get (header, "nonce", "<nonce>"), "<nonce>")) {
-        zsys_error ("Missing nonce, got '%s', expected nonce", zconfig_get (header, "nonce", ""));
-        zconfig_destroy (&header);
-        zmsg_destroy (&msg);
+    int dup_fd = dup (fd);
+    FILE *file = dup_fd == -1 ? NULL : fdopen (dup_fd, "w");
+    if (!file) {
+        zsys_error ("Can't open memory file: %s", strerror (errno));
+        if (dup_fd != -1)
+            close (dup_fd);
+        close (fd);
         return -1;
     }
-
-    r = zns_nonce_from_str (self->nonce, zconfig_get (header, "nonce", ""));
-    zconfig_destroy (&header);
+    int64_t start = zclock_usecs ();
+    pthread_rwlock_wrlock (&self->lock);
+    s_loader_step (self, SIZE_MAX);
+    s_set_master (self, key);
+    int r = s_handover_write (self, file, key);
+    pthread_rwlock_unlock (&self->lock);
+    if (fclose (file) != 0)
+        r = -1;
+    if (r == 0
+    &&  fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+        r = -1;
+    s_phase (self, "write", start);
     if (r == -1) {
-        zsys_error ("Can't decode nonce: '%s'", zconfig_get (header, "nonce", ""));
-        zmsg_destroy (&msg);
+        zsys_error ("Can't write memory file: %s", strerror (errno));
+        close (fd);
         return -1;
     }
-    if (self->verbose) {
-        char *nonce_str = zns_nonce_str (self->nonce);
-        zsys_debug ("\tnonce_str=%s", nonce_str);
-        zstr_free (&nonce_str);
-    }
+    return fd;
+#else
+    zsys_error ("Handover needs memory files of Linux");
+    return -1;
+#endif
+}
 
-    frame = zmsg_pop (msg);
-    if (!frame) {
-        zsys_error ("Can't read encrypted data frame");
-        zmsg_destroy (&msg);
-        return -1;
+//  Map memory file of handover, it must be sealed against writes. Return
+//  mapped data and its size or NULL.
+
+static const byte *
+s_handover_map (int fd, size_t *size_p)
+{
+#if defined (__UTYPE_LINUX) && defined (MFD_ALLOW_SEALING)
+    int seals = fcntl (fd, F_GET_SEALS);
+    struct stat st;
+    if (seals == -1
+    ||  (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+        zsys_error ("Memory file of handover is not sealed");
+        return NULL;
     }
-    if (self->verbose)
-        zsys_debug ("\tencrypted buffer size: %zu", zframe_size (frame));
-
-    size_t decrypted_buffer_size = zframe_size (frame) - crypto_secretbox_MACBYTES;
-    zchunk_t *decrypted_buffer = zchunk_new (NULL, decrypted_buffer_size);
-    //FIXME: this is incorrect use of zchunk, zchunk_size does not report properly
-    r = crypto_secretbox_open_easy(
-            zchunk_data (decrypted_buffer),
-            zframe_data (frame),
-            zframe_size (frame),
-            zns_nonce_raw (self->nonce),
-            key);
-
-    sodium_memzero (zframe_data (frame), zframe_size (frame));
-    zframe_destroy (&frame);
+    if (fstat (fd, &st) == -1 || st.st_size == 0)
+        return NULL;
+    void *data = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        zsys_error ("Can't map memory file of handover: %s", strerror (errno));
+        return NULL;
+    }
+    *size_p = (size_t) st.st_size;
+    return (const byte *) data;
+#else
+    return NULL;
+#endif
+}
+
+//  --------------------------------------------------------------------------
+//  Return key derivation of memory file from handover, NULL if it is keyed
+//  by password itself. Caller is responsible for destroying it.
+
+zns_kdf_t *
+zns_store_handover_kdf (int fd)
+{
+    size_t size;
+    const byte *data = s_handover_map (fd, &size);
+    if (!data)
+        return NULL;
+    zconfig_t *header = s_header_peek (data, size);
+    zns_kdf_t *kdf = header ? zns_kdf_decode (header) : NULL;
     zconfig_destroy (&header);
-    zmsg_destroy (&msg);
+    munmap ((void *) data, size);
+    return kdf;
+}
 
-    if (r != 0) {
-        zsys_error ("Decrypting of storage failed");
-        sodium_memzero (zchunk_data (decrypted_buffer), zchunk_max_size (decrypted_buffer));
-        zchunk_destroy (&decrypted_buffer);
+//  Reader of mapped memory file, fails once data are short
 
+typedef struct {
+    const byte *data;
+    size_t size;
+    size_t offset;
+    int result;
+} s_reader_t;
+
+static const byte *
+s_read_mem (s_reader_t *reader, size_t size)
+{
+    if (reader->result == -1 || reader->size - reader->offset < size) {
+        reader->result = -1;
+        return NULL;
     }
+    const byte *data = reader->data + reader->offset;
+    reader->offset += size;
+    return data;
+}
 
-    frame = zframe_new (zchunk_data (decrypted_buffer), decrypted_buffer_size);
-    if (self->verbose)
-        zsys_debug ("\tpacked zhashx size: %zu", zframe_size (frame));
-    sodium_memzero (zchunk_data (decrypted_buffer), zchunk_max_size (decrypted_buffer));
-    zchunk_destroy (&decrypted_buffer);
+static uint64_t
+s_read_u64 (s_reader_t *reader)
+{
+    const byte *data = s_read_mem (reader, 8);
+    return data ? s_get_u64 (data) : 0;
+}
 
-    zhashx_t *hash = s_zhashx_unpack (frame);
+//  --------------------------------------------------------------------------
+//  Replace the content of the store by memory file from handover, key must
+//  be the same as key of handover. The file stays open. Return 0 for
+//  success, -1 for error.
 
-    sodium_memzero (zframe_data (frame), zframe_size (frame));
-    zframe_destroy (&frame);
+int
+zns_store_takeover (zns_store_t *self, int fd, byte key [crypto_secretbox_KEYBYTES])
+{
+    assert (self);
+    s_reader_t reader = {NULL, 0, 0, 0};
+    reader.data = s_handover_map (fd, &reader.size);
+    if (!reader.data)
+        return -1;
+    int64_t start = zclock_usecs ();
+    zconfig_t *header = s_header_peek (reader.data, reader.size);
+    if (!header || atoi (zconfig_get (header, "handover", "0")) != ZNS_STORE_HANDOVER) {
+        zsys_error ("Memory file is not a handover of zns_store");
+        zconfig_destroy (&header);
+        munmap ((void *) reader.data, reader.size);
+        return -1;
+    }
+    uint64_t sequence = strtoull (zconfig_get (header, "sequence", "0"), NULL, 10);
+    size_t keys = (size_t) strtoull (zconfig_get (header, "keys", "0"), NULL, 10);
+    zns_cipher_t *cipher = zns_cipher_new (zconfig_get (header, "cipher", ""));
+    zconfig_destroy (&header);
 
-    if (!hash) {
-        zsys_error ("Unpacking of storage failed");
+    //  Skip the header frame, its size is checked by peek
+    s_read_mem (&reader, 1);
+    if (reader.data [0] == 0xFF) {
+        const byte *size = s_read_mem (&reader, 4);
+        s_read_mem (&reader, ((size_t) size [0] << 24) | ((size_t) size [1] << 16)
+                           | ((size_t) size [2] << 8) | (size_t) size [3]);
+    }
+    else
+        s_read_mem (&reader, reader.data [0]);
+    const byte *check = s_read_mem (&reader, ZNS_STORE_CHECK_SIZE);
+    byte plain [8];
+    if (!check
+    ||  crypto_secretbox_open_easy (plain,
+            check + crypto_secretbox_NONCEBYTES, ZNS_STORE_CHECK_SIZE - crypto_secretbox_NONCEBYTES,
+            check, key) != 0
+    ||  memcmp (plain, ZNS_STORE_CHECK, 8) != 0) {
+        zsys_error ("Key of handover is not the same");
+        zns_cipher_destroy (&cipher);
+        munmap ((void *) reader.data, reader.size);
+        return -1;
+    }
+
+    zhashx_t *hash = zhashx_new ();
+    zhashx_set_destructor (hash, s_destructor);
+    int64_t now = zclock_time ();
+    for (size_t i = 0; i != keys && reader.result == 0; i++) {
+        size_t name_size = (size_t) s_read_u64 (&reader);
+        const byte *name = s_read_mem (&reader, name_size);
+        uint64_t version = s_read_u64 (&reader);
+        int64_t expires = (int64_t) s_read_u64 (&reader);
+        const byte *dek = s_read_mem (&reader, crypto_secretbox_KEYBYTES);
+        const byte *wrapped = s_read_mem (&reader, ZNS_STORE_WRAPPED);
+        size_t value_size = (size_t) s_read_u64 (&reader);
+        const byte *value = s_read_mem (&reader, value_size);
+        if (reader.result == -1 || (expires && expires <= now))
+            continue;
+        s_entry_t *entry = s_entry_new (zchunk_new (value, value_size), version);
+        entry->expires = expires;
+        memcpy (entry->dek, dek, sizeof entry->dek);
+        memcpy (entry->wrapped, wrapped, sizeof entry->wrapped);
+        char *key_str = (char *) zmalloc (name_size + 1);
+        assert (key_str);
+        memcpy (key_str, name, name_size);
+        zhashx_update (hash, key_str, entry);
+        free (key_str);
+    }
+    int r = reader.result == 0 && reader.offset == reader.size ? 0 : -1;
+    munmap ((void *) reader.data, reader.size);
+    s_phase (self, "unpack", start);
+    if (r == -1) {
+        zsys_error ("Memory file of handover is damaged");
+        zhashx_destroy (&hash);
+        zns_cipher_destroy (&cipher);
         return -1;
     }
 
+    pthread_rwlock_wrlock (&self->lock);
     zhashx_destroy (&self->hash);
     self->hash = hash;
+    s_loader_destroy (&self->loader);
+    __atomic_store_n (&self->loader, NULL, __ATOMIC_RELEASE);
+    if (!self->cipher_set && cipher) {
+        zns_cipher_destroy (&self->cipher);
+        self->cipher = cipher;
+        cipher = NULL;
+    }
+    //  Data keys come wrapped by the key
+    s_set_master (self, key);
+    for (s_entry_t *entry = (s_entry_t *) zhashx_first (hash);
+                    entry != NULL;
+                    entry = (s_entry_t *) zhashx_next (hash)) {
+        s_entry_expire_at (self, entry, (const char *) zhashx_cursor (hash), entry->expires);
+        entry->wrapped_by = self->generation;
+    }
+    if (self->sequence < sequence)
+        self->sequence = sequence;
+    pthread_rwlock_unlock (&self->lock);
+    zns_cipher_destroy (&cipher);
     return 0;
 }
 
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
+static void *
+s_test_writer (void *args)
+{
+    zns_store_t *store = (zns_store_t *) args;
+    zchunk_t *chunk = zchunk_new ("CHUNK", strlen ("CHUNK") + 1);
+    for (int i = 0; i != 1000; i++) {
+        zns_store_put (store, "KEY", chunk);
+        zchunk_t *copy = zns_store_lookup (store, "KEY", NULL);
+        assert (copy);
+        zchunk_destroy (&copy);
+    }
+    zchunk_destroy (&chunk);
+    return NULL;
+}
+
+static void
+s_test_expired (const char *key, uint64_t version, void *arg)
+{
+    assert (streq (key, "SHORT"));
+    assert (version > 0);
+    (*(size_t *) arg)++;
+}
+
+static void
+s_test_phase (const char *phase, int64_t usecs, void *arg)
+{
+    assert (usecs >= 0);
+    char *phases = (char *) arg;
+    if (!strstr (phases, phase))
+        strcat (strcat (phases, phase), " ");
+}
+
+static int
+s_test_scan (const char *key, zchunk_t *value, uint64_t version, int64_t expires, void *arg)
+{
+    assert (version > 0);
+    assert (expires == 0);
+    if (streq (key, "KEY"))
+        assert (zchunk_size (value) == strlen ("CHUNK") + 1
+             && memcmp (zchunk_data (value), "CHUNK", strlen ("CHUNK") + 1) == 0);
+    (*(size_t *) arg)++;
+    return 0;
+}
+
+static void
+s_test_corrupt (uint64_t offset, uint64_t size, const char *what, void *arg)
+{
+    assert (size > 0);
+    char *corrupted = (char *) arg;
+    strcat (strcat (corrupted, what), " ");
+}
+
+//  Return number of temporary files of saves of src/test.zenstore
+
+static int
+s_test_tmp_files (void)
+{
+    int count = 0;
+    DIR *dir = opendir ("src");
+    assert (dir);
+    struct dirent *entry;
+    while ((entry = readdir (dir)))
+        if (strlen (entry->d_name) == strlen ("test.zenstore.XXXXXX")
+        &&  strncmp (entry->d_name, "test.zenstore.", strlen ("test.zenstore.")) == 0)
+            count++;
+    closedir (dir);
+    return count;
+}
+
+//  Job of pool test, counts items taken by workers
+
+typedef struct {
+    size_t count;
+    size_t next;
+    size_t done;
+} s_test_job_t;
+
+static void *
+s_test_worker (void *args)
+{
+    s_test_job_t *job = (s_test_job_t *) args;
+    while (__atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED) < job->count)
+        __atomic_fetch_add (&job->done, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+//  Run pool jobs of any size, while other thread runs them too
+
+static void *
+s_test_jobs (void *args)
+{
+    for (size_t i = 0; i != 200; i++) {
+        s_test_job_t job = {i % 50, 0, 0};
+        s_run_workers (s_test_worker, &job, job.count);
+        assert (job.done == job.count);
+    }
+    return NULL;
+}
+
 void
 zns_store_test (bool verbose)
 {
     printf (" * zns_store: ");
     zsys_file_delete ("src/test.zenstore");
-    zsys_file_delete ("src/test.zenstore.tmp");
 
     //  @selftest
     zns_store_t *store = zns_store_new ();
@@ -547,12 +3383,57 @@ zns_store_test (bool verbose)
     assert (zns_store_get (store, "KEY"));
     assert (!zns_store_get (store, "NO-KEY"));
 
-    // store test
+    // versions
+    uint64_t version = zns_store_version (store, "KEY");
+    assert (version > 0);
+    assert (zns_store_version (store, "NO-KEY") == 0);
+    chunk = zchunk_new ("CHUNK2", strlen ("CHUNK2") + 1);
+    assert (zns_store_put (store, "KEY2", chunk) > version);
+    zchunk_destroy (&chunk);
+    uint64_t deleted = zns_store_put (store, "KEY2", NULL);
+    assert (deleted > zns_store_version (store, "KEY"));
+    assert (!zns_store_get (store, "KEY2"));
+
+    // atomic read-modify-write
+    uint64_t cas_version;
+    chunk = zchunk_new ("CAS", 3);
+    assert (zns_store_cas (store, "CAS", 1, chunk, &cas_version) == -1);
+    assert (cas_version == 0);
+    assert (zns_store_cas (store, "CAS", 0, chunk, &cas_version) == 0);
+    assert (zns_store_version (store, "CAS") == cas_version);
+    assert (zns_store_append (store, "CAS", chunk) > cas_version);
+    zchunk_destroy (&chunk);
+    chunk = zns_store_lookup (store, "CAS", NULL);
+    assert (zchunk_streq (chunk, "CASCAS"));
+    zchunk_destroy (&chunk);
+    int64_t counter;
+    assert (zns_store_incr (store, "CAS", 1, &counter, &cas_version) == -1);
+    assert (zns_store_incr (store, "COUNTER", -2, &counter, &cas_version) == 0);
+    assert (zns_store_incr (store, "COUNTER", 5, &counter, &cas_version) == 0);
+    assert (counter == 3);
+    assert (zns_store_incr (store, "COUNTER", INT64_MAX, &counter, &cas_version) == -1);
+    assert (zns_store_cas (store, "CAS", zns_store_version (store, "CAS"), NULL, &cas_version) == 0);
+    assert (!zns_store_get (store, "CAS"));
+    deleted = cas_version;
+
+    // store test, every phase of save is reported
     zns_store_set_dir (store, "src");
     zns_store_set_file (store, "test.zenstore");
-
+    char phases [128] = "";
+    zns_store_set_phase_fn (store, s_test_phase, phases);
+
+    // temporary file left by crashed save does not stop the next one, which
+    // leaves none of its own
+    FILE *stale = fopen ("src/test.zenstore.Stale0", "w");
+    assert (stale);
+    fclose (stale);
     int r = zns_store_save (store, (byte*) "S3cret!");
     assert (r == 0);
+    assert (s_test_tmp_files () == 1);
+    zsys_file_delete ("src/test.zenstore.Stale0");
+    assert (s_test_tmp_files () == 0);
+    assert ((zsys_file_mode ("src/test.zenstore") & 0777) == 0600);
+    assert (streq (phases, "pack encrypt write fsync "));
     zns_store_destroy (&store);
     assert (!store);
 
@@ -560,11 +3441,354 @@ zns_store_test (bool verbose)
     store = zns_store_new ();
     zns_store_set_dir (store, "src");
     zns_store_set_file (store, "test.zenstore");
+    phases [0] = '\0';
+    zns_store_set_phase_fn (store, s_test_phase, phases);
 
     r = zns_store_load (store, (byte*) "S3cret!");
     assert (r == 0);
+    assert (streq (phases, "read decode decrypt unpack "));
+
+    // backup writes copy of the store without reporting phases
+    phases [0] = '\0';
+    zsys_file_delete ("src/test-backup.zenstore");
+    int64_t backup_size = zns_store_backup (store, (byte*) "S3cret!", NULL, "src/test-backup.zenstore");
+    assert (backup_size > 0);
+    assert (streq (phases, ""));
+    assert (zsys_file_size ("src/test-backup.zenstore") == (ssize_t) backup_size);
+    zns_store_t *backup = zns_store_new ();
+    zns_store_set_dir (backup, "src");
+    zns_store_set_file (backup, "test-backup.zenstore");
+    assert (zns_store_load (backup, (byte*) "S3cret!") == 0);
+    assert (zns_store_size (backup) == 2);
+    assert (zns_store_version (backup, "KEY") == version);
+    zns_store_destroy (&backup);
+    //  Backup by other key leaves master key of the store alone
+    assert (zns_store_backup (store, (byte*) "0ther!!", NULL, "src/test-backup.zenstore") > 0);
+    backup = zns_store_new ();
+    zns_store_set_dir (backup, "src");
+    zns_store_set_file (backup, "test-backup.zenstore");
+    assert (zns_store_load (backup, (byte*) "S3cret!") == -1);
+    zns_store_destroy (&backup);
+    backup = zns_store_new ();
+    zns_store_set_dir (backup, "src");
+    zns_store_set_file (backup, "test-backup.zenstore");
+    assert (zns_store_load (backup, (byte*) "0ther!!") == 0);
+    assert (zns_store_version (backup, "KEY") == version);
+    zns_store_destroy (&backup);
+    zsys_file_delete ("src/test-backup.zenstore");
+    zns_store_set_phase_fn (store, NULL, NULL);
 
     assert (zns_store_get (store, "KEY"));
+    assert (zns_store_version (store, "KEY") == version);
+    assert (zns_store_sequence (store) == deleted);
+    assert (zns_store_size (store) == 2);
+
+    // scan reads the file value by value
+    size_t scanned = 0;
+    assert (zns_store_scan (store, (byte*) "S3cret!", s_test_scan, &scanned) == 0);
+    assert (scanned == 2);
+    byte bad [crypto_secretbox_KEYBYTES] = "wr0ng!!";
+    assert (zns_store_scan (store, bad, s_test_scan, &scanned) == -1);
+    assert (scanned == 2);
+
+    // verify reports corrupted ranges of copy of the file
+    char corrupted [128] = "";
+    assert (zns_store_verify_end (store) == -1);
+    assert (zns_store_verify (store, (byte*) "S3cret!", 1000000, s_test_corrupt, corrupted) == 0);
+    assert (streq (corrupted, ""));
+    FILE *handle = fopen ("src/test.zenstore", "rb");
+    assert (handle);
+    byte content [4096];
+    size_t content_size = fread (content, 1, sizeof content, handle);
+    fclose (handle);
+    assert (content_size > 0 && content_size < sizeof content);
+    zns_store_t *copy = zns_store_new ();
+    zns_store_set_dir (copy, "src");
+    zns_store_set_file (copy, "test-verify.zenstore");
+    content [content_size - 1] ^= 0x01;
+    handle = fopen ("src/test-verify.zenstore", "wb");
+    assert (handle);
+    assert (fwrite (content, 1, content_size, handle) == content_size);
+    fclose (handle);
+    assert (zns_store_verify (copy, (byte*) "S3cret!", 0, s_test_corrupt, corrupted) == 1);
+    assert (streq (corrupted, "KEY ") || streq (corrupted, "COUNTER "));
+    //  Damaged value found by background load keeps the file from save
+    assert (zns_store_load_begin (copy, (byte*) "S3cret!") == 0);
+    assert (zns_store_load_step (copy, SIZE_MAX) == 0);
+    assert (zns_store_unreadable (copy) == 1);
+    assert (zns_store_size (copy) == 1);
+    assert (zns_store_save (copy, (byte*) "S3cret!") == -1);
+    assert (!zns_store_export (copy, (byte*) "S3cret!"));
+    handle = fopen ("src/test-verify.zenstore", "rb");
+    assert (handle);
+    byte saved [4096];
+    assert (fread (saved, 1, sizeof saved, handle) == content_size);
+    fclose (handle);
+    assert (memcmp (saved, content, content_size) == 0);
+    zns_store_destroy (&copy);
+    copy = zns_store_new ();
+    zns_store_set_dir (copy, "src");
+    zns_store_set_file (copy, "test-verify.zenstore");
+    //  The first segment of the index follows the header
+    corrupted [0] = '\0';
+    content [content_size - 1] ^= 0x01;
+    content [1 + content [0] + 8] ^= 0x01;
+    handle = fopen ("src/test-verify.zenstore", "wb");
+    assert (handle);
+    assert (fwrite (content, 1, content_size, handle) == content_size);
+    fclose (handle);
+    assert (zns_store_verify (copy, (byte*) "S3cret!", 0, s_test_corrupt, corrupted) == 2);
+    assert (streq (corrupted, "index unverified "));
+    corrupted [0] = '\0';
+    assert (zns_store_verify (store, bad, 0, s_test_corrupt, corrupted) == 2);
+    assert (streq (corrupted, "index unverified "));
+    zns_store_destroy (&copy);
+    //  Damaged size of frame is not allocated
+    handle = fopen ("src/test-verify.zenstore", "w+b");
+    assert (handle);
+    byte damaged [] = {0xFF, 0xF0, 0x00, 0x00, 0x00, 'x', 0x01, 'y'};
+    assert (fwrite (damaged, 1, sizeof damaged, handle) == sizeof damaged);
+    rewind (handle);
+    assert (!s_frame_read (handle));
+    assert (fseek (handle, 6, SEEK_SET) == 0);
+    zframe_t *frame = s_frame_read (handle);
+    assert (frame && zframe_streq (frame, "y"));
+    zframe_destroy (&frame);
+    fclose (handle);
+    zsys_file_delete ("src/test-verify.zenstore");
+
+    // replica gets the same content and versions
+    zchunk_t *image = zns_store_export (store, (byte*) "S3cret!");
+    assert (image);
+    zns_store_t *replica = zns_store_new ();
+    byte wrong [crypto_secretbox_KEYBYTES] = "wr0ng!!";
+    assert (zns_store_import (replica, image, wrong) == -1);
+    r = zns_store_import (replica, image, (byte*) "S3cret!");
+    assert (r == 0);
+    zchunk_destroy (&image);
+    assert (zns_store_version (replica, "KEY") == version);
+    chunk = zchunk_new ("CHUNK3", strlen ("CHUNK3") + 1);
+    assert (zns_store_apply (replica, "KEY3", chunk, deleted + 10, 0) == 0);
+    assert (zns_store_version (replica, "KEY3") == deleted + 10);
+    assert (zns_store_sequence (replica) == deleted + 10);
+    //  Old or replayed change does not roll the key back
+    assert (zns_store_apply (replica, "KEY3", chunk, deleted + 10, 0) == -1);
+    assert (zns_store_apply (replica, "KEY", NULL, version, 0) == -1);
+    assert (zns_store_version (replica, "KEY") == version);
+    zchunk_destroy (&chunk);
+    assert (zns_store_apply (replica, "KEY3", NULL, deleted + 11, 0) == 0);
+    assert (!zns_store_get (replica, "KEY3"));
+    zns_store_destroy (&replica);
+
+    // every cipher supported by this CPU, replica keeps the cipher it got
+    assert (streq (zns_store_cipher (store), "salsa20poly1305"));
+    assert (zns_store_set_cipher (store, "rot13") == -1);
+    byte secret [crypto_secretbox_KEYBYTES] = "S3cret!";
+    const char *ciphers [] = {"xchacha20poly1305_ietf", "aes256gcm", "fastest"};
+    for (int i = 0; i != 3; i++) {
+        if (zns_store_set_cipher (store, ciphers [i]) == -1)
+            continue;
+        image = zns_store_export (store, secret);
+        assert (image);
+        replica = zns_store_new ();
+        assert (zns_store_import (replica, image, wrong) == -1);
+        assert (zns_store_import (replica, image, secret) == 0);
+        zchunk_destroy (&image);
+        assert (streq (zns_store_cipher (replica), zns_store_cipher (store)));
+        assert (zns_store_version (replica, "KEY") == version);
+        zns_store_destroy (&replica);
+    }
+
+    // big values and index are encrypted in parts, which can't be reordered
+    size_t big = ZNS_STORE_SEGMENT * 2 + 1;
+    zns_store_t *segmented = zns_store_new ();
+    chunk = zchunk_new (NULL, big);
+    zchunk_fill (chunk, 'x', big);
+    zns_store_put (segmented, "BIG", chunk);
+    zchunk_destroy (&chunk);
+    char name [256 + 1];
+    memset (name, 'k', 256);
+    name [256] = '\0';
+    for (int i = 0; i != 20000; i++) {
+        snprintf (name, 8, "%07d", i);
+        name [7] = 'k';
+        chunk = zchunk_new (&i, sizeof (i));
+        zns_store_put (segmented, name, chunk);
+        zchunk_destroy (&chunk);
+    }
+    image = zns_store_export (segmented, secret);
+    assert (image);
+    replica = zns_store_new ();
+    assert (zns_store_import (replica, image, secret) == 0);
+    chunk = zns_store_lookup (replica, "BIG", NULL);
+    assert (chunk);
+    assert (zchunk_size (chunk) == big);
+    assert (zchunk_data (chunk) [big - 1] == 'x');
+    zchunk_destroy (&chunk);
+    assert (zns_store_get (replica, name));
+    zns_store_destroy (&replica);
+
+    // header, two index segments and values, swap both of segments and values
+    zmsg_t *parts = zmsg_decode (zchunk_data (image), zchunk_size (image));
+    zchunk_destroy (&image);
+    assert (zmsg_size (parts) == 1 + 2 + 20001);
+    for (int swap = 1; swap <= 3; swap += 2) {
+        zmsg_t *swapped = zmsg_dup (parts);
+        zframe_t *frames [5];
+        for (int i = 0; i != 5; i++)
+            frames [i] = zmsg_pop (swapped);
+        int order [] = {4, 3, 2, 1, 0};
+        for (int i = 0; i != 5; i++) {
+            int j = order [i];
+            if (j == swap || j == swap + 1)
+                j = swap + swap + 1 - j;
+            zmsg_pushmem (swapped, zframe_data (frames [j]), zframe_size (frames [j]));
+        }
+        for (int i = 0; i != 5; i++)
+            zframe_destroy (&frames [i]);
+        byte *encoded;
+        size_t encoded_size = zmsg_encode (swapped, &encoded);
+        image = zchunk_new (encoded, encoded_size);
+        free (encoded);
+        replica = zns_store_new ();
+        assert (zns_store_import (replica, image, secret) == -1);
+        zns_store_destroy (&replica);
+        zchunk_destroy (&image);
+        zmsg_destroy (&swapped);
+    }
+    zmsg_destroy (&parts);
+
+    // single value is decrypted from the image alone
+    image = zns_store_export (segmented, secret);
+    chunk = zns_store_extract (image, "BIG", secret);
+    assert (chunk);
+    assert (zchunk_size (chunk) == big);
+    zchunk_destroy (&chunk);
+    assert (!zns_store_extract (image, "MISSING", secret));
+    assert (!zns_store_extract (image, "BIG", wrong));
+    zchunk_destroy (&image);
+
+    // rekey rewraps data keys in batches, then only the new key opens store
+    byte rekeyed [crypto_secretbox_KEYBYTES] = "N3w S3cret!";
+    zns_store_rekey (segmented, rekeyed);
+    size_t waiting = zns_store_rewrap (segmented, 1000);
+    assert (waiting == 20001 - 1000);
+    chunk = zchunk_new ("NEW", 3);
+    zns_store_put (segmented, "NEW", chunk);
+    zns_store_put (segmented, "BIG", NULL);
+    zchunk_destroy (&chunk);
+    while (waiting)
+        waiting = zns_store_rewrap (segmented, 1000);
+    image = zns_store_export (segmented, rekeyed);
+    replica = zns_store_new ();
+    assert (zns_store_import (replica, image, secret) == -1);
+    assert (zns_store_import (replica, image, rekeyed) == 0);
+    assert (zns_store_get (replica, "NEW"));
+    assert (!zns_store_get (replica, "BIG"));
+    assert (zns_store_get (replica, name));
+    zns_store_destroy (&replica);
+    zchunk_destroy (&image);
+    zns_store_destroy (&segmented);
+
+    // embedded use - more threads share the store
+    pthread_t writers [4];
+    for (int i = 0; i != 4; i++)
+        pthread_create (&writers [i], NULL, s_test_writer, store);
+    for (int i = 0; i != 4; i++)
+        pthread_join (writers [i], NULL);
+
+    // workers - pool is kept across jobs, jobs of more threads take turns
+    for (int i = 0; i != 2; i++)
+        pthread_create (&writers [i], NULL, s_test_jobs, NULL);
+    for (int i = 0; i != 2; i++)
+        pthread_join (writers [i], NULL);
+    version = 0;
+    chunk = zns_store_lookup (store, "KEY", &version);
+    assert (chunk);
+    assert (version > deleted);
+    zchunk_destroy (&chunk);
+
+    // expiry, only expired keys are deleted and ttl survives save and load
+    chunk = zchunk_new ("TOKEN", 5);
+    zns_store_put_ttl (store, "TOKEN", chunk, 60000);
+    zns_store_put_ttl (store, "SHORT", chunk, 10);
+    zchunk_destroy (&chunk);
+    int64_t expires = zns_store_expires (store, "TOKEN");
+    assert (expires > zclock_time ());
+    assert (zns_store_expires (store, "KEY") == 0);
+
+    // read-modify-write keeps expiry time of the key
+    chunk = zchunk_new ("RMW", 3);
+    zns_store_put_ttl (store, "RMW", chunk, 60000);
+    int64_t rmw_expires = zns_store_expires (store, "RMW");
+    assert (zns_store_cas (store, "RMW", zns_store_version (store, "RMW"), chunk, &cas_version) == 0);
+    assert (zns_store_expires (store, "RMW") == rmw_expires);
+    zns_store_append (store, "RMW", chunk);
+    assert (zns_store_expires (store, "RMW") == rmw_expires);
+    zns_store_put (store, "RMW", NULL);
+    zchunk_destroy (&chunk);
+    zclock_sleep (20);
+    assert (!zns_store_get (store, "SHORT"));
+    size_t expired = 0;
+    assert (zns_store_expire (store, zclock_time (), s_test_expired, &expired) == 1);
+    assert (expired == 1);
+    assert (zns_store_expire_timeout (store, zclock_time ()) > 0);
+    r = zns_store_save (store, (byte*) "S3cret!");
+    assert (r == 0);
+    zns_store_destroy (&store);
+
+    store = zns_store_new ();
+    zns_store_set_dir (store, "src");
+    zns_store_set_file (store, "test.zenstore");
+    r = zns_store_load (store, (byte*) "S3cret!");
+    assert (r == 0);
+    assert (zns_store_expires (store, "TOKEN") == expires);
+    assert (zns_store_expire_timeout (store, zclock_time ()) > 0);
+    chunk = zchunk_new ("GONE", 4);
+    zns_store_put (store, "GONE", chunk);
+    zchunk_destroy (&chunk);
+    r = zns_store_save (store, (byte*) "S3cret!");
+    assert (r == 0);
+    zns_store_destroy (&store);
+
+    // background load, keys are served and changed before their batch
+    store = zns_store_new ();
+    zns_store_set_dir (store, "src");
+    zns_store_set_file (store, "test.zenstore");
+    r = zns_store_load_begin (store, (byte*) "S3cret!");
+    assert (r == 0);
+    assert (zns_store_size (store) == 4);
+    assert (zns_store_expires (store, "TOKEN") == expires);
+    chunk = zchunk_new ("NEW", 3);
+    zns_store_put (store, "KEY", chunk);
+    zchunk_destroy (&chunk);
+    zns_store_put (store, "GONE", NULL);
+    assert (zns_store_load_step (store, 1) == 0);
+    assert (zns_store_size (store) == 3);
+    chunk = zns_store_lookup (store, "KEY", NULL);
+    assert (zchunk_streq (chunk, "NEW"));
+    zchunk_destroy (&chunk);
+    assert (!zns_store_get (store, "GONE"));
+
+    // handover, content moves to new process in sealed memory file
+    int fd = zns_store_handover (store, (byte*) "S3cret!");
+#if defined (__UTYPE_LINUX)
+    assert (fd != -1);
+#endif
+    if (fd != -1) {
+        assert (write (fd, "X", 1) == -1);
+        replica = zns_store_new ();
+        assert (zns_store_takeover (replica, fd, wrong) == -1);
+        assert (zns_store_takeover (replica, fd, (byte*) "S3cret!") == 0);
+        assert (zns_store_size (replica) == 3);
+        assert (zns_store_sequence (replica) == zns_store_sequence (store));
+        assert (zns_store_expires (replica, "TOKEN") == expires);
+        chunk = zns_store_lookup (replica, "KEY", NULL);
+        assert (zchunk_streq (chunk, "NEW"));
+        zchunk_destroy (&chunk);
+        zns_store_destroy (&replica);
+        close (fd);
+    }
     zns_store_destroy (&store);
 
     //  @end
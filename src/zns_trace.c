@@ -0,0 +1,304 @@
+/*  =========================================================================
+    zns_trace - Sampled traces of requests and slow operation log
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_trace - Sampled traces of requests and slow operation log
+@discuss
+    Operation is split to spans, e.g. decode, lookup, copy and send of GET
+    or phases of save. Every n-th operation is kept in a ring of fixed size,
+    so the memory does not grow and the oldest traces are overwritten.
+    Operation slower than threshold is logged by zsys_warning with all its
+    spans, sampled or not.
+
+    Not thread safe, every zns_srv traces its own thread.
+@end
+*/
+
+#include "zns_classes.h"
+
+#include <inttypes.h>
+
+#define ZNS_TRACE_SPANS 12      //  Spans kept per operation
+#define ZNS_TRACE_KEY   64      //  Bytes of key kept
+
+typedef struct {
+    const char *name;
+    int64_t usecs;
+} s_span_t;
+
+typedef struct {
+    int64_t time;               //  Wall clock msec of begin
+    char op [16];
+    char key [ZNS_TRACE_KEY];
+    int64_t total;              //  Usecs from begin to end
+    s_span_t spans [ZNS_TRACE_SPANS];
+    size_t count;               //  Number of spans
+} s_record_t;
+
+//  Structure of our class
+
+struct _zns_trace_t {
+    s_record_t *ring;           //  Kept traces
+    size_t size;                //  Capacity of ring
+    size_t head;                //  Next record to write
+    size_t kept;                //  Records in ring
+    unsigned sample;            //  Keep every n-th operation, 0 none
+    unsigned counter;           //  Operations since last kept
+    int64_t slow;               //  Log operations this slow, 0 none
+    bool timing;                //  Current operation is timed?
+    bool sampled;               //  Current operation is kept?
+    int64_t begin;              //  Usecs of begin of current operation
+    int64_t mark;               //  Usecs of end of last span
+    s_record_t current;
+};
+
+//  --------------------------------------------------------------------------
+//  Create a new zns_trace
+
+zns_trace_t *
+zns_trace_new (size_t size)
+{
+    zns_trace_t *self = (zns_trace_t *) zmalloc (sizeof (zns_trace_t));
+    assert (self);
+    self->size = size ? size : 1;
+    self->ring = (s_record_t *) zmalloc (self->size * sizeof (s_record_t));
+    assert (self->ring);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the zns_trace
+
+void
+zns_trace_destroy (zns_trace_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zns_trace_t *self = *self_p;
+        free (self->ring);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Keep trace of every n-th operation, 0 none
+
+void
+zns_trace_set_sample (zns_trace_t *self, unsigned n)
+{
+    assert (self);
+    self->sample = n;
+    self->counter = 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Log operations which took at least usecs, 0 none
+
+void
+zns_trace_set_slow (zns_trace_t *self, int64_t usecs)
+{
+    assert (self);
+    self->slow = usecs > 0 ? usecs : 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Begin operation op on key
+
+bool
+zns_trace_begin (zns_trace_t *self, const char *op, const char *key)
+{
+    assert (self);
+    assert (op);
+    self->sampled = false;
+    if (self->sample && ++self->counter >= self->sample) {
+        self->counter = 0;
+        self->sampled = true;
+    }
+    self->timing = self->sampled || self->slow;
+    if (!self->timing)
+        return false;
+
+    s_record_t *record = &self->current;
+    record->time = zclock_time ();
+    snprintf (record->op, sizeof record->op, "%s", op);
+    snprintf (record->key, sizeof record->key, "%s", key ? key : "-");
+    record->count = 0;
+    record->total = 0;
+    self->begin = self->mark = zclock_usecs ();
+    return true;
+}
+
+//  --------------------------------------------------------------------------
+//  End span name of current operation
+
+void
+zns_trace_span (zns_trace_t *self, const char *name)
+{
+    assert (self);
+    if (!self->timing)
+        return;
+    int64_t now = zclock_usecs ();
+    zns_trace_add (self, name, now - self->mark);
+    self->mark = now;
+}
+
+//  --------------------------------------------------------------------------
+//  Add span name of usecs measured by caller
+
+void
+zns_trace_add (zns_trace_t *self, const char *name, int64_t usecs)
+{
+    assert (self);
+    if (!self->timing)
+        return;
+    s_record_t *record = &self->current;
+    //  Span of the same name, e.g. phase reported twice, adds up
+    for (size_t i = 0; i != record->count; i++)
+        if (streq (record->spans [i].name, name)) {
+            record->spans [i].usecs += usecs;
+            return;
+        }
+    if (record->count < ZNS_TRACE_SPANS) {
+        record->spans [record->count].name = name;
+        record->spans [record->count].usecs = usecs;
+        record->count++;
+    }
+}
+
+//  Format record as "time op key total=usecs span=usecs ...", caller must
+//  free it
+
+static char *
+s_format (s_record_t *record)
+{
+    char buffer [512];
+    size_t length = snprintf (buffer, sizeof buffer, "%" PRId64 " %s %s total=%" PRId64,
+                              record->time, record->op, record->key, record->total);
+    for (size_t i = 0; i != record->count && length < sizeof buffer; i++)
+        length += snprintf (buffer + length, sizeof buffer - length, " %s=%" PRId64,
+                            record->spans [i].name, record->spans [i].usecs);
+    return strdup (buffer);
+}
+
+//  --------------------------------------------------------------------------
+//  End current operation, keep it if sampled and log it if slow
+
+int64_t
+zns_trace_end (zns_trace_t *self)
+{
+    assert (self);
+    if (!self->timing)
+        return -1;
+    self->timing = false;
+    s_record_t *record = &self->current;
+    record->total = zclock_usecs () - self->begin;
+    if (self->sampled) {
+        self->ring [self->head] = *record;
+        self->head = (self->head + 1) % self->size;
+        if (self->kept < self->size)
+            self->kept++;
+    }
+    if (self->slow && record->total >= self->slow) {
+        char *line = s_format (record);
+        zsys_warning ("Slow operation: %s", line);
+        zstr_free (&line);
+    }
+    return record->total;
+}
+
+//  --------------------------------------------------------------------------
+//  Append kept traces to msg, oldest first
+
+void
+zns_trace_dump (zns_trace_t *self, zmsg_t *msg)
+{
+    assert (self);
+    assert (msg);
+    size_t first = (self->head + self->size - self->kept) % self->size;
+    for (size_t i = 0; i != self->kept; i++) {
+        char *line = s_format (&self->ring [(first + i) % self->size]);
+        zmsg_addstr (msg, line);
+        zstr_free (&line);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of kept traces
+
+size_t
+zns_trace_size (zns_trace_t *self)
+{
+    assert (self);
+    return self->kept;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zns_trace_test (bool verbose)
+{
+    printf (" * zns_trace: ");
+
+    //  @selftest
+    zns_trace_t *self = zns_trace_new (4);
+    assert (self);
+
+    //  Nothing is timed by default
+    assert (!zns_trace_begin (self, "GET", "KEY"));
+    zns_trace_span (self, "lookup");
+    assert (zns_trace_end (self) == -1);
+    assert (zns_trace_size (self) == 0);
+
+    //  Every second operation is kept, the ring keeps the last four
+    zns_trace_set_sample (self, 2);
+    for (int i = 0; i != 10; i++) {
+        char key [16];
+        snprintf (key, sizeof key, "KEY%d", i);
+        bool timed = zns_trace_begin (self, "GET", key);
+        assert (timed == (i % 2 == 1));
+        zns_trace_span (self, "decode");
+        zns_trace_span (self, "lookup");
+        zns_trace_add (self, "lookup", 5);
+        assert ((zns_trace_end (self) >= 0) == timed);
+    }
+    assert (zns_trace_size (self) == 4);
+    zmsg_t *msg = zmsg_new ();
+    zns_trace_dump (self, msg);
+    assert (zmsg_size (msg) == 4);
+    char *line = zmsg_popstr (msg);
+    if (verbose)
+        zsys_debug ("%s", line);
+    assert (strstr (line, " GET KEY3 total="));
+    assert (strstr (line, " decode="));
+    assert (strstr (line, " lookup="));
+    zstr_free (&line);
+    while ((line = zmsg_popstr (msg)))
+        zstr_free (&line);
+    zmsg_destroy (&msg);
+
+    //  Slow operation is timed even if not sampled
+    zns_trace_set_sample (self, 0);
+    zns_trace_set_slow (self, 1000);
+    assert (zns_trace_begin (self, "SAVE", NULL));
+    zns_trace_add (self, "fsync", 2000);
+    zclock_sleep (2);
+    assert (zns_trace_end (self) >= 1000);
+    assert (zns_trace_size (self) == 4);
+
+    zns_trace_destroy (&self);
+    assert (!self);
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,76 @@
+/*  =========================================================================
+    zns_trace - Sampled traces of requests and slow operation log
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_TRACE_H_INCLUDED
+#define ZNS_TRACE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _zns_trace_t zns_trace_t;
+
+//  @interface
+//  Create a new zns_trace keeping last size traces, nothing is traced until
+//  sampling or slow threshold is set
+ZNS_EXPORT zns_trace_t *
+    zns_trace_new (size_t size);
+
+//  Destroy the zns_trace
+ZNS_EXPORT void
+    zns_trace_destroy (zns_trace_t **self_p);
+
+//  Keep trace of every n-th operation in the ring, 0 none
+ZNS_EXPORT void
+    zns_trace_set_sample (zns_trace_t *self, unsigned n);
+
+//  Log operations which took at least usecs with their spans, 0 none
+ZNS_EXPORT void
+    zns_trace_set_slow (zns_trace_t *self, int64_t usecs);
+
+//  Begin operation op on key, which may be NULL. Return true if it is timed,
+//  otherwise spans and end cost nothing.
+ZNS_EXPORT bool
+    zns_trace_begin (zns_trace_t *self, const char *op, const char *key);
+
+//  End span name of current operation, the span began where the previous
+//  one ended or at begin. Names are not copied, they must be constants.
+ZNS_EXPORT void
+    zns_trace_span (zns_trace_t *self, const char *name);
+
+//  Add span name of usecs measured by caller, e.g. phase of save
+ZNS_EXPORT void
+    zns_trace_add (zns_trace_t *self, const char *name, int64_t usecs);
+
+//  End current operation, keep it if sampled and log it if slow. Return
+//  usecs it took, -1 if it was not timed.
+ZNS_EXPORT int64_t
+    zns_trace_end (zns_trace_t *self);
+
+//  Append kept traces to msg, oldest first, a frame per trace formatted as
+//  "time op key total=usecs span=usecs ...", time is wall clock msec.
+ZNS_EXPORT void
+    zns_trace_dump (zns_trace_t *self, zmsg_t *msg);
+
+//  Return number of kept traces
+ZNS_EXPORT size_t
+    zns_trace_size (zns_trace_t *self);
+
+//  Self test of this class
+ZNS_EXPORT void
+    zns_trace_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,296 @@
+/*  =========================================================================
+    zns_wheel - Hierarchical timing wheel
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zns_wheel - Hierarchical timing wheel
+@discuss
+    Timers are kept in 5 levels of 64 slots, level 0 slot is one msec and
+    every next level slot covers whole previous level. Adding and cancelling
+    of timer is O(1), advancing moves timers of one slot to lower level every
+    64^level msecs, so each timer is touched at most 5 times. Timers beyond
+    the range of wheel (about 12 days) wait in the last level and are moved
+    again until they get in range.
+@end
+*/
+
+#include "zns_classes.h"
+
+#define ZNS_WHEEL_BITS      6
+#define ZNS_WHEEL_SLOTS     (1 << ZNS_WHEEL_BITS)
+#define ZNS_WHEEL_LEVELS    5
+
+typedef struct _s_timer_t s_timer_t;
+
+struct _s_timer_t {
+    s_timer_t *prev;
+    s_timer_t *next;
+    int64_t when;               //  Time to fire in msec
+    void *item;                 //  Item of caller, not owned
+};
+
+//  Structure of our class
+
+struct _zns_wheel_t {
+    int64_t current;            //  Time processed so far in msec
+    size_t size;                //  Number of timers
+    s_timer_t slots [ZNS_WHEEL_LEVELS][ZNS_WHEEL_SLOTS];   //  List heads
+};
+
+static void
+s_unlink (s_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = timer;
+}
+
+//  Put timer to slot, timers due before floor go to the slot of floor
+
+static void
+s_insert (zns_wheel_t *self, s_timer_t *timer, int64_t floor)
+{
+    int64_t when = timer->when < floor ? floor : timer->when;
+    int64_t delta = when - self->current;
+    int level = 0;
+    while (level < ZNS_WHEEL_LEVELS - 1
+    &&     delta >= ((int64_t) 1 << (ZNS_WHEEL_BITS * (level + 1))))
+        level++;
+    //  Out of range, wait in the last slot before current one
+    if (delta >= ((int64_t) 1 << (ZNS_WHEEL_BITS * ZNS_WHEEL_LEVELS)))
+        when = self->current + ((int64_t) 1 << (ZNS_WHEEL_BITS * ZNS_WHEEL_LEVELS)) - 1;
+    int slot = (int) ((when >> (ZNS_WHEEL_BITS * level)) & (ZNS_WHEEL_SLOTS - 1));
+
+    s_timer_t *head = &self->slots [level][slot];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+//  Return the nearest time something has to be done, which is either firing
+//  of level 0 slot or moving higher level slot down, INT64_MAX if none
+
+static int64_t
+s_next (zns_wheel_t *self)
+{
+    int64_t next = INT64_MAX;
+    for (int level = 0; level != ZNS_WHEEL_LEVELS; level++) {
+        int shift = ZNS_WHEEL_BITS * level;
+        int64_t when = ((self->current >> shift) + 1) << shift;
+        for (int i = 0; i != ZNS_WHEEL_SLOTS && when < next; i++, when += (int64_t) 1 << shift) {
+            s_timer_t *head = &self->slots [level][(when >> shift) & (ZNS_WHEEL_SLOTS - 1)];
+            if (head->next != head) {
+                next = when;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new zns_wheel starting at now msec
+
+zns_wheel_t *
+zns_wheel_new (int64_t now)
+{
+    zns_wheel_t *self = (zns_wheel_t *) zmalloc (sizeof (zns_wheel_t));
+    assert (self);
+    //  Initialize class properties here
+    self->current = now;
+    for (int level = 0; level != ZNS_WHEEL_LEVELS; level++)
+        for (int slot = 0; slot != ZNS_WHEEL_SLOTS; slot++) {
+            s_timer_t *head = &self->slots [level][slot];
+            head->prev = head->next = head;
+        }
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the zns_wheel, items of pending timers are not touched
+
+void
+zns_wheel_destroy (zns_wheel_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zns_wheel_t *self = *self_p;
+        //  Free class properties here
+        for (int level = 0; level != ZNS_WHEEL_LEVELS; level++)
+            for (int slot = 0; slot != ZNS_WHEEL_SLOTS; slot++) {
+                s_timer_t *head = &self->slots [level][slot];
+                while (head->next != head) {
+                    s_timer_t *timer = head->next;
+                    s_unlink (timer);
+                    free (timer);
+                }
+            }
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Add timer firing item at when msec, return handle for cancel
+
+void *
+zns_wheel_add (zns_wheel_t *self, int64_t when, void *item)
+{
+    assert (self);
+    s_timer_t *timer = (s_timer_t *) zmalloc (sizeof (s_timer_t));
+    assert (timer);
+    timer->when = when;
+    timer->item = item;
+    //  Slot of current time has been processed already
+    s_insert (self, timer, self->current + 1);
+    self->size++;
+    return timer;
+}
+
+//  --------------------------------------------------------------------------
+//  Cancel the timer which has not fired yet, return its item
+
+void *
+zns_wheel_cancel (zns_wheel_t *self, void *handle)
+{
+    assert (self);
+    assert (handle);
+    s_timer_t *timer = (s_timer_t *) handle;
+    void *item = timer->item;
+    s_unlink (timer);
+    free (timer);
+    self->size--;
+    return item;
+}
+
+//  --------------------------------------------------------------------------
+//  Advance the wheel to now msec, items of fired timers are appended to
+//  expired list. Return number of fired timers.
+
+size_t
+zns_wheel_advance (zns_wheel_t *self, int64_t now, zlistx_t *expired)
+{
+    assert (self);
+    assert (expired);
+    size_t fired = 0;
+
+    while (self->current < now) {
+        //  Skip the time when nothing happens
+        int64_t next = s_next (self);
+        if (next > now) {
+            self->current = now;
+            break;
+        }
+        self->current = next;
+        //  Move timers of next slot of higher levels down, when lower level
+        //  wraps around
+        for (int level = 1; level != ZNS_WHEEL_LEVELS; level++) {
+            if (self->current & (((int64_t) 1 << (ZNS_WHEEL_BITS * level)) - 1))
+                break;
+            int slot = (int) ((self->current >> (ZNS_WHEEL_BITS * level)) & (ZNS_WHEEL_SLOTS - 1));
+            s_timer_t *head = &self->slots [level][slot];
+            s_timer_t list = *head;
+            if (head->next == head)
+                continue;
+            //  Detach whole list, then insert timers again
+            list.next->prev = &list;
+            list.prev->next = &list;
+            head->prev = head->next = head;
+            while (list.next != &list) {
+                s_timer_t *timer = list.next;
+                s_unlink (timer);
+                s_insert (self, timer, self->current);
+            }
+        }
+        s_timer_t *head = &self->slots [0][self->current & (ZNS_WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            s_timer_t *timer = head->next;
+            s_unlink (timer);
+            zlistx_add_end (expired, timer->item);
+            free (timer);
+            self->size--;
+            fired++;
+        }
+    }
+    return fired;
+}
+
+//  --------------------------------------------------------------------------
+//  Return msecs until the wheel needs to be advanced from now, -1 if there
+//  are no timers
+
+int64_t
+zns_wheel_timeout (zns_wheel_t *self, int64_t now)
+{
+    assert (self);
+    if (self->size == 0)
+        return -1;
+    int64_t next = s_next (self);
+    return next > now ? next - now : 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of pending timers
+
+size_t
+zns_wheel_size (zns_wheel_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zns_wheel_test (bool verbose)
+{
+    printf (" * zns_wheel: ");
+
+    //  @selftest
+    int64_t start = 1000000;
+    zns_wheel_t *self = zns_wheel_new (start);
+    assert (self);
+    zlistx_t *expired = zlistx_new ();
+
+    //  Timers on all levels, out of range and already due
+    int64_t delays [] = {-5, 1, 63, 64, 100, 4095, 4096, 300000, 20000000, (int64_t) 1 << 31};
+    size_t count = sizeof (delays) / sizeof (delays [0]);
+    for (size_t i = 0; i != count; i++)
+        zns_wheel_add (self, start + delays [i], &delays [i]);
+    void *handle = zns_wheel_add (self, start + 50, &start);
+    assert (zns_wheel_size (self) == count + 1);
+    assert (zns_wheel_cancel (self, handle) == &start);
+    assert (zns_wheel_timeout (self, start) == 1);
+
+    //  Every timer fires in its time, never sooner
+    for (size_t i = 0; i != count; i++) {
+        int64_t when = start + (delays [i] > 1 ? delays [i] : 1);
+        zns_wheel_advance (self, when - 1, expired);
+        assert (zlistx_size (expired) == 0);
+        zns_wheel_advance (self, when, expired);
+        assert (zlistx_size (expired) == (delays [i] == -5 ? 2 : 1));
+        zlistx_purge (expired);
+        if (delays [i] == -5)
+            i++;
+    }
+    assert (zns_wheel_size (self) == 0);
+    assert (zns_wheel_timeout (self, start) == -1);
+
+    //  Pending timers are dropped with the wheel
+    zns_wheel_add (self, start + ((int64_t) 1 << 32), NULL);
+    zlistx_destroy (&expired);
+    zns_wheel_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,61 @@
+/*  =========================================================================
+    zns_wheel - Hierarchical timing wheel
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZNS_WHEEL_H_INCLUDED
+#define ZNS_WHEEL_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _zns_wheel_t zns_wheel_t;
+
+//  @interface
+//  Create a new zns_wheel starting at now msec
+ZNS_EXPORT zns_wheel_t *
+    zns_wheel_new (int64_t now);
+
+//  Destroy the zns_wheel, items of pending timers are not touched
+ZNS_EXPORT void
+    zns_wheel_destroy (zns_wheel_t **self_p);
+
+//  Add timer firing item at when msec, return handle for cancel
+ZNS_EXPORT void *
+    zns_wheel_add (zns_wheel_t *self, int64_t when, void *item);
+
+//  Cancel the timer which has not fired yet, return its item
+ZNS_EXPORT void *
+    zns_wheel_cancel (zns_wheel_t *self, void *handle);
+
+//  Advance the wheel to now msec, items of fired timers are appended to
+//  expired list. Return number of fired timers.
+ZNS_EXPORT size_t
+    zns_wheel_advance (zns_wheel_t *self, int64_t now, zlistx_t *expired);
+
+//  Return msecs until the wheel needs to be advanced from now, -1 if there
+//  are no timers
+ZNS_EXPORT int64_t
+    zns_wheel_timeout (zns_wheel_t *self, int64_t now);
+
+//  Return number of pending timers
+ZNS_EXPORT size_t
+    zns_wheel_size (zns_wheel_t *self);
+
+//  Self test of this class
+ZNS_EXPORT void
+    zns_wheel_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif